@@ -0,0 +1,1138 @@
+//! `memlink serve`: a long-lived region manager
+//!
+//! One-shot invocations pay for opening `/dev/obmm`, probing the topology and
+//! rebuilding every cache on each command. The daemon does that once and keeps
+//! a region table (`MemId` -> descriptor, owner, refcount, NUMA node) for its
+//! lifetime. Clients talk to it over a Unix socket with one JSON request per
+//! line and get one JSON response per line back; a `batch` request is issued
+//! through the batched export/import calls. A `metrics` request, or the
+//! optional HTTP endpoint of `metrics`, reports the libobmm statistics.
+//!
+//! With `--preimport`, imports falling inside the listed ranges go through a
+//! `PreimportPool` that keeps ranges declared ahead of the requests, so the
+//! attach path only pays for the import itself.
+
+use std::collections::HashMap;
+use std::io::{BufRead, BufReader, Write};
+use std::net::SocketAddr;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::Path;
+use std::sync::{Arc, Mutex, PoisonError};
+
+use anyhow::Context;
+use log::{info, warn};
+use obmm_rs::preimport::PreimportPool;
+use obmm_rs::registry::DescRegistry;
+use obmm_rs::teardown::{Teardown, TeardownRegion};
+use obmm_rs::{
+    MAX_NUMA_NODES, MemId, OBMM_MAX_LOCAL_NUMA_NODES, ObmmExportFlags, ObmmImportFlags,
+    ObmmMemDesc, ObmmPreimportInfo, ObmmUnexportFlags, UbPrivData, mem_export, mem_export_batch,
+    mem_import, mem_import_batch, mem_unexport, mem_unimport,
+};
+use serde::{Deserialize, Serialize};
+use threadpool::ThreadPool;
+
+use crate::metrics;
+
+/// Socket the daemon listens on by default
+pub(crate) const DEFAULT_SOCKET: &str = "/tmp/memlink/memlink.sock";
+
+/// Descriptor type managed by the daemon
+type Desc = ObmmMemDesc<UbPrivData>;
+
+/// Regions of one NUMA node released at once by `evict`
+const EVICT_PER_NODE: usize = 4;
+
+/// One client request, tagged by `op`
+#[derive(Deserialize, Serialize, Debug)]
+#[serde(tag = "op", rename_all = "snake_case")]
+pub(crate) enum Request {
+    /// Export freshly allocated memory from a NUMA node
+    Export {
+        /// NUMA node to allocate on
+        node: usize,
+        /// Bytes to export
+        length: usize,
+        /// Tenant owning the region
+        #[serde(default)]
+        owner: String,
+    },
+    /// Import a remote region, shared with earlier importers of the same descriptor
+    Import {
+        /// Descriptor from the exporting node
+        desc: Desc,
+        /// Base distance hint
+        #[serde(default)]
+        base_dist: i32,
+        /// Tenant owning the region
+        #[serde(default)]
+        owner: String,
+    },
+    /// Drop one reference to an exported region, unexporting it with the last one
+    Unexport {
+        /// Region to release
+        mem_id: MemId,
+        /// Unexport even if the region is still in use remotely
+        #[serde(default)]
+        force: bool,
+    },
+    /// Drop one reference to an imported region, unimporting it with the last one
+    Unimport {
+        /// Region to release
+        mem_id: MemId,
+    },
+    /// Release every region of a tenant at once, whatever its refcount
+    Evict {
+        /// Tenant going away
+        owner: String,
+        /// Unexport regions still in use remotely with `FORCE`
+        #[serde(default)]
+        force: bool,
+    },
+    /// Describe every region in the table
+    List,
+    /// libobmm statistics and region counts in Prometheus text format
+    Metrics,
+    /// Several requests answered in order, exports and imports issued as batches
+    Batch {
+        /// Requests to run
+        requests: Vec<Request>,
+    },
+}
+
+/// Answer to one `Request`
+#[derive(Serialize, Deserialize, Debug, Default)]
+pub(crate) struct Response {
+    /// Whether the request succeeded
+    ok: bool,
+    /// Reason of the failure
+    #[serde(skip_serializing_if = "Option::is_none")]
+    error: Option<String>,
+    /// Region created or released
+    #[serde(skip_serializing_if = "Option::is_none")]
+    mem_id: Option<MemId>,
+    /// Descriptor of an exported region
+    #[serde(skip_serializing_if = "Option::is_none")]
+    desc: Option<Desc>,
+    /// NUMA node of the region
+    #[serde(skip_serializing_if = "Option::is_none")]
+    numa: Option<i32>,
+    /// References left on the region
+    #[serde(skip_serializing_if = "Option::is_none")]
+    refcount: Option<usize>,
+    /// Region table, answer to `list`
+    #[serde(skip_serializing_if = "Option::is_none")]
+    regions: Option<Vec<RegionInfo>>,
+    /// Answers to the requests of a `batch`
+    #[serde(skip_serializing_if = "Option::is_none")]
+    responses: Option<Vec<Response>>,
+    /// Prometheus text, answer to `metrics`
+    #[serde(skip_serializing_if = "Option::is_none")]
+    metrics: Option<String>,
+    /// Regions released by `evict`
+    #[serde(skip_serializing_if = "Option::is_none")]
+    evicted: Option<Vec<MemId>>,
+}
+
+impl Response {
+    /// Failed request
+    fn error(error: impl std::fmt::Display) -> Self {
+        Response {
+            error: Some(error.to_string()),
+            ..Response::default()
+        }
+    }
+
+    /// Region created, or shared with a new owner
+    fn region(mem_id: MemId, region: &Region) -> Self {
+        Response {
+            ok: true,
+            mem_id: Some(mem_id),
+            desc: (region.kind == RegionKind::Exported).then(|| region.desc.clone()),
+            numa: Some(region.numa),
+            refcount: Some(region.refcount),
+            ..Response::default()
+        }
+    }
+
+    /// Reference dropped, `refcount` left
+    fn released(mem_id: MemId, refcount: usize) -> Self {
+        Response {
+            ok: true,
+            mem_id: Some(mem_id),
+            refcount: Some(refcount),
+            ..Response::default()
+        }
+    }
+}
+
+/// Direction of a region
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq, Eq, Hash)]
+#[serde(rename_all = "snake_case")]
+pub(crate) enum RegionKind {
+    /// Local memory exported by the daemon
+    Exported,
+    /// Remote memory imported by the daemon
+    Imported,
+}
+
+/// Region table entry as reported by `list`
+#[derive(Serialize, Deserialize, Debug)]
+pub(crate) struct RegionInfo {
+    /// Memory ID of the region
+    mem_id: MemId,
+    /// Direction of the region
+    kind: RegionKind,
+    /// Tenant that created the region
+    owner: String,
+    /// Outstanding references
+    refcount: usize,
+    /// NUMA node of the region
+    numa: i32,
+    /// Length of the region
+    length: u64,
+}
+
+/// A region owned by the daemon
+#[derive(Debug)]
+struct Region {
+    /// Direction of the region
+    kind: RegionKind,
+    /// Descriptor of the region
+    desc: Desc,
+    /// Tenant that created the region
+    owner: String,
+    /// Outstanding references, the region is released when it drops to zero
+    refcount: usize,
+    /// NUMA node of the region
+    numa: i32,
+}
+
+/// One entry of the `--preimport` file
+#[derive(Deserialize, Debug)]
+struct PreimportRange {
+    /// Remote range to keep declared, usually a whole exported window
+    desc: Desc,
+    /// NUMA node to declare it on, -1 to let the kernel choose
+    #[serde(default = "any_node")]
+    numa: i32,
+    /// Base distance of the remote node
+    #[serde(default)]
+    base_dist: i32,
+}
+
+/// Default of `PreimportRange::numa`
+const fn any_node() -> i32 {
+    -1
+}
+
+/// Preimport ranges listed in the JSON array at `path`
+fn load_preimport(path: &Path) -> anyhow::Result<Vec<ObmmPreimportInfo<UbPrivData>>> {
+    let text = std::fs::read_to_string(path)
+        .with_context(|| format!("Failed to read {}", path.display()))?;
+    let ranges: Vec<PreimportRange> = serde_json::from_str(&text)
+        .with_context(|| format!("Invalid preimport ranges in {}", path.display()))?;
+    Ok(ranges
+        .iter()
+        .map(|range| ObmmPreimportInfo::covering(&range.desc, range.numa, range.base_dist))
+        .collect())
+}
+
+/// Identity of a remote region, imports of the same one share a `MemId`
+type ImportKey = (u64, u64, u32, [u8; 16], [u8; 16]);
+
+/// Identity of the region `desc` describes
+const fn import_key(desc: &Desc) -> ImportKey {
+    (desc.addr, desc.length, desc.tokenid, desc.seid, desc.deid)
+}
+
+/// Regions owned by the daemon
+///
+/// Exports and imports are kept apart since the driver numbers them independently.
+#[derive(Debug, Default)]
+struct Table {
+    /// Exported regions
+    exports: HashMap<MemId, Region>,
+    /// Imported regions
+    imports: HashMap<MemId, Region>,
+    /// Imported regions by remote identity
+    by_key: HashMap<ImportKey, MemId>,
+}
+
+impl Table {
+    /// Take every region of `owner` out of the table, with the teardown list for them
+    ///
+    /// Exports and imports are numbered independently, so the same `MemId` may be both;
+    /// the removed regions are keyed by kind as well.
+    fn take_owned(
+        &mut self,
+        owner: &str,
+    ) -> (HashMap<(RegionKind, MemId), Region>, Vec<TeardownRegion>) {
+        let mut removed = HashMap::new();
+        let mut regions = Vec::new();
+        let exports: Vec<MemId> = self
+            .exports
+            .iter()
+            .filter(|entry| entry.1.owner == owner)
+            .map(|entry| *entry.0)
+            .collect();
+        let imports: Vec<MemId> = self
+            .imports
+            .iter()
+            .filter(|entry| entry.1.owner == owner)
+            .map(|entry| *entry.0)
+            .collect();
+        for mem_id in exports {
+            if let Some(region) = self.exports.remove(&mem_id) {
+                regions.push(TeardownRegion::exported(
+                    mem_id,
+                    usize::try_from(region.numa).ok(),
+                ));
+                let _ = removed.insert((RegionKind::Exported, mem_id), region);
+            }
+        }
+        for mem_id in imports {
+            if let Some(region) = self.imports.remove(&mem_id) {
+                let _ = self.by_key.remove(&import_key(&region.desc));
+                regions.push(TeardownRegion::imported(
+                    mem_id,
+                    usize::try_from(region.numa).ok(),
+                ));
+                let _ = removed.insert((RegionKind::Imported, mem_id), region);
+            }
+        }
+        (removed, regions)
+    }
+}
+
+/// State shared by all connections
+#[derive(Debug)]
+struct Daemon {
+    /// Region table; ioctls are issued without holding it
+    table: Mutex<Table>,
+    /// Published exports, `None` if the registry could not be opened
+    registry: Option<DescRegistry>,
+    /// Workers releasing the regions of an evicted tenant and declaring preimport
+    /// ranges, apart from the connection workers
+    teardown: Arc<ThreadPool>,
+    /// Warm preimport ranges imports are served from, `None` without `--preimport`
+    preimport: Option<PreimportPool>,
+}
+
+impl Daemon {
+    /// Daemon with an empty region table
+    fn new(
+        registry: Option<DescRegistry>,
+        teardown: Arc<ThreadPool>,
+        preimport: Option<PreimportPool>,
+    ) -> Self {
+        Daemon {
+            table: Mutex::new(Table::default()),
+            registry,
+            teardown,
+            preimport,
+        }
+    }
+
+    /// Run one request
+    fn handle(&self, request: Request) -> Response {
+        match request {
+            Request::Export {
+                node,
+                length,
+                owner,
+            } => self.export(node, length, owner),
+            Request::Import {
+                desc,
+                base_dist,
+                owner,
+            } => self.import(desc, base_dist, owner),
+            Request::Unexport { mem_id, force } => self.unexport(mem_id, force),
+            Request::Unimport { mem_id } => self.unimport(mem_id),
+            Request::Evict { owner, force } => self.evict(&owner, force),
+            Request::List => self.list(),
+            Request::Metrics => Response {
+                ok: true,
+                metrics: Some(self.metrics()),
+                ..Response::default()
+            },
+            Request::Batch { requests } => Response {
+                ok: true,
+                responses: Some(self.batch(requests)),
+                ..Response::default()
+            },
+        }
+    }
+
+    /// Lock the region table, a panicked connection leaves it consistent
+    fn table(&self) -> std::sync::MutexGuard<'_, Table> {
+        self.table.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+
+    /// Record a new export and publish it in the registry
+    fn add_export(&self, mem_id: MemId, desc: Desc, node: usize, owner: String) -> Response {
+        if let Some(registry) = self.registry.as_ref()
+            && let Err(e) = registry.insert(mem_id, &desc)
+        {
+            warn!("Failed to publish MemID {mem_id}: {e:#}");
+        }
+        let region = Region {
+            kind: RegionKind::Exported,
+            desc,
+            owner,
+            refcount: 1,
+            numa: i32::try_from(node).unwrap_or(-1),
+        };
+        let response = Response::region(mem_id, &region);
+        if self.table().exports.insert(mem_id, region).is_some() {
+            warn!("MemID {mem_id} was exported twice");
+        }
+        response
+    }
+
+    /// Record a new import, or share the region another importer got first
+    fn add_import(&self, mem_id: MemId, numa: i32, desc: Desc, owner: String) -> Response {
+        let key = import_key(&desc);
+        let mut table = self.table();
+        if let Some(&existing) = table
+            .by_key
+            .get(&key)
+            .filter(|&&existing| existing != mem_id)
+        {
+            // lost a race with a concurrent importer of the same region
+            drop(table);
+            self.unimport_region(mem_id).unwrap_or_else(|e| {
+                warn!("Failed to unimport duplicate MemID {mem_id}: errno {e}");
+            });
+            return self
+                .share_import(existing)
+                .unwrap_or_else(|| Response::error("import raced with unimport"));
+        }
+        let region = Region {
+            kind: RegionKind::Imported,
+            desc,
+            owner,
+            refcount: 1,
+            numa,
+        };
+        let response = Response::region(mem_id, &region);
+        let _ = table.by_key.insert(key, mem_id);
+        if table.imports.insert(mem_id, region).is_some() {
+            warn!("MemID {mem_id} was imported twice");
+        }
+        response
+    }
+
+    /// Take another reference on an imported region
+    fn share_import(&self, mem_id: MemId) -> Option<Response> {
+        let mut table = self.table();
+        let region = table.imports.get_mut(&mem_id)?;
+        region.refcount = region.refcount.saturating_add(1);
+        Some(Response::region(mem_id, region))
+    }
+
+    /// Export `length` bytes from `node`
+    fn export(&self, node: usize, length: usize, owner: String) -> Response {
+        let mut lens = vec![0; MAX_NUMA_NODES];
+        let Some(len) = lens.get_mut(node) else {
+            return Response::error(format!("NUMA node {node} out of range"));
+        };
+        *len = length;
+        match mem_export::<UbPrivData>(&lens, ObmmExportFlags::ALLOWMMAP) {
+            Ok((mem_id, desc)) => {
+                info!("Exported MemID {mem_id} for {owner:?}");
+                self.add_export(mem_id, desc, node, owner)
+            }
+            Err(e) => Response::error(format!("{e:#}")),
+        }
+    }
+
+    /// Import `desc`, reusing an existing import of the same region
+    fn import(&self, desc: Desc, base_dist: i32, owner: String) -> Response {
+        let shared = self.table().by_key.get(&import_key(&desc)).copied();
+        if let Some(response) = shared.and_then(|mem_id| self.share_import(mem_id)) {
+            return response;
+        }
+        match self.import_region(&desc, base_dist) {
+            Ok((mem_id, numa)) => {
+                info!("Imported MemID {mem_id} on node {numa} for {owner:?}");
+                self.add_import(mem_id, numa, desc, owner)
+            }
+            Err(e) => Response::error(format!("Failed to import memory: errno {e}")),
+        }
+    }
+
+    /// Import `desc` through the preimport pool if there is one
+    fn import_region(&self, desc: &Desc, base_dist: i32) -> Result<(MemId, i32), i32> {
+        match self.preimport.as_ref() {
+            Some(pool) => pool.import(desc, ObmmImportFlags::ALLOWMMAP, base_dist),
+            None => mem_import(desc, ObmmExportFlags::ALLOWMMAP, base_dist),
+        }
+    }
+
+    /// Unimport `mem_id`, returning its preimport range to the pool
+    fn unimport_region(&self, mem_id: MemId) -> Result<(), i32> {
+        match self.preimport.as_ref() {
+            Some(pool) => pool.unimport(mem_id, ObmmExportFlags::empty()),
+            None => mem_unimport(mem_id, ObmmExportFlags::empty()),
+        }
+    }
+
+    /// Drop a reference to an exported region
+    fn unexport(&self, mem_id: MemId, force: bool) -> Response {
+        let mut table = self.table();
+        let Some(region) = table.exports.get_mut(&mem_id) else {
+            return Response::error(format!("MemID {mem_id} is not exported"));
+        };
+        region.refcount = region.refcount.saturating_sub(1);
+        if region.refcount > 0 {
+            return Response::released(mem_id, region.refcount);
+        }
+        let removed = table.exports.remove(&mem_id);
+        drop(table);
+
+        let flags = if force {
+            ObmmUnexportFlags::FORCE
+        } else {
+            ObmmUnexportFlags::empty()
+        };
+        if let Err(e) = mem_unexport(mem_id, flags) {
+            // still held by the driver, keep it so a retry can release it
+            self.restore(removed.map(|held| {
+                (
+                    mem_id,
+                    Region {
+                        refcount: 1,
+                        ..held
+                    },
+                )
+            }));
+            return Response::error(format!("Failed to unexport MemID {mem_id}: errno {e}"));
+        }
+        if let Some(registry) = self.registry.as_ref()
+            && let Err(e) = registry.remove(mem_id)
+        {
+            warn!("Failed to unpublish MemID {mem_id}: {e:#}");
+        }
+        info!("Unexported MemID {mem_id}");
+        Response::released(mem_id, 0)
+    }
+
+    /// Drop a reference to an imported region
+    fn unimport(&self, mem_id: MemId) -> Response {
+        let mut table = self.table();
+        let Some(region) = table.imports.get_mut(&mem_id) else {
+            return Response::error(format!("MemID {mem_id} is not imported"));
+        };
+        region.refcount = region.refcount.saturating_sub(1);
+        if region.refcount > 0 {
+            return Response::released(mem_id, region.refcount);
+        }
+        let removed = table.imports.remove(&mem_id);
+        if let Some(held) = removed.as_ref() {
+            let _ = table.by_key.remove(&import_key(&held.desc));
+        }
+        drop(table);
+
+        if let Err(e) = self.unimport_region(mem_id) {
+            self.restore(removed.map(|held| {
+                (
+                    mem_id,
+                    Region {
+                        refcount: 1,
+                        ..held
+                    },
+                )
+            }));
+            return Response::error(format!("Failed to unimport MemID {mem_id}: errno {e}"));
+        }
+        info!("Unimported MemID {mem_id}");
+        Response::released(mem_id, 0)
+    }
+
+    /// Release every region of `owner` in parallel; regions that fail stay in the table
+    fn evict(&self, owner: &str, force: bool) -> Response {
+        let (mut removed, regions) = self.table().take_owned(owner);
+
+        let outcome = Teardown::new(&self.teardown, EVICT_PER_NODE)
+            .force_fallback(force)
+            .run(&regions);
+        let report = match outcome {
+            Ok(report) => report,
+            Err(e) => {
+                self.restore(
+                    removed
+                        .into_iter()
+                        .map(|((_, mem_id), region)| (mem_id, region)),
+                );
+                return Response::error(format!("Failed to evict {owner}: {e:#}"));
+            }
+        };
+        let mut evicted: Vec<MemId> = report
+            .released
+            .iter()
+            .chain(report.forced.iter())
+            .copied()
+            .collect();
+        evicted.sort_unstable();
+        // the report has no kinds: forced ones are exports, a released MemId is taken
+        // as the export of that number if there is one, as the import otherwise
+        let forced = report
+            .forced
+            .iter()
+            .map(|&mem_id| (Some(RegionKind::Exported), mem_id));
+        let released = report.released.iter().map(|&mem_id| (None, mem_id));
+        for (kind, mem_id) in forced.chain(released) {
+            let region = match kind {
+                Some(kind) => removed.remove(&(kind, mem_id)),
+                None => removed
+                    .remove(&(RegionKind::Exported, mem_id))
+                    .or_else(|| removed.remove(&(RegionKind::Imported, mem_id))),
+            };
+            let Some(region) = region else {
+                continue;
+            };
+            match (region.kind, self.preimport.as_ref(), self.registry.as_ref()) {
+                (RegionKind::Imported, Some(pool), _) => pool.forget(mem_id),
+                (RegionKind::Exported, _, Some(registry)) => {
+                    if let Err(e) = registry.remove(mem_id) {
+                        warn!("Failed to unpublish MemID {mem_id}: {e:#}");
+                    }
+                }
+                (RegionKind::Imported, None, _) | (RegionKind::Exported, _, None) => {}
+            }
+        }
+        // what is left failed and is still held by the driver
+        self.restore(
+            removed
+                .into_iter()
+                .map(|((_, mem_id), region)| (mem_id, region)),
+        );
+        info!(
+            "Evicted {} regions of {owner}, {} forced, {} failed",
+            evicted.len(),
+            report.forced.len(),
+            report.failed.len()
+        );
+        match report.into_result() {
+            Ok(_) => Response {
+                ok: true,
+                evicted: Some(evicted),
+                ..Response::default()
+            },
+            Err(e) => Response {
+                evicted: Some(evicted),
+                ..Response::error(format!("{e:#}"))
+            },
+        }
+    }
+
+    /// Put regions taken out of the table back
+    fn restore(&self, regions: impl IntoIterator<Item = (MemId, Region)>) {
+        let mut table = self.table();
+        for (mem_id, region) in regions {
+            if region.kind == RegionKind::Exported {
+                let _ = table.exports.insert(mem_id, region);
+            } else {
+                let _ = table.by_key.insert(import_key(&region.desc), mem_id);
+                let _ = table.imports.insert(mem_id, region);
+            }
+        }
+    }
+
+    /// Snapshot of the region table
+    fn list(&self) -> Response {
+        let table = self.table();
+        let regions = table
+            .exports
+            .iter()
+            .chain(table.imports.iter())
+            .map(|(&mem_id, region)| RegionInfo {
+                mem_id,
+                kind: region.kind,
+                owner: region.owner.clone(),
+                refcount: region.refcount,
+                numa: region.numa,
+                length: region.desc.length,
+            })
+            .collect();
+        Response {
+            ok: true,
+            regions: Some(regions),
+            ..Response::default()
+        }
+    }
+
+    /// Current libobmm statistics and table size as Prometheus text
+    fn metrics(&self) -> String {
+        let (exported, imported) = {
+            let table = self.table();
+            (table.exports.len(), table.imports.len())
+        };
+        metrics::render(
+            &obmm_rs::stats::snapshot(),
+            &[("exported", exported), ("imported", imported)],
+        )
+        .unwrap_or_default()
+    }
+
+    /// Run `requests` in order, exports and fresh imports through one batched call each
+    fn batch(&self, requests: Vec<Request>) -> Vec<Response> {
+        let mut responses: Vec<Option<Response>> = requests.iter().map(|_| None).collect();
+        let mut exports = Vec::new();
+        let mut imports: HashMap<i32, Vec<(usize, Desc, String)>> = HashMap::new();
+        let mut others = Vec::new();
+        for (index, request) in requests.into_iter().enumerate() {
+            match request {
+                Request::Export {
+                    node,
+                    length,
+                    owner,
+                } => {
+                    let mut lens = [0; OBMM_MAX_LOCAL_NUMA_NODES];
+                    match lens.get_mut(node) {
+                        Some(len) => {
+                            *len = length;
+                            exports.push((index, lens, node, owner));
+                        }
+                        None => set(
+                            &mut responses,
+                            index,
+                            Response::error(format!("NUMA node {node} out of range")),
+                        ),
+                    }
+                }
+                Request::Import {
+                    desc,
+                    base_dist,
+                    owner,
+                } => {
+                    let shared = self.table().by_key.get(&import_key(&desc)).copied();
+                    match shared.and_then(|mem_id| self.share_import(mem_id)) {
+                        Some(response) => set(&mut responses, index, response),
+                        // warm ranges are handed out one import at a time
+                        None if self.preimport.is_some() => {
+                            set(&mut responses, index, self.import(desc, base_dist, owner));
+                        }
+                        None => imports
+                            .entry(base_dist)
+                            .or_default()
+                            .push((index, desc, owner)),
+                    }
+                }
+                Request::Unexport { .. }
+                | Request::Unimport { .. }
+                | Request::Evict { .. }
+                | Request::List
+                | Request::Metrics
+                | Request::Batch { .. } => {
+                    others.push((index, request));
+                }
+            }
+        }
+
+        if !exports.is_empty() {
+            let lengths: Vec<_> = exports.iter().map(|&(_, lens, _, _)| lens).collect();
+            let results = mem_export_batch::<UbPrivData>(&lengths, ObmmExportFlags::ALLOWMMAP);
+            for ((index, _, node, owner), result) in exports.into_iter().zip(results) {
+                let response = match result {
+                    Ok((mem_id, desc)) => self.add_export(mem_id, desc, node, owner),
+                    Err(e) => Response::error(format!("Failed to export memory: errno {e}")),
+                };
+                set(&mut responses, index, response);
+            }
+        }
+        for (base_dist, group) in imports {
+            let descs: Vec<Desc> = group.iter().map(|entry| entry.1.clone()).collect();
+            let results = mem_import_batch(&descs, ObmmExportFlags::ALLOWMMAP, base_dist);
+            for ((index, desc, owner), result) in group.into_iter().zip(results) {
+                let response = match result {
+                    Ok((mem_id, numa)) => self.add_import(mem_id, numa, desc, owner),
+                    Err(e) => Response::error(format!("Failed to import memory: errno {e}")),
+                };
+                set(&mut responses, index, response);
+            }
+        }
+        // releases run last so a batch can create and drop regions in one go
+        for (index, request) in others {
+            set(&mut responses, index, self.handle(request));
+        }
+
+        responses
+            .into_iter()
+            .map(|response| response.unwrap_or_else(|| Response::error("request was not run")))
+            .collect()
+    }
+
+    /// Answer requests from `stream` until the client hangs up
+    fn serve_connection(&self, stream: UnixStream) -> anyhow::Result<()> {
+        let mut writer = stream.try_clone()?;
+        for line in BufReader::new(stream).lines() {
+            let line = line?;
+            if line.trim().is_empty() {
+                continue;
+            }
+            let response = match serde_json::from_str::<Request>(&line) {
+                Ok(request) => self.handle(request),
+                Err(e) => Response::error(format!("Invalid request: {e}")),
+            };
+            serde_json::to_writer(&mut writer, &response)?;
+            writer.write_all(b"\n")?;
+        }
+        Ok(())
+    }
+}
+
+/// Store the answer to request `index` of a batch
+fn set(responses: &mut [Option<Response>], index: usize, response: Response) {
+    if let Some(slot) = responses.get_mut(index) {
+        *slot = Some(response);
+    }
+}
+
+/// Run the daemon on `socket`, `workers` connections are served concurrently;
+/// libobmm statistics are collected and served over HTTP on `metrics_addr` if given;
+/// imports inside the ranges listed in the `preimport` file are served from `warm_per_node` warm ranges per node
+pub(crate) fn serve(
+    socket: &Path,
+    workers: usize,
+    metrics_addr: Option<SocketAddr>,
+    preimport: Option<&Path>,
+    warm_per_node: usize,
+) -> anyhow::Result<()> {
+    if let Some(dir) = socket.parent() {
+        std::fs::create_dir_all(dir)
+            .with_context(|| format!("Failed to create {}", dir.display()))?;
+    }
+    // a socket left behind by a previous daemon refuses new binds
+    if socket.exists() && UnixStream::connect(socket).is_err() {
+        std::fs::remove_file(socket)
+            .with_context(|| format!("Failed to remove stale {}", socket.display()))?;
+    }
+    let listener = UnixListener::bind(socket)
+        .with_context(|| format!("Failed to bind {}", socket.display()))?;
+
+    let nodes = obmm_rs::refresh_topology()
+        .map_err(|e| anyhow::anyhow!("Failed to probe the topology: errno {e}"))?;
+    let registry = DescRegistry::open_default()
+        .inspect_err(|e| warn!("Exports will not be published: {e:#}"))
+        .ok();
+    let teardown = Arc::new(ThreadPool::new(
+        std::thread::available_parallelism()?.get(),
+    )?);
+    let preimport = match preimport {
+        Some(path) => {
+            let ranges = load_preimport(path)?;
+            info!(
+                "Keeping {warm_per_node} of {} preimport ranges warm per node",
+                ranges.len()
+            );
+            Some(PreimportPool::new(
+                Arc::clone(&teardown),
+                ranges,
+                warm_per_node,
+            ))
+        }
+        None => None,
+    };
+    let daemon = Arc::new(Daemon::new(registry, teardown, preimport));
+    if let Some(addr) = metrics_addr {
+        let daemon = Arc::clone(&daemon);
+        metrics::listen(addr, move || daemon.metrics())?;
+    }
+    let pool = ThreadPool::new(workers)?;
+    info!(
+        "Serving on {} with {workers} workers, {nodes} NUMA nodes",
+        socket.display()
+    );
+
+    for stream in listener.incoming() {
+        let stream = match stream {
+            Ok(stream) => stream,
+            Err(e) => {
+                warn!("Failed to accept a client: {e}");
+                continue;
+            }
+        };
+        let daemon = Arc::clone(&daemon);
+        pool.execute(move || {
+            daemon
+                .serve_connection(stream)
+                .unwrap_or_else(|e| warn!("Client connection failed: {e:#}"));
+        })?;
+    }
+    Ok(())
+}
+
+/// Forward requests read from stdin to the daemon on `socket`, one per line, and print the answers
+pub(crate) fn client(socket: &Path) -> anyhow::Result<()> {
+    let stream = UnixStream::connect(socket)
+        .with_context(|| format!("Failed to connect to {}", socket.display()))?;
+    let mut writer = stream.try_clone()?;
+    let mut answers = BufReader::new(stream);
+    let mut stdout = std::io::stdout().lock();
+    let mut answer = String::new();
+    for line in std::io::stdin().lock().lines() {
+        let line = line?;
+        if line.trim().is_empty() {
+            continue;
+        }
+        writer.write_all(line.trim().as_bytes())?;
+        writer.write_all(b"\n")?;
+        answer.clear();
+        if answers.read_line(&mut answer)? == 0 {
+            anyhow::bail!("Daemon closed the connection");
+        }
+        stdout.write_all(answer.as_bytes())?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Daemon over the hooked libobmm, without registry
+    fn daemon(preimport: Option<PreimportPool>) -> anyhow::Result<Daemon> {
+        Ok(Daemon::new(None, Arc::new(ThreadPool::new(2)?), preimport))
+    }
+
+    /// Descriptor of a remote region of `length` bytes; the hook gives every region the same address
+    fn remote(length: usize) -> anyhow::Result<Desc> {
+        let mut lens = vec![0; MAX_NUMA_NODES];
+        if let Some(len) = lens.get_mut(0) {
+            *len = length;
+        }
+        Ok(mem_export::<UbPrivData>(&lens, ObmmExportFlags::empty())?.1)
+    }
+
+    /// Table entry owned by `owner`
+    fn region(kind: RegionKind, desc: Desc, owner: &str) -> Region {
+        Region {
+            kind,
+            desc,
+            owner: owner.to_owned(),
+            refcount: 1,
+            numa: 0,
+        }
+    }
+
+    #[test]
+    fn test_import_shared_by_descriptor() -> anyhow::Result<()> {
+        let daemon = daemon(None)?;
+        let desc = remote(1 << 21_u32)?;
+        let first = daemon.handle(Request::Import {
+            desc: desc.clone(),
+            base_dist: 0,
+            owner: "a".to_owned(),
+        });
+        let second = daemon.handle(Request::Import {
+            desc,
+            base_dist: 0,
+            owner: "b".to_owned(),
+        });
+        assert!(first.ok && second.ok);
+        assert_eq!(first.mem_id, second.mem_id);
+        assert_eq!(second.refcount, Some(2));
+        assert_eq!(daemon.table().by_key.len(), 1);
+
+        let mem_id = first.mem_id.ok_or_else(|| anyhow::anyhow!("no MemID"))?;
+        assert_eq!(
+            daemon.handle(Request::Unimport { mem_id }).refcount,
+            Some(1)
+        );
+        assert_eq!(
+            daemon.handle(Request::Unimport { mem_id }).refcount,
+            Some(0)
+        );
+        let table = daemon.table();
+        assert!(table.imports.is_empty() && table.by_key.is_empty());
+        drop(table);
+        let again = daemon.handle(Request::Unimport { mem_id });
+        assert!(!again.ok);
+        assert!(again.error.is_some_and(|e| e.contains("is not imported")));
+        Ok(())
+    }
+
+    #[test]
+    fn test_release_unknown_and_exported() -> anyhow::Result<()> {
+        let daemon = daemon(None)?;
+        let unknown = daemon.handle(Request::Unexport {
+            mem_id: 42,
+            force: false,
+        });
+        assert!(
+            unknown
+                .error
+                .is_some_and(|e| e.contains("MemID 42 is not exported"))
+        );
+        assert!(!daemon.handle(Request::Unimport { mem_id: 42 }).ok);
+        assert!(
+            !daemon
+                .handle(Request::Export {
+                    node: MAX_NUMA_NODES,
+                    length: 4096,
+                    owner: String::new()
+                })
+                .ok
+        );
+
+        let exported = daemon.handle(Request::Export {
+            node: 0,
+            length: 1 << 21_u32,
+            owner: "a".to_owned(),
+        });
+        assert!(exported.ok && exported.desc.is_some());
+        let mem_id = exported.mem_id.ok_or_else(|| anyhow::anyhow!("no MemID"))?;
+        assert_eq!(daemon.list().regions.map(|regions| regions.len()), Some(1));
+        assert_eq!(
+            daemon
+                .handle(Request::Unexport {
+                    mem_id,
+                    force: false
+                })
+                .refcount,
+            Some(0)
+        );
+        assert_eq!(daemon.list().regions.map(|regions| regions.len()), Some(0));
+        Ok(())
+    }
+
+    #[test]
+    fn test_evict_owner() -> anyhow::Result<()> {
+        let daemon = daemon(None)?;
+        let desc = remote(1 << 21_u32)?;
+        {
+            let mut table = daemon.table();
+            // an export and an import may share a MemID
+            let _ = table
+                .exports
+                .insert(1, region(RegionKind::Exported, desc.clone(), "gone"));
+            let _ = table
+                .exports
+                .insert(2, region(RegionKind::Exported, desc.clone(), "kept"));
+            let _ = table.by_key.insert(import_key(&desc), 1);
+            let _ = table
+                .imports
+                .insert(1, region(RegionKind::Imported, desc, "gone"));
+        }
+        let response = daemon.handle(Request::Evict {
+            owner: "gone".to_owned(),
+            force: false,
+        });
+        assert!(response.ok);
+        assert_eq!(response.evicted, Some(vec![1, 1]));
+        let table = daemon.table();
+        assert_eq!(table.exports.keys().copied().collect::<Vec<_>>(), vec![2]);
+        assert!(table.imports.is_empty() && table.by_key.is_empty());
+        Ok(())
+    }
+
+    #[test]
+    fn test_batch_runs_releases_last() -> anyhow::Result<()> {
+        let daemon = daemon(None)?;
+        let responses = daemon.batch(vec![
+            Request::Unimport { mem_id: 1 },
+            Request::Export {
+                node: 0,
+                length: 1 << 21_u32,
+                owner: "a".to_owned(),
+            },
+            Request::Import {
+                desc: remote(1 << 22_u32)?,
+                base_dist: 0,
+                owner: "a".to_owned(),
+            },
+            Request::Export {
+                node: MAX_NUMA_NODES,
+                length: 4096,
+                owner: "a".to_owned(),
+            },
+            Request::List,
+        ]);
+        assert_eq!(responses.len(), 5);
+        let ok: Vec<bool> = responses.iter().map(|response| response.ok).collect();
+        assert_eq!(ok, vec![true, true, true, false, true]);
+        // the unimport ran after the import, the list after both
+        assert_eq!(
+            responses.first().and_then(|response| response.refcount),
+            Some(0)
+        );
+        let kinds: Option<Vec<RegionKind>> = responses
+            .get(4)
+            .and_then(|response| response.regions.as_ref())
+            .map(|regions| regions.iter().map(|info| info.kind).collect());
+        assert_eq!(kinds, Some(vec![RegionKind::Exported]));
+        Ok(())
+    }
+
+    #[test]
+    fn test_imports_from_preimport_pool() -> anyhow::Result<()> {
+        let workers = Arc::new(ThreadPool::new(2)?);
+        let desc = remote(1 << 21_u32)?;
+        let pool = PreimportPool::new(
+            Arc::clone(&workers),
+            vec![ObmmPreimportInfo::covering(&desc, 3, 0)],
+            1,
+        );
+        pool.wait_idle();
+        let daemon = Daemon::new(None, workers, Some(pool));
+
+        let imported = daemon.handle(Request::Import {
+            desc,
+            base_dist: 0,
+            owner: "a".to_owned(),
+        });
+        // the hook imports onto the node it is given, which is the range's
+        assert_eq!(imported.numa, Some(3));
+        let warm = |served: &Daemon| served.preimport.as_ref().map(|warmed| warmed.warm(3));
+        assert_eq!(warm(&daemon), Some(0));
+        let evicted = daemon.handle(Request::Evict {
+            owner: "a".to_owned(),
+            force: false,
+        });
+        assert_eq!(evicted.evicted, Some(vec![1]));
+        // the range is idle again once the evicted import is forgotten
+        assert_eq!(warm(&daemon), Some(1));
+        Ok(())
+    }
+
+    #[test]
+    fn test_serve_connection_dispatch() -> anyhow::Result<()> {
+        let daemon = daemon(None)?;
+        let (client, server) = UnixStream::pair()?;
+        let handle = std::thread::spawn(move || daemon.serve_connection(server));
+        let mut writer = client.try_clone()?;
+        writer.write_all(
+            b"{\"op\":\"export\",\"node\":0,\"length\":4096}\n\n{\"op\":\"list\"}\nnot json\n",
+        )?;
+        writer.shutdown(std::net::Shutdown::Write)?;
+        let answers = BufReader::new(client)
+            .lines()
+            .map(|line| Ok(serde_json::from_str::<Response>(&line?)?))
+            .collect::<anyhow::Result<Vec<_>>>()?;
+        handle
+            .join()
+            .or(Err(anyhow::anyhow!("connection panicked")))??;
+        assert_eq!(answers.len(), 3);
+        assert!(
+            answers
+                .first()
+                .is_some_and(|answer| answer.ok && answer.mem_id.is_some())
+        );
+        assert_eq!(
+            answers
+                .get(1)
+                .and_then(|answer| answer.regions.as_ref())
+                .map(Vec::len),
+            Some(1)
+        );
+        assert!(
+            answers
+                .get(2)
+                .and_then(|answer| answer.error.as_deref())
+                .is_some_and(|e| e.starts_with("Invalid request"))
+        );
+        Ok(())
+    }
+}
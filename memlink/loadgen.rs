@@ -0,0 +1,960 @@
+//! `memlink bench` and `memlink soak`: control plane load generation
+//!
+//! Workers on a `ThreadPool` replay a weighted mix of export, import,
+//! ownership change and unexport against libobmm, exporting round robin from
+//! the given NUMA nodes. Each worker owns the regions it created; unexporting
+//! a region first unimports whatever the worker imported from it. Latencies go
+//! into per operation log-linear histograms, merged when the run ends.
+//!
+//! With `--rate` the load is open loop: an operation is timed from the moment
+//! it was scheduled, so a stall is recorded as latency of everything queued
+//! behind it instead of quietly lowering the offered rate. `bench` stops after
+//! `--ops` operations; `soak` runs for `--duration` and logs a progress line
+//! every `--interval`. Both then release everything still held and report the
+//! regions that could not be released, together with any `/dev/obmm_shmdev*`
+//! devices left behind compared to the start.
+
+use std::fmt;
+use std::io::Write;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Mutex, PoisonError};
+use std::time::{Duration, Instant};
+
+use anyhow::Context;
+use log::{info, warn};
+use obmm_rs::mapping::{MapOptions, RegionMap, SHMDEV_PREFIX};
+use obmm_rs::{
+    MAX_NUMA_NODES, MemId, OBMM_MAX_LOCAL_NUMA_NODES, ObmmExportFlags, ObmmMemDesc, ObmmUnexportFlags, UbPrivData,
+    mem_export, mem_export_batch, mem_import, mem_set_ownership, mem_unexport, mem_unimport,
+};
+use serde::Serialize;
+use threadpool::ThreadPool;
+
+/// Descriptor type the load works with
+type Desc = ObmmMemDesc<UbPrivData>;
+
+/// Sub-buckets per power of two of a `Histogram`, as a shift
+const SUB_BITS: u32 = 4;
+
+/// Sub-buckets per power of two, relative error of a bucket is below 1/16
+const SUB_BUCKETS: usize = 1 << SUB_BITS;
+
+/// Buckets covering every `u64` value: the linear range plus exponents 4 to 63
+const BUCKETS: usize = 61 * SUB_BUCKETS;
+
+/// How often `soak` checks for the end of an interval
+const SOAK_TICK: Duration = Duration::from_millis(100);
+
+/// Load shape shared by `bench` and `soak`
+#[derive(clap::Args, Debug, Clone)]
+pub(crate) struct LoadArgs {
+    /// Concurrent workers
+    #[arg(long, default_value_t = 8)]
+    concurrency: usize,
+    /// Operations per second over all workers, 0 to run closed loop as fast as possible
+    #[arg(long, default_value_t = 0)]
+    rate: u64,
+    /// NUMA nodes to export from, round robin
+    #[arg(long, value_delimiter = ',', default_value = "1")]
+    nodes: Vec<usize>,
+    /// Bytes per region, a multiple of 4K
+    #[arg(long, default_value_t = 2 * 1024 * 1024)]
+    length: usize,
+    /// Weights of export, import, ownership change and unexport
+    #[arg(long, value_parser = parse_mix, default_value = "30,30,30,10")]
+    mix: Mix,
+    /// Regions per export call, more than 1 goes through the batched export
+    #[arg(long, default_value_t = 1)]
+    batch: usize,
+    /// Exports one worker holds at most, further exports turn into unexports
+    #[arg(long, default_value_t = 64)]
+    max_live: usize,
+}
+
+/// Weights of the operations the load picks from
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct Mix {
+    /// Export, import, ownership change and unexport
+    weights: [u32; 4],
+}
+
+impl Mix {
+    /// Operation for `roll`, uniformly distributed over the sum of the weights
+    fn pick(&self, roll: u64) -> Op {
+        let total = self.weights.iter().copied().map(u64::from).sum::<u64>().max(1);
+        let mut left = roll.checked_rem(total).unwrap_or(0);
+        for (op, weight) in [Op::Export, Op::Import, Op::Ownership, Op::Unexport].into_iter().zip(self.weights) {
+            let weight = u64::from(weight);
+            if left < weight {
+                return op;
+            }
+            left = left.saturating_sub(weight);
+        }
+        Op::Export
+    }
+}
+
+/// Parse `--mix`, four comma separated weights
+fn parse_mix(arg: &str) -> Result<Mix, String> {
+    let weights: Vec<u32> = arg
+        .split(',')
+        .map(|weight| weight.trim().parse().map_err(|e| format!("invalid weight {weight}: {e}")))
+        .collect::<Result<_, _>>()?;
+    let weights: [u32; 4] =
+        weights.try_into().map_err(|weights: Vec<u32>| format!("--mix needs 4 weights, got {}", weights.len()))?;
+    if weights.iter().all(|&weight| weight == 0) {
+        return Err("--mix needs a non-zero weight".to_owned());
+    }
+    Ok(Mix { weights })
+}
+
+/// Operations timed by the load
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Op {
+    /// `mem_export`, or one `mem_export_batch` call
+    Export,
+    /// `mem_import` of a region the worker exported
+    Import,
+    /// `mem_set_ownership` flipping an import between reader and writer
+    Ownership,
+    /// `mem_unexport`
+    Unexport,
+    /// `mem_unimport`, issued by unexports for the imports of their region
+    Unimport,
+}
+
+impl Op {
+    /// Every operation, in report order
+    const ALL: [Op; 5] = [Op::Export, Op::Import, Op::Ownership, Op::Unexport, Op::Unimport];
+
+    /// Name in reports
+    const fn name(self) -> &'static str {
+        match self {
+            Op::Export => "export",
+            Op::Import => "import",
+            Op::Ownership => "ownership",
+            Op::Unexport => "unexport",
+            Op::Unimport => "unimport",
+        }
+    }
+
+    /// Position in `ALL`
+    const fn index(self) -> usize {
+        match self {
+            Op::Export => 0,
+            Op::Import => 1,
+            Op::Ownership => 2,
+            Op::Unexport => 3,
+            Op::Unimport => 4,
+        }
+    }
+}
+
+/// Log-linear latency histogram in nanoseconds
+///
+/// Values below 16 get a bucket each, above that every power of two is split
+/// into 16 buckets, so a reported percentile is within 1/16 of the truth.
+#[derive(Debug, Clone)]
+struct Histogram {
+    /// Count per bucket
+    counts: Vec<u64>,
+    /// Values recorded
+    total: u64,
+    /// Largest value recorded
+    max: u64,
+    /// Sum of the values recorded
+    sum: u128,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Histogram { counts: vec![0; BUCKETS], total: 0, max: 0, sum: 0 }
+    }
+}
+
+impl Histogram {
+    /// Bucket of `value`
+    fn bucket(value: u64) -> usize {
+        let Some(exp) = 63_u32.checked_sub(value.leading_zeros()).filter(|&exp| exp >= SUB_BITS) else {
+            return usize::try_from(value).unwrap_or(0);
+        };
+        let shift = exp.saturating_sub(SUB_BITS);
+        let sub = usize::try_from(value.checked_shr(shift).unwrap_or(0)).unwrap_or(0) & SUB_BUCKETS.saturating_sub(1);
+        usize::try_from(shift.saturating_add(1)).unwrap_or(0).saturating_mul(SUB_BUCKETS).saturating_add(sub)
+    }
+
+    /// Largest value falling into `bucket`
+    fn upper_bound(bucket: usize) -> u64 {
+        if bucket < SUB_BUCKETS {
+            return u64::try_from(bucket).unwrap_or(u64::MAX);
+        }
+        let shift = u32::try_from(bucket.checked_div(SUB_BUCKETS).unwrap_or(0).saturating_sub(1)).unwrap_or(0);
+        let sub = u128::try_from(bucket & SUB_BUCKETS.saturating_sub(1)).unwrap_or(0);
+        let base = u128::try_from(SUB_BUCKETS).unwrap_or(0).saturating_add(sub);
+        let next = base.saturating_add(1).checked_shl(shift).unwrap_or(u128::MAX);
+        u64::try_from(next.saturating_sub(1)).unwrap_or(u64::MAX)
+    }
+
+    /// Record one value
+    fn record(&mut self, value: u64) {
+        if let Some(count) = self.counts.get_mut(Self::bucket(value)) {
+            *count = count.saturating_add(1);
+        }
+        self.total = self.total.saturating_add(1);
+        self.max = self.max.max(value);
+        self.sum = self.sum.saturating_add(u128::from(value));
+    }
+
+    /// Add the values of `other`
+    fn merge(&mut self, other: &Histogram) {
+        for (count, added) in self.counts.iter_mut().zip(&other.counts) {
+            *count = count.saturating_add(*added);
+        }
+        self.total = self.total.saturating_add(other.total);
+        self.max = self.max.max(other.max);
+        self.sum = self.sum.saturating_add(other.sum);
+    }
+
+    /// Value below which `per_mille` thousandths of the records fall
+    fn percentile(&self, per_mille: u64) -> u64 {
+        let rank = u128::from(self.total).saturating_mul(u128::from(per_mille)).div_ceil(1000).max(1);
+        let mut seen = 0_u128;
+        for (bucket, &count) in self.counts.iter().enumerate() {
+            seen = seen.saturating_add(u128::from(count));
+            if seen >= rank {
+                return Self::upper_bound(bucket).min(self.max);
+            }
+        }
+        self.max
+    }
+
+    /// Mean of the values recorded
+    fn mean(&self) -> u64 {
+        u64::try_from(self.sum.checked_div(u128::from(self.total)).unwrap_or(0)).unwrap_or(u64::MAX)
+    }
+}
+
+/// Latency summary of one operation, in nanoseconds
+#[derive(Debug, Serialize)]
+struct OpReport {
+    /// Operation name
+    op: &'static str,
+    /// Successful calls
+    count: u64,
+    /// Failed calls
+    errors: u64,
+    /// Mean latency
+    mean: u64,
+    /// Median latency
+    p50: u64,
+    /// 90th percentile
+    p90: u64,
+    /// 99th percentile
+    p99: u64,
+    /// 99.9th percentile
+    p999: u64,
+    /// Largest latency
+    max: u64,
+}
+
+/// Result of a whole run, logged and written to stdout as JSON
+#[derive(Debug, Serialize)]
+struct Report {
+    /// Wall time of the load, cleanup excluded, in milliseconds
+    elapsed_ms: u128,
+    /// Operations issued
+    ops: u64,
+    /// Operations per second over the run
+    ops_per_sec: u128,
+    /// Regions still held when the load stopped
+    live_at_stop: u64,
+    /// Regions that could not be released during cleanup
+    leaked_regions: u64,
+    /// `/dev/obmm_shmdev*` devices present after cleanup that were not there before
+    leaked_devices: i64,
+    /// Per operation latency
+    latency: Vec<OpReport>,
+}
+
+impl fmt::Display for Report {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{} ops in {} ms, {} ops/s, {} live at stop, {} leaked regions, {} leaked devices",
+            self.ops, self.elapsed_ms, self.ops_per_sec, self.live_at_stop, self.leaked_regions, self.leaked_devices
+        )
+    }
+}
+
+/// Counters shared by the workers
+#[derive(Debug, Default)]
+struct Shared {
+    /// Operations claimed, bounds `bench`
+    claimed: AtomicU64,
+    /// Operations finished
+    done: AtomicU64,
+    /// Operations failed
+    errors: AtomicU64,
+    /// Regions exported or imported
+    created: AtomicU64,
+    /// Regions unexported or unimported
+    released: AtomicU64,
+    /// Set to stop every worker
+    stop: AtomicBool,
+}
+
+impl Shared {
+    /// Regions held right now
+    fn live(&self) -> u64 {
+        self.created.load(Ordering::Relaxed).saturating_sub(self.released.load(Ordering::Relaxed))
+    }
+}
+
+/// When a run ends
+#[derive(Debug, Clone, Copy)]
+enum Until {
+    /// After this many operations over all workers
+    Ops(u64),
+    /// When `Shared::stop` is set
+    Stopped,
+}
+
+/// A region imported from one of the worker's exports
+#[derive(Debug)]
+struct Import {
+    /// Memory ID of the import
+    mem_id: MemId,
+    /// Mapping for ownership changes, made on the first one
+    map: Option<RegionMap>,
+    /// Whether the import currently owns the range for writing
+    writer: bool,
+}
+
+/// A region the worker exported
+#[derive(Debug)]
+struct Export {
+    /// Memory ID of the export
+    mem_id: MemId,
+    /// Descriptor imported by `Op::Import`
+    desc: Desc,
+    /// Imports of this region
+    imports: Vec<Import>,
+}
+
+/// One worker of the load
+#[derive(Debug)]
+struct Worker<'a> {
+    /// Load shape
+    args: &'a LoadArgs,
+    /// Counters shared with the other workers
+    shared: &'a Shared,
+    /// xorshift state
+    rng: u64,
+    /// Exports round robin position
+    next_node: usize,
+    /// Regions held
+    exports: Vec<Export>,
+    /// Latency per operation
+    histograms: [Histogram; 5],
+    /// Failures per operation
+    errors: [u64; 5],
+    /// Whether outcomes are recorded, off while cleaning up
+    timed: bool,
+}
+
+impl<'a> Worker<'a> {
+    /// Worker number `id`
+    fn new(args: &'a LoadArgs, shared: &'a Shared, id: usize) -> Self {
+        let seed = u64::try_from(id).unwrap_or(0).wrapping_mul(0x9e37_79b9_7f4a_7c15) | 1;
+        Worker {
+            args,
+            shared,
+            rng: seed,
+            next_node: id,
+            exports: Vec::new(),
+            histograms: Default::default(),
+            errors: [0; 5],
+            timed: true,
+        }
+    }
+
+    /// Next pseudo random number
+    fn roll(&mut self) -> u64 {
+        self.rng ^= self.rng << 13_u32;
+        self.rng ^= self.rng >> 7_u32;
+        self.rng ^= self.rng << 17_u32;
+        self.rng
+    }
+
+    /// Random index below `len`, which is non-zero
+    fn pick(&mut self, len: usize) -> usize {
+        usize::try_from(self.roll().checked_rem(u64::try_from(len).unwrap_or(1)).unwrap_or(0)).unwrap_or(0)
+    }
+
+    /// Issue operations until `until`, paced to `interval` per operation if set
+    fn run(&mut self, until: Until, interval: Option<Duration>) {
+        let mut scheduled = Instant::now();
+        loop {
+            let more = match until {
+                Until::Ops(total) => self.shared.claimed.fetch_add(1, Ordering::Relaxed) < total,
+                Until::Stopped => !self.shared.stop.load(Ordering::Relaxed),
+            };
+            if !more || self.shared.stop.load(Ordering::Relaxed) {
+                break;
+            }
+            let origin = if let Some(interval) = interval {
+                let origin = scheduled;
+                scheduled = scheduled.checked_add(interval).unwrap_or(scheduled);
+                std::thread::sleep(origin.saturating_duration_since(Instant::now()));
+                origin
+            } else {
+                Instant::now()
+            };
+            let roll = self.roll();
+            let op = self.args.mix.pick(roll);
+            self.step(op, origin);
+            let _ = self.shared.done.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Run `op`, or what it degrades to given the regions held
+    fn step(&mut self, op: Op, origin: Instant) {
+        match op {
+            Op::Export if self.exports.len() >= self.args.max_live => self.unexport(origin),
+            Op::Export => self.export(origin),
+            Op::Import | Op::Ownership | Op::Unexport | Op::Unimport if self.exports.is_empty() => self.export(origin),
+            Op::Import => self.import(origin),
+            Op::Ownership => self.ownership(origin),
+            Op::Unexport | Op::Unimport => self.unexport(origin),
+        }
+    }
+
+    /// Record the outcome of `op` started at `origin`, unless cleaning up
+    fn record<T, E>(&mut self, op: Op, origin: Instant, result: &Result<T, E>) {
+        if !self.timed {
+            return;
+        }
+        let index = op.index();
+        if result.is_ok() {
+            let ns = u64::try_from(origin.elapsed().as_nanos()).unwrap_or(u64::MAX);
+            if let Some(histogram) = self.histograms.get_mut(index) {
+                histogram.record(ns);
+            }
+        } else {
+            if let Some(errors) = self.errors.get_mut(index) {
+                *errors = errors.saturating_add(1);
+            }
+            let _ = self.shared.errors.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Per node lengths of one region on the next node
+    fn lengths(&mut self) -> [usize; OBMM_MAX_LOCAL_NUMA_NODES] {
+        let mut lengths = [0; OBMM_MAX_LOCAL_NUMA_NODES];
+        let node = self.args.nodes.get(self.next_node.checked_rem(self.args.nodes.len()).unwrap_or(0)).copied();
+        self.next_node = self.next_node.wrapping_add(1);
+        if let Some(length) = node.and_then(|node| lengths.get_mut(node)) {
+            *length = self.args.length;
+        }
+        lengths
+    }
+
+    /// Export one region, or a batch of them
+    fn export(&mut self, origin: Instant) {
+        if self.args.batch > 1 {
+            let lengths: Vec<_> = (0..self.args.batch).map(|_| self.lengths()).collect();
+            let results = mem_export_batch::<UbPrivData>(&lengths, ObmmExportFlags::ALLOWMMAP);
+            let all: Result<(), i32> = results.iter().try_for_each(|result| result.as_ref().map(|_| ()).map_err(|&errno| errno));
+            self.record(Op::Export, origin, &all);
+            for (mem_id, desc) in results.into_iter().flatten() {
+                self.add_export(mem_id, desc);
+            }
+        } else {
+            let lengths = self.lengths();
+            let result = mem_export::<UbPrivData>(&lengths, ObmmExportFlags::ALLOWMMAP);
+            self.record(Op::Export, origin, &result);
+            if let Ok((mem_id, desc)) = result {
+                self.add_export(mem_id, desc);
+            }
+        }
+    }
+
+    /// Hold a freshly exported region
+    fn add_export(&mut self, mem_id: MemId, desc: Desc) {
+        let _ = self.shared.created.fetch_add(1, Ordering::Relaxed);
+        self.exports.push(Export { mem_id, desc, imports: Vec::new() });
+    }
+
+    /// Import one of the worker's exports
+    fn import(&mut self, origin: Instant) {
+        let index = self.pick(self.exports.len());
+        let Some(result) = self.exports.get(index).map(|export| mem_import(&export.desc, ObmmExportFlags::ALLOWMMAP, 0))
+        else {
+            return;
+        };
+        self.record(Op::Import, origin, &result);
+        if let Ok((mem_id, _)) = result {
+            let _ = self.shared.created.fetch_add(1, Ordering::Relaxed);
+            if let Some(export) = self.exports.get_mut(index) {
+                export.imports.push(Import { mem_id, map: None, writer: false });
+            }
+        }
+    }
+
+    /// Flip an import between reader and writer ownership, importing first if there is none
+    fn ownership(&mut self, origin: Instant) {
+        let index = self.pick(self.exports.len());
+        let choice = self.roll();
+        let length = self.args.length;
+        let Some(import) = self.exports.get_mut(index).and_then(|export| {
+            let slot = choice.checked_rem(u64::try_from(export.imports.len()).ok()?)?;
+            export.imports.get_mut(usize::try_from(slot).ok()?)
+        }) else {
+            self.import(origin);
+            return;
+        };
+        let (started, result) = flip(import, length, origin);
+        if let Err(ref e) = result {
+            warn!("Ownership change failed: {e:#}");
+        }
+        self.record(Op::Ownership, started, &result);
+    }
+
+    /// Unexport one region, unimporting its imports first
+    fn unexport(&mut self, origin: Instant) {
+        let index = self.pick(self.exports.len());
+        if index >= self.exports.len() {
+            return;
+        }
+        let export = self.exports.swap_remove(index);
+        if let Err(export) = self.release(export, origin, ObmmUnexportFlags::empty()) {
+            // keep it, cleanup retries with FORCE
+            self.exports.push(export);
+        }
+    }
+
+    /// Unimport and drop every import of `export`, then unexport it
+    /// # Errors
+    /// The export with the imports that are still held, if any release failed
+    fn release(&mut self, mut export: Export, origin: Instant, flags: ObmmUnexportFlags) -> Result<(), Export> {
+        let mut kept = Vec::new();
+        for mut import in std::mem::take(&mut export.imports) {
+            drop(import.map.take());
+            let started = Instant::now();
+            let result = mem_unimport(import.mem_id, ObmmExportFlags::empty());
+            self.record(Op::Unimport, started, &result);
+            if result.is_ok() {
+                let _ = self.shared.released.fetch_add(1, Ordering::Relaxed);
+            } else {
+                kept.push(import);
+            }
+        }
+        if !kept.is_empty() {
+            export.imports = kept;
+            return Err(export);
+        }
+        let result = mem_unexport(export.mem_id, flags);
+        self.record(Op::Unexport, origin, &result);
+        if result.is_ok() {
+            let _ = self.shared.released.fetch_add(1, Ordering::Relaxed);
+            Ok(())
+        } else {
+            Err(export)
+        }
+    }
+
+    /// Exports and imports held
+    fn held(&self) -> u64 {
+        let regions = self.exports.iter().map(|export| export.imports.len().saturating_add(1)).fold(0, usize::saturating_add);
+        u64::try_from(regions).unwrap_or(u64::MAX)
+    }
+
+    /// Release everything still held, unexporting with `FORCE` as a last resort
+    ///
+    /// Teardown is not part of the load: nothing is recorded, and what cannot
+    /// be released shows up as a leak instead.
+    fn cleanup(&mut self) {
+        self.timed = false;
+        for export in std::mem::take(&mut self.exports) {
+            if let Err(busy) = self.release(export, Instant::now(), ObmmUnexportFlags::empty())
+                && let Err(stuck) = self.release(busy, Instant::now(), ObmmUnexportFlags::FORCE)
+            {
+                warn!("Leaking MemID {} with {} imports", stuck.mem_id, stuck.imports.len());
+            }
+        }
+    }
+}
+
+/// Flip `import` between reader and writer, mapping it first if needed
+/// # Returns
+/// When the timed part started, and the outcome
+fn flip(import: &mut Import, length: usize, origin: Instant) -> (Instant, anyhow::Result<()>) {
+    let mut started = origin;
+    if import.map.is_none() {
+        match RegionMap::open(import.mem_id, length, MapOptions::new().writable(true)) {
+            Ok(map) => import.map = Some(map),
+            Err(e) => return (started, Err(e.context(format!("Failed to map MemID {}", import.mem_id)))),
+        }
+        // an import is mapped once, that is not part of the ownership latency
+        started = Instant::now();
+    }
+    let Some(map) = import.map.as_ref() else {
+        return (started, Err(anyhow::anyhow!("MemID {} is not mapped", import.mem_id)));
+    };
+    let start = map.as_mut_ptr().addr();
+    let prot = if import.writer { libc::PROT_READ } else { libc::PROT_READ | libc::PROT_WRITE };
+    let result = mem_set_ownership(map.fd(), start, start.saturating_add(map.len()), prot)
+        .map_err(|errno| anyhow::anyhow!("Failed to set ownership of MemID {}: errno {errno}", import.mem_id));
+    if result.is_ok() {
+        import.writer = !import.writer;
+    }
+    (started, result)
+}
+
+/// Latencies and failures of one finished worker
+#[derive(Debug)]
+struct WorkerResult {
+    /// Latency per operation
+    histograms: [Histogram; 5],
+    /// Failures per operation
+    errors: [u64; 5],
+    /// When the worker stopped issuing operations, since the start of the run
+    finished: Duration,
+    /// Regions the worker held when it stopped
+    held: u64,
+}
+
+/// Number of `/dev/obmm_shmdev*` devices, 0 where there is no such device
+fn shmdev_count() -> i64 {
+    let Some(name) = SHMDEV_PREFIX.strip_prefix("/dev/") else {
+        return 0;
+    };
+    std::fs::read_dir("/dev").map_or(0, |entries| {
+        let count = entries.filter_map(Result::ok).filter(|entry| entry.file_name().to_string_lossy().starts_with(name)).count();
+        i64::try_from(count).unwrap_or(i64::MAX)
+    })
+}
+
+/// Check the load shape before starting any worker
+fn validate(args: &LoadArgs) -> anyhow::Result<()> {
+    if args.concurrency == 0 {
+        anyhow::bail!("--concurrency must be at least 1");
+    }
+    if args.length == 0 || !args.length.is_multiple_of(4096) {
+        anyhow::bail!("--length {} is not a non-zero multiple of 4096", args.length);
+    }
+    if args.nodes.is_empty() {
+        anyhow::bail!("--nodes needs at least one node");
+    }
+    if let Some(node) = args.nodes.iter().find(|&&node| node >= MAX_NUMA_NODES.min(OBMM_MAX_LOCAL_NUMA_NODES)) {
+        anyhow::bail!("NUMA node {node} is out of range");
+    }
+    Ok(())
+}
+
+/// Run the load until `until`, calling `monitor` on this thread while the workers run
+fn run<F>(args: &LoadArgs, until: Until, monitor: F) -> anyhow::Result<()>
+where
+    F: FnOnce(&Shared),
+{
+    validate(args)?;
+    let interval = (args.rate > 0).then(|| {
+        let per_worker = u128::from(args.rate).checked_div(u128::try_from(args.concurrency).unwrap_or(1)).unwrap_or(0);
+        let ns = 1_000_000_000_u128.checked_div(per_worker.max(1)).unwrap_or(0);
+        Duration::from_nanos(u64::try_from(ns).unwrap_or(u64::MAX))
+    });
+    let devices_before = shmdev_count();
+    let pool = ThreadPool::new(args.concurrency)?;
+    let shared = Shared::default();
+    let results = Mutex::new(Vec::new());
+    let started = Instant::now();
+
+    pool.scope(|scope| -> anyhow::Result<()> {
+        for id in 0..args.concurrency {
+            let (shared, results) = (&shared, &results);
+            let spawned = scope.spawn(move || {
+                let mut worker = Worker::new(args, shared, id);
+                worker.run(until, interval);
+                let finished = started.elapsed();
+                let held = worker.held();
+                worker.cleanup();
+                results.lock().unwrap_or_else(PoisonError::into_inner).push(WorkerResult {
+                    histograms: worker.histograms,
+                    errors: worker.errors,
+                    finished,
+                    held,
+                });
+            });
+            if let Err(e) = spawned {
+                shared.stop.store(true, Ordering::Relaxed);
+                return Err(e);
+            }
+        }
+        monitor(&shared);
+        Ok(())
+    })?
+    .context("Failed to start the load workers")?;
+
+    let (mut elapsed, mut live_at_stop) = (Duration::ZERO, 0_u64);
+    let mut histograms: [Histogram; 5] = Default::default();
+    let mut errors = [0_u64; 5];
+    for result in results.into_inner().unwrap_or_else(PoisonError::into_inner) {
+        elapsed = elapsed.max(result.finished);
+        live_at_stop = live_at_stop.saturating_add(result.held);
+        for (total, histogram) in histograms.iter_mut().zip(&result.histograms) {
+            total.merge(histogram);
+        }
+        for (total, count) in errors.iter_mut().zip(result.errors) {
+            *total = total.saturating_add(count);
+        }
+    }
+    let ops = shared.done.load(Ordering::Relaxed);
+    let report = Report {
+        elapsed_ms: elapsed.as_millis(),
+        ops,
+        ops_per_sec: u128::from(ops).saturating_mul(1_000_000_000).checked_div(elapsed.as_nanos()).unwrap_or(0),
+        live_at_stop,
+        leaked_regions: shared.live(),
+        leaked_devices: shmdev_count().saturating_sub(devices_before),
+        latency: Op::ALL
+            .into_iter()
+            .zip(histograms.iter().zip(errors))
+            .map(|(op, (histogram, errors))| OpReport {
+                op: op.name(),
+                count: histogram.total,
+                errors,
+                mean: histogram.mean(),
+                p50: histogram.percentile(500),
+                p90: histogram.percentile(900),
+                p99: histogram.percentile(990),
+                p999: histogram.percentile(999),
+                max: histogram.max,
+            })
+            .collect(),
+    };
+    info!("{report}");
+    for op in &report.latency {
+        info!(
+            "{:>9}: {} ok, {} failed, mean {} ns, p50 {} ns, p99 {} ns, p99.9 {} ns, max {} ns",
+            op.op, op.count, op.errors, op.mean, op.p50, op.p99, op.p999, op.max
+        );
+    }
+    let mut stdout = std::io::stdout().lock();
+    serde_json::to_writer(&mut stdout, &report)?;
+    stdout.write_all(b"\n")?;
+    if report.leaked_regions > 0 || report.leaked_devices > 0 {
+        anyhow::bail!("{} regions and {} devices leaked", report.leaked_regions, report.leaked_devices);
+    }
+    Ok(())
+}
+
+/// `memlink bench`: run `ops` operations and report
+pub(crate) fn bench(args: &LoadArgs, ops: u64) -> anyhow::Result<()> {
+    info!("Running {ops} operations on {} workers, mix {:?}", args.concurrency, args.mix.weights);
+    run(args, Until::Ops(ops), |_| ())
+}
+
+/// `memlink soak`: run for `duration`, logging progress every `interval`
+pub(crate) fn soak(args: &LoadArgs, duration: Duration, interval: Duration) -> anyhow::Result<()> {
+    info!("Soaking for {} s on {} workers, mix {:?}", duration.as_secs(), args.concurrency, args.mix.weights);
+    run(args, Until::Stopped, |shared| {
+        let started = Instant::now();
+        let mut last = (started, 0_u64);
+        while started.elapsed() < duration {
+            std::thread::sleep(SOAK_TICK);
+            if last.0.elapsed() < interval {
+                continue;
+            }
+            let done = shared.done.load(Ordering::Relaxed);
+            let window = last.0.elapsed().as_nanos();
+            let rate = u128::from(done.saturating_sub(last.1)).saturating_mul(1_000_000_000).checked_div(window).unwrap_or(0);
+            info!(
+                "{} s: {done} ops, {rate} ops/s, {} live regions, {} errors",
+                started.elapsed().as_secs(),
+                shared.live(),
+                shared.errors.load(Ordering::Relaxed)
+            );
+            last = (Instant::now(), done);
+        }
+        shared.stop.store(true, Ordering::Relaxed);
+    })
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Edit of a valid load shape that `validate` must reject
+    type Breakage = fn(&mut LoadArgs);
+
+    /// Load shape that passes `validate`
+    fn load() -> Result<LoadArgs, String> {
+        Ok(LoadArgs {
+            concurrency: 8,
+            rate: 0,
+            nodes: vec![1],
+            length: 2 * 1024 * 1024,
+            mix: parse_mix("30,30,30,10")?,
+            batch: 1,
+            max_live: 64,
+        })
+    }
+
+    #[test]
+    fn test_histogram_bucket_boundaries() {
+        // below 16 every value has its own bucket
+        assert_eq!(Histogram::bucket(0), 0);
+        assert_eq!(Histogram::bucket(15), 15);
+        assert_eq!(Histogram::upper_bound(15), 15);
+        // the first log-linear octave is still one value wide
+        assert_eq!(Histogram::bucket(16), 16);
+        assert_eq!(Histogram::upper_bound(16), 16);
+        assert_eq!(Histogram::bucket(31), 31);
+        // from there on buckets double in width every 16
+        assert_eq!(Histogram::bucket(32), Histogram::bucket(33));
+        assert_eq!(Histogram::upper_bound(Histogram::bucket(32)), 33);
+        assert_eq!(Histogram::bucket(u64::MAX), BUCKETS.saturating_sub(1));
+        assert_eq!(Histogram::upper_bound(BUCKETS.saturating_sub(1)), u64::MAX);
+    }
+
+    #[test]
+    fn test_histogram_buckets_are_contiguous() {
+        for bucket in 0..BUCKETS.saturating_sub(1) {
+            let upper = Histogram::upper_bound(bucket);
+            assert_eq!(Histogram::bucket(upper), bucket);
+            assert_eq!(
+                Histogram::bucket(upper.saturating_add(1)),
+                bucket.saturating_add(1)
+            );
+        }
+    }
+
+    #[test]
+    fn test_histogram_error_bound() {
+        let mut values: Vec<u64> = (0..1024).collect();
+        for exp in 4..64_u32 {
+            let power = 1_u64 << exp;
+            values.extend([
+                power.saturating_sub(1),
+                power,
+                power.saturating_add(1),
+                power | (power >> 1_u32),
+            ]);
+        }
+        values.extend([1_000_003, 999_999_937, u64::MAX.saturating_sub(1), u64::MAX]);
+        for value in values {
+            let upper = Histogram::upper_bound(Histogram::bucket(value));
+            assert!(upper >= value, "{value} reported as {upper}");
+            assert!(
+                upper.saturating_sub(value) <= value / 16,
+                "{value} reported as {upper}"
+            );
+        }
+    }
+
+    #[test]
+    fn test_histogram_percentiles() {
+        let mut histogram = Histogram::default();
+        assert_eq!(histogram.percentile(500), 0);
+        for value in 1..=1000 {
+            histogram.record(value);
+        }
+        assert_eq!(histogram.total, 1000);
+        assert_eq!(histogram.mean(), 500);
+        for (per_mille, exact) in [(1, 1), (500, 500), (900, 900), (990, 990), (999, 999)] {
+            let reported = histogram.percentile(per_mille);
+            assert!(
+                reported >= exact && reported.saturating_sub(exact) <= exact / 16,
+                "p{per_mille} {reported}"
+            );
+        }
+        // the top bucket is capped by the largest value seen
+        assert_eq!(histogram.percentile(1000), 1000);
+    }
+
+    #[test]
+    fn test_histogram_merge() {
+        let mut whole = Histogram::default();
+        let mut even = Histogram::default();
+        let mut odd = Histogram::default();
+        for value in (0..10_000_u64).map(|i| i.saturating_mul(i)) {
+            whole.record(value);
+            if value.is_multiple_of(2) {
+                even.record(value);
+            } else {
+                odd.record(value);
+            }
+        }
+        even.merge(&odd);
+        assert_eq!(even.counts, whole.counts);
+        assert_eq!(
+            (even.total, even.max, even.sum),
+            (whole.total, whole.max, whole.sum)
+        );
+        assert_eq!(even.percentile(999), whole.percentile(999));
+    }
+
+    #[test]
+    fn test_parse_mix() {
+        assert!(parse_mix("30,30,30,10").is_ok_and(|mix| mix.weights == [30, 30, 30, 10]));
+        assert!(parse_mix(" 1, 2 ,3,4").is_ok_and(|mix| mix.weights == [1, 2, 3, 4]));
+        assert!(parse_mix("1,2,3").is_err_and(|e| e.contains("4 weights, got 3")));
+        assert!(parse_mix("1,2,3,4,5").is_err());
+        assert!(parse_mix("0,0,0,0").is_err_and(|e| e.contains("non-zero")));
+        assert!(parse_mix("1,x,1,1").is_err_and(|e| e.contains("invalid weight x")));
+        assert!(parse_mix("-1,1,1,1").is_err());
+    }
+
+    #[test]
+    fn test_mix_pick() -> Result<(), String> {
+        let mix = parse_mix("1,2,0,3")?;
+        let picked: Vec<Op> = (0..7).map(|roll| mix.pick(roll)).collect();
+        assert_eq!(
+            picked,
+            [
+                Op::Export,
+                Op::Import,
+                Op::Import,
+                Op::Unexport,
+                Op::Unexport,
+                Op::Unexport,
+                Op::Export
+            ]
+        );
+        // a zero weight is never picked, the others in proportion to their weight
+        let mut counts = [0_u64; 5];
+        for roll in 0..6000 {
+            if let Some(count) = counts.get_mut(mix.pick(roll).index()) {
+                *count = count.saturating_add(1);
+            }
+        }
+        assert_eq!(counts, [1000, 2000, 0, 3000, 0]);
+        assert_eq!(mix.pick(u64::MAX), Op::Unexport);
+        Ok(())
+    }
+
+    #[test]
+    fn test_validate() -> Result<(), String> {
+        assert!(validate(&load()?).is_ok());
+        let checks: [(&str, Breakage); 5] = [
+            ("--concurrency", |args| args.concurrency = 0),
+            ("--length", |args| args.length = 0),
+            ("--length", |args| args.length = 4097),
+            ("--nodes", |args| args.nodes.clear()),
+            ("out of range", |args| {
+                args.nodes = vec![1, MAX_NUMA_NODES.min(OBMM_MAX_LOCAL_NUMA_NODES)];
+            }),
+        ];
+        for (message, change) in checks {
+            let mut args = load()?;
+            change(&mut args);
+            let result = validate(&args);
+            assert!(
+                result.is_err_and(|e| e.to_string().contains(message)),
+                "{message}"
+            );
+        }
+        Ok(())
+    }
+}
@@ -84,18 +84,215 @@
     clippy::wildcard_enum_match_arm,
 )]
 
+mod daemon;
+mod loadgen;
+mod metrics;
+
+use std::io::BufRead;
+use std::net::SocketAddr;
+use std::path::PathBuf;
+use std::time::Duration;
+
 use anyhow::Context;
+use clap::{Parser, Subcommand, ValueEnum};
 use log::info;
-use obmm_rs::{UbPrivData, ObmmExportFlags, MAX_NUMA_NODES, mem_export};
+use obmm_rs::hugepage::{HugeBuffer, HugePageBacking};
+use obmm_rs::placement::{NodeSet, Policy};
+use obmm_rs::{UbPrivData, ObmmExportFlags, ObmmUnexportFlags, MAX_NUMA_NODES, mem_export, mem_export_useraddr, mem_unexport};
+use threadpool::ThreadPool;
 
-fn main() -> anyhow::Result<()> {
-    env_logger::init_from_env(env_logger::Env::default().default_filter_or("info"));
-    let export_id = 1;
-    info!("Memory linking and analysis utilities");
-    let mut lens = vec![0; MAX_NUMA_NODES];
-    lens.get_mut(export_id).map(|v| *v = 1024 * 1024 * 128).with_context(|| format!("Failed to set length for NUMA node {export_id}"))?;
+/// Memory linking and analysis utilities
+#[derive(Parser, Debug)]
+#[command(version, about)]
+struct Cli {
+    /// Mode to run, exports 128MB on NUMA node 1 when omitted
+    #[command(subcommand)]
+    command: Option<Command>,
+}
+
+/// memlink modes
+#[derive(Subcommand, Debug)]
+enum Command {
+    /// Export freshly allocated memory from a NUMA node, or striped across nodes
+    Export {
+        /// NUMA node to allocate on, the first node filled with `--policy closest`
+        #[arg(long, default_value_t = 1)]
+        node: usize,
+        /// Bytes to export
+        #[arg(long, default_value_t = 1024 * 1024 * 128)]
+        length: usize,
+        /// Spread the region over the NUMA nodes instead of allocating on `--node` only
+        #[arg(long, value_enum)]
+        policy: Option<Placement>,
+    },
+    /// Zero-copy export of a process VA range backed by 2M pages
+    ExportUseraddr {
+        /// Process owning the range, 0 for memlink itself
+        #[arg(long, default_value_t = 0)]
+        pid: i32,
+        /// Start of the range (hex), omitted to allocate and pre-fault a buffer in memlink
+        #[arg(long, value_parser = parse_addr)]
+        va: Option<usize>,
+        /// Bytes to export
+        #[arg(long)]
+        length: usize,
+        /// Huge pages backing the buffer allocated by memlink
+        #[arg(long, value_enum, default_value_t = Backing::Thp)]
+        backing: Backing,
+        /// Pre-fault threads, defaults to the available parallelism
+        #[arg(long)]
+        threads: Option<usize>,
+    },
+    /// Run as a daemon owning the region table, serving requests over a Unix socket
+    Serve {
+        /// Socket to listen on
+        #[arg(long, default_value = daemon::DEFAULT_SOCKET)]
+        socket: PathBuf,
+        /// Connections served concurrently
+        #[arg(long, default_value_t = 8)]
+        workers: usize,
+        /// Collect libobmm statistics and serve them in Prometheus format on this address
+        #[arg(long, num_args = 0..=1, default_missing_value = metrics::DEFAULT_METRICS_ADDR)]
+        metrics: Option<SocketAddr>,
+        /// JSON array of `{"desc", "numa", "base_dist"}` ranges to keep preimported for imports
+        #[arg(long)]
+        preimport: Option<PathBuf>,
+        /// Idle preimported ranges kept declared per NUMA node
+        #[arg(long, default_value_t = 1)]
+        warm_per_node: usize,
+    },
+    /// Send JSON requests read from stdin to a running daemon
+    Client {
+        /// Socket the daemon listens on
+        #[arg(long, default_value = daemon::DEFAULT_SOCKET)]
+        socket: PathBuf,
+    },
+    /// Replay a mix of export/import/ownership/unexport and report latency and throughput
+    Bench {
+        /// Load shape
+        #[command(flatten)]
+        load: loadgen::LoadArgs,
+        /// Operations to run over all workers
+        #[arg(long, default_value_t = 100_000)]
+        ops: u64,
+    },
+    /// Run the same load for a long time, logging progress and checking for leaked regions
+    Soak {
+        /// Load shape
+        #[command(flatten)]
+        load: loadgen::LoadArgs,
+        /// Seconds to run
+        #[arg(long, default_value_t = 3600)]
+        duration: u64,
+        /// Seconds between progress lines
+        #[arg(long, default_value_t = 60)]
+        interval: u64,
+    },
+}
+
+/// `--backing` values
+#[derive(ValueEnum, Debug, Clone, Copy)]
+enum Backing {
+    /// Reserved hugetlbfs pages
+    Hugetlb,
+    /// Transparent huge pages
+    Thp,
+}
+
+/// `--policy` values
+#[derive(ValueEnum, Debug, Clone, Copy)]
+enum Placement {
+    /// Equal share on every node
+    Interleave,
+    /// Share proportional to free memory
+    Capacity,
+    /// Share proportional to memory bandwidth
+    Bandwidth,
+    /// `--node` first, then the nearest nodes
+    Closest,
+}
+
+/// Parse a hexadecimal address with an optional 0x prefix
+fn parse_addr(arg: &str) -> Result<usize, String> {
+    usize::from_str_radix(arg.trim_start_matches("0x"), 16).map_err(|e| format!("invalid address {arg}: {e}"))
+}
+
+/// Export `length` bytes freshly allocated on `node`, or placed by `policy`
+fn export(node: usize, length: usize, policy: Option<Placement>) -> anyhow::Result<()> {
+    let lens = if let Some(placement) = policy {
+        let spread = match placement {
+            Placement::Interleave => Policy::Interleave,
+            Placement::Capacity => Policy::Capacity,
+            Placement::Bandwidth => Policy::Bandwidth,
+            Placement::Closest => Policy::Closest(node),
+        };
+        let lens = NodeSet::detect()?.lengths(length, spread)?.to_vec();
+        info!("Placing {length} bytes by {spread:?}: {lens:?}");
+        lens
+    } else {
+        let mut lens = vec![0; MAX_NUMA_NODES];
+        lens.get_mut(node).map(|v| *v = length).with_context(|| format!("Failed to set length for NUMA node {node}"))?;
+        lens
+    };
     let (mem_id, desc) = mem_export::<UbPrivData>(&lens, ObmmExportFlags::ALLOWMMAP).with_context(|| "Failed to export memory")?;
     info!("Exported memory with MemID: {mem_id}");
     info!("Memory Descriptor: {desc:?}");
     Ok(())
-}
\ No newline at end of file
+}
+
+/// Export a VA range of `pid`, or a buffer pre-faulted across a thread pool when `va` is omitted
+fn export_useraddr(pid: i32, va: Option<usize>, length: usize, backing: Backing, threads: Option<usize>) -> anyhow::Result<()> {
+    if let Some(va) = va {
+        let (mem_id, desc) = mem_export_useraddr::<UbPrivData>(pid, va, length, ObmmExportFlags::ALLOWMMAP)
+            .with_context(|| format!("Failed to export {length} bytes at {va:#x} of pid {pid}"))?;
+        info!("Exported VA range with MemID: {mem_id}");
+        info!("Memory Descriptor: {desc:?}");
+        return Ok(());
+    }
+    if pid != 0 {
+        anyhow::bail!("--va is required to export the memory of pid {pid}");
+    }
+
+    let threads = match threads {
+        Some(threads) => threads,
+        None => std::thread::available_parallelism()?.get(),
+    };
+    let backing = match backing {
+        Backing::Hugetlb => HugePageBacking::HugeTlb,
+        Backing::Thp => HugePageBacking::Transparent,
+    };
+    let buffer = HugeBuffer::alloc(length, backing)?;
+    let pool = ThreadPool::new(threads)?;
+    buffer.prefault(&pool)?;
+    info!("Pre-faulted {} bytes on {threads} threads", buffer.len());
+
+    let (mem_id, desc) = mem_export_useraddr::<UbPrivData>(0, buffer.as_mut_ptr().addr(), buffer.len(), ObmmExportFlags::ALLOWMMAP)
+        .with_context(|| "Failed to export pre-faulted buffer")?;
+    info!("Exported VA range with MemID: {mem_id}");
+    info!("Memory Descriptor: {desc:?}");
+    info!("Press Enter to unexport");
+    let mut line = String::new();
+    let _ = std::io::stdin().lock().read_line(&mut line)?;
+    mem_unexport(mem_id, ObmmUnexportFlags::empty()).map_err(|e| anyhow::anyhow!("Failed to unexport MemID {mem_id}: {e}"))?;
+    Ok(())
+}
+
+fn main() -> anyhow::Result<()> {
+    env_logger::init_from_env(env_logger::Env::default().default_filter_or("info"));
+    let cli = Cli::parse();
+    info!("Memory linking and analysis utilities");
+    obmm_rs::init().map_err(|e| anyhow::anyhow!("Failed to open the OBMM device: errno {e}"))?;
+    match cli.command {
+        None => export(1, 1024 * 1024 * 128, None),
+        Some(Command::Export { node, length, policy }) => export(node, length, policy),
+        Some(Command::ExportUseraddr { pid, va, length, backing, threads }) => export_useraddr(pid, va, length, backing, threads),
+        Some(Command::Serve { socket, workers, metrics, preimport, warm_per_node }) => {
+            daemon::serve(&socket, workers, metrics, preimport.as_deref(), warm_per_node)
+        }
+        Some(Command::Client { socket }) => daemon::client(&socket),
+        Some(Command::Bench { load, ops }) => loadgen::bench(&load, ops),
+        Some(Command::Soak { load, duration, interval }) => {
+            loadgen::soak(&load, Duration::from_secs(duration), Duration::from_secs(interval))
+        }
+    }
+}
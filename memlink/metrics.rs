@@ -0,0 +1,129 @@
+//! Prometheus text exposition of the libobmm statistics
+//!
+//! `memlink serve --metrics <addr>` turns libobmm collection on and answers any
+//! HTTP request on `addr` with the current counters, so a scraper can watch
+//! export/import rates, per phase latency and failures by errno without going
+//! through the JSON socket. The same text is returned by the `metrics` request.
+
+use std::fmt::{self, Write as _};
+use std::io::{BufRead, BufReader, Write};
+use std::net::{SocketAddr, TcpListener, TcpStream};
+use std::time::Duration;
+
+use anyhow::Context;
+use log::{info, warn};
+use obmm_rs::stats::{ObmmStats, StatCall, StatPhase};
+
+/// Address the metrics endpoint binds when `--metrics` is given without one
+pub(crate) const DEFAULT_METRICS_ADDR: &str = "127.0.0.1:9464";
+
+/// How long one scrape may take to send its request or read the answer
+const SCRAPE_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// A nanosecond counter as Prometheus seconds, without float arithmetic
+fn seconds(ns: u64) -> String {
+    let elapsed = Duration::from_nanos(ns);
+    format!("{}.{:09}", elapsed.as_secs(), elapsed.subsec_nanos())
+}
+
+/// `# HELP` and `# TYPE` header of one metric family
+fn family(out: &mut String, name: &str, kind: &str, help: &str) -> fmt::Result {
+    writeln!(out, "# HELP {name} {help}")?;
+    writeln!(out, "# TYPE {name} {kind}")
+}
+
+/// Per node series of one direction, nodes that never saw traffic are left out
+fn per_node(out: &mut String, name: &str, direction: &str, values: &[u64]) -> fmt::Result {
+    for (node, value) in values.iter().enumerate().filter(|&(_, value)| *value != 0) {
+        writeln!(out, "{name}{{direction=\"{direction}\",node=\"{node}\"}} {value}")?;
+    }
+    Ok(())
+}
+
+/// Render `stats`, plus the region table gauges given as `(kind, count)`
+/// # Errors
+/// Only if formatting fails, writing to a `String` does not
+pub(crate) fn render(stats: &ObmmStats, regions: &[(&str, usize)]) -> Result<String, fmt::Error> {
+    let mut out = String::new();
+
+    family(&mut out, "obmm_calls_total", "counter", "libobmm calls completed, batches count one per region")?;
+    for call in StatCall::ALL {
+        writeln!(out, "obmm_calls_total{{call=\"{}\"}} {}", call.name(), stats.calls(call))?;
+    }
+    family(&mut out, "obmm_call_errors_total", "counter", "libobmm calls that failed")?;
+    for call in StatCall::ALL {
+        writeln!(out, "obmm_call_errors_total{{call=\"{}\"}} {}", call.name(), stats.errors(call))?;
+    }
+    family(&mut out, "obmm_call_seconds_total", "counter", "Time spent in libobmm calls")?;
+    for call in StatCall::ALL {
+        writeln!(out, "obmm_call_seconds_total{{call=\"{}\"}} {}", call.name(), seconds(stats.call_ns(call)))?;
+    }
+    family(&mut out, "obmm_phase_total", "counter", "Times each phase of a call ran")?;
+    for phase in StatPhase::ALL {
+        writeln!(out, "obmm_phase_total{{phase=\"{}\"}} {}", phase.name(), stats.phase_count(phase))?;
+    }
+    family(&mut out, "obmm_phase_seconds_total", "counter", "Time spent in each phase of a call")?;
+    for phase in StatPhase::ALL {
+        writeln!(out, "obmm_phase_seconds_total{{phase=\"{}\"}} {}", phase.name(), seconds(stats.phase_ns(phase)))?;
+    }
+
+    family(&mut out, "obmm_bytes_total", "counter", "Bytes exported or imported")?;
+    writeln!(out, "obmm_bytes_total{{direction=\"export\"}} {}", stats.bytes_exported)?;
+    writeln!(out, "obmm_bytes_total{{direction=\"import\"}} {}", stats.bytes_imported)?;
+    family(&mut out, "obmm_node_regions_total", "counter", "Regions exported from or imported to a NUMA node")?;
+    per_node(&mut out, "obmm_node_regions_total", "export", &stats.node_exports)?;
+    per_node(&mut out, "obmm_node_regions_total", "import", &stats.node_imports)?;
+    family(&mut out, "obmm_node_bytes_total", "counter", "Bytes exported from or imported to a NUMA node")?;
+    per_node(&mut out, "obmm_node_bytes_total", "export", &stats.node_bytes_exported)?;
+    per_node(&mut out, "obmm_node_bytes_total", "import", &stats.node_bytes_imported)?;
+
+    family(&mut out, "obmm_errno_total", "counter", "Failed calls by errno, 0 for values out of range")?;
+    for (errno, count) in stats.errnos() {
+        writeln!(out, "obmm_errno_total{{errno=\"{errno}\"}} {count}")?;
+    }
+
+    family(&mut out, "memlink_regions", "gauge", "Regions in the daemon table")?;
+    for &(kind, count) in regions {
+        writeln!(out, "memlink_regions{{kind=\"{kind}\"}} {count}")?;
+    }
+    Ok(out)
+}
+
+/// Answer one scrape: the request is read up to its blank line and ignored
+///
+/// Scrapes are served one at a time, a client that stalls is dropped after
+/// `SCRAPE_TIMEOUT` instead of blocking the endpoint.
+fn answer(stream: TcpStream, body: &str) -> anyhow::Result<()> {
+    stream.set_read_timeout(Some(SCRAPE_TIMEOUT))?;
+    stream.set_write_timeout(Some(SCRAPE_TIMEOUT))?;
+    let mut writer = stream.try_clone()?;
+    let mut reader = BufReader::new(stream);
+    let mut line = String::new();
+    while reader.read_line(&mut line)? > 0 && !line.trim().is_empty() {
+        line.clear();
+    }
+    write!(
+        writer,
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+        body.len()
+    )?;
+    writer.write_all(body.as_bytes())?;
+    Ok(())
+}
+
+/// Serve `render()` on `addr` from a dedicated thread, enabling libobmm collection
+pub(crate) fn listen(addr: SocketAddr, render: impl Fn() -> String + Send + 'static) -> anyhow::Result<()> {
+    let listener = TcpListener::bind(addr).with_context(|| format!("Failed to bind metrics endpoint {addr}"))?;
+    obmm_rs::stats::enable(true);
+    info!("Serving metrics on http://{addr}/metrics");
+    let _ = std::thread::Builder::new().name("memlink-metrics".to_owned()).spawn(move || {
+        for stream in listener.incoming() {
+            match stream {
+                Ok(stream) => answer(stream, &render()).unwrap_or_else(|e| warn!("Metrics scrape failed: {e:#}")),
+                Err(e) => warn!("Failed to accept a scrape: {e}"),
+            }
+        }
+    })?;
+    Ok(())
+}
+
@@ -0,0 +1,242 @@
+//! Latency and throughput of the OBMM export/import paths
+//!
+//! `cargo bench -p obmm-rs` runs against the hooked driver and measures the
+//! userspace overhead alone; `cargo bench -p obmm-rs --no-default-features`
+//! runs against `/dev/obmm`. On real hardware region sizes the node cannot
+//! export are skipped, and the import benches need `OBMM_BENCH_DESC` to name a
+//! JSON descriptor exported by a peer. `OBMM_BENCH_NODE` picks the NUMA node
+//! exports are allocated on (default 0).
+
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use obmm_rs::{
+    mem_export, mem_export_batch, mem_import, mem_import_batch, mem_unexport, mem_unimport, wire, MemId,
+    ObmmExportFlags, ObmmMemDesc, ObmmUnexportFlags, UbPrivData, MAX_NUMA_NODES, OBMM_MAX_LOCAL_NUMA_NODES,
+};
+
+const MB: usize = 1 << 20;
+const GB: usize = 1 << 30;
+/// Region sizes of the single-call benches
+const SIZES: [usize; 6] = [2 * MB, 64 * MB, GB, 4 * GB, 16 * GB, 64 * GB];
+/// Regions per call of the batch benches, each `BATCH_REGION` long
+const BATCHES: [usize; 4] = [1, 8, 64, 256];
+const BATCH_REGION: usize = 2 * MB;
+/// Thread counts of the concurrent attach bench
+const THREADS: [usize; 4] = [1, 2, 4, 8];
+
+/// NUMA node exports are allocated on
+fn node() -> usize {
+    std::env::var("OBMM_BENCH_NODE").ok().and_then(|v| v.parse().ok()).unwrap_or(0)
+}
+
+/// Per-node lengths of a `size` byte export on `node()`
+fn lengths(size: usize) -> [usize; OBMM_MAX_LOCAL_NUMA_NODES] {
+    let mut lens = [0; OBMM_MAX_LOCAL_NUMA_NODES];
+    lens[node().min(MAX_NUMA_NODES - 1)] = size;
+    lens
+}
+
+fn export(size: usize) -> Result<(MemId, ObmmMemDesc<UbPrivData>), String> {
+    mem_export::<UbPrivData>(&lengths(size), ObmmExportFlags::ALLOWMMAP).map_err(|e| format!("{e:#}"))
+}
+
+fn unexport(memid: MemId) {
+    mem_unexport(memid, ObmmUnexportFlags::FORCE).expect("unexport");
+}
+
+/// Descriptor of a remote region to import, `None` when there is none to bench
+fn remote_desc() -> Option<ObmmMemDesc<UbPrivData>> {
+    if cfg!(feature = "hook") {
+        return export(2 * MB).ok().map(|(memid, desc)| {
+            unexport(memid);
+            desc
+        });
+    }
+    let path = std::env::var("OBMM_BENCH_DESC").ok()?;
+    let json = std::fs::read_to_string(&path).map_err(|e| eprintln!("skipping imports, {path}: {e}")).ok()?;
+    ObmmMemDesc::from_json(&json).map_err(|e| eprintln!("skipping imports, {path}: {e:#}")).ok()
+}
+
+fn import(desc: &ObmmMemDesc<UbPrivData>) -> MemId {
+    mem_import(desc, ObmmExportFlags::ALLOWMMAP, 0).expect("import").0
+}
+
+fn unimport(memid: MemId) {
+    mem_unimport(memid, ObmmExportFlags::empty()).expect("unimport");
+}
+
+/// Export and unexport latency per region size, each timed on its own
+fn bench_export(c: &mut Criterion) {
+    let mut group = c.benchmark_group("export");
+    group.sample_size(10);
+    for size in SIZES {
+        if let Err(e) = export(size).map(|(memid, _)| unexport(memid)) {
+            eprintln!("skipping {} MB exports: {e}", size / MB);
+            continue;
+        }
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(BenchmarkId::new("mem_export", size / MB), &size, |b, &size| {
+            b.iter_custom(|iters| {
+                let mut total = Duration::ZERO;
+                for _ in 0..iters {
+                    let start = Instant::now();
+                    let (memid, desc) = export(size).expect("export");
+                    total += start.elapsed();
+                    black_box(desc);
+                    unexport(memid);
+                }
+                total
+            });
+        });
+        group.bench_with_input(BenchmarkId::new("mem_unexport", size / MB), &size, |b, &size| {
+            b.iter_custom(|iters| {
+                let mut total = Duration::ZERO;
+                for _ in 0..iters {
+                    let (memid, _) = export(size).expect("export");
+                    let start = Instant::now();
+                    unexport(memid);
+                    total += start.elapsed();
+                }
+                total
+            });
+        });
+    }
+    group.finish();
+}
+
+/// Import and unimport latency of the remote descriptor
+fn bench_import(c: &mut Criterion) {
+    let Some(desc) = remote_desc() else {
+        eprintln!("skipping imports, set OBMM_BENCH_DESC to a descriptor exported by a peer");
+        return;
+    };
+    let mut group = c.benchmark_group("import");
+    group.throughput(Throughput::Bytes(desc.length));
+    group.bench_function("mem_import", |b| {
+        b.iter_custom(|iters| {
+            let mut total = Duration::ZERO;
+            for _ in 0..iters {
+                let start = Instant::now();
+                let memid = import(&desc);
+                total += start.elapsed();
+                unimport(memid);
+            }
+            total
+        });
+    });
+    group.bench_function("mem_unimport", |b| {
+        b.iter_custom(|iters| {
+            let mut total = Duration::ZERO;
+            for _ in 0..iters {
+                let memid = import(&desc);
+                let start = Instant::now();
+                unimport(memid);
+                total += start.elapsed();
+            }
+            total
+        });
+    });
+    group.finish();
+}
+
+/// Regions per second through the batched calls against one call per region
+fn bench_batch(c: &mut Criterion) {
+    let mut group = c.benchmark_group("batch");
+    group.sample_size(10);
+    for count in BATCHES {
+        let lens = vec![lengths(BATCH_REGION); count];
+        group.throughput(Throughput::Elements(count as u64));
+        group.bench_with_input(BenchmarkId::new("mem_export_batch", count), &lens, |b, lens| {
+            b.iter(|| {
+                for (memid, _) in mem_export_batch::<UbPrivData>(lens, ObmmExportFlags::ALLOWMMAP).into_iter().flatten() {
+                    unexport(memid);
+                }
+            });
+        });
+        group.bench_with_input(BenchmarkId::new("mem_export_loop", count), &lens, |b, lens| {
+            b.iter(|| {
+                for len in lens {
+                    if let Ok((memid, _)) = mem_export::<UbPrivData>(len, ObmmExportFlags::ALLOWMMAP) {
+                        unexport(memid);
+                    }
+                }
+            });
+        });
+        if let Some(desc) = remote_desc() {
+            let descs = vec![desc; count];
+            group.bench_with_input(BenchmarkId::new("mem_import_batch", count), &descs, |b, descs| {
+                b.iter(|| {
+                    for (memid, _) in mem_import_batch(descs, ObmmExportFlags::ALLOWMMAP, 0).into_iter().flatten() {
+                        unimport(memid);
+                    }
+                });
+            });
+        }
+    }
+    group.finish();
+}
+
+/// Attach/detach round trips per second with several threads hammering the driver
+fn bench_concurrent_attach(c: &mut Criterion) {
+    let desc = remote_desc();
+    let name = if desc.is_some() { "import_unimport" } else { "export_unexport" };
+    let mut group = c.benchmark_group("concurrent_attach");
+    for threads in THREADS {
+        group.throughput(Throughput::Elements(threads as u64));
+        group.bench_with_input(BenchmarkId::new(name, threads), &threads, |b, &threads| {
+            // every iteration is one round trip on each thread
+            b.iter_custom(|iters| {
+                let start = Instant::now();
+                std::thread::scope(|scope| {
+                    for _ in 0..threads {
+                        scope.spawn(|| {
+                            for _ in 0..iters {
+                                match desc.as_ref() {
+                                    Some(desc) => unimport(import(desc)),
+                                    None => unexport(export(BATCH_REGION).expect("export").0),
+                                }
+                            }
+                        });
+                    }
+                });
+                start.elapsed()
+            });
+        });
+    }
+    group.finish();
+}
+
+/// Descriptor encoding: JSON against the binary wire format
+fn bench_serialization(c: &mut Criterion) {
+    let (memid, desc) = export(2 * MB).expect("export");
+    unexport(memid);
+    let json = desc.to_json().expect("to_json");
+    let bin = wire::encode(&desc).expect("encode");
+    let mut buf = vec![0_u8; bin.len()];
+
+    let mut group = c.benchmark_group("serialization");
+    group.bench_function("json_encode", |b| b.iter(|| black_box(&desc).to_json().expect("to_json")));
+    group.bench_function("json_decode", |b| {
+        b.iter(|| ObmmMemDesc::<UbPrivData>::from_json(black_box(&json)).expect("from_json"))
+    });
+    group.bench_function("wire_encode", |b| b.iter(|| wire::encode(black_box(&desc)).expect("encode")));
+    group.bench_function("wire_encode_into", |b| {
+        b.iter(|| wire::encode_into(black_box(&desc), &mut buf).expect("encode_into"))
+    });
+    group.bench_function("wire_decode", |b| {
+        b.iter(|| wire::decode::<UbPrivData>(black_box(&bin)).expect("decode"))
+    });
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_export,
+    bench_import,
+    bench_batch,
+    bench_concurrent_attach,
+    bench_serialization
+);
+criterion_main!(benches);
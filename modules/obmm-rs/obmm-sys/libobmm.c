@@ -17,6 +17,8 @@
 
 #include <asm-generic/errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdatomic.h>
@@ -31,25 +33,111 @@
 
 #include "vendor_adaptor.h"
 #include "libobmm.h"
+#include "obmm_stats.h"
 
 #define NUMA_NO_NODE (-1)
 #define OBMM_DEV_PATH "/dev/obmm"
 
-static int obmm_dev_get_fd(void)
+/*
+ * The fd is opened once and then never changes until obmm_fini(), so callers
+ * only ever see an acquire load; the mutex serializes the open itself.
+ */
+static _Atomic int obmm_dev_fd = -1;
+static pthread_mutex_t obmm_dev_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int obmm_dev_open_slow(void)
 {
-    static int obmm_dev_fd = -1;
-    static pthread_mutex_t obmm_dev_fd_lock = PTHREAD_MUTEX_INITIALIZER;
-    int errsv = 0;
+    int fd, errsv = 0;
 
     pthread_mutex_lock(&obmm_dev_fd_lock);
-    if (obmm_dev_fd < 0) {
-        obmm_dev_fd = open(OBMM_DEV_PATH, O_RDWR);
-        if (obmm_dev_fd < 0)
+    fd = atomic_load_explicit(&obmm_dev_fd, memory_order_relaxed);
+    if (fd < 0) {
+        fd = open(OBMM_DEV_PATH, O_RDWR);
+        if (fd < 0)
             errsv = errno;
+        else
+            atomic_store_explicit(&obmm_dev_fd, fd, memory_order_release);
     }
     pthread_mutex_unlock(&obmm_dev_fd_lock);
     errno = errsv;
-    return obmm_dev_fd;
+    return fd;
+}
+
+static int obmm_dev_get_fd(void)
+{
+    int fd = atomic_load_explicit(&obmm_dev_fd, memory_order_acquire);
+
+    if (__builtin_expect(fd >= 0, 1))
+        return fd;
+    return obmm_dev_open_slow();
+}
+
+__attribute__((visibility("default"))) int obmm_init(void)
+{
+    return obmm_dev_get_fd() < 0 ? -1 : 0;
+}
+
+__attribute__((visibility("default"))) void obmm_fini(void)
+{
+    int fd;
+
+    pthread_mutex_lock(&obmm_dev_fd_lock);
+    fd = atomic_exchange_explicit(&obmm_dev_fd, -1, memory_order_acq_rel);
+    pthread_mutex_unlock(&obmm_dev_fd_lock);
+    if (fd >= 0)
+        close(fd);
+    vendor_topology_invalidate();
+}
+
+static int batch_errno(void)
+{
+    return errno ? errno : EIO;
+}
+
+/* ioctl accounted as one whole @call, for the entry points that are nothing more */
+static int stat_ioctl(enum obmm_stat_call call, int fd, unsigned long request, void *arg)
+{
+    uint64_t start = obmm_stat_start();
+    int ret, errsv;
+
+    ret = ioctl(fd, request, arg);
+    if (__builtin_expect(start != 0, 0)) {
+        errsv = errno;
+        obmm_stat_phase_end(OBMM_STAT_PHASE_IOCTL, start);
+        obmm_stat_call_end(call, start, ret < 0 ? errsv : 0);
+        errno = errsv;
+    }
+    return ret;
+}
+
+__attribute__((visibility("default"))) int obmm_refresh_topology(void)
+{
+    return vendor_topology_refresh();
+}
+
+__attribute__((visibility("default"))) void obmm_invalidate_topology(void)
+{
+    vendor_topology_invalidate();
+}
+
+__attribute__((visibility("default"))) int obmm_refresh_controller(unsigned int ubc_index,
+    struct obmm_controller_info *old, struct obmm_controller_info *now)
+{
+    return vendor_topology_refresh_ctl(ubc_index, old, now);
+}
+
+__attribute__((visibility("default"))) uint64_t obmm_topology_generation(void)
+{
+    return vendor_topology_generation();
+}
+
+__attribute__((visibility("default"))) int obmm_query_numa_by_eid(const uint8_t eid[16])
+{
+    if (eid == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return vendor_topology_numa(eid);
 }
 
 __attribute__((visibility("default"))) int obmm_query_memid_by_pa(unsigned long pa, mem_id *id, unsigned long *offset)
@@ -96,11 +184,82 @@ __attribute__((visibility("default"))) int obmm_query_pa_by_memid(mem_id id, uns
     return 0;
 }
 
+__attribute__((visibility("default"))) int obmm_query_memid_by_pa_bulk(const unsigned long pa[], size_t count,
+                                       mem_id ids[], unsigned long offsets[], int errs[])
+{
+    struct obmm_cmd_addr_query cmd_addr_query;
+    int fd, ret, done = 0;
+    size_t i;
+
+    if ((count > 0 && (pa == NULL || ids == NULL || errs == NULL)) || count > INT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = obmm_dev_get_fd();
+    if (fd < 0)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        memset(&cmd_addr_query, 0, sizeof(struct obmm_cmd_addr_query));
+        cmd_addr_query.key_type = OBMM_QUERY_BY_PA;
+        cmd_addr_query.pa = pa[i];
+        ret = ioctl(fd, OBMM_CMD_ADDR_QUERY, &cmd_addr_query);
+        if (ret < 0) {
+            ids[i] = OBMM_INVALID_MEMID;
+            errs[i] = batch_errno();
+            continue;
+        }
+        ids[i] = cmd_addr_query.mem_id;
+        if (offsets)
+            offsets[i] = cmd_addr_query.offset;
+        errs[i] = 0;
+        done++;
+    }
+    return done;
+}
+
+__attribute__((visibility("default"))) int obmm_query_pa_by_memid_bulk(mem_id id, const unsigned long offsets[],
+                                       size_t count, unsigned long pa[], int errs[])
+{
+    struct obmm_cmd_addr_query cmd_addr_query;
+    int fd, ret, done = 0;
+    size_t i;
+
+    if ((count > 0 && (offsets == NULL || pa == NULL || errs == NULL)) || count > INT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = obmm_dev_get_fd();
+    if (fd < 0)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        memset(&cmd_addr_query, 0, sizeof(struct obmm_cmd_addr_query));
+        cmd_addr_query.key_type = OBMM_QUERY_BY_ID_OFFSET;
+        cmd_addr_query.mem_id = id;
+        cmd_addr_query.offset = offsets[i];
+        ret = ioctl(fd, OBMM_CMD_ADDR_QUERY, &cmd_addr_query);
+        if (ret < 0) {
+            pa[i] = 0;
+            errs[i] = batch_errno();
+            continue;
+        }
+        pa[i] = cmd_addr_query.pa;
+        errs[i] = 0;
+        done++;
+    }
+    return done;
+}
+
 __attribute__((visibility("default"))) mem_id obmm_export_useraddr(int pid, void* va, size_t length,
                 unsigned long flags, struct obmm_mem_desc *desc)
 {
     struct obmm_cmd_export_pid cmd_export_pid = {0};
-    int fd, ret;
+    struct vendor_info_storage vendor_storage;
+    uint64_t start, phase;
+    int fd, ret, errsv;
 
     if (desc == NULL) {
         errno = EINVAL;
@@ -111,6 +270,8 @@ __attribute__((visibility("default"))) mem_id obmm_export_useraddr(int pid, void
     if (fd < 0)
         return OBMM_INVALID_MEMID;
 
+    start = obmm_stat_start();
+
     cmd_export_pid.va = va;
     cmd_export_pid.length = length;
     cmd_export_pid.pid = pid;
@@ -119,16 +280,24 @@ __attribute__((visibility("default"))) mem_id obmm_export_useraddr(int pid, void
     cmd_export_pid.priv = desc->priv;
     memcpy(cmd_export_pid.deid, desc->deid, sizeof(cmd_export_pid.deid));
 
-    ret = vendor_adapt_export(desc, &cmd_export_pid.vendor_info, &cmd_export_pid.vendor_len,
-                  &cmd_export_pid.pxm_numa);
+    phase = obmm_stat_start();
+    ret = vendor_adapt_export(desc, &vendor_storage, &cmd_export_pid.vendor_info,
+                  &cmd_export_pid.vendor_len, &cmd_export_pid.pxm_numa);
+    obmm_stat_phase_end(OBMM_STAT_PHASE_VENDOR_ADAPT, phase);
     if (ret) {
+        obmm_stat_call_end(OBMM_STAT_EXPORT_USERADDR, start, ret);
         errno = ret;
         return OBMM_INVALID_MEMID;
     }
+    phase = obmm_stat_start();
     ret = ioctl(fd, OBMM_CMD_EXPORT_PID, &cmd_export_pid);
-    free_vendor_info((void *)cmd_export_pid.vendor_info);
+    errsv = errno;
+    obmm_stat_phase_end(OBMM_STAT_PHASE_IOCTL, phase);
+    obmm_stat_call_end(OBMM_STAT_EXPORT_USERADDR, start, ret < 0 ? errsv : 0);
+    errno = errsv;
     if (ret < 0)
         return OBMM_INVALID_MEMID;
+    obmm_stat_bytes(start, false, NUMA_NO_NODE, length);
 
     desc->addr = cmd_export_pid.uba;
     desc->length = length;
@@ -139,21 +308,13 @@ __attribute__((visibility("default"))) mem_id obmm_export_useraddr(int pid, void
     return cmd_export_pid.mem_id;
 }
 
-__attribute__((visibility("default"))) mem_id obmm_export(const size_t length[OBMM_MAX_LOCAL_NUMA_NODES],
-           unsigned long flags, struct obmm_mem_desc *desc)
+static mem_id do_export(int fd, const size_t length[OBMM_MAX_LOCAL_NUMA_NODES], unsigned long flags,
+             struct obmm_mem_desc *desc, struct vendor_export_cache *cache)
 {
+    struct vendor_info_storage vendor_storage;
     struct obmm_cmd_export cmd_export;
-    int fd, i, ret, errsv;
-    mem_id memid;
-
-    if (length == NULL || desc == NULL) {
-        errno = EINVAL;
-        return OBMM_INVALID_MEMID;
-    }
-
-    fd = obmm_dev_get_fd();
-    if (fd < 0)
-        return OBMM_INVALID_MEMID;
+    uint64_t start = obmm_stat_start(), phase;
+    int i, ret, errsv;
 
     memset(&cmd_export, 0, sizeof(struct obmm_cmd_export));
     memcpy(cmd_export.size, length, sizeof(size_t) * OBMM_MAX_LOCAL_NUMA_NODES);
@@ -163,32 +324,97 @@ __attribute__((visibility("default"))) mem_id obmm_export(const size_t length[OB
     cmd_export.priv = desc->priv;
     memcpy(cmd_export.deid, desc->deid, sizeof(cmd_export.deid));
 
-    ret = vendor_adapt_export(desc, &cmd_export.vendor_info, &cmd_export.vendor_len, &cmd_export.pxm_numa);
+    phase = obmm_stat_start();
+    ret = vendor_adapt_export_cached(cache, desc, &vendor_storage, &cmd_export.vendor_info,
+                     &cmd_export.vendor_len, &cmd_export.pxm_numa);
+    obmm_stat_phase_end(OBMM_STAT_PHASE_VENDOR_ADAPT, phase);
     if (ret) {
+        obmm_stat_call_end(OBMM_STAT_EXPORT, start, ret);
         errno = ret;
         return OBMM_INVALID_MEMID;
     }
+    phase = obmm_stat_start();
     ret = ioctl(fd, OBMM_CMD_EXPORT, &cmd_export);
     errsv = errno;
-    free_vendor_info((void *)cmd_export.vendor_info);
+    obmm_stat_phase_end(OBMM_STAT_PHASE_IOCTL, phase);
+    obmm_stat_call_end(OBMM_STAT_EXPORT, start, ret < 0 ? errsv : 0);
     errno = errsv;
 
     if (ret < 0)
         return OBMM_INVALID_MEMID;
 
-    memid = cmd_export.mem_id;
-
     desc->addr = cmd_export.uba;
     desc->tokenid = cmd_export.tokenid;
     desc->scna = 0;
     desc->dcna = 0;
     desc->length = 0;
-    for (i = 0; i < OBMM_MAX_LOCAL_NUMA_NODES; i++)
+    for (i = 0; i < OBMM_MAX_LOCAL_NUMA_NODES; i++) {
         desc->length += length[i];
+        if (length[i])
+            obmm_stat_bytes(start, false, i, length[i]);
+    }
+
+    return cmd_export.mem_id;
+}
+
+__attribute__((visibility("default"))) mem_id obmm_export(const size_t length[OBMM_MAX_LOCAL_NUMA_NODES],
+           unsigned long flags, struct obmm_mem_desc *desc)
+{
+    struct vendor_export_cache cache;
+    int fd, errsv;
+    mem_id memid;
+
+    if (length == NULL || desc == NULL) {
+        errno = EINVAL;
+        return OBMM_INVALID_MEMID;
+    }
+
+    fd = obmm_dev_get_fd();
+    if (fd < 0)
+        return OBMM_INVALID_MEMID;
+
+    vendor_export_cache_init(&cache);
+    memid = do_export(fd, length, flags, desc, &cache);
+    errsv = errno;
+    vendor_export_cache_release(&cache);
+    errno = errsv;
 
     return memid;
 }
 
+__attribute__((visibility("default"))) int obmm_export_batch(const size_t (*length)[OBMM_MAX_LOCAL_NUMA_NODES],
+           size_t count, unsigned long flags, struct obmm_mem_desc *const descs[], mem_id ids[], int errs[])
+{
+    struct vendor_export_cache cache;
+    int fd, done = 0;
+
+    if (length == NULL || descs == NULL || ids == NULL || errs == NULL || count > INT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = obmm_dev_get_fd();
+    if (fd < 0)
+        return -1;
+
+    vendor_export_cache_init(&cache);
+    for (size_t i = 0; i < count; i++) {
+        ids[i] = OBMM_INVALID_MEMID;
+        if (descs[i] == NULL) {
+            errs[i] = EINVAL;
+            continue;
+        }
+        errno = 0;
+        ids[i] = do_export(fd, length[i], flags, descs[i], &cache);
+        errs[i] = ids[i] == OBMM_INVALID_MEMID ? batch_errno() : 0;
+        if (!errs[i])
+            done++;
+    }
+    vendor_export_cache_release(&cache);
+
+    return done;
+}
+
 static void fill_import_cmd_info(const struct obmm_mem_desc *desc,
                  struct obmm_cmd_import *cmd_import,
                  unsigned long flags, int base_dist)
@@ -207,23 +433,18 @@ static void fill_import_cmd_info(const struct obmm_mem_desc *desc,
     memcpy(cmd_import->seid, desc->seid, sizeof(cmd_import->seid));
 }
 
-__attribute__((visibility("default"))) mem_id obmm_import(const struct obmm_mem_desc *desc, unsigned long flags,
-           int base_dist, int *numa)
+static bool import_base_dist_valid(unsigned long flags, int base_dist)
 {
-    struct obmm_cmd_import cmd_import;
-    int fd, ret, errsv;
-    mem_id memid;
-
-    if (desc == NULL) {
-        errno = EINVAL;
-        return OBMM_INVALID_MEMID;
-    }
+    return !((flags & OBMM_IMPORT_FLAG_NUMA_REMOTE) && !(flags & OBMM_IMPORT_FLAG_PREIMPORT)) ||
+        (base_dist >= 0 && base_dist <= UINT8_MAX);
+}
 
-    if (((flags & OBMM_IMPORT_FLAG_NUMA_REMOTE) && !(flags & OBMM_IMPORT_FLAG_PREIMPORT)) &&
-        (base_dist < 0 || base_dist > UINT8_MAX)) {
-        errno = EINVAL;
-        return OBMM_INVALID_MEMID;
-    }
+static mem_id do_import(int fd, const struct obmm_mem_desc *desc, unsigned long flags, int base_dist,
+             int *numa, struct vendor_import_cache *cache)
+{
+    struct obmm_cmd_import cmd_import;
+    uint64_t start = obmm_stat_start(), phase;
+    int ret, errsv;
 
     fill_import_cmd_info(desc, &cmd_import, flags, base_dist);
 
@@ -233,27 +454,89 @@ __attribute__((visibility("default"))) mem_id obmm_import(const struct obmm_mem_
     else
         cmd_import.numa_id = NUMA_NO_NODE;
 
-    fd = obmm_dev_get_fd();
-    if (fd < 0)
-        return OBMM_INVALID_MEMID;
-
-    ret = vendor_fixup_import_cmd(&cmd_import);
-    if (ret)
+    phase = obmm_stat_start();
+    ret = vendor_fixup_import_cmd_cached(cache, &cmd_import);
+    obmm_stat_phase_end(OBMM_STAT_PHASE_VENDOR_ADAPT, phase);
+    if (ret) {
+        obmm_stat_call_end(OBMM_STAT_IMPORT, start, batch_errno());
         return OBMM_INVALID_MEMID;
+    }
 
+    phase = obmm_stat_start();
     ret = ioctl(fd, OBMM_CMD_IMPORT, &cmd_import);
     errsv = errno;
+    obmm_stat_phase_end(OBMM_STAT_PHASE_IOCTL, phase);
     vendor_cleanup_import_cmd(&cmd_import);
+    obmm_stat_call_end(OBMM_STAT_IMPORT, start, ret < 0 ? errsv : 0);
     errno = errsv;
 
     if (ret < 0)
         return OBMM_INVALID_MEMID;
+    obmm_stat_bytes(start, true, cmd_import.numa_id, desc->length);
 
     if (numa != NULL)
         *numa = cmd_import.numa_id;
-    memid = cmd_import.mem_id;
 
-    return memid;
+    return cmd_import.mem_id;
+}
+
+__attribute__((visibility("default"))) mem_id obmm_import(const struct obmm_mem_desc *desc, unsigned long flags,
+           int base_dist, int *numa)
+{
+    int fd;
+
+    if (desc == NULL) {
+        errno = EINVAL;
+        return OBMM_INVALID_MEMID;
+    }
+
+    if (!import_base_dist_valid(flags, base_dist)) {
+        errno = EINVAL;
+        return OBMM_INVALID_MEMID;
+    }
+
+    fd = obmm_dev_get_fd();
+    if (fd < 0)
+        return OBMM_INVALID_MEMID;
+
+    return do_import(fd, desc, flags, base_dist, numa, NULL);
+}
+
+__attribute__((visibility("default"))) int obmm_import_batch(const struct obmm_mem_desc *const descs[],
+           size_t count, unsigned long flags, int base_dist, int numa[], mem_id ids[], int errs[])
+{
+    struct vendor_import_cache cache;
+    int fd, done = 0;
+
+    if (descs == NULL || ids == NULL || errs == NULL || count > INT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!import_base_dist_valid(flags, base_dist)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = obmm_dev_get_fd();
+    if (fd < 0)
+        return -1;
+
+    vendor_import_cache_init(&cache);
+    for (size_t i = 0; i < count; i++) {
+        ids[i] = OBMM_INVALID_MEMID;
+        if (descs[i] == NULL) {
+            errs[i] = EINVAL;
+            continue;
+        }
+        errno = 0;
+        ids[i] = do_import(fd, descs[i], flags, base_dist, numa != NULL ? &numa[i] : NULL, &cache);
+        errs[i] = ids[i] == OBMM_INVALID_MEMID ? batch_errno() : 0;
+        if (!errs[i])
+            done++;
+    }
+
+    return done;
 }
 
 __attribute__((visibility("default"))) int obmm_unexport(mem_id id, unsigned long flags)
@@ -273,7 +556,7 @@ __attribute__((visibility("default"))) int obmm_unexport(mem_id id, unsigned lon
     cmd_unexport.mem_id = id;
     cmd_unexport.flags = flags;
 
-    return ioctl(fd, OBMM_CMD_UNEXPORT, &cmd_unexport);
+    return stat_ioctl(OBMM_STAT_UNEXPORT, fd, OBMM_CMD_UNEXPORT, &cmd_unexport);
 }
 
 __attribute__((visibility("default"))) int obmm_unimport(mem_id id, unsigned long flags)
@@ -293,37 +576,103 @@ __attribute__((visibility("default"))) int obmm_unimport(mem_id id, unsigned lon
     cmd_unimport.mem_id = id;
     cmd_unimport.flags = flags;
 
-    return ioctl(fd, OBMM_CMD_UNIMPORT, &cmd_unimport);
+    return stat_ioctl(OBMM_STAT_UNIMPORT, fd, OBMM_CMD_UNIMPORT, &cmd_unimport);
 }
 
-__attribute__((visibility("default"))) int obmm_set_ownership(int fd, void *start, void *end, int prot)
+static int ownership_mem_attr(int prot, uint64_t *mem_attr)
 {
-    uint64_t mem_attr;
-    struct obmm_cmd_update_range update_info;
-
     if (prot == PROT_NONE) {
-        mem_attr = OBMM_SHM_MEM_NORMAL_NC | OBMM_SHM_MEM_NO_ACCESS;
+        *mem_attr = OBMM_SHM_MEM_NORMAL_NC | OBMM_SHM_MEM_NO_ACCESS;
     } else if (prot == PROT_READ) {
-        mem_attr = OBMM_SHM_MEM_NORMAL | OBMM_SHM_MEM_READONLY;
+        *mem_attr = OBMM_SHM_MEM_NORMAL | OBMM_SHM_MEM_READONLY;
     } else if (prot == PROT_WRITE || prot == (PROT_READ | PROT_WRITE)) {
-        mem_attr = OBMM_SHM_MEM_NORMAL | OBMM_SHM_MEM_READWRITE;
+        *mem_attr = OBMM_SHM_MEM_NORMAL | OBMM_SHM_MEM_READWRITE;
     } else {
         errno = EINVAL;
         return -1;
     }
+    return 0;
+}
+
+/* obmm-rs passes these as CacheOp::bits, keep both in step */
+_Static_assert(OBMM_SHM_CACHE_NONE == 0 && OBMM_SHM_CACHE_INVAL == 1 && OBMM_SHM_CACHE_WB_INVAL == 2 &&
+    OBMM_SHM_CACHE_WB_ONLY == 3 && OBMM_SHM_CACHE_INFER == 4, "OBMM_SHM_CACHE_* differ from CacheOp::bits");
+
+static bool cache_ops_valid(int cache_ops)
+{
+    switch (cache_ops) {
+    case OBMM_SHM_CACHE_NONE:
+    case OBMM_SHM_CACHE_INVAL:
+    case OBMM_SHM_CACHE_WB_INVAL:
+    case OBMM_SHM_CACHE_WB_ONLY:
+    case OBMM_SHM_CACHE_INFER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+__attribute__((visibility("default"))) int obmm_set_ownership_ex(int fd, void *start, void *end, int prot,
+    int cache_ops)
+{
+    uint64_t mem_attr;
+    struct obmm_cmd_update_range update_info;
+
+    if (!cache_ops_valid(cache_ops)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ownership_mem_attr(prot, &mem_attr))
+        return -1;
 
     update_info.start = (uintptr_t)start;
     update_info.end = (uintptr_t)end;
     update_info.mem_state = mem_attr;
-    update_info.cache_ops = OBMM_SHM_CACHE_INFER;
+    update_info.cache_ops = (uint64_t)cache_ops;
 
-    return ioctl(fd, OBMM_SHMDEV_UPDATE_RANGE, &update_info);
+    return stat_ioctl(OBMM_STAT_SET_OWNERSHIP, fd, OBMM_SHMDEV_UPDATE_RANGE, &update_info);
+}
+
+__attribute__((visibility("default"))) int obmm_set_ownership(int fd, void *start, void *end, int prot)
+{
+    return obmm_set_ownership_ex(fd, start, end, prot, OBMM_SHM_CACHE_INFER);
+}
+
+__attribute__((visibility("default"))) int obmm_set_ownership_batch(int fd,
+    const struct obmm_ownership_range ranges[], size_t count, int errs[])
+{
+    struct obmm_cmd_update_range update_info;
+    int done = 0;
+
+    if (fd < 0 || ranges == NULL || errs == NULL || count > INT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!cache_ops_valid(ranges[i].cache_ops) ||
+            ownership_mem_attr(ranges[i].prot, &update_info.mem_state)) {
+            errs[i] = EINVAL;
+            continue;
+        }
+        update_info.start = (uintptr_t)ranges[i].start;
+        update_info.end = (uintptr_t)ranges[i].end;
+        update_info.cache_ops = (uint64_t)ranges[i].cache_ops;
+        errno = 0;
+        errs[i] = stat_ioctl(OBMM_STAT_SET_OWNERSHIP, fd, OBMM_SHMDEV_UPDATE_RANGE, &update_info) ?
+            batch_errno() : 0;
+        if (!errs[i])
+            done++;
+    }
+
+    return done;
 }
 
 __attribute__((visibility("default"))) int obmm_preimport(struct obmm_preimport_info *preimport_info,
     unsigned long flags)
 {
     struct obmm_cmd_preimport cmd;
+    uint64_t start, phase;
     int ret, fd, errsv;
 
     if (preimport_info == NULL) {
@@ -352,13 +701,20 @@ __attribute__((visibility("default"))) int obmm_preimport(struct obmm_preimport_
     memcpy(cmd.deid, preimport_info->deid, sizeof(cmd.deid));
     memcpy(cmd.seid, preimport_info->seid, sizeof(cmd.seid));
 
+    start = obmm_stat_start();
     ret = vendor_fixup_preimport_cmd(&cmd);
-    if (ret)
+    obmm_stat_phase_end(OBMM_STAT_PHASE_VENDOR_ADAPT, start);
+    if (ret) {
+        obmm_stat_call_end(OBMM_STAT_PREIMPORT, start, batch_errno());
         return ret;
+    }
 
+    phase = obmm_stat_start();
     ret = ioctl(fd, OBMM_CMD_DECLARE_PREIMPORT, &cmd);
     errsv = errno;
+    obmm_stat_phase_end(OBMM_STAT_PHASE_IOCTL, phase);
     vendor_cleanup_preimport_cmd(&cmd);
+    obmm_stat_call_end(OBMM_STAT_PREIMPORT, start, ret < 0 ? errsv : 0);
     errno = errsv;
 
     if (ret < 0)
@@ -394,5 +750,5 @@ __attribute__((visibility("default"))) int obmm_unpreimport(const struct obmm_pr
     memcpy(cmd.deid, preimport_info->deid, sizeof(cmd.deid));
     memcpy(cmd.seid, preimport_info->seid, sizeof(cmd.seid));
 
-    return ioctl(fd, OBMM_CMD_UNDECLARE_PREIMPORT, &cmd);
+    return stat_ioctl(OBMM_STAT_UNPREIMPORT, fd, OBMM_CMD_UNDECLARE_PREIMPORT, &cmd);
 }
@@ -18,6 +18,7 @@
 #ifndef _OBMM_API_H
 #define _OBMM_API_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <ub/obmm.h>
@@ -58,6 +59,17 @@ struct obmm_preimport_info {
     uint8_t priv[];
 };
 
+/*
+ * Open /dev/obmm eagerly. Every API call opens it lazily on first use otherwise.
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int obmm_init(void);
+/*
+ * Close /dev/obmm and drop cached topology. Must not race with any other call;
+ * a later call reopens the device.
+ */
+void obmm_fini(void);
+
 mem_id obmm_export(const size_t length[OBMM_MAX_LOCAL_NUMA_NODES], unsigned long flags, struct obmm_mem_desc *desc);
 int obmm_unexport(mem_id id, unsigned long flags);
 
@@ -78,6 +90,50 @@ mem_id obmm_export_useraddr(int pid, void* va, size_t length, unsigned long flag
 mem_id obmm_import(const struct obmm_mem_desc *desc, unsigned long flags, int base_dist, int *numa);
 int obmm_unimport(mem_id id, unsigned long flags);
 
+/*
+ * Batched obmm_export/obmm_import. Entry i behaves exactly like the single call on
+ * length[i]/descs[i] (and numa[i], which may be NULL as a whole), but the vendor
+ * lookup is shared by all entries that target the same eid.
+ * ids[i] receives the mem_id or OBMM_INVALID_MEMID, errs[i] receives 0 or an errno.
+ * Returns the number of entries that succeeded, or -1 with errno set when the
+ * arguments themselves are invalid.
+ */
+int obmm_export_batch(const size_t (*length)[OBMM_MAX_LOCAL_NUMA_NODES], size_t count, unsigned long flags,
+              struct obmm_mem_desc *const descs[], mem_id ids[], int errs[]);
+int obmm_import_batch(const struct obmm_mem_desc *const descs[], size_t count, unsigned long flags,
+              int base_dist, int numa[], mem_id ids[], int errs[]);
+
+/*
+ * Asynchronous export/import. Requests are executed by @nr_workers threads owned by
+ * the context, at most @depth of them outstanding at a time (submit fails with
+ * EAGAIN beyond that). A request with a callback completes by calling it on a
+ * worker thread; otherwise its completion is queued until obmm_async_reap() and
+ * the eventfd returned by obmm_async_eventfd() becomes readable.
+ * Descriptors passed to submit must stay valid until the request completes.
+ * obmm_async_destroy() runs every queued request to completion first and must
+ * not be called from a callback.
+ */
+struct obmm_async_ctx;
+
+struct obmm_async_cmpl {
+    uint64_t user_data;
+    mem_id id;
+    int numa;
+    int err;
+};
+
+typedef void (*obmm_async_cb)(const struct obmm_async_cmpl *cmpl, void *arg);
+
+struct obmm_async_ctx *obmm_async_create(unsigned int nr_workers, unsigned int depth);
+void obmm_async_destroy(struct obmm_async_ctx *ctx);
+int obmm_async_eventfd(const struct obmm_async_ctx *ctx);
+int obmm_async_submit_export(struct obmm_async_ctx *ctx, const size_t length[OBMM_MAX_LOCAL_NUMA_NODES],
+                 unsigned long flags, struct obmm_mem_desc *desc, uint64_t user_data, obmm_async_cb cb, void *arg);
+int obmm_async_submit_import(struct obmm_async_ctx *ctx, const struct obmm_mem_desc *desc, unsigned long flags,
+                 int base_dist, int numa, uint64_t user_data, obmm_async_cb cb, void *arg);
+/* Non-blocking, returns the number of completions copied to @cmpl */
+int obmm_async_reap(struct obmm_async_ctx *ctx, struct obmm_async_cmpl cmpl[], unsigned int max);
+
 /*
  * Set the ownership (reader, writer, none) of a range of OBMM virtual address space.
  * @fd: The file descriptor of an OBMM memory device.
@@ -88,9 +144,146 @@ int obmm_unimport(mem_id id, unsigned long flags);
  */
 int obmm_set_ownership(int fd, void *start, void *end, int prot);
 
+/*
+ * obmm_set_ownership with an explicit cache maintenance operation instead of OBMM_SHM_CACHE_INFER.
+ * @cache_ops: One of OBMM_SHM_CACHE_NONE, OBMM_SHM_CACHE_INVAL, OBMM_SHM_CACHE_WB_INVAL,
+ *             OBMM_SHM_CACHE_WB_ONLY or OBMM_SHM_CACHE_INFER.
+ *             NOTE: skipping the writeback of a range with dirty lines discards them.
+ */
+int obmm_set_ownership_ex(int fd, void *start, void *end, int prot, int cache_ops);
+
+struct obmm_ownership_range {
+    void *start;
+    void *end;
+    int prot;
+    int cache_ops;
+};
+
+/*
+ * Apply obmm_set_ownership_ex to each of @count ranges of the device @fd, in order.
+ * errs[i] receives 0 or the errno of range i; a failed range does not stop the batch.
+ * Returns the number of ranges updated, or -1 with errno set if the arguments are invalid.
+ */
+int obmm_set_ownership_batch(int fd, const struct obmm_ownership_range ranges[], size_t count, int errs[]);
+
+/*
+ * UB bus controller topology (eid, ummu_map, numa, primary_cna) is read from sysfs
+ * on first use and cached for the lifetime of the process.
+ * obmm_refresh_topology: rescan sysfs now, returns the number of controllers found.
+ * obmm_invalidate_topology: drop the cached table, the next call rescans lazily.
+ */
+int obmm_refresh_topology(void);
+void obmm_invalidate_topology(void);
+
+/* cached attributes of one UB bus controller, -1 where unknown */
+struct obmm_controller_info {
+    /* 128bit eid, ordered by little-endian */
+    uint8_t eid[16];
+    int numa_id;
+    int primary_cna;
+    int ummu_mapping;
+};
+
+enum obmm_ctl_change {
+    OBMM_CTL_UNCHANGED = 0,
+    OBMM_CTL_ADDED = 1,
+    OBMM_CTL_CHANGED = 2,
+    OBMM_CTL_REMOVED = 3,
+};
+
+/*
+ * Rescan UB bus controller @ubc_index (ub_bus_controller<N> in sysfs) and update
+ * its entry in the cached table, leaving the other controllers alone. @old and
+ * @now, both optional, receive the entry before and after; an absent entry has
+ * a zero eid. Returns one of enum obmm_ctl_change, or -1 with errno set if
+ * @ubc_index is out of range.
+ */
+int obmm_refresh_controller(unsigned int ubc_index, struct obmm_controller_info *old,
+                struct obmm_controller_info *now);
+/* Counter bumped by every change of the cached table, to tell stale lookups apart */
+uint64_t obmm_topology_generation(void);
+/*
+ * NUMA node of the UB bus controller with @eid (16 bytes, little-endian), the
+ * node an export through that controller is closest to. Returns -1 with errno
+ * set if no controller has @eid.
+ */
+int obmm_query_numa_by_eid(const uint8_t eid[16]);
+
 /* debug interface */
 int obmm_query_memid_by_pa(unsigned long pa, mem_id *id, unsigned long *offset);
 int obmm_query_pa_by_memid(mem_id id, unsigned long offset, unsigned long *pa);
+/*
+ * Bulk variants: entry i behaves like the single query on pa[i] / offsets[i], the
+ * device fd and the command buffer are shared by the whole batch. offsets may be
+ * NULL in obmm_query_memid_by_pa_bulk. errs[i] receives 0 or an errno.
+ * Returns the number of entries translated, or -1 with errno set when the
+ * arguments themselves are invalid.
+ */
+int obmm_query_memid_by_pa_bulk(const unsigned long pa[], size_t count, mem_id ids[], unsigned long offsets[],
+                int errs[]);
+int obmm_query_pa_by_memid_bulk(mem_id id, const unsigned long offsets[], size_t count, unsigned long pa[],
+                int errs[]);
+
+/*
+ * Hot-path statistics. Collection is off by default; while disabled every
+ * instrumented call pays a single relaxed load. Batch calls are accounted per
+ * region, so one obmm_export_batch of N regions adds N export calls.
+ */
+enum obmm_stat_call {
+    OBMM_STAT_EXPORT,
+    OBMM_STAT_EXPORT_USERADDR,
+    OBMM_STAT_UNEXPORT,
+    OBMM_STAT_IMPORT,
+    OBMM_STAT_UNIMPORT,
+    OBMM_STAT_PREIMPORT,
+    OBMM_STAT_UNPREIMPORT,
+    OBMM_STAT_SET_OWNERSHIP,
+    OBMM_STAT_NR_CALLS,
+};
+
+/*
+ * OBMM_STAT_PHASE_TOPOLOGY: sysfs controller discovery
+ * OBMM_STAT_PHASE_VENDOR_ADAPT: vendor_info / cna lookup for one command
+ * OBMM_STAT_PHASE_VENDOR_ALLOC: building vendor_info in caller-provided storage
+ * OBMM_STAT_PHASE_IOCTL: the driver call itself
+ */
+enum obmm_stat_phase {
+    OBMM_STAT_PHASE_TOPOLOGY,
+    OBMM_STAT_PHASE_VENDOR_ADAPT,
+    OBMM_STAT_PHASE_VENDOR_ALLOC,
+    OBMM_STAT_PHASE_IOCTL,
+    OBMM_STAT_NR_PHASES,
+};
+
+/* errno values at or above this are folded into errnos[0] */
+#define OBMM_STAT_NR_ERRNO 134
+
+struct obmm_stats {
+    uint64_t calls[OBMM_STAT_NR_CALLS];
+    uint64_t errors[OBMM_STAT_NR_CALLS];
+    uint64_t call_ns[OBMM_STAT_NR_CALLS];
+    uint64_t phase_count[OBMM_STAT_NR_PHASES];
+    uint64_t phase_ns[OBMM_STAT_NR_PHASES];
+    uint64_t bytes_exported;
+    uint64_t bytes_imported;
+    /* indexed by local NUMA node for exports, by the node the driver picked for imports */
+    uint64_t node_exports[MAX_NUMA_NODES];
+    uint64_t node_imports[MAX_NUMA_NODES];
+    uint64_t node_bytes_exported[MAX_NUMA_NODES];
+    uint64_t node_bytes_imported[MAX_NUMA_NODES];
+    uint64_t errnos[OBMM_STAT_NR_ERRNO];
+};
+
+/*
+ * obmm_stats_enable: start or stop collection, counters are kept across toggles.
+ * obmm_stats_snapshot: copy the counters into @stats. Each field is read
+ * atomically but the snapshot as a whole is not, a call completing concurrently
+ * may be visible in some fields only. Returns 0, or -1 with errno set.
+ * obmm_stats_reset: zero every counter.
+ */
+void obmm_stats_enable(bool enable);
+int obmm_stats_snapshot(struct obmm_stats *stats);
+void obmm_stats_reset(void);
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2025 Huawei Technologies Co., Ltd. All rights reserved.
+ * libobmm is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ *
+ * Description: libobmm asynchronous export/import submission
+ * Author: Gao Chao
+ * Create: 2025-10-28
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "libobmm.h"
+
+#define NUMA_NO_NODE (-1)
+#define OBMM_ASYNC_MAX_WORKERS 64
+
+enum obmm_async_op {
+    OBMM_ASYNC_EXPORT,
+    OBMM_ASYNC_IMPORT,
+};
+
+struct obmm_async_req {
+    struct obmm_async_req *next;
+    enum obmm_async_op op;
+    size_t length[OBMM_MAX_LOCAL_NUMA_NODES];
+    unsigned long flags;
+    struct obmm_mem_desc *export_desc;
+    const struct obmm_mem_desc *import_desc;
+    int base_dist;
+    int numa;
+    uint64_t user_data;
+    obmm_async_cb cb;
+    void *arg;
+};
+
+/*
+ * The obmm ioctls are synchronous and the driver has no uring_cmd support, so
+ * requests are executed by a small set of worker threads owned by the context.
+ * Completions are either delivered to the request callback on the worker, or
+ * queued in a ring of @depth entries and announced through an eventfd.
+ * @outstanding counts requests submitted but not yet completed (callback mode)
+ * or reaped (ring mode), which bounds the ring occupancy by @depth.
+ */
+struct obmm_async_ctx {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    struct obmm_async_req *sq_head;
+    struct obmm_async_req *sq_tail;
+    struct obmm_async_cmpl *cq;
+    unsigned int cq_head;
+    unsigned int cq_count;
+    unsigned int depth;
+    unsigned int outstanding;
+    unsigned int running;
+    bool stopping;
+    int efd;
+    unsigned int nr_workers;
+    pthread_t workers[OBMM_ASYNC_MAX_WORKERS];
+};
+
+static void async_execute(const struct obmm_async_req *req, struct obmm_async_cmpl *cmpl)
+{
+    int numa = req->numa;
+
+    errno = 0;
+    cmpl->user_data = req->user_data;
+    cmpl->numa = NUMA_NO_NODE;
+    switch (req->op) {
+    case OBMM_ASYNC_EXPORT:
+        cmpl->id = obmm_export(req->length, req->flags, req->export_desc);
+        break;
+    case OBMM_ASYNC_IMPORT:
+        cmpl->id = obmm_import(req->import_desc, req->flags, req->base_dist, &numa);
+        cmpl->numa = numa;
+        break;
+    default:
+        cmpl->id = OBMM_INVALID_MEMID;
+        errno = EINVAL;
+        break;
+    }
+    cmpl->err = cmpl->id == OBMM_INVALID_MEMID ? (errno ? errno : EIO) : 0;
+}
+
+static void async_complete(struct obmm_async_ctx *ctx, const struct obmm_async_req *req,
+               const struct obmm_async_cmpl *cmpl)
+{
+    uint64_t one = 1;
+    ssize_t ret;
+
+    if (req->cb != NULL) {
+        req->cb(cmpl, req->arg);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->outstanding--;
+        ctx->running--;
+        pthread_cond_broadcast(&ctx->idle);
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->cq[(ctx->cq_head + ctx->cq_count) % ctx->depth] = *cmpl;
+    ctx->cq_count++;
+    ctx->running--;
+    pthread_cond_broadcast(&ctx->idle);
+    pthread_mutex_unlock(&ctx->lock);
+    do {
+        ret = write(ctx->efd, &one, sizeof(one));
+    } while (ret < 0 && errno == EINTR);
+}
+
+static void *async_worker(void *data)
+{
+    struct obmm_async_ctx *ctx = data;
+    struct obmm_async_cmpl cmpl;
+    struct obmm_async_req *req;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->sq_head == NULL && !ctx->stopping)
+            pthread_cond_wait(&ctx->work, &ctx->lock);
+        req = ctx->sq_head;
+        if (req == NULL) {
+            pthread_mutex_unlock(&ctx->lock);
+            return NULL;
+        }
+        ctx->sq_head = req->next;
+        if (ctx->sq_head == NULL)
+            ctx->sq_tail = NULL;
+        ctx->running++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        async_execute(req, &cmpl);
+        async_complete(ctx, req, &cmpl);
+        free(req);
+    }
+}
+
+static void async_stop_workers(struct obmm_async_ctx *ctx, unsigned int nr_workers)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    pthread_cond_broadcast(&ctx->work);
+    pthread_mutex_unlock(&ctx->lock);
+    for (i = 0; i < nr_workers; i++)
+        pthread_join(ctx->workers[i], NULL);
+}
+
+__attribute__((visibility("default"))) struct obmm_async_ctx *obmm_async_create(unsigned int nr_workers,
+                                         unsigned int depth)
+{
+    struct obmm_async_ctx *ctx;
+    unsigned int i;
+    int ret;
+
+    if (nr_workers == 0 || nr_workers > OBMM_ASYNC_MAX_WORKERS || depth == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+    ctx->cq = calloc(depth, sizeof(*ctx->cq));
+    if (ctx->cq == NULL)
+        goto free_ctx;
+    ctx->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ctx->efd < 0)
+        goto free_cq;
+    ctx->depth = depth;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->work, NULL);
+    pthread_cond_init(&ctx->idle, NULL);
+
+    for (i = 0; i < nr_workers; i++) {
+        ret = pthread_create(&ctx->workers[i], NULL, async_worker, ctx);
+        if (ret) {
+            async_stop_workers(ctx, i);
+            errno = ret;
+            goto destroy_sync;
+        }
+    }
+    ctx->nr_workers = nr_workers;
+    return ctx;
+
+destroy_sync:
+    pthread_cond_destroy(&ctx->idle);
+    pthread_cond_destroy(&ctx->work);
+    pthread_mutex_destroy(&ctx->lock);
+    close(ctx->efd);
+free_cq:
+    free(ctx->cq);
+free_ctx:
+    free(ctx);
+    return NULL;
+}
+
+__attribute__((visibility("default"))) void obmm_async_destroy(struct obmm_async_ctx *ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    /* queued requests are still executed, so every callback fires exactly once */
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->sq_head != NULL || ctx->running > 0)
+        pthread_cond_wait(&ctx->idle, &ctx->lock);
+    pthread_mutex_unlock(&ctx->lock);
+    async_stop_workers(ctx, ctx->nr_workers);
+
+    pthread_cond_destroy(&ctx->idle);
+    pthread_cond_destroy(&ctx->work);
+    pthread_mutex_destroy(&ctx->lock);
+    close(ctx->efd);
+    free(ctx->cq);
+    free(ctx);
+}
+
+__attribute__((visibility("default"))) int obmm_async_eventfd(const struct obmm_async_ctx *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ctx->efd;
+}
+
+static int async_submit(struct obmm_async_ctx *ctx, struct obmm_async_req *req)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->stopping || ctx->outstanding >= ctx->depth) {
+        pthread_mutex_unlock(&ctx->lock);
+        free(req);
+        errno = EAGAIN;
+        return -1;
+    }
+    ctx->outstanding++;
+    if (ctx->sq_tail != NULL)
+        ctx->sq_tail->next = req;
+    else
+        ctx->sq_head = req;
+    ctx->sq_tail = req;
+    pthread_cond_signal(&ctx->work);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+__attribute__((visibility("default"))) int obmm_async_submit_export(struct obmm_async_ctx *ctx,
+    const size_t length[OBMM_MAX_LOCAL_NUMA_NODES], unsigned long flags, struct obmm_mem_desc *desc,
+    uint64_t user_data, obmm_async_cb cb, void *arg)
+{
+    struct obmm_async_req *req;
+
+    if (ctx == NULL || length == NULL || desc == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    req = calloc(1, sizeof(*req));
+    if (req == NULL)
+        return -1;
+
+    req->op = OBMM_ASYNC_EXPORT;
+    memcpy(req->length, length, sizeof(req->length));
+    req->flags = flags;
+    req->export_desc = desc;
+    req->user_data = user_data;
+    req->cb = cb;
+    req->arg = arg;
+    return async_submit(ctx, req);
+}
+
+__attribute__((visibility("default"))) int obmm_async_submit_import(struct obmm_async_ctx *ctx,
+    const struct obmm_mem_desc *desc, unsigned long flags, int base_dist, int numa, uint64_t user_data,
+    obmm_async_cb cb, void *arg)
+{
+    struct obmm_async_req *req;
+
+    if (ctx == NULL || desc == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    req = calloc(1, sizeof(*req));
+    if (req == NULL)
+        return -1;
+
+    req->op = OBMM_ASYNC_IMPORT;
+    req->flags = flags;
+    req->import_desc = desc;
+    req->base_dist = base_dist;
+    req->numa = numa;
+    req->user_data = user_data;
+    req->cb = cb;
+    req->arg = arg;
+    return async_submit(ctx, req);
+}
+
+__attribute__((visibility("default"))) int obmm_async_reap(struct obmm_async_ctx *ctx,
+                               struct obmm_async_cmpl cmpl[], unsigned int max)
+{
+    unsigned int n = 0, left;
+    uint64_t count;
+    ssize_t ret;
+
+    if (ctx == NULL || (cmpl == NULL && max > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* drain the eventfd first so a completion racing with us re-arms it */
+    do {
+        ret = read(ctx->efd, &count, sizeof(count));
+    } while (ret < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (n < max && ctx->cq_count > 0) {
+        cmpl[n++] = ctx->cq[ctx->cq_head];
+        ctx->cq_head = (ctx->cq_head + 1) % ctx->depth;
+        ctx->cq_count--;
+        ctx->outstanding--;
+    }
+    left = ctx->cq_count;
+    pthread_mutex_unlock(&ctx->lock);
+
+    /* entries left behind by a short @max keep the eventfd readable */
+    if (left > 0) {
+        count = 1;
+        ret = write(ctx->efd, &count, sizeof(count));
+        (void)ret;
+    }
+    return (int)n;
+}
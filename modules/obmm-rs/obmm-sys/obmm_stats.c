@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2025 Huawei Technologies Co., Ltd. All rights reserved.
+ * libobmm is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ *
+ * Description: libobmm hot-path statistics
+ * Author: Gao Chao
+ * Create: 2025-10-28
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "libobmm.h"
+#include "obmm_stats.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+_Atomic bool g_obmm_stats_enabled;
+
+/*
+ * Every field of struct obmm_stats is a uint64_t, so the counters are updated
+ * with relaxed atomic adds in place and snapshot/reset walk them as an array.
+ */
+static struct obmm_stats g_stats;
+
+#define STAT_ADD(field, val) __atomic_fetch_add(&(field), (val), __ATOMIC_RELAXED)
+
+uint64_t obmm_stat_clock(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    /* never 0, which obmm_stat_start reserves for "disabled" */
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec + 1;
+}
+
+static uint64_t stat_elapsed(uint64_t start)
+{
+    uint64_t now = obmm_stat_clock();
+
+    return now > start ? now - start : 0;
+}
+
+void obmm_stat_record_phase(enum obmm_stat_phase phase, uint64_t start)
+{
+    if ((unsigned int)phase >= OBMM_STAT_NR_PHASES)
+        return;
+    STAT_ADD(g_stats.phase_ns[phase], stat_elapsed(start));
+    STAT_ADD(g_stats.phase_count[phase], 1);
+}
+
+void obmm_stat_record_call(enum obmm_stat_call call, uint64_t start, int err)
+{
+    if ((unsigned int)call >= OBMM_STAT_NR_CALLS)
+        return;
+    STAT_ADD(g_stats.call_ns[call], stat_elapsed(start));
+    STAT_ADD(g_stats.calls[call], 1);
+    if (err) {
+        STAT_ADD(g_stats.errors[call], 1);
+        STAT_ADD(g_stats.errnos[err > 0 && err < OBMM_STAT_NR_ERRNO ? err : 0], 1);
+    }
+}
+
+void obmm_stat_record_bytes(bool import, int numa, uint64_t bytes)
+{
+    bool has_node = numa >= 0 && numa < MAX_NUMA_NODES;
+
+    if (import) {
+        STAT_ADD(g_stats.bytes_imported, bytes);
+        if (has_node) {
+            STAT_ADD(g_stats.node_imports[numa], 1);
+            STAT_ADD(g_stats.node_bytes_imported[numa], bytes);
+        }
+    } else {
+        STAT_ADD(g_stats.bytes_exported, bytes);
+        if (has_node) {
+            STAT_ADD(g_stats.node_exports[numa], 1);
+            STAT_ADD(g_stats.node_bytes_exported[numa], bytes);
+        }
+    }
+}
+
+__attribute__((visibility("default"))) void obmm_stats_enable(bool enable)
+{
+    atomic_store_explicit(&g_obmm_stats_enabled, enable, memory_order_relaxed);
+}
+
+__attribute__((visibility("default"))) int obmm_stats_snapshot(struct obmm_stats *stats)
+{
+    const uint64_t *src = (const uint64_t *)&g_stats;
+    uint64_t *dst;
+
+    if (stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dst = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(g_stats) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    return 0;
+}
+
+__attribute__((visibility("default"))) void obmm_stats_reset(void)
+{
+    uint64_t *dst = (uint64_t *)&g_stats;
+
+    for (size_t i = 0; i < sizeof(g_stats) / sizeof(uint64_t); i++)
+        __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2025 Huawei Technologies Co., Ltd. All rights reserved.
+ * libobmm is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ *
+ * Description: libobmm hot-path statistics
+ * Author: Gao Chao
+ * Create: 2025-10-28
+ */
+
+#ifndef _OBMM_STATS_H
+#define _OBMM_STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <libobmm.h>
+
+extern _Atomic bool g_obmm_stats_enabled;
+
+uint64_t obmm_stat_clock(void);
+void obmm_stat_record_phase(enum obmm_stat_phase phase, uint64_t start);
+void obmm_stat_record_call(enum obmm_stat_call call, uint64_t start, int err);
+void obmm_stat_record_bytes(bool import, int numa, uint64_t bytes);
+
+/*
+ * A start stamp of 0 means collection was disabled when the call began: the
+ * matching end helpers then do nothing, so a call toggled mid-flight is either
+ * fully accounted or not at all.
+ */
+static inline uint64_t obmm_stat_start(void)
+{
+    if (__builtin_expect(!atomic_load_explicit(&g_obmm_stats_enabled, memory_order_relaxed), 1))
+        return 0;
+    return obmm_stat_clock();
+}
+
+static inline void obmm_stat_phase_end(enum obmm_stat_phase phase, uint64_t start)
+{
+    if (__builtin_expect(start != 0, 0))
+        obmm_stat_record_phase(phase, start);
+}
+
+/* @err is 0 on success, the errno of the failure otherwise */
+static inline void obmm_stat_call_end(enum obmm_stat_call call, uint64_t start, int err)
+{
+    if (__builtin_expect(start != 0, 0))
+        obmm_stat_record_call(call, start, err);
+}
+
+/* @numa < 0 accounts the bytes without a node */
+static inline void obmm_stat_bytes(uint64_t start, bool import, int numa, uint64_t bytes)
+{
+    if (__builtin_expect(start != 0, 0))
+        obmm_stat_record_bytes(import, numa, bytes);
+}
+
+#endif
@@ -24,9 +24,11 @@
 #include <glob.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <libobmm.h>
 #include "vendor_adaptor.h"
+#include "obmm_stats.h"
 
 #define pr_err(fmt, ...)	fprintf(stderr, "libobmm: [vendor-adaptor][ERROR]" fmt, ##__VA_ARGS__)
 
@@ -132,101 +134,330 @@ static int get_ubc_path(int ubc_index, char *ubc_path, size_t path_len)
     return 0;
 }
 
-static int get_ubc_by_eid(unsigned int *uba_index, char *ubc_path, size_t path_len, const uint8_t *eid)
+/*
+ * Controller attributes only change on hotplug, so sysfs is scanned once and
+ * every export/import afterwards is served from this table. A watcher keeps it
+ * current one controller at a time with vendor_topology_refresh_ctl; every
+ * change bumps the generation, a rescan that finds the same controllers does
+ * not. Attributes that could not be read are kept as -1 and reported on lookup.
+ */
+struct ubc_topo_entry {
+    uint8_t eid[EID_SIZE];
+    unsigned int ubc_index;
+    int ummu_mapping;
+    int numa_id;
+    int primary_cna;
+    char path[MAX_PATH];
+};
+
+struct ubc_topology {
+    struct ubc_topo_entry ctl[MAX_CONTROLLERS];
+    unsigned int nr_ctl;
+    bool valid;
+    uint64_t generation;
+    uint64_t scanned_at; /* obmm_stat_clock() of the last full scan */
+};
+
+/* a lookup miss rescans sysfs at most this often, the watcher covers the rest */
+#define TOPOLOGY_MISS_RESCAN_NS 1000000000ULL
+
+static struct ubc_topology g_topology;
+static pthread_rwlock_t g_topology_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* read controller @ubc_index from sysfs, ENODEV if it is not there */
+static int topology_read_ctl(unsigned int ubc_index, struct ubc_topo_entry *entry)
+{
+    int ret = get_ubc_path((int)ubc_index, entry->path, sizeof(entry->path));
+    if (ret)
+        return ret;
+
+    ret = get_ubc_attr(entry->path, "eid"); /* host endian */
+    if (ret < 0) {
+        pr_err("failed to read ctl eid, path %s.\n", entry->path);
+        return ENODEV;
+    }
+
+    memset(entry->eid, 0, sizeof(entry->eid));
+    *(unsigned int *)entry->eid = (unsigned int)ret;
+    entry->ubc_index = ubc_index;
+    entry->ummu_mapping = get_ubc_attr(entry->path, "ummu_map");
+    entry->numa_id = get_ubc_attr(entry->path, "numa");
+    entry->primary_cna = get_ubc_attr(entry->path, "primary_cna");
+    return 0;
+}
+
+static bool topology_entry_equal(const struct ubc_topo_entry *a, const struct ubc_topo_entry *b)
+{
+    return memcmp(a->eid, b->eid, EID_SIZE) == 0 && a->ummu_mapping == b->ummu_mapping &&
+           a->numa_id == b->numa_id && a->primary_cna == b->primary_cna && strcmp(a->path, b->path) == 0;
+}
+
+static void topology_build_locked(struct ubc_topology *topo)
 {
+    uint64_t start = obmm_stat_start();
+    struct ubc_topo_entry fresh;
+    unsigned int nr_ctl = 0;
+    bool changed = false;
+
     for (unsigned int i = 0; i < MAX_CONTROLLERS; i++) {
-        int ret = get_ubc_path(i, ubc_path, path_len);
-        if (ret)
+        if (topology_read_ctl(i, &fresh))
             continue;
+        if (nr_ctl >= topo->nr_ctl || !topology_entry_equal(&topo->ctl[nr_ctl], &fresh)) {
+            topo->ctl[nr_ctl] = fresh;
+            changed = true;
+        }
+        nr_ctl++;
+    }
+    if (nr_ctl != topo->nr_ctl)
+        changed = true;
+    topo->nr_ctl = nr_ctl;
+    topo->valid = true;
+    topo->scanned_at = obmm_stat_clock();
+    if (changed)
+        topo->generation++;
+    obmm_stat_phase_end(OBMM_STAT_PHASE_TOPOLOGY, start);
+}
 
-        ret = get_ubc_attr(ubc_path, "eid"); /* host endian */
-        if (ret < 0) {
-            pr_err("failed to read ctl eid, path %s.\n", ubc_path);
-            errno = ENODEV;
-            return -1;
+static void topology_ensure_locked_rd(void)
+{
+    while (!g_topology.valid) {
+        (void)pthread_rwlock_unlock(&g_topology_lock);
+        (void)pthread_rwlock_wrlock(&g_topology_lock);
+        if (!g_topology.valid)
+            topology_build_locked(&g_topology);
+        (void)pthread_rwlock_unlock(&g_topology_lock);
+        (void)pthread_rwlock_rdlock(&g_topology_lock);
+    }
+}
+
+static int topology_find_locked(const uint8_t *eid, struct ubc_topo_entry *out)
+{
+    for (unsigned int i = 0; i < g_topology.nr_ctl; i++) {
+        if (memcmp(g_topology.ctl[i].eid, eid, EID_SIZE) == 0) {
+            *out = g_topology.ctl[i];
+            return 0;
         }
+    }
+    return ENODEV;
+}
 
-        uint8_t sysfs_eid[EID_SIZE] = {};
-        *(unsigned int*)sysfs_eid = (unsigned int)ret;
+static int topology_lookup(const uint8_t *eid, struct ubc_topo_entry *out)
+{
+    uint64_t scanned_at;
+    int ret;
 
-        if (memcmp(sysfs_eid, eid, EID_SIZE) != 0)
-            continue;
+    (void)pthread_rwlock_rdlock(&g_topology_lock);
+    topology_ensure_locked_rd();
+    ret = topology_find_locked(eid, out);
+    scanned_at = g_topology.scanned_at;
+    (void)pthread_rwlock_unlock(&g_topology_lock);
+
+    /*
+     * the table may predate the bus probe or a hotplug, rescan unless that was
+     * done recently: misses on an unknown eid must not serialize every lookup
+     * on the write lock
+     */
+    if (ret && obmm_stat_clock() - scanned_at >= TOPOLOGY_MISS_RESCAN_NS) {
+        (void)pthread_rwlock_wrlock(&g_topology_lock);
+        if (g_topology.scanned_at == scanned_at)
+            topology_build_locked(&g_topology);
+        ret = topology_find_locked(eid, out);
+        (void)pthread_rwlock_unlock(&g_topology_lock);
+    }
 
-        *uba_index = i;
-        return 0;
+    if (ret) {
+        pr_err("failed to find ctl, eid:" EID_FMT64 ".\n", EID_ARGS64(eid));
+        errno = ENODEV;
+        return -1;
     }
-    pr_err("failed to find ctl, eid:" EID_FMT64 ".\n", EID_ARGS64(eid));
-    errno = ENODEV;
-    return -1;
+    return 0;
+}
+
+int vendor_topology_refresh(void)
+{
+    int nr_ctl;
+
+    (void)pthread_rwlock_wrlock(&g_topology_lock);
+    topology_build_locked(&g_topology);
+    nr_ctl = (int)g_topology.nr_ctl;
+    (void)pthread_rwlock_unlock(&g_topology_lock);
+    return nr_ctl;
 }
 
-static struct ub_bus_ctl_node get_ctl_by_eid(uint8_t *eid)
+void vendor_topology_invalidate(void)
+{
+    (void)pthread_rwlock_wrlock(&g_topology_lock);
+    g_topology.valid = false;
+    g_topology.generation++;
+    (void)pthread_rwlock_unlock(&g_topology_lock);
+}
+
+uint64_t vendor_topology_generation(void)
+{
+    uint64_t generation;
+
+    (void)pthread_rwlock_rdlock(&g_topology_lock);
+    generation = g_topology.generation;
+    (void)pthread_rwlock_unlock(&g_topology_lock);
+    return generation;
+}
+
+static void topology_export_entry(const struct ubc_topo_entry *entry, struct obmm_controller_info *info)
+{
+    if (info == NULL)
+        return;
+    memset(info, 0, sizeof(*info));
+    if (entry == NULL) {
+        info->numa_id = -1;
+        info->primary_cna = -1;
+        info->ummu_mapping = -1;
+        return;
+    }
+    memcpy(info->eid, entry->eid, EID_SIZE);
+    info->numa_id = entry->numa_id;
+    info->primary_cna = entry->primary_cna;
+    info->ummu_mapping = entry->ummu_mapping;
+}
+
+int vendor_topology_refresh_ctl(unsigned int ubc_index, struct obmm_controller_info *old,
+                struct obmm_controller_info *now)
+{
+    struct ubc_topo_entry fresh, *cached = NULL;
+    bool present;
+    int change = OBMM_CTL_UNCHANGED;
+
+    if (ubc_index >= MAX_CONTROLLERS) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* sysfs is read outside the lock, lookups keep being served meanwhile */
+    present = topology_read_ctl(ubc_index, &fresh) == 0;
+
+    (void)pthread_rwlock_wrlock(&g_topology_lock);
+    if (!g_topology.valid)
+        topology_build_locked(&g_topology);
+    for (unsigned int i = 0; i < g_topology.nr_ctl; i++) {
+        if (g_topology.ctl[i].ubc_index == ubc_index) {
+            cached = &g_topology.ctl[i];
+            break;
+        }
+    }
+    topology_export_entry(cached, old);
+    if (cached != NULL && !present) {
+        unsigned int idx = (unsigned int)(cached - g_topology.ctl);
+        memmove(cached, cached + 1, (g_topology.nr_ctl - idx - 1) * sizeof(*cached));
+        g_topology.nr_ctl--;
+        change = OBMM_CTL_REMOVED;
+    } else if (cached != NULL && !topology_entry_equal(cached, &fresh)) {
+        *cached = fresh;
+        change = OBMM_CTL_CHANGED;
+    } else if (cached == NULL && present && g_topology.nr_ctl < MAX_CONTROLLERS) {
+        g_topology.ctl[g_topology.nr_ctl++] = fresh;
+        change = OBMM_CTL_ADDED;
+    }
+    if (change != OBMM_CTL_UNCHANGED)
+        g_topology.generation++;
+    topology_export_entry(present ? &fresh : NULL, now);
+    (void)pthread_rwlock_unlock(&g_topology_lock);
+    return change;
+}
+
+/* rescan the controller currently cached under @eid, 0 if it changed */
+static int topology_refresh_eid(const uint8_t *eid)
+{
+    unsigned int ubc_index = MAX_CONTROLLERS;
+
+    (void)pthread_rwlock_rdlock(&g_topology_lock);
+    for (unsigned int i = 0; g_topology.valid && i < g_topology.nr_ctl; i++) {
+        if (memcmp(g_topology.ctl[i].eid, eid, EID_SIZE) == 0) {
+            ubc_index = g_topology.ctl[i].ubc_index;
+            break;
+        }
+    }
+    (void)pthread_rwlock_unlock(&g_topology_lock);
+    if (ubc_index == MAX_CONTROLLERS)
+        return -1;
+    return vendor_topology_refresh_ctl(ubc_index, NULL, NULL) > OBMM_CTL_UNCHANGED ? 0 : -1;
+}
+
+static struct ub_bus_ctl_node get_ctl_by_eid(const uint8_t *eid)
 {
     struct ub_bus_ctl_node node = {0};
-    char ubc_path[MAX_PATH];
-    unsigned int ubc_index;
+    struct ubc_topo_entry entry;
 
-    int ret = get_ubc_by_eid(&ubc_index, ubc_path, sizeof(ubc_path), eid);
-    if (ret)
+    if (topology_lookup(eid, &entry))
         return node;
 
-    node.ummu_mapping = get_ubc_attr(ubc_path, "ummu_map");
+    node.ummu_mapping = entry.ummu_mapping;
     if (node.ummu_mapping < 0) {
-        pr_err("failed to read ctl ummu_map, path %s.\n", ubc_path);
+        pr_err("failed to read ctl ummu_map, path %s.\n", entry.path);
         return node;
     }
 
-    node.numa_id = get_ubc_attr(ubc_path, "numa");
+    node.numa_id = entry.numa_id;
     if (node.numa_id < 0) {
-        pr_err("failed to read ctl numa, path %s.\n", ubc_path);
+        pr_err("failed to read ctl numa, path %s.\n", entry.path);
         return node;
     }
     node.valid = true;
     return node;
 }
 
+int vendor_topology_numa(const uint8_t *eid)
+{
+    struct ubc_topo_entry entry;
+
+    if (topology_lookup(eid, &entry))
+        return -1;
+    if (entry.numa_id < 0) {
+        errno = ENODATA;
+        return -1;
+    }
+    return entry.numa_id;
+}
+
 static int get_primary_cna_by_eid(unsigned int *cna, const uint8_t *eid)
 {
-    char ubc_path[MAX_PATH];
-    unsigned int ubc_index;
+    struct ubc_topo_entry entry;
 
-    int ret = get_ubc_by_eid(&ubc_index, ubc_path, sizeof(ubc_path), eid);
+    int ret = topology_lookup(eid, &entry);
     if (ret)
         return ret;
 
-    ret = get_ubc_attr(ubc_path, "primary_cna");
-    if (ret < 0) {
-        pr_err("failed to read ctl primary_cna, path %s.\n", ubc_path);
+    if (entry.primary_cna < 0) {
+        pr_err("failed to read ctl primary_cna, path %s.\n", entry.path);
         errno = ENODEV;
         return -1;
     }
-    *cna = (unsigned int)ret;
+    *cna = (unsigned int)entry.primary_cna;
 
     return 0;
 }
 
-static int init_vendor_info(int ummu_mapping, const void **vendor_info, uint16_t *vendor_len)
-{
-    struct hisi_ummu_tdev_info *info = (struct hisi_ummu_tdev_info *)calloc(1, sizeof(*info));
+_Static_assert(sizeof(struct hisi_ummu_tdev_info) <= sizeof(struct vendor_info_storage),
+           "vendor_info_storage cannot hold hisi_ummu_tdev_info");
 
-    if (!info)
-        return ENOMEM;
+static int init_vendor_info(int ummu_mapping, struct vendor_info_storage *storage,
+                const void **vendor_info, uint16_t *vendor_len)
+{
+    uint64_t start = obmm_stat_start();
+    struct hisi_ummu_tdev_info *info = (struct hisi_ummu_tdev_info *)storage->bytes;
 
-    if (sizeof(struct hisi_ummu_tdev_info) > OBMM_MAX_VENDOR_LEN) {
-        free(info);
+    if (sizeof(struct hisi_ummu_tdev_info) > OBMM_MAX_VENDOR_LEN)
         return EINVAL;
-    }
 
+    memset(info, 0, sizeof(*info));
     info->ver = HISI_TDEV_INFO_V1;
     info->v1.on_chip = true;
     info->v1.ummu_idx_mask = 1 << ummu_mapping;
     *vendor_info = info;
     *vendor_len = sizeof(struct hisi_ummu_tdev_info);
+    obmm_stat_phase_end(OBMM_STAT_PHASE_VENDOR_ALLOC, start);
     return 0;
 }
 
-int vendor_adapt_export(struct obmm_mem_desc *desc, const void **vendor_info,
-            uint16_t *vendor_len, int *numa)
+int vendor_adapt_export(struct obmm_mem_desc *desc, struct vendor_info_storage *storage,
+            const void **vendor_info, uint16_t *vendor_len, int *numa)
 {
     struct ub_bus_ctl_node node;
     int ret;
@@ -239,7 +470,7 @@ int vendor_adapt_export(struct obmm_mem_desc *desc, const void **vendor_info,
     if (!node.valid)
         return ENODEV;
 
-    ret = init_vendor_info(node.ummu_mapping, vendor_info, vendor_len);
+    ret = init_vendor_info(node.ummu_mapping, storage, vendor_info, vendor_len);
     if (ret) {
         pr_err("init_vendor_info failed, ret %d.\n", ret);
         return ret;
@@ -248,26 +479,105 @@ int vendor_adapt_export(struct obmm_mem_desc *desc, const void **vendor_info,
     return 0;
 }
 
-void free_vendor_info(void *vendor_info)
+void vendor_export_cache_init(struct vendor_export_cache *cache)
 {
-    free(vendor_info);
+    cache->nr = 0;
 }
 
-int vendor_fixup_import_cmd(struct obmm_cmd_import *cmd)
+int vendor_adapt_export_cached(struct vendor_export_cache *cache, struct obmm_mem_desc *desc,
+            struct vendor_info_storage *spill, const void **vendor_info, uint16_t *vendor_len,
+            int *numa)
 {
-    unsigned int cna;
-    int ret = get_primary_cna_by_eid(&cna, cmd->seid);
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < cache->nr; i++) {
+        if (memcmp(cache->ent[i].eid, desc->deid, EID_SIZE) == 0) {
+            *vendor_info = cache->ent[i].info.bytes;
+            *vendor_len = cache->ent[i].vendor_len;
+            *numa = cache->ent[i].numa;
+            return 0;
+        }
+    }
+
+    /* a full cache builds into the caller's spill storage instead */
+    if (cache->nr >= VENDOR_LOOKUP_CACHE_SIZE)
+        return vendor_adapt_export(desc, spill, vendor_info, vendor_len, numa);
+
+    /* failed lookups are not memoized, they are not worth a slot */
+    ret = vendor_adapt_export(desc, &cache->ent[cache->nr].info, vendor_info, vendor_len, numa);
     if (ret)
         return ret;
-    if (cna != cmd->scna) {
+
+    memcpy(cache->ent[cache->nr].eid, desc->deid, EID_SIZE);
+    cache->ent[cache->nr].vendor_len = *vendor_len;
+    cache->ent[cache->nr].numa = *numa;
+    cache->nr++;
+    return 0;
+}
+
+void vendor_export_cache_release(struct vendor_export_cache *cache)
+{
+    /* vendor info lives inside the entries, nothing to free */
+    cache->nr = 0;
+}
+
+int vendor_fixup_import_cmd(struct obmm_cmd_import *cmd)
+{
+    return vendor_fixup_import_cmd_cached(NULL, cmd);
+}
+
+/*
+ * Check @scna of a command against @cna, the primary cna cached for @eid. A
+ * mismatch may be a controller that changed after it was cached, so the
+ * controller is rescanned once and @cna updated before the command is refused.
+ */
+static int check_scna(const uint8_t *eid, unsigned int *cna, unsigned int scna)
+{
+    if (*cna != scna && topology_refresh_eid(eid) == 0 && get_primary_cna_by_eid(cna, eid))
+        return -1;
+    if (*cna != scna) {
         pr_err("ctl with eid " EID_FMT64 " has scna=%#x which is different from scna=%#x.\n",
-                EID_ARGS64(cmd->seid), cna, cmd->scna);
+                EID_ARGS64(eid), *cna, scna);
         errno = ENODEV;
         return -1;
     }
     return 0;
 }
 
+void vendor_import_cache_init(struct vendor_import_cache *cache)
+{
+    cache->nr = 0;
+}
+
+int vendor_fixup_import_cmd_cached(struct vendor_import_cache *cache, struct obmm_cmd_import *cmd)
+{
+    unsigned int cna, i, *memo = NULL;
+    int ret;
+
+    for (i = 0; cache != NULL && i < cache->nr; i++) {
+        if (memcmp(cache->ent[i].eid, cmd->seid, EID_SIZE) == 0) {
+            cna = cache->ent[i].cna;
+            memo = &cache->ent[i].cna;
+            break;
+        }
+    }
+    if (memo == NULL) {
+        ret = get_primary_cna_by_eid(&cna, cmd->seid);
+        if (ret)
+            return ret;
+        if (cache != NULL && cache->nr < VENDOR_LOOKUP_CACHE_SIZE) {
+            memcpy(cache->ent[cache->nr].eid, cmd->seid, EID_SIZE);
+            memo = &cache->ent[cache->nr].cna;
+            cache->nr++;
+        }
+    }
+    ret = check_scna(cmd->seid, &cna, cmd->scna);
+    if (memo != NULL)
+        *memo = cna;
+    return ret;
+}
+
 void vendor_cleanup_import_cmd(struct obmm_cmd_import *cmd)
 {
 }
@@ -278,13 +588,7 @@ int vendor_fixup_preimport_cmd(struct obmm_cmd_preimport *cmd)
     int ret = get_primary_cna_by_eid(&cna, cmd->seid);
     if (ret)
         return ret;
-    if (cna != cmd->scna) {
-        pr_err("ctl with eid " EID_FMT64 " has scna=%#x which is different from scna=%#x.\n",
-                EID_ARGS64(cmd->seid), cna, cmd->scna);
-        errno = ENODEV;
-        return -1;
-    }
-    return 0;
+    return check_scna(cmd->seid, &cna, cmd->scna);
 }
 
 void vendor_cleanup_preimport_cmd(struct obmm_cmd_preimport *cmd)
@@ -18,11 +18,69 @@
 #ifndef _VENDOR_ADAPTOR_H
 #define _VENDOR_ADAPTOR_H
 
+#include <stdbool.h>
 #include <libobmm.h>
 
-int vendor_adapt_export(struct obmm_mem_desc *desc, const void **vendor_info,
-            uint16_t *vendor_len, int *numa);
-void free_vendor_info(void *vendor_info);
+#define VENDOR_LOOKUP_CACHE_SIZE 8
+#define VENDOR_INFO_MAX_LEN 32
+
+/*
+ * Caller-provided room for the vendor info of one export, large enough for
+ * every vendor layout, so the export paths can keep it on their stack.
+ */
+struct vendor_info_storage {
+    union {
+        uint64_t align;
+        uint8_t bytes[VENDOR_INFO_MAX_LEN];
+    };
+};
+
+/*
+ * Lookup memo shared by the entries of one batched call, so that every distinct
+ * eid is resolved (and its vendor info built) only once per batch.
+ */
+struct vendor_export_cache {
+    struct {
+        uint8_t eid[16];
+        struct vendor_info_storage info;
+        uint16_t vendor_len;
+        int numa;
+    } ent[VENDOR_LOOKUP_CACHE_SIZE];
+    unsigned int nr;
+};
+
+struct vendor_import_cache {
+    struct {
+        uint8_t eid[16];
+        unsigned int cna;
+    } ent[VENDOR_LOOKUP_CACHE_SIZE];
+    unsigned int nr;
+};
+
+/* returns the number of controllers found */
+int vendor_topology_refresh(void);
+void vendor_topology_invalidate(void);
+/* rescan controller @ubc_index only, returns one of OBMM_CTL_* or -1 with errno set */
+int vendor_topology_refresh_ctl(unsigned int ubc_index, struct obmm_controller_info *old,
+                struct obmm_controller_info *now);
+/* bumped by every change of the cached table */
+uint64_t vendor_topology_generation(void);
+/* NUMA node of the controller with @eid, -1 with errno set if unknown */
+int vendor_topology_numa(const uint8_t *eid);
+
+/* *vendor_info points into @storage on return */
+int vendor_adapt_export(struct obmm_mem_desc *desc, struct vendor_info_storage *storage,
+            const void **vendor_info, uint16_t *vendor_len, int *numa);
+
+void vendor_export_cache_init(struct vendor_export_cache *cache);
+/* *vendor_info points into the cache, or into @spill once the cache is full */
+int vendor_adapt_export_cached(struct vendor_export_cache *cache, struct obmm_mem_desc *desc,
+            struct vendor_info_storage *spill, const void **vendor_info, uint16_t *vendor_len,
+            int *numa);
+void vendor_export_cache_release(struct vendor_export_cache *cache);
+
+void vendor_import_cache_init(struct vendor_import_cache *cache);
+int vendor_fixup_import_cmd_cached(struct vendor_import_cache *cache, struct obmm_cmd_import *cmd);
 
 int vendor_fixup_import_cmd(struct obmm_cmd_import *cmd);
 void vendor_cleanup_import_cmd(struct obmm_cmd_import *cmd);
@@ -0,0 +1,400 @@
+//! Asynchronous export and import
+//!
+//! `AsyncCtx` wraps a libobmm async context: requests are handed to its worker
+//! threads at submission and complete through a callback, so a single control
+//! thread can keep many exports and imports in flight. Each submission returns a
+//! future; awaiting it in any executor, or with [`block_on`], yields the result.
+
+use std::future::Future;
+use std::pin::{Pin, pin};
+use std::sync::{Arc, Mutex, PoisonError};
+use std::task::{Context, Poll, Wake, Waker};
+use std::thread::{self, Thread};
+
+#[cfg(not(feature = "hook"))]
+use std::ffi::c_void;
+#[cfg(not(feature = "hook"))]
+use std::ptr::NonNull;
+
+use crate::{MemId, ObmmExportFlags, ObmmMemDesc, UbPrivData, OBMM_MAX_LOCAL_NUMA_NODES};
+#[cfg(feature = "hook")]
+use crate::{mem_export, mem_import};
+
+/// Completion record filled in by libobmm
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+struct ObmmAsyncCmpl {
+    /// Caller cookie, unused by this crate
+    user_data: u64,
+    /// Memory ID, `OBMM_INVALID_MEMID` on failure
+    id: MemId,
+    /// NUMA node of an import
+    numa: i32,
+    /// 0 on success, errno on failure
+    err: i32,
+}
+
+/// Result slot shared between a future and the completion callback
+#[derive(Debug)]
+struct Slot<T> {
+    /// Completion, once delivered
+    done: Option<ObmmAsyncCmpl>,
+    /// Descriptor owned by the request; libobmm reads or fills it until completion
+    desc: Option<Box<ObmmMemDesc<T>>>,
+    /// Task to wake on completion
+    waker: Option<Waker>,
+}
+
+/// Shared state of one request
+#[derive(Debug)]
+struct Op<T> {
+    /// Result slot
+    slot: Mutex<Slot<T>>,
+}
+
+impl<T> Op<T> {
+    /// New request owning `desc`
+    fn new(desc: ObmmMemDesc<T>) -> Arc<Self> {
+        Arc::new(Op { slot: Mutex::new(Slot { done: None, desc: Some(Box::new(desc)), waker: None }) })
+    }
+
+    /// Record the completion and wake the waiting task
+    fn complete(&self, cmpl: ObmmAsyncCmpl) {
+        let mut slot = self.slot.lock().unwrap_or_else(PoisonError::into_inner);
+        slot.done = Some(cmpl);
+        let waker = slot.waker.take();
+        drop(slot);
+        if let Some(waker) = waker {
+            waker.wake();
+        }
+    }
+
+    /// Poll for the completion, handing back the descriptor once it is done
+    fn poll_done(&self, cx: &Context<'_>) -> Poll<(ObmmAsyncCmpl, ObmmMemDesc<T>)> {
+        let mut slot = self.slot.lock().unwrap_or_else(PoisonError::into_inner);
+        match (slot.done, slot.desc.take()) {
+            (Some(cmpl), Some(desc)) => Poll::Ready((cmpl, *desc)),
+            (_, desc) => {
+                slot.desc = desc;
+                slot.waker = Some(cx.waker().clone());
+                Poll::Pending
+            }
+        }
+    }
+}
+
+/// Completion callback registered with every request
+#[cfg(not(feature = "hook"))]
+extern "C" fn on_complete<T>(cmpl: *const ObmmAsyncCmpl, arg: *mut c_void) {
+    // SAFETY: `arg` is the `Arc<Op<T>>` leaked at submission, reclaimed exactly once
+    // here; `cmpl` points to a live completion for the duration of the call.
+    let (op, cmpl) = unsafe { (Arc::from_raw(arg.cast_const().cast::<Op<T>>()), *cmpl) };
+    op.complete(cmpl);
+}
+
+/// Future of an asynchronous `mem_export`
+#[derive(Debug)]
+pub struct ExportFuture<T> {
+    /// Request state
+    op: Arc<Op<T>>,
+}
+
+impl<T> Future for ExportFuture<T> {
+    type Output = Result<(MemId, ObmmMemDesc<T>), i32>;
+
+    #[inline]
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        self.op.poll_done(cx).map(|(cmpl, desc)| if cmpl.err == 0 { Ok((cmpl.id, desc)) } else { Err(cmpl.err) })
+    }
+}
+
+/// Future of an asynchronous `mem_import`
+#[derive(Debug)]
+pub struct ImportFuture {
+    /// Request state
+    op: Arc<Op<UbPrivData>>,
+}
+
+impl Future for ImportFuture {
+    type Output = Result<(MemId, i32), i32>;
+
+    #[inline]
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        self.op.poll_done(cx).map(|(cmpl, _)| if cmpl.err == 0 { Ok((cmpl.id, cmpl.numa)) } else { Err(cmpl.err) })
+    }
+}
+
+/// libobmm async context: worker threads executing export/import requests
+#[derive(Debug)]
+#[non_exhaustive]
+pub struct AsyncCtx {
+    /// `struct obmm_async_ctx *`
+    #[cfg(not(feature = "hook"))]
+    raw: NonNull<c_void>,
+}
+
+// SAFETY: the C context is internally synchronized.
+unsafe impl Send for AsyncCtx {}
+// SAFETY: see above.
+unsafe impl Sync for AsyncCtx {}
+
+impl AsyncCtx {
+    /// Create a context with `workers` threads and at most `depth` requests in flight
+    /// # Returns
+    /// # Errors
+    /// `AsyncCtx` on success, errno on failure
+    #[cfg(feature = "hook")]
+    #[inline]
+    pub fn new(workers: u32, depth: u32) -> Result<Self, i32> {
+        // hooked implementation
+        if workers == 0 || depth == 0 {
+            return Err(libc::EINVAL);
+        }
+        Ok(AsyncCtx {})
+    }
+
+    /// Create a context with `workers` threads and at most `depth` requests in flight
+    /// # Returns
+    /// # Errors
+    /// `AsyncCtx` on success, errno on failure
+    #[cfg(not(feature = "hook"))]
+    #[inline]
+    pub fn new(workers: u32, depth: u32) -> Result<Self, i32> {
+        let raw = unsafe { obmm_async_create(workers, depth) };
+        NonNull::new(raw).map(|raw| AsyncCtx { raw }).ok_or_else(crate::last_errno)
+    }
+
+    /// Submit an export; the request runs even if the future is dropped
+    /// # Arguments
+    /// * `length` - Array of lengths for each NUMA node
+    /// * `flags` - Export flags
+    /// # Returns
+    /// # Errors
+    /// Future of the Memory ID and Memory Descriptor, errno if submission fails
+    /// (`EAGAIN` when `depth` requests are already in flight)
+    #[cfg(feature = "hook")]
+    #[inline]
+    pub fn export<T: Default + Send + 'static>(
+        &self,
+        length: &[usize; OBMM_MAX_LOCAL_NUMA_NODES],
+        flags: ObmmExportFlags,
+    ) -> Result<ExportFuture<T>, i32> {
+        // hooked implementation
+        let (id, desc) = mem_export::<T>(length, flags).or(Err(libc::EIO))?;
+        let op = Op::new(desc);
+        op.complete(ObmmAsyncCmpl { id, ..ObmmAsyncCmpl::default() });
+        Ok(ExportFuture { op })
+    }
+
+    /// Submit an export; the request runs even if the future is dropped
+    /// # Arguments
+    /// * `length` - Array of lengths for each NUMA node
+    /// * `flags` - Export flags
+    /// # Returns
+    /// # Errors
+    /// Future of the Memory ID and Memory Descriptor, errno if submission fails
+    /// (`EAGAIN` when `depth` requests are already in flight)
+    #[cfg(not(feature = "hook"))]
+    #[inline]
+    pub fn export<T: Default + Send + 'static>(
+        &self,
+        length: &[usize; OBMM_MAX_LOCAL_NUMA_NODES],
+        flags: ObmmExportFlags,
+    ) -> Result<ExportFuture<T>, i32> {
+        let op = Op::new(ObmmMemDesc::<T>::default());
+        let desc = Self::desc_ptr(&op);
+        let arg = Arc::into_raw(Arc::clone(&op)).cast_mut().cast::<c_void>();
+        let ret = unsafe {
+            obmm_async_submit_export(self.raw.as_ptr(), length.as_ptr(), flags.bits(), desc, 0, on_complete::<T>, arg)
+        };
+        Self::submitted(ret, arg.cast_const().cast::<Op<T>>())?;
+        Ok(ExportFuture { op })
+    }
+
+    /// Submit an import; the request runs even if the future is dropped
+    /// # Arguments
+    /// * `desc` - Memory Descriptor from remote
+    /// * `flags` - Import flags
+    /// * `base_dist` - Base distribution hint
+    /// * `numa` - NUMA node to import onto, -1 to let the kernel choose
+    /// # Returns
+    /// # Errors
+    /// Future of the Memory ID and NUMA node, errno if submission fails
+    /// (`EAGAIN` when `depth` requests are already in flight)
+    #[cfg(feature = "hook")]
+    #[inline]
+    pub fn import(
+        &self,
+        desc: ObmmMemDesc<UbPrivData>,
+        flags: ObmmExportFlags,
+        base_dist: i32,
+        _: i32,
+    ) -> Result<ImportFuture, i32> {
+        // hooked implementation
+        let (id, numa) = mem_import(&desc, flags, base_dist)?;
+        let op = Op::new(desc);
+        op.complete(ObmmAsyncCmpl { id, numa, ..ObmmAsyncCmpl::default() });
+        Ok(ImportFuture { op })
+    }
+
+    /// Submit an import; the request runs even if the future is dropped
+    /// # Arguments
+    /// * `desc` - Memory Descriptor from remote
+    /// * `flags` - Import flags
+    /// * `base_dist` - Base distribution hint
+    /// * `numa` - NUMA node to import onto, -1 to let the kernel choose
+    /// # Returns
+    /// # Errors
+    /// Future of the Memory ID and NUMA node, errno if submission fails
+    /// (`EAGAIN` when `depth` requests are already in flight)
+    #[cfg(not(feature = "hook"))]
+    #[inline]
+    pub fn import(
+        &self,
+        desc: ObmmMemDesc<UbPrivData>,
+        flags: ObmmExportFlags,
+        base_dist: i32,
+        numa: i32,
+    ) -> Result<ImportFuture, i32> {
+        let op = Op::new(desc);
+        let desc_ptr = Self::desc_ptr(&op).cast_const();
+        let arg = Arc::into_raw(Arc::clone(&op)).cast_mut().cast::<c_void>();
+        let ret = unsafe {
+            obmm_async_submit_import(
+                self.raw.as_ptr(),
+                desc_ptr,
+                flags.bits(),
+                base_dist,
+                numa,
+                0,
+                on_complete::<UbPrivData>,
+                arg,
+            )
+        };
+        Self::submitted(ret, arg.cast_const().cast::<Op<UbPrivData>>())?;
+        Ok(ImportFuture { op })
+    }
+
+    /// Stable address of the descriptor boxed in `op`
+    #[cfg(not(feature = "hook"))]
+    fn desc_ptr<T>(op: &Op<T>) -> *mut c_void {
+        let mut slot = op.slot.lock().unwrap_or_else(PoisonError::into_inner);
+        slot.desc.as_deref_mut().map_or(std::ptr::null_mut(), |desc| core::ptr::from_mut(desc).cast::<c_void>())
+    }
+
+    /// Check a submit return value, reclaiming the callback reference on failure
+    #[cfg(not(feature = "hook"))]
+    fn submitted<T>(ret: i32, arg: *const Op<T>) -> Result<(), i32> {
+        if ret == 0 {
+            return Ok(());
+        }
+        let errno = crate::last_errno();
+        // SAFETY: libobmm rejected the request, so the callback never runs and this
+        // is the only reclaim of the reference leaked for it.
+        drop(unsafe { Arc::from_raw(arg) });
+        Err(errno)
+    }
+}
+
+impl Drop for AsyncCtx {
+    /// Runs every submitted request to completion before returning
+    #[inline]
+    fn drop(&mut self) {
+        // hooked requests complete at submission
+        #[cfg(not(feature = "hook"))]
+        unsafe {
+            obmm_async_destroy(self.raw.as_ptr());
+        }
+    }
+}
+
+/// Wakes a thread parked in `block_on`
+#[derive(Debug)]
+struct ThreadWaker(Thread);
+
+impl Wake for ThreadWaker {
+    #[inline]
+    fn wake(self: Arc<Self>) {
+        self.0.unpark();
+    }
+}
+
+/// Run `fut` to completion on the calling thread
+#[inline]
+pub fn block_on<F: Future>(fut: F) -> F::Output {
+    let waker = Waker::from(Arc::new(ThreadWaker(thread::current())));
+    let mut cx = Context::from_waker(&waker);
+    let mut fut = pin!(fut);
+    loop {
+        if let Poll::Ready(output) = fut.as_mut().poll(&mut cx) {
+            return output;
+        }
+        thread::park();
+    }
+}
+
+#[cfg(not(feature = "hook"))]
+unsafe extern "C" {
+    /// Create an async context
+    fn obmm_async_create(nr_workers: u32, depth: u32) -> *mut c_void;
+
+    /// Destroy an async context after running every queued request
+    fn obmm_async_destroy(ctx: *mut c_void);
+
+    /// Submit an export request
+    fn obmm_async_submit_export(
+        ctx: *mut c_void,
+        length: *const usize,
+        flags: u64,
+        desc: *mut c_void,
+        user_data: u64,
+        cb: extern "C" fn(*const ObmmAsyncCmpl, *mut c_void),
+        arg: *mut c_void,
+    ) -> i32;
+
+    /// Submit an import request
+    fn obmm_async_submit_import(
+        ctx: *mut c_void,
+        desc: *const c_void,
+        flags: u64,
+        base_dist: i32,
+        numa: i32,
+        user_data: u64,
+        cb: extern "C" fn(*const ObmmAsyncCmpl, *mut c_void),
+        arg: *mut c_void,
+    ) -> i32;
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_async_import_export() -> Result<(), i32> {
+        let ctx = AsyncCtx::new(2, 8)?;
+        let mut length = [0_usize; OBMM_MAX_LOCAL_NUMA_NODES];
+        if let Some(v) = length.get_mut(1) {
+            *v = 1024 * 1024 * 2;
+        }
+        // keep several requests in flight before waiting on any of them
+        let exports = (0..4)
+            .map(|_| ctx.export::<UbPrivData>(&length, ObmmExportFlags::ALLOWMMAP))
+            .collect::<Result<Vec<_>, i32>>()?;
+        let descs = exports.into_iter().map(|fut| block_on(fut).map(|(_, desc)| desc)).collect::<Result<Vec<_>, i32>>()?;
+        assert!(descs.iter().all(|desc| desc.length == 1024 * 1024 * 2));
+
+        let imports = descs
+            .into_iter()
+            .map(|desc| ctx.import(desc, ObmmExportFlags::empty(), 0, -1))
+            .collect::<Result<Vec<_>, i32>>()?;
+        for fut in imports {
+            assert!(block_on(fut)?.0 != crate::OBMM_INVALID_MEMID);
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_async_rejects_empty_ctx() {
+        assert!(AsyncCtx::new(0, 8).is_err());
+    }
+}
@@ -0,0 +1,554 @@
+//! Slab and bump allocation out of a single OBMM region
+//!
+//! An export/import round trip costs a pair of ioctls and a page table setup,
+//! so backing every small object with its own region is out of the question.
+//! `Arena` takes one large mapping, either an imported region mapped by the
+//! caller or a `HugeBuffer` about to be exported, and serves allocations out of
+//! it: sizes up to `MAX_CLASS_SIZE` come from power-of-two size classes carved
+//! into slabs, larger ones are bumped off the end of the region and recycled by
+//! exact size. Every thread keeps a small free list per class, so the shared
+//! lists are only touched once per `CACHE_BATCH` allocations.
+//!
+//! `std::alloc::Allocator` is still unstable, so the allocator interface is
+//! `GlobalAlloc` plus the equivalent safe `Arena::allocate`. The thread caches
+//! and free lists are ordinary heap collections; with the arena installed as
+//! `#[global_allocator]`, whatever they allocate while the arena is at work on
+//! the same thread is served by `System` instead, so the arena never re-enters
+//! itself.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::{Cell, RefCell};
+use std::collections::{BTreeMap, HashMap};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, MutexGuard, PoisonError, Weak};
+
+use crate::hugepage::HugeBuffer;
+
+/// Smallest size class
+pub const MIN_CLASS_SIZE: usize = 16;
+/// Largest size class, bigger allocations are bumped
+pub const MAX_CLASS_SIZE: usize = 4096;
+/// Number of size classes, one per power of two in `MIN_CLASS_SIZE..=MAX_CLASS_SIZE`
+const CLASS_COUNT: usize = 9;
+/// Bytes carved into objects of one class at a time
+const SLAB_LEN: usize = 64 << 10_u32;
+/// Granule of bump allocations
+const PAGE_LEN: usize = 4096;
+/// Objects moved between a thread cache and the shared list at a time
+const CACHE_BATCH: usize = 32;
+
+/// Source of arena identities, keys of the thread caches
+static NEXT_ARENA_ID: AtomicU64 = AtomicU64::new(1);
+
+thread_local! {
+    /// Free objects of every arena used by this thread, by arena identity
+    ///
+    /// A dropped arena removes its entry on the dropping thread; entries other
+    /// threads hold for it are pruned the next time they look up a new arena.
+    static CACHES: RefCell<HashMap<u64, ThreadCache>> = RefCell::new(HashMap::new());
+
+    /// Set while this thread runs arena code, its own allocations then go to `System`
+    static BUSY: Cell<bool> = const { Cell::new(false) };
+}
+
+/// Marks the calling thread busy in the arena until dropped
+struct Busy {
+    /// Whether the thread was busy already, the outermost guard clears the mark
+    nested: bool,
+}
+
+impl Busy {
+    /// Mark the calling thread
+    fn enter() -> Self {
+        Busy { nested: BUSY.with(|busy| busy.replace(true)) }
+    }
+
+    /// Whether the calling thread runs arena code
+    fn active() -> bool {
+        BUSY.with(Cell::get)
+    }
+}
+
+impl Drop for Busy {
+    fn drop(&mut self) {
+        if !self.nested {
+            BUSY.with(|busy| busy.set(false));
+        }
+    }
+}
+
+/// Allocator over one mapped OBMM region
+#[derive(Debug)]
+pub struct Arena {
+    /// State shared with the thread caches
+    shared: Arc<Shared>,
+}
+
+/// Arena state, offsets are relative to `base`
+#[derive(Debug)]
+struct Shared {
+    /// Key of the thread caches of this arena
+    id: u64,
+    /// Start of the region
+    base: NonNull<u8>,
+    /// Length of the region
+    len: usize,
+    /// Offset of the first byte never handed out
+    next: AtomicUsize,
+    /// Free objects of every size class
+    classes: [Mutex<Vec<usize>>; CLASS_COUNT],
+    /// Free bump allocations by rounded size
+    large: Mutex<BTreeMap<usize, Vec<usize>>>,
+    /// Buffer owned by the arena, `None` for borrowed mappings
+    backing: Option<HugeBuffer>,
+}
+
+// SAFETY: the region is only reached through offsets handed out under the
+// arena's own synchronization; the owned buffer is Send and Sync itself.
+unsafe impl Send for Shared {}
+// SAFETY: see above.
+unsafe impl Sync for Shared {}
+
+/// Per-thread free lists of one arena
+#[derive(Debug)]
+struct ThreadCache {
+    /// Arena the objects belong to, flushed back on thread exit if still alive
+    shared: Weak<Shared>,
+    /// Free objects of every size class
+    free: [Vec<usize>; CLASS_COUNT],
+}
+
+impl Drop for ThreadCache {
+    fn drop(&mut self) {
+        let _busy = Busy::enter();
+        if let Some(shared) = self.shared.upgrade() {
+            for (class, free) in self.free.iter_mut().enumerate() {
+                shared.release(class, free.drain(..));
+            }
+        }
+    }
+}
+
+/// Size class serving `layout`, `None` if it is bumped
+fn class_of(layout: Layout) -> Option<usize> {
+    let size = layout.size().max(layout.align()).max(MIN_CLASS_SIZE);
+    if size > MAX_CLASS_SIZE {
+        return None;
+    }
+    let class = size.next_power_of_two().trailing_zeros().saturating_sub(MIN_CLASS_SIZE.trailing_zeros());
+    usize::try_from(class).ok()
+}
+
+/// Object size of `class`
+const fn class_size(class: usize) -> usize {
+    MIN_CLASS_SIZE << class
+}
+
+/// Lock `mutex`, the protected free lists stay consistent across a panic
+fn lock<T>(mutex: &Mutex<T>) -> MutexGuard<'_, T> {
+    mutex.lock().unwrap_or_else(PoisonError::into_inner)
+}
+
+impl Shared {
+    /// Bump `len` bytes aligned to `align` off the end of the region
+    fn bump(&self, len: usize, align: usize) -> Option<usize> {
+        // offsets aligned to at most the alignment of the base give aligned addresses
+        let base_align = 1_usize << self.base.as_ptr().addr().trailing_zeros().min(usize::BITS.saturating_sub(1));
+        if align > base_align {
+            return None;
+        }
+        let mut current = self.next.load(Ordering::Relaxed);
+        loop {
+            let start = current.checked_next_multiple_of(align)?;
+            let end = start.checked_add(len).filter(|&end| end <= self.len)?;
+            match self.next.compare_exchange_weak(current, end, Ordering::Relaxed, Ordering::Relaxed) {
+                Ok(_) => return Some(start),
+                Err(actual) => current = actual,
+            }
+        }
+    }
+
+    /// Move up to `CACHE_BATCH` free objects of `class` into `free`, carving a slab if none are left
+    fn refill(&self, class: usize, free: &mut Vec<usize>) -> bool {
+        let Some(shared) = self.classes.get(class) else {
+            return false;
+        };
+        let mut list = lock(shared);
+        if list.is_empty() {
+            // page aligned slabs keep every object aligned to its class size
+            let Some(slab) = self.bump(SLAB_LEN, PAGE_LEN) else {
+                return false;
+            };
+            let size = class_size(class);
+            // pushed in reverse so the cache pops the slab front to back
+            list.extend((0..SLAB_LEN.checked_div(size).unwrap_or(0)).rev().map(|i| slab.saturating_add(i.saturating_mul(size))));
+        }
+        let keep = list.len().saturating_sub(CACHE_BATCH);
+        free.extend(list.drain(keep..));
+        true
+    }
+
+    /// Return free objects of `class` to the shared list
+    fn release(&self, class: usize, objects: impl Iterator<Item = usize>) {
+        if let Some(shared) = self.classes.get(class) {
+            lock(shared).extend(objects);
+        }
+    }
+
+    /// Offset of a bump allocation for `layout`, reusing a freed one of the same size
+    fn alloc_large(&self, layout: Layout) -> Option<usize> {
+        let len = layout.size().checked_next_multiple_of(PAGE_LEN)?;
+        let base = self.base.as_ptr().addr();
+        {
+            let mut large = lock(&self.large);
+            // the alignment is of the address, the base need not be aligned as much as the layout
+            if let Some(free) = large.get_mut(&len)
+                && let Some(pos) =
+                    free.iter().position(|&offset| base.wrapping_add(offset).is_multiple_of(layout.align()))
+            {
+                return Some(free.swap_remove(pos));
+            }
+        }
+        self.bump(len, layout.align().max(PAGE_LEN))
+    }
+
+    /// Return a bump allocation for `layout` at `offset`
+    fn free_large(&self, layout: Layout, offset: usize) {
+        if let Some(len) = layout.size().checked_next_multiple_of(PAGE_LEN) {
+            lock(&self.large).entry(len).or_default().push(offset);
+        }
+    }
+}
+
+impl Arena {
+    /// Arena over `len` bytes at `base`, such as the mapping of an imported region
+    /// # Safety
+    /// `base..base + len` must be mapped read-write, page aligned, unused by
+    /// anything else, and outlive the arena and every allocation made from it.
+    /// # Returns
+    /// `Arena` handing out memory of the range
+    #[inline]
+    #[must_use]
+    pub unsafe fn from_raw_parts(base: NonNull<u8>, len: usize) -> Self {
+        Arena::with_backing(base, len, None)
+    }
+
+    /// Arena owning `buffer`, typically the buffer behind a `mem_export_useraddr` export
+    /// # Returns
+    /// `Arena` handing out memory of the buffer
+    #[inline]
+    #[must_use]
+    pub fn from_huge_buffer(buffer: HugeBuffer) -> Self {
+        // SAFETY: a NonNull buffer pointer is never null.
+        let base = unsafe { NonNull::new_unchecked(buffer.as_mut_ptr()) };
+        let len = buffer.len();
+        Arena::with_backing(base, len, Some(buffer))
+    }
+
+    /// Arena over `base..base + len` keeping `backing` alive
+    fn with_backing(base: NonNull<u8>, len: usize, backing: Option<HugeBuffer>) -> Self {
+        let shared = Arc::new(Shared {
+            id: NEXT_ARENA_ID.fetch_add(1, Ordering::Relaxed),
+            base,
+            len,
+            next: AtomicUsize::new(0),
+            classes: Default::default(),
+            large: Mutex::new(BTreeMap::new()),
+            backing,
+        });
+        Arena { shared }
+    }
+
+    /// Run `f` on this thread's free list of `class`
+    /// # Returns
+    /// What `f` returned, `None` once the thread caches are torn down or while
+    /// they are borrowed further up the stack; callers then use the shared lists
+    fn with_cache<R>(&self, class: usize, f: impl FnOnce(&mut Vec<usize>) -> R) -> Option<R> {
+        CACHES.try_with(|caches| {
+            let mut caches = caches.try_borrow_mut().ok()?;
+            if !caches.contains_key(&self.shared.id) {
+                caches.retain(|_, cache| cache.shared.strong_count() > 0);
+            }
+            let cache = caches.entry(self.shared.id).or_insert_with(|| ThreadCache {
+                shared: Arc::downgrade(&self.shared),
+                free: Default::default(),
+            });
+            let mut unused = Vec::new();
+            Some(f(cache.free.get_mut(class).unwrap_or(&mut unused)))
+        })
+        .ok()
+        .flatten()
+    }
+
+    /// Offset of an object of class `class`
+    fn alloc_small(&self, class: usize) -> Option<usize> {
+        let shared = &*self.shared;
+        let cached = self.with_cache(class, |free| {
+            if free.is_empty() && !shared.refill(class, free) {
+                return None;
+            }
+            free.pop()
+        });
+        cached.unwrap_or_else(|| {
+            // no thread cache: take from the shared list directly
+            let mut free = Vec::new();
+            let offset = shared.refill(class, &mut free).then(|| free.pop()).flatten();
+            shared.release(class, free.into_iter());
+            offset
+        })
+    }
+
+    /// Return an object of class `class` at `offset`
+    fn free_small(&self, class: usize, offset: usize) {
+        let overflow = self.with_cache(class, |free| {
+            free.push(offset);
+            (free.len() > CACHE_BATCH.saturating_mul(2)).then(|| free.split_off(CACHE_BATCH))
+        });
+        match overflow {
+            Some(Some(objects)) => self.shared.release(class, objects.into_iter()),
+            Some(None) => {}
+            None => self.shared.release(class, core::iter::once(offset)),
+        }
+    }
+
+    /// Allocate memory for `layout`
+    /// # Arguments
+    /// * `layout` - Size and alignment of the allocation
+    /// # Returns
+    /// Start of the allocation, `None` if the region is exhausted or the alignment cannot be met
+    #[inline]
+    #[must_use]
+    pub fn allocate(&self, layout: Layout) -> Option<NonNull<u8>> {
+        let _busy = Busy::enter();
+        let shared = &*self.shared;
+        let offset = match class_of(layout) {
+            Some(class) => self.alloc_small(class)?,
+            None => shared.alloc_large(layout)?,
+        };
+        // SAFETY: every offset handed out lies inside the region.
+        Some(unsafe { shared.base.add(offset) })
+    }
+
+    /// Return memory obtained from `allocate`
+    /// # Safety
+    /// `ptr` must come from `allocate` on this arena with the same `layout`
+    /// and must not be used afterwards.
+    /// # Arguments
+    /// * `ptr` - Start of the allocation
+    /// * `layout` - Layout it was allocated with
+    #[inline]
+    pub unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+        let _busy = Busy::enter();
+        let shared = &*self.shared;
+        let offset = ptr.as_ptr().addr().wrapping_sub(shared.base.as_ptr().addr());
+        match class_of(layout) {
+            Some(class) => self.free_small(class, offset),
+            None => shared.free_large(layout, offset),
+        }
+    }
+
+    /// Whether `ptr` points into the arena's region
+    #[inline]
+    #[must_use]
+    pub fn contains(&self, ptr: *const u8) -> bool {
+        ptr.addr()
+            .checked_sub(self.shared.base.as_ptr().addr())
+            .is_some_and(|offset| offset < self.shared.len)
+    }
+
+    /// Length of the region
+    #[inline]
+    #[must_use]
+    pub fn capacity(&self) -> usize {
+        self.shared.len
+    }
+
+    /// Bytes of the region handed out to slabs and bump allocations so far
+    #[inline]
+    #[must_use]
+    pub fn used(&self) -> usize {
+        self.shared.next.load(Ordering::Relaxed)
+    }
+
+    /// Buffer backing the arena, `None` for borrowed mappings
+    #[inline]
+    #[must_use]
+    pub fn backing(&self) -> Option<&HugeBuffer> {
+        self.shared.backing.as_ref()
+    }
+}
+
+impl Drop for Arena {
+    /// Drop this thread's cache of the arena, its objects go back to the shared lists
+    #[inline]
+    fn drop(&mut self) {
+        let id = self.shared.id;
+        let removed = CACHES.try_with(|caches| caches.try_borrow_mut().ok().and_then(|mut caches| caches.remove(&id)));
+        drop(removed);
+    }
+}
+
+// SAFETY: `allocate` returns disjoint, suitably aligned ranges of the region,
+// and `deallocate` only recycles them. Allocations made while the arena is at
+// work on this thread come from `System` and are told apart by address.
+unsafe impl GlobalAlloc for Arena {
+    /// Allocate from the region, or from `System` for the arena's own bookkeeping
+    #[inline]
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        if Busy::active() {
+            // SAFETY: forwarded from the caller of `alloc`.
+            return unsafe { System.alloc(layout) };
+        }
+        self.allocate(layout).map_or(core::ptr::null_mut(), NonNull::as_ptr)
+    }
+
+    /// Return `ptr` to the region, or to `System` if it did not come from the region
+    #[inline]
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        match NonNull::new(ptr) {
+            // SAFETY: forwarded from the caller of `dealloc`.
+            Some(ptr) if self.contains(ptr.as_ptr()) => unsafe { self.deallocate(ptr, layout) },
+            // SAFETY: anything outside the region came from the `System` branch of `alloc`.
+            _ => unsafe { System.dealloc(ptr, layout) },
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::hugepage::{HugePageBacking, HUGE_PAGE_SIZE};
+
+    #[test]
+    fn test_arena_classes_and_reuse() -> anyhow::Result<()> {
+        let arena = Arena::from_huge_buffer(HugeBuffer::alloc(HUGE_PAGE_SIZE, HugePageBacking::Transparent)?);
+        let layout = Layout::from_size_align(24, 8)?;
+        let first = arena.allocate(layout).ok_or_else(|| anyhow::anyhow!("arena exhausted"))?;
+        let second = arena.allocate(layout).ok_or_else(|| anyhow::anyhow!("arena exhausted"))?;
+        assert_ne!(first, second);
+        assert!(arena.contains(first.as_ptr()));
+        assert_eq!(first.as_ptr().addr() % 32, 0);
+        // SAFETY: both came from `allocate` with `layout`.
+        unsafe {
+            first.as_ptr().write_bytes(0xa5, 24);
+            arena.deallocate(second, layout);
+        }
+        let third = arena.allocate(layout).ok_or_else(|| anyhow::anyhow!("arena exhausted"))?;
+        assert_eq!(third, second);
+
+        let large = Layout::from_size_align(3 * PAGE_LEN + 1, PAGE_LEN)?;
+        let big = arena.allocate(large).ok_or_else(|| anyhow::anyhow!("arena exhausted"))?;
+        assert_eq!(big.as_ptr().addr() % PAGE_LEN, 0);
+        // SAFETY: `big` came from `allocate` with `large`.
+        unsafe { arena.deallocate(big, large) };
+        assert_eq!(arena.allocate(large), Some(big));
+        Ok(())
+    }
+
+    #[test]
+    fn test_arena_threads_exhaustion() -> anyhow::Result<()> {
+        let arena = Arc::new(Arena::from_huge_buffer(HugeBuffer::alloc(HUGE_PAGE_SIZE, HugePageBacking::Transparent)?));
+        let layout = Layout::from_size_align(64, 64)?;
+        let barrier = Arc::new(std::sync::Barrier::new(4));
+        let handles: Vec<_> = (0..4)
+            .map(|_| {
+                let arena = Arc::clone(&arena);
+                let barrier = Arc::clone(&barrier);
+                std::thread::spawn(move || {
+                    let objects: Vec<_> = (0..1000).filter_map(|_| arena.allocate(layout)).collect();
+                    let count = objects.len();
+                    // all 4000 objects are live at once
+                    let _ = barrier.wait();
+                    for object in objects {
+                        // SAFETY: allocated above with `layout`.
+                        unsafe { arena.deallocate(object, layout) };
+                    }
+                    count
+                })
+            })
+            .collect();
+        for handle in handles {
+            assert_eq!(handle.join().or(Err(anyhow::anyhow!("worker panicked")))?, 1000);
+        }
+        // objects of exited threads went back to the shared lists and are reused
+        let used = arena.used();
+        let again: Vec<_> = (0..4000).filter_map(|_| arena.allocate(layout)).collect();
+        assert_eq!(again.len(), 4000);
+        assert_eq!(arena.used(), used);
+
+        let huge = Layout::from_size_align(2 * HUGE_PAGE_SIZE, PAGE_LEN)?;
+        assert!(arena.allocate(huge).is_none());
+        Ok(())
+    }
+
+    #[test]
+    fn test_arena_large_reuse_keeps_alignment() -> anyhow::Result<()> {
+        let buffer = HugeBuffer::alloc(HUGE_PAGE_SIZE, HugePageBacking::Transparent)?;
+        // 4K aligned but not 8K aligned, so reused offsets must be checked as addresses
+        let base = NonNull::new(buffer.as_mut_ptr().wrapping_add(PAGE_LEN)).ok_or_else(|| anyhow::anyhow!("null"))?;
+        assert_eq!(base.as_ptr().addr() % (2 * PAGE_LEN), PAGE_LEN);
+        // SAFETY: the range lies inside `buffer`, which outlives the arena.
+        let arena = unsafe { Arena::from_raw_parts(base, HUGE_PAGE_SIZE - PAGE_LEN) };
+        let small = Layout::from_size_align(2 * PAGE_LEN, PAGE_LEN)?;
+        let first = arena.allocate(small).ok_or_else(|| anyhow::anyhow!("arena exhausted"))?;
+        // SAFETY: allocated above with `small`.
+        unsafe { arena.deallocate(first, small) };
+        let aligned = Layout::from_size_align(2 * PAGE_LEN, 2 * PAGE_LEN)?;
+        // the freed block is misaligned as an address and the bump cannot do better than the base
+        assert!(arena.allocate(aligned).is_none_or(|second| second.as_ptr().addr() % (2 * PAGE_LEN) == 0));
+        drop(arena);
+        drop(buffer);
+        Ok(())
+    }
+
+    #[test]
+    fn test_arena_reentrant_allocation() -> anyhow::Result<()> {
+        let arena = Arena::from_huge_buffer(HugeBuffer::alloc(HUGE_PAGE_SIZE, HugePageBacking::Transparent)?);
+        let layout = Layout::from_size_align(64, 8)?;
+        {
+            // what the free lists allocate while the arena is at work comes from System
+            let _busy = Busy::enter();
+            // SAFETY: `layout` has a non-zero size.
+            let outside = unsafe { arena.alloc(layout) };
+            assert!(!outside.is_null());
+            assert!(!arena.contains(outside));
+            // SAFETY: allocated above with `layout`.
+            unsafe { arena.dealloc(outside, layout) };
+        }
+        assert!(!Busy::active());
+        // an allocation while this thread's cache is borrowed takes the shared lists
+        let nested = arena.with_cache(0, |_| arena.allocate(layout)).flatten();
+        let nested = nested.ok_or_else(|| anyhow::anyhow!("arena exhausted"))?;
+        assert!(arena.contains(nested.as_ptr()));
+        // SAFETY: allocated above with `layout`.
+        unsafe { arena.deallocate(nested, layout) };
+        Ok(())
+    }
+
+    #[test]
+    fn test_arena_drop_releases_thread_caches() -> anyhow::Result<()> {
+        let layout = Layout::from_size_align(32, 8)?;
+        let touch = |arena: &Arena| {
+            let object = arena.allocate(layout).ok_or_else(|| anyhow::anyhow!("arena exhausted"))?;
+            // SAFETY: allocated above with `layout`.
+            unsafe { arena.deallocate(object, layout) };
+            Ok::<_, anyhow::Error>(())
+        };
+        let cached = || CACHES.with(|caches| caches.borrow().len());
+
+        let stale = Arena::from_huge_buffer(HugeBuffer::alloc(HUGE_PAGE_SIZE, HugePageBacking::Transparent)?);
+        touch(&stale)?;
+        assert_eq!(cached(), 1);
+        // dropped elsewhere, this thread's entry stays until the next new arena
+        std::thread::spawn(move || drop(stale)).join().or(Err(anyhow::anyhow!("drop panicked")))?;
+        assert_eq!(cached(), 1);
+
+        let fresh = Arena::from_huge_buffer(HugeBuffer::alloc(HUGE_PAGE_SIZE, HugePageBacking::Transparent)?);
+        touch(&fresh)?;
+        assert_eq!(cached(), 1);
+        drop(fresh);
+        assert_eq!(cached(), 0);
+        Ok(())
+    }
+}
@@ -0,0 +1,248 @@
+//! Huge-page backed buffers and parallel pre-faulting
+//!
+//! `obmm_export_useraddr` pins the exported VA range and requires it to be
+//! backed by 2M pages. Left to the ioctl, every page of a large range is
+//! allocated by a single thread inside the kernel. `HugeBuffer` maps the range
+//! up front and `HugeBuffer::prefault` touches it from every worker of a
+//! `ThreadPool`, so the export only has to pin pages that already exist.
+
+use std::ptr::NonNull;
+use std::sync::mpsc;
+
+use threadpool::ThreadPool;
+
+/// Size of the huge pages `obmm_export_useraddr` expects
+pub const HUGE_PAGE_SIZE: usize = 2 << 20_u32;
+
+/// How a `HugeBuffer` gets its huge pages
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum HugePageBacking {
+    /// Reserved hugetlbfs pages (`MAP_HUGETLB`), fails if the pool is exhausted
+    HugeTlb,
+    /// Transparent huge pages (`MADV_HUGEPAGE`) on a 2M aligned range
+    Transparent,
+}
+
+/// Anonymous, 2M aligned mapping backed by huge pages
+#[derive(Debug)]
+pub struct HugeBuffer {
+    /// Start of the mapping, 2M aligned
+    ptr: NonNull<u8>,
+    /// Length of the mapping, a multiple of `HUGE_PAGE_SIZE`
+    len: usize,
+}
+
+// SAFETY: the buffer owns its mapping; access goes through raw pointers handed
+// out by the owner.
+unsafe impl Send for HugeBuffer {}
+// SAFETY: see above.
+unsafe impl Sync for HugeBuffer {}
+
+/// Raw page pointer moved into a pre-fault job
+#[derive(Debug, Clone, Copy)]
+struct PagePtr(*mut u8);
+
+// SAFETY: every job touches a disjoint set of pages of a buffer that outlives it.
+unsafe impl Send for PagePtr {}
+
+impl HugeBuffer {
+    /// Map `len` bytes, rounded up to whole huge pages, without faulting them in
+    /// # Arguments
+    /// * `len` - Requested length
+    /// * `backing` - Where the huge pages come from
+    /// # Returns
+    /// # Errors
+    /// `HugeBuffer` on success, `anyhow::Error` on failure
+    #[inline]
+    pub fn alloc(len: usize, backing: HugePageBacking) -> anyhow::Result<Self> {
+        if len == 0 {
+            anyhow::bail!("Cannot allocate an empty huge page buffer");
+        }
+        let len = len
+            .checked_next_multiple_of(HUGE_PAGE_SIZE)
+            .ok_or_else(|| anyhow::anyhow!("Huge page buffer of {len} bytes is too large"))?;
+        let ptr = match backing {
+            HugePageBacking::HugeTlb => map_hugetlb(len)?,
+            HugePageBacking::Transparent => map_thp(len)?,
+        };
+        Ok(HugeBuffer { ptr, len })
+    }
+
+    /// Touch every huge page once, spread over all workers of `pool`
+    ///
+    /// Returns once every page has been faulted in.
+    /// # Arguments
+    /// * `pool` - Workers doing the page faults
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` if a job could not run
+    #[inline]
+    pub fn prefault(&self, pool: &ThreadPool) -> anyhow::Result<()> {
+        let pages = self.len / HUGE_PAGE_SIZE;
+        let per_job = pages.div_ceil(pool.size().max(1));
+        let (done_tx, done_rx) = mpsc::channel::<usize>();
+
+        let mut queued = 0_usize;
+        let mut first_err = None;
+        for first in (0..pages).step_by(per_job.max(1)) {
+            let count = per_job.min(pages.saturating_sub(first));
+            // SAFETY: `first` is below `pages`, so the page lies inside the mapping.
+            let start =
+                PagePtr(unsafe { self.ptr.as_ptr().add(first.saturating_mul(HUGE_PAGE_SIZE)) });
+            let done = done_tx.clone();
+            let job = move || {
+                let page = start;
+                for i in 0..count {
+                    // SAFETY: pages [first, first + count) belong to this job only and the
+                    // buffer stays mapped until every job has reported back.
+                    unsafe {
+                        page.0
+                            .add(i.saturating_mul(HUGE_PAGE_SIZE))
+                            .write_volatile(0);
+                    }
+                }
+                done.send(count).unwrap_or_default();
+            };
+            match pool.execute(job) {
+                Ok(()) => queued = queued.saturating_add(1),
+                Err(e) => {
+                    first_err = Some(e);
+                    break;
+                }
+            }
+        }
+        drop(done_tx);
+
+        // the channel closes once every queued job has finished or panicked
+        let touched: usize = done_rx.iter().sum();
+        if let Some(e) = first_err {
+            return Err(e.context("Failed to queue huge page pre-fault job"));
+        }
+        if touched != pages {
+            anyhow::bail!("Pre-faulted {touched} of {pages} huge pages over {queued} jobs");
+        }
+        Ok(())
+    }
+
+    /// Start of the buffer
+    #[inline]
+    #[must_use]
+    pub fn as_mut_ptr(&self) -> *mut u8 {
+        self.ptr.as_ptr()
+    }
+
+    /// Length of the buffer, a multiple of `HUGE_PAGE_SIZE`
+    #[inline]
+    #[must_use]
+    pub const fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Always false, empty buffers cannot be allocated
+    #[inline]
+    #[must_use]
+    pub const fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+}
+
+impl Drop for HugeBuffer {
+    #[inline]
+    fn drop(&mut self) {
+        // SAFETY: unmapping exactly the range mapped in `alloc`.
+        let _ = unsafe { libc::munmap(self.ptr.as_ptr().cast(), self.len) };
+    }
+}
+
+/// Private anonymous read-write mapping of `len` bytes with extra `flags`
+fn map_anonymous(len: usize, flags: i32) -> anyhow::Result<NonNull<u8>> {
+    // SAFETY: a fresh anonymous mapping aliases nothing; the result is checked below.
+    let ptr = unsafe {
+        libc::mmap(
+            std::ptr::null_mut(),
+            len,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | flags,
+            -1,
+            0,
+        )
+    };
+    if ptr == libc::MAP_FAILED {
+        return Err(anyhow::Error::new(std::io::Error::last_os_error())
+            .context(format!("Failed to map {len} bytes of huge page memory")));
+    }
+    NonNull::new(ptr.cast::<u8>()).ok_or_else(|| anyhow::anyhow!("mmap returned null"))
+}
+
+/// Anonymous mapping of `len` bytes from the 2M hugetlbfs pool
+///
+/// Without `MAP_HUGE_2MB` the kernel takes the default huge page size, which may
+/// be 1G or 512M depending on the architecture and boot parameters.
+fn map_hugetlb(len: usize) -> anyhow::Result<NonNull<u8>> {
+    if !len.is_multiple_of(HUGE_PAGE_SIZE) {
+        anyhow::bail!("Huge page buffer of {len} bytes is not a multiple of {HUGE_PAGE_SIZE}");
+    }
+    map_anonymous(len, libc::MAP_HUGETLB | libc::MAP_HUGE_2MB)
+}
+
+/// 2M aligned anonymous mapping of `len` bytes advised for transparent huge pages
+fn map_thp(len: usize) -> anyhow::Result<NonNull<u8>> {
+    let padded = len
+        .checked_add(HUGE_PAGE_SIZE)
+        .ok_or_else(|| anyhow::anyhow!("Huge page buffer of {len} bytes is too large"))?;
+    let raw = map_anonymous(padded, 0)?.as_ptr();
+    let head = raw.align_offset(HUGE_PAGE_SIZE);
+    let tail = HUGE_PAGE_SIZE.saturating_sub(head);
+    // SAFETY: `head` < HUGE_PAGE_SIZE, so both the aligned start and the unused tail
+    // lie inside the padded mapping; trimming leaves exactly [aligned, aligned + len).
+    let aligned = unsafe {
+        let aligned = raw.add(head);
+        if head > 0 {
+            let _ = libc::munmap(raw.cast(), head);
+        }
+        if tail > 0 {
+            let _ = libc::munmap(aligned.add(len).cast(), tail);
+        }
+        let _ = libc::madvise(aligned.cast(), len, libc::MADV_HUGEPAGE);
+        aligned
+    };
+    NonNull::new(aligned).ok_or_else(|| anyhow::anyhow!("mmap returned null"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_prefault_transparent() -> anyhow::Result<()> {
+        let pool = ThreadPool::new(4)?;
+        let buffer = HugeBuffer::alloc(HUGE_PAGE_SIZE * 5 + 1, HugePageBacking::Transparent)?;
+        assert_eq!(buffer.len(), HUGE_PAGE_SIZE * 6);
+        assert_eq!(buffer.as_mut_ptr().align_offset(HUGE_PAGE_SIZE), 0);
+        buffer.prefault(&pool)?;
+        // the buffer is still writable after pre-faulting
+        // SAFETY: the last byte lies inside the mapping.
+        unsafe { buffer.as_mut_ptr().add(buffer.len() - 1).write(1) };
+        Ok(())
+    }
+
+    #[test]
+    fn test_hugetlb_rejects_partial_page() {
+        assert!(map_hugetlb(HUGE_PAGE_SIZE + 1).is_err());
+    }
+
+    #[test]
+    fn test_alloc_hugetlb_2m_pages() {
+        // the 2M pool may be empty here; a mapping that succeeds must be 2M aligned
+        if let Ok(buffer) = HugeBuffer::alloc(HUGE_PAGE_SIZE + 1, HugePageBacking::HugeTlb) {
+            assert_eq!(buffer.len(), HUGE_PAGE_SIZE * 2);
+            assert_eq!(buffer.as_mut_ptr().align_offset(HUGE_PAGE_SIZE), 0);
+        }
+    }
+
+    #[test]
+    fn test_alloc_rejects_empty() {
+        assert!(HugeBuffer::alloc(0, HugePageBacking::Transparent).is_err());
+    }
+}
@@ -0,0 +1,831 @@
+//! Bulk copy, fill, compare and checksum kernels for mapped regions
+//!
+//! Writing a large buffer into remote memory through the cache first reads
+//! every destination line across the bus and later evicts it back; on a
+//! non-cacheable mapping every plain store is a separate bus transaction.
+//! Non-temporal stores avoid both: they go to memory directly in full lines
+//! through the write-combining buffers. `copy` and `fill` pick them by
+//! `StoreHint`, `mismatch` and `checksum` read with the widest vectors the CPU
+//! has. The instruction set is detected once at runtime: AVX-512 or AVX2 on
+//! `x86_64`, NEON on aarch64, portable code elsewhere. The `par_` variants
+//! split very large transfers over a `ThreadPool`.
+
+use std::sync::OnceLock;
+
+use threadpool::ThreadPool;
+
+/// Transfers from this size on use non-temporal stores on cacheable memory
+pub const STREAMING_THRESHOLD: usize = 8 << 20_u32;
+
+/// Smallest share of a transfer given to one worker by the `par_` kernels
+pub const PARALLEL_CHUNK: usize = 4 << 20_u32;
+
+/// Alignment and granule of the vector loops
+const VECTOR_BLOCK: usize = 64;
+
+/// Bytes per checksum stripe, eight little-endian 32-bit lanes
+const STRIPE: usize = 32;
+
+/// Lanes of a checksum stripe
+const LANES: usize = STRIPE / 4;
+
+/// Multiplier of the checksum finalizer
+const CHECKSUM_PRIME: u64 = 0x9e37_79b9_7f4a_7c15;
+
+/// Vector instruction set used by the kernels
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum Isa {
+    /// No vector extension, plain Rust
+    Portable,
+    /// `x86_64` AVX2, 256 bit
+    Avx2,
+    /// `x86_64` AVX-512F/BW, 512 bit
+    Avx512,
+    /// aarch64 Advanced SIMD, 128 bit
+    Neon,
+}
+
+/// Instruction set of this CPU, detected on first use
+/// # Returns
+/// The widest supported `Isa`
+#[inline]
+#[must_use]
+pub fn isa() -> Isa {
+    static ISA: OnceLock<Isa> = OnceLock::new();
+    *ISA.get_or_init(detect)
+}
+
+/// Detect the widest supported instruction set
+#[cfg(target_arch = "x86_64")]
+fn detect() -> Isa {
+    if is_x86_feature_detected!("avx512f") && is_x86_feature_detected!("avx512bw") {
+        Isa::Avx512
+    } else if is_x86_feature_detected!("avx2") {
+        Isa::Avx2
+    } else {
+        Isa::Portable
+    }
+}
+
+/// Detect the widest supported instruction set
+#[cfg(target_arch = "aarch64")]
+fn detect() -> Isa {
+    if std::arch::is_aarch64_feature_detected!("neon") { Isa::Neon } else { Isa::Portable }
+}
+
+/// Detect the widest supported instruction set
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+const fn detect() -> Isa {
+    Isa::Portable
+}
+
+/// How `copy` and `fill` write the destination
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum StoreHint {
+    /// Through the cache, for data read back soon
+    Temporal,
+    /// Around the cache in full lines
+    NonTemporal,
+}
+
+impl StoreHint {
+    /// Hint for a `len` byte transfer into memory mapped `cacheable` or not
+    ///
+    /// Non-cacheable mappings always stream; cacheable ones from
+    /// `STREAMING_THRESHOLD` on, where the data would evict itself anyway.
+    #[inline]
+    #[must_use]
+    pub const fn for_region(cacheable: bool, len: usize) -> Self {
+        if !cacheable || len >= STREAMING_THRESHOLD { StoreHint::NonTemporal } else { StoreHint::Temporal }
+    }
+}
+
+/// Copy `src` into `dst`
+/// # Arguments
+/// * `dst` - Destination, as long as `src`
+/// * `src` - Source
+/// * `hint` - How to write `dst`
+/// # Returns
+/// # Errors
+/// Ok(()) on success, `anyhow::Error` if the lengths differ
+#[inline]
+pub fn copy(dst: &mut [u8], src: &[u8], hint: StoreHint) -> anyhow::Result<()> {
+    same_len(dst.len(), src.len())?;
+    if hint == StoreHint::Temporal || dst.len() < VECTOR_BLOCK {
+        dst.copy_from_slice(src);
+        return Ok(());
+    }
+    arch::stream_copy(dst, src);
+    Ok(())
+}
+
+/// Set every byte of `dst` to `value`
+/// # Arguments
+/// * `dst` - Destination
+/// * `value` - Byte to write
+/// * `hint` - How to write `dst`
+#[inline]
+pub fn fill(dst: &mut [u8], value: u8, hint: StoreHint) {
+    if hint == StoreHint::Temporal || dst.len() < VECTOR_BLOCK {
+        dst.fill(value);
+        return;
+    }
+    arch::stream_fill(dst, value);
+}
+
+/// Offset of the first byte where `a` and `b` differ
+/// # Returns
+/// `None` if they are equal, the length of the shorter one if it is a prefix of the other
+#[inline]
+#[must_use]
+pub fn mismatch(a: &[u8], b: &[u8]) -> Option<usize> {
+    let len = a.len().min(b.len());
+    let (x, y) = (a.get(..len).unwrap_or_default(), b.get(..len).unwrap_or_default());
+    let body = whole(len, VECTOR_BLOCK);
+    let (a_body, b_body) = (x.get(..body).unwrap_or_default(), y.get(..body).unwrap_or_default());
+    // the vector loops report the block holding the first difference, the scan pins it down
+    let from = arch::mismatch_block(a_body, b_body).unwrap_or(body);
+    let pos = x.iter().zip(y).skip(from).position(|(x, y)| x != y).map(|pos| pos.saturating_add(from));
+    pos.or_else(|| (a.len() != b.len()).then_some(len))
+}
+
+/// Checksum of `data`
+///
+/// Eight 32-bit little-endian lanes each keep a Fletcher pair over 64-bit
+/// sums; the last stripe is zero padded and the pairs are folded with the
+/// length. The definition does not depend on the vector width, so every host
+/// computes the same value and `par_checksum` can combine chunks.
+#[inline]
+#[must_use]
+pub fn checksum(data: &[u8]) -> u64 {
+    let mut sums = LaneSums::default();
+    sums.update(data);
+    sums.finish(data.len())
+}
+
+/// `copy` split over the workers of `pool` for transfers of at least two `PARALLEL_CHUNK`s
+/// # Returns
+/// # Errors
+/// Ok(()) on success, `anyhow::Error` if the lengths differ or a job could not run
+#[inline]
+pub fn par_copy(pool: &ThreadPool, dst: &mut [u8], src: &[u8], hint: StoreHint) -> anyhow::Result<()> {
+    same_len(dst.len(), src.len())?;
+    let Some(chunk) = chunk_len(pool, dst.len()) else {
+        return copy(dst, src, hint);
+    };
+    pool.scope(|scope| -> anyhow::Result<()> {
+        for (to, from) in dst.chunks_mut(chunk).zip(src.chunks(chunk)) {
+            // lengths are equal, so is every pair of chunks
+            scope.spawn(move || copy(to, from, hint).unwrap_or_default())?;
+        }
+        Ok(())
+    })?
+}
+
+/// `fill` split over the workers of `pool` for transfers of at least two `PARALLEL_CHUNK`s
+/// # Returns
+/// # Errors
+/// Ok(()) on success, `anyhow::Error` if a job could not run
+#[inline]
+pub fn par_fill(pool: &ThreadPool, dst: &mut [u8], value: u8, hint: StoreHint) -> anyhow::Result<()> {
+    let Some(chunk) = chunk_len(pool, dst.len()) else {
+        fill(dst, value, hint);
+        return Ok(());
+    };
+    pool.scope(|scope| -> anyhow::Result<()> {
+        for to in dst.chunks_mut(chunk) {
+            scope.spawn(move || fill(to, value, hint))?;
+        }
+        Ok(())
+    })?
+}
+
+/// `mismatch` split over the workers of `pool` for inputs of at least two `PARALLEL_CHUNK`s
+/// # Returns
+/// # Errors
+/// As `mismatch` on success, `anyhow::Error` if a job could not run
+#[inline]
+pub fn par_mismatch(pool: &ThreadPool, a: &[u8], b: &[u8]) -> anyhow::Result<Option<usize>> {
+    let len = a.len().min(b.len());
+    let Some(chunk) = chunk_len(pool, len) else {
+        return Ok(mismatch(a, b));
+    };
+    let (a_common, b_common) = (a.get(..len).unwrap_or_default(), b.get(..len).unwrap_or_default());
+    let mut found = vec![None; len.div_ceil(chunk)];
+    pool.scope(|scope| -> anyhow::Result<()> {
+        for (slot, (x, y)) in found.iter_mut().zip(a_common.chunks(chunk).zip(b_common.chunks(chunk))) {
+            scope.spawn(move || *slot = mismatch(x, y))?;
+        }
+        Ok(())
+    })??;
+    let first = found
+        .iter()
+        .enumerate()
+        .find_map(|(index, pos)| pos.map(|pos| index.saturating_mul(chunk).saturating_add(pos)));
+    Ok(first.or_else(|| (a.len() != b.len()).then_some(len)))
+}
+
+/// `checksum` split over the workers of `pool` for inputs of at least two `PARALLEL_CHUNK`s
+/// # Returns
+/// # Errors
+/// Same value as `checksum` on success, `anyhow::Error` if a job could not run
+#[inline]
+pub fn par_checksum(pool: &ThreadPool, data: &[u8]) -> anyhow::Result<u64> {
+    let Some(chunk) = chunk_len(pool, data.len()) else {
+        return Ok(checksum(data));
+    };
+    let mut partial = vec![LaneSums::default(); data.len().div_ceil(chunk)];
+    pool.scope(|scope| -> anyhow::Result<()> {
+        for (sums, part) in partial.iter_mut().zip(data.chunks(chunk)) {
+            scope.spawn(move || sums.update(part))?;
+        }
+        Ok(())
+    })??;
+    let sums = partial.into_iter().reduce(LaneSums::then).unwrap_or_default();
+    Ok(sums.finish(data.len()))
+}
+
+/// `len` rounded down to whole `block`s
+const fn whole(len: usize, block: usize) -> usize {
+    match len.checked_rem(block) {
+        Some(rest) => len.saturating_sub(rest),
+        None => 0,
+    }
+}
+
+/// Fail unless the two lengths match
+fn same_len(dst: usize, src: usize) -> anyhow::Result<()> {
+    if dst != src {
+        anyhow::bail!("Destination holds {dst} bytes, source {src}");
+    }
+    Ok(())
+}
+
+/// Per worker share of a `len` byte transfer, `None` if it is not worth splitting
+fn chunk_len(pool: &ThreadPool, len: usize) -> Option<usize> {
+    if pool.size() < 2 || len < PARALLEL_CHUNK.saturating_mul(2) {
+        return None;
+    }
+    // whole vector blocks keep every chunk on stripe and line boundaries
+    let share = len.div_ceil(pool.size()).max(PARALLEL_CHUNK);
+    share.checked_next_multiple_of(VECTOR_BLOCK)
+}
+
+#[cfg(target_arch = "aarch64")]
+use arm as arch;
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+use portable as arch;
+#[cfg(target_arch = "x86_64")]
+use x86 as arch;
+
+/// Fletcher sums of the checksum lanes
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+struct LaneSums {
+    /// Sum of the words of each lane
+    a: [u64; LANES],
+    /// Sum of the running `a` of each lane
+    b: [u64; LANES],
+    /// Stripes summed
+    stripes: u64,
+}
+
+impl LaneSums {
+    /// Add `data`; a trailing partial stripe is zero padded, so only the last update may have one
+    fn update(&mut self, data: &[u8]) {
+        let body = whole(data.len(), STRIPE);
+        let (full, rest) = data.split_at(body);
+        arch::sum_stripes(self, full);
+        self.stripes = self.stripes.wrapping_add(u64::try_from(full.len() / STRIPE).unwrap_or(u64::MAX));
+        if !rest.is_empty() {
+            let mut padded = [0_u8; STRIPE];
+            padded.iter_mut().zip(rest).for_each(|(to, from)| *to = *from);
+            self.sum_portable(&padded);
+            self.stripes = self.stripes.wrapping_add(1);
+        }
+    }
+
+    /// Portable lane update over whole stripes, `stripes` is left to the caller
+    fn sum_portable(&mut self, data: &[u8]) {
+        for stripe in data.chunks_exact(STRIPE) {
+            for ((a, b), word) in self.a.iter_mut().zip(self.b.iter_mut()).zip(stripe.chunks_exact(4)) {
+                let word = word.try_into().map_or(0, u32::from_le_bytes);
+                *a = a.wrapping_add(u64::from(word));
+                *b = b.wrapping_add(*a);
+            }
+        }
+    }
+
+    /// Sums of `self` followed by `next`
+    fn then(self, next: LaneSums) -> LaneSums {
+        let mut sums = LaneSums { stripes: self.stripes.wrapping_add(next.stripes), ..next };
+        for ((a, b), first) in sums.a.iter_mut().zip(sums.b.iter_mut()).zip(self.a.iter().zip(self.b)) {
+            // every stripe of `next` added the `a` of `self` once more to `b`
+            *b = b.wrapping_add(first.1).wrapping_add(next.stripes.wrapping_mul(*first.0));
+            *a = a.wrapping_add(*first.0);
+        }
+        sums
+    }
+
+    /// Fold the lanes and the length into the checksum
+    fn finish(&self, len: usize) -> u64 {
+        let seed = CHECKSUM_PRIME ^ u64::try_from(len).unwrap_or(u64::MAX);
+        let hash = self.a.iter().zip(self.b).fold(seed, |hash, (a, b)| {
+            let hash = (hash ^ a).wrapping_mul(CHECKSUM_PRIME).rotate_left(31);
+            (hash ^ b).wrapping_mul(CHECKSUM_PRIME).rotate_left(31)
+        });
+        hash ^ (hash >> 29_u32)
+    }
+}
+
+/// `x86_64` kernels
+///
+/// Streaming stores need an aligned destination, so it is split with
+/// `align_to_mut` into vectors and byte head and tail; loads are unaligned.
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use std::arch::x86_64::{
+        __m256i, __m512i, _mm_sfence, _mm256_add_epi64, _mm256_castsi256_si128, _mm256_cmpeq_epi8,
+        _mm256_cvtepu32_epi64, _mm256_extracti128_si256, _mm256_movemask_epi8, _mm256_set1_epi8,
+        _mm256_stream_si256, _mm512_cmpneq_epi8_mask, _mm512_set1_epi8, _mm512_stream_si512,
+    };
+    use std::ptr::{from_mut, read_unaligned, write_unaligned};
+
+    use super::{Isa, LANES, LaneSums, STRIPE, VECTOR_BLOCK, isa};
+
+    /// Non-temporal copy of `src` into `dst` of the same length
+    pub(super) fn stream_copy(dst: &mut [u8], src: &[u8]) {
+        match isa() {
+            // SAFETY: `isa` reported AVX-512; `dst` is as long as `src`.
+            Isa::Avx512 => unsafe { copy_nt_avx512(dst, src) },
+            // SAFETY: `isa` reported AVX2; `dst` is as long as `src`.
+            Isa::Avx2 => unsafe { copy_nt_avx2(dst, src) },
+            Isa::Portable | Isa::Neon => dst.copy_from_slice(src),
+        }
+    }
+
+    /// Non-temporal fill of `dst`
+    pub(super) fn stream_fill(dst: &mut [u8], value: u8) {
+        match isa() {
+            // SAFETY: `isa` reported AVX-512.
+            Isa::Avx512 => unsafe { fill_nt_avx512(dst, value) },
+            // SAFETY: `isa` reported AVX2.
+            Isa::Avx2 => unsafe { fill_nt_avx2(dst, value) },
+            Isa::Portable | Isa::Neon => dst.fill(value),
+        }
+    }
+
+    /// First 64 byte block where `a` and `b` differ, both a multiple of 64 long
+    pub(super) fn mismatch_block(a: &[u8], b: &[u8]) -> Option<usize> {
+        match isa() {
+            // SAFETY: `isa` reported AVX-512; the slices have the same length.
+            Isa::Avx512 => unsafe { mismatch_avx512(a, b) },
+            // SAFETY: `isa` reported AVX2; the slices have the same length.
+            Isa::Avx2 => unsafe { mismatch_avx2(a, b) },
+            Isa::Portable | Isa::Neon => Some(0),
+        }
+    }
+
+    /// Lane update over whole stripes
+    pub(super) fn sum_stripes(sums: &mut LaneSums, data: &[u8]) {
+        match isa() {
+            // SAFETY: `isa` reported AVX2 or better; `data` is whole stripes.
+            Isa::Avx2 | Isa::Avx512 => unsafe { sum_avx2(sums, data) },
+            Isa::Portable | Isa::Neon => sums.sum_portable(data),
+        }
+    }
+
+    /// Copy with 256 bit streaming stores
+    ///
+    /// # Safety
+    /// The CPU supports AVX2 and `dst` is as long as `src`.
+    #[target_feature(enable = "avx2")]
+    unsafe fn copy_nt_avx2(dst: &mut [u8], src: &[u8]) {
+        // SAFETY: every bit pattern is a valid `__m256i`.
+        let (head, body, tail) = unsafe { dst.align_to_mut::<__m256i>() };
+        let (src_head, src_rest) = src.split_at(head.len());
+        let (src_body, src_tail) = src_rest.split_at(src_rest.len().saturating_sub(tail.len()));
+        head.copy_from_slice(src_head);
+        // SAFETY: the source chunks are read unaligned, the stores target aligned vectors.
+        unsafe {
+            for (to, from) in body.iter_mut().zip(src_body.chunks_exact(size_of::<__m256i>())) {
+                _mm256_stream_si256(from_mut(to), read_unaligned(from.as_ptr().cast::<__m256i>()));
+            }
+            _mm_sfence();
+        }
+        tail.copy_from_slice(src_tail);
+    }
+
+    /// Copy with 512 bit streaming stores
+    ///
+    /// # Safety
+    /// The CPU supports AVX-512F and `dst` is as long as `src`.
+    #[target_feature(enable = "avx512f")]
+    unsafe fn copy_nt_avx512(dst: &mut [u8], src: &[u8]) {
+        // SAFETY: every bit pattern is a valid `__m512i`.
+        let (head, body, tail) = unsafe { dst.align_to_mut::<__m512i>() };
+        let (src_head, src_rest) = src.split_at(head.len());
+        let (src_body, src_tail) = src_rest.split_at(src_rest.len().saturating_sub(tail.len()));
+        head.copy_from_slice(src_head);
+        // SAFETY: the source chunks are read unaligned, the stores target aligned vectors.
+        unsafe {
+            for (to, from) in body.iter_mut().zip(src_body.chunks_exact(size_of::<__m512i>())) {
+                _mm512_stream_si512(from_mut(to), read_unaligned(from.as_ptr().cast::<__m512i>()));
+            }
+            _mm_sfence();
+        }
+        tail.copy_from_slice(src_tail);
+    }
+
+    /// Fill with 256 bit streaming stores
+    ///
+    /// # Safety
+    /// The CPU supports AVX2.
+    #[target_feature(enable = "avx2")]
+    unsafe fn fill_nt_avx2(dst: &mut [u8], value: u8) {
+        // SAFETY: every bit pattern is a valid `__m256i`.
+        let (head, body, tail) = unsafe { dst.align_to_mut::<__m256i>() };
+        head.fill(value);
+        let block = _mm256_set1_epi8(i8::from_ne_bytes([value]));
+        // SAFETY: the stores target aligned vectors.
+        unsafe {
+            for to in body {
+                _mm256_stream_si256(from_mut(to), block);
+            }
+            _mm_sfence();
+        }
+        tail.fill(value);
+    }
+
+    /// Fill with 512 bit streaming stores
+    ///
+    /// # Safety
+    /// The CPU supports AVX-512F.
+    #[target_feature(enable = "avx512f")]
+    unsafe fn fill_nt_avx512(dst: &mut [u8], value: u8) {
+        // SAFETY: every bit pattern is a valid `__m512i`.
+        let (head, body, tail) = unsafe { dst.align_to_mut::<__m512i>() };
+        head.fill(value);
+        let block = _mm512_set1_epi8(i8::from_ne_bytes([value]));
+        // SAFETY: the stores target aligned vectors.
+        unsafe {
+            for to in body {
+                _mm512_stream_si512(from_mut(to), block);
+            }
+            _mm_sfence();
+        }
+        tail.fill(value);
+    }
+
+    /// Offset of the first 64 byte block where `a` and `b` differ
+    ///
+    /// # Safety
+    /// The CPU supports AVX2, both slices have the same length, a multiple of 64.
+    #[target_feature(enable = "avx2")]
+    unsafe fn mismatch_avx2(a: &[u8], b: &[u8]) -> Option<usize> {
+        let half = size_of::<__m256i>();
+        for (index, (x, y)) in a.chunks_exact(VECTOR_BLOCK).zip(b.chunks_exact(VECTOR_BLOCK)).enumerate() {
+            // SAFETY: each block holds two vectors, read unaligned.
+            let equal = unsafe {
+                let load = |block: &[u8], at: usize| read_unaligned(block.as_ptr().add(at).cast::<__m256i>());
+                let low = _mm256_cmpeq_epi8(load(x, 0), load(y, 0));
+                let high = _mm256_cmpeq_epi8(load(x, half), load(y, half));
+                _mm256_movemask_epi8(low) == -1 && _mm256_movemask_epi8(high) == -1
+            };
+            if !equal {
+                return Some(index.saturating_mul(VECTOR_BLOCK));
+            }
+        }
+        None
+    }
+
+    /// Offset of the first 64 byte block where `a` and `b` differ
+    ///
+    /// # Safety
+    /// The CPU supports AVX-512BW, both slices have the same length, a multiple of 64.
+    #[target_feature(enable = "avx512f,avx512bw")]
+    unsafe fn mismatch_avx512(a: &[u8], b: &[u8]) -> Option<usize> {
+        for (index, (x, y)) in a.chunks_exact(VECTOR_BLOCK).zip(b.chunks_exact(VECTOR_BLOCK)).enumerate() {
+            // SAFETY: each block is one vector, read unaligned.
+            let differ = unsafe {
+                _mm512_cmpneq_epi8_mask(
+                    read_unaligned(x.as_ptr().cast::<__m512i>()),
+                    read_unaligned(y.as_ptr().cast::<__m512i>()),
+                )
+            };
+            if differ != 0 {
+                return Some(index.saturating_mul(VECTOR_BLOCK));
+            }
+        }
+        None
+    }
+
+    /// Lane update over whole stripes, four 64-bit sums per half stripe
+    ///
+    /// # Safety
+    /// The CPU supports AVX2 and `data` is whole stripes.
+    #[target_feature(enable = "avx2")]
+    unsafe fn sum_avx2(sums: &mut LaneSums, data: &[u8]) {
+        const HALF: usize = LANES / 2;
+        let (a, b) = (sums.a.as_mut_ptr(), sums.b.as_mut_ptr());
+        // SAFETY: the sums are [u64; 8], read and written as two unaligned halves;
+        // every stripe is one vector, read unaligned.
+        unsafe {
+            let mut a_low = read_unaligned(a.cast::<__m256i>());
+            let mut a_high = read_unaligned(a.add(HALF).cast::<__m256i>());
+            let mut b_low = read_unaligned(b.cast::<__m256i>());
+            let mut b_high = read_unaligned(b.add(HALF).cast::<__m256i>());
+            for stripe in data.chunks_exact(STRIPE) {
+                let words = read_unaligned(stripe.as_ptr().cast::<__m256i>());
+                a_low = _mm256_add_epi64(a_low, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(words)));
+                a_high = _mm256_add_epi64(a_high, _mm256_cvtepu32_epi64(_mm256_extracti128_si256::<1>(words)));
+                b_low = _mm256_add_epi64(b_low, a_low);
+                b_high = _mm256_add_epi64(b_high, a_high);
+            }
+            write_unaligned(a.cast::<__m256i>(), a_low);
+            write_unaligned(a.add(HALF).cast::<__m256i>(), a_high);
+            write_unaligned(b.cast::<__m256i>(), b_low);
+            write_unaligned(b.add(HALF).cast::<__m256i>(), b_high);
+        }
+    }
+}
+
+/// aarch64 kernels
+///
+/// Advanced SIMD has no non-temporal store intrinsic, the copy and fill loops
+/// issue `stnp` pairs directly. SVE intrinsics are not available in stable Rust.
+#[cfg(target_arch = "aarch64")]
+mod arm {
+    use std::arch::aarch64::{
+        vaddq_u64, vaddw_high_u32, vaddw_u32, vceqq_u8, vdupq_n_u8, vget_low_u32, vld1q_u8, vld1q_u64, vminvq_u8,
+        vreinterpretq_u32_u8, vst1q_u64,
+    };
+    use std::arch::asm;
+
+    use super::{Isa, LaneSums, STRIPE, VECTOR_BLOCK, isa, whole};
+
+    /// Non-temporal copy of `src` into `dst` of the same length
+    pub(super) fn stream_copy(dst: &mut [u8], src: &[u8]) {
+        match isa() {
+            Isa::Neon => {
+                let head = dst.as_ptr().align_offset(VECTOR_BLOCK).min(dst.len());
+                let (dst_head, dst_rest) = dst.split_at_mut(head);
+                let (src_head, src_rest) = src.split_at(head);
+                let body = whole(dst_rest.len(), VECTOR_BLOCK);
+                let (dst_body, dst_tail) = dst_rest.split_at_mut(body);
+                let (src_body, src_tail) = src_rest.split_at(body);
+                dst_head.copy_from_slice(src_head);
+                // SAFETY: `isa` reported NEON; both bodies are the same whole blocks.
+                unsafe { copy_nt_neon(dst_body, src_body) };
+                dst_tail.copy_from_slice(src_tail);
+            }
+            Isa::Portable | Isa::Avx2 | Isa::Avx512 => dst.copy_from_slice(src),
+        }
+    }
+
+    /// Non-temporal fill of `dst`
+    pub(super) fn stream_fill(dst: &mut [u8], value: u8) {
+        match isa() {
+            Isa::Neon => {
+                let head = dst.as_ptr().align_offset(VECTOR_BLOCK).min(dst.len());
+                let (dst_head, dst_rest) = dst.split_at_mut(head);
+                let body = whole(dst_rest.len(), VECTOR_BLOCK);
+                let (dst_body, dst_tail) = dst_rest.split_at_mut(body);
+                dst_head.fill(value);
+                // SAFETY: `isa` reported NEON; the body is whole blocks.
+                unsafe { fill_nt_neon(dst_body, value) };
+                dst_tail.fill(value);
+            }
+            Isa::Portable | Isa::Avx2 | Isa::Avx512 => dst.fill(value),
+        }
+    }
+
+    /// First 64 byte block where `a` and `b` differ, both a multiple of 64 long
+    pub(super) fn mismatch_block(a: &[u8], b: &[u8]) -> Option<usize> {
+        match isa() {
+            // SAFETY: `isa` reported NEON; the slices have the same length.
+            Isa::Neon => unsafe { mismatch_neon(a, b) },
+            Isa::Portable | Isa::Avx2 | Isa::Avx512 => Some(0),
+        }
+    }
+
+    /// Lane update over whole stripes
+    pub(super) fn sum_stripes(sums: &mut LaneSums, data: &[u8]) {
+        match isa() {
+            // SAFETY: `isa` reported NEON; `data` is whole stripes.
+            Isa::Neon => unsafe { sum_neon(sums, data) },
+            Isa::Portable | Isa::Avx2 | Isa::Avx512 => sums.sum_portable(data),
+        }
+    }
+
+    /// Copy with non-temporal store pairs
+    ///
+    /// # Safety
+    /// The CPU supports NEON, `dst` is as long as `src`, a multiple of 64.
+    #[target_feature(enable = "neon")]
+    unsafe fn copy_nt_neon(dst: &mut [u8], src: &[u8]) {
+        let (to, from) = (dst.as_mut_ptr(), src.as_ptr());
+        for off in (0..dst.len()).step_by(VECTOR_BLOCK) {
+            // SAFETY: the block lies inside both slices.
+            unsafe {
+                asm!(
+                    "ldp {a:q}, {b:q}, [{from}]",
+                    "ldp {c:q}, {d:q}, [{from}, #32]",
+                    "stnp {a:q}, {b:q}, [{to}]",
+                    "stnp {c:q}, {d:q}, [{to}, #32]",
+                    from = in(reg) from.add(off),
+                    to = in(reg) to.add(off),
+                    a = out(vreg) _,
+                    b = out(vreg) _,
+                    c = out(vreg) _,
+                    d = out(vreg) _,
+                    options(nostack, preserves_flags),
+                );
+            }
+        }
+    }
+
+    /// Fill with non-temporal store pairs
+    ///
+    /// # Safety
+    /// The CPU supports NEON, `dst` is a multiple of 64 long.
+    #[target_feature(enable = "neon")]
+    unsafe fn fill_nt_neon(dst: &mut [u8], value: u8) {
+        let to = dst.as_mut_ptr();
+        // SAFETY: every block lies inside `dst`.
+        unsafe {
+            let block = vdupq_n_u8(value);
+            for off in (0..dst.len()).step_by(VECTOR_BLOCK) {
+                asm!(
+                    "stnp {v:q}, {v:q}, [{to}]",
+                    "stnp {v:q}, {v:q}, [{to}, #32]",
+                    to = in(reg) to.add(off),
+                    v = in(vreg) block,
+                    options(nostack, preserves_flags),
+                );
+            }
+        }
+    }
+
+    /// Offset of the first 64 byte block where `a` and `b` differ
+    ///
+    /// # Safety
+    /// The CPU supports NEON, both slices have the same length, a multiple of 64.
+    #[target_feature(enable = "neon")]
+    unsafe fn mismatch_neon(a: &[u8], b: &[u8]) -> Option<usize> {
+        let (x, y) = (a.as_ptr(), b.as_ptr());
+        // SAFETY: every block lies inside both slices.
+        unsafe {
+            for off in (0..a.len()).step_by(VECTOR_BLOCK) {
+                for part in (0..VECTOR_BLOCK).step_by(16) {
+                    let at = off.saturating_add(part);
+                    if vminvq_u8(vceqq_u8(vld1q_u8(x.add(at)), vld1q_u8(y.add(at)))) != u8::MAX {
+                        return Some(off);
+                    }
+                }
+            }
+        }
+        None
+    }
+
+    /// Lane update over whole stripes, two 64-bit sums per quarter stripe
+    ///
+    /// # Safety
+    /// The CPU supports NEON, `data` is whole stripes.
+    #[target_feature(enable = "neon")]
+    unsafe fn sum_neon(sums: &mut LaneSums, data: &[u8]) {
+        let ptr = data.as_ptr();
+        // SAFETY: every stripe lies inside `data`; the sums are [u64; 8], read and
+        // written as four pairs.
+        unsafe {
+            let (a, b) = (sums.a.as_mut_ptr(), sums.b.as_mut_ptr());
+            let mut a01 = vld1q_u64(a);
+            let mut a23 = vld1q_u64(a.add(2));
+            let mut a45 = vld1q_u64(a.add(4));
+            let mut a67 = vld1q_u64(a.add(6));
+            let mut b01 = vld1q_u64(b);
+            let mut b23 = vld1q_u64(b.add(2));
+            let mut b45 = vld1q_u64(b.add(4));
+            let mut b67 = vld1q_u64(b.add(6));
+            for off in (0..data.len()).step_by(STRIPE) {
+                let low = vreinterpretq_u32_u8(vld1q_u8(ptr.add(off)));
+                let high = vreinterpretq_u32_u8(vld1q_u8(ptr.add(off).add(16)));
+                a01 = vaddw_u32(a01, vget_low_u32(low));
+                a23 = vaddw_high_u32(a23, low);
+                a45 = vaddw_u32(a45, vget_low_u32(high));
+                a67 = vaddw_high_u32(a67, high);
+                b01 = vaddq_u64(b01, a01);
+                b23 = vaddq_u64(b23, a23);
+                b45 = vaddq_u64(b45, a45);
+                b67 = vaddq_u64(b67, a67);
+            }
+            vst1q_u64(a, a01);
+            vst1q_u64(a.add(2), a23);
+            vst1q_u64(a.add(4), a45);
+            vst1q_u64(a.add(6), a67);
+            vst1q_u64(b, b01);
+            vst1q_u64(b.add(2), b23);
+            vst1q_u64(b.add(4), b45);
+            vst1q_u64(b.add(6), b67);
+        }
+    }
+}
+
+/// Kernels of targets without a vector implementation
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+mod portable {
+    use super::LaneSums;
+
+    /// Copy into `dst`
+    pub(super) fn stream_copy(dst: &mut [u8], src: &[u8]) {
+        dst.copy_from_slice(src);
+    }
+
+    /// Fill `dst`
+    pub(super) fn stream_fill(dst: &mut [u8], value: u8) {
+        dst.fill(value);
+    }
+
+    /// Scan from the start
+    pub(super) const fn mismatch_block(_: &[u8], _: &[u8]) -> Option<usize> {
+        Some(0)
+    }
+
+    /// Lane update over whole stripes
+    pub(super) fn sum_stripes(sums: &mut LaneSums, data: &[u8]) {
+        sums.sum_portable(data);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pattern(len: usize) -> Vec<u8> {
+        (0..len).map(|i| u8::try_from(i.wrapping_mul(31) % 251).unwrap_or(0)).collect()
+    }
+
+    #[test]
+    fn test_kernels_copy_fill() -> anyhow::Result<()> {
+        let src = pattern(4096 + 77);
+        for hint in [StoreHint::Temporal, StoreHint::NonTemporal] {
+            for offset in [0, 1, 13, 64] {
+                let mut dst = vec![0_u8; src.len() + offset];
+                let window = dst.get_mut(offset..).unwrap_or_default();
+                copy(window, &src, hint)?;
+                assert_eq!(window, src.as_slice());
+                fill(window, 0xa5, hint);
+                assert!(window.iter().all(|&byte| byte == 0xa5));
+            }
+        }
+        assert!(copy(&mut [0; 3], &[0; 4], StoreHint::Temporal).is_err());
+        assert_eq!(StoreHint::for_region(false, 64), StoreHint::NonTemporal);
+        assert_eq!(StoreHint::for_region(true, 64), StoreHint::Temporal);
+        Ok(())
+    }
+
+    #[test]
+    fn test_kernels_mismatch_checksum() {
+        let a = pattern(1000);
+        let mut b = a.clone();
+        assert_eq!(mismatch(&a, &b), None);
+        let flip = |bytes: &mut Vec<u8>, pos: usize| bytes.get_mut(pos).map(|byte| *byte ^= 1);
+        for pos in [0, 63, 64, 500, 999] {
+            let _ = flip(&mut b, pos);
+            assert_eq!(mismatch(&a, &b), Some(pos));
+            let _ = flip(&mut b, pos);
+        }
+        let (head, rest) = a.split_at(992);
+        assert_eq!(mismatch(&a, head), Some(992));
+
+        // the dispatched kernel agrees with the portable definition
+        let mut portable = LaneSums::default();
+        portable.sum_portable(head);
+        let mut padded = [0_u8; STRIPE];
+        padded.iter_mut().zip(rest).for_each(|(to, from)| *to = *from);
+        portable.sum_portable(&padded);
+        portable.stripes = 32;
+        assert_eq!(checksum(&a), portable.finish(1000));
+        assert_ne!(checksum(&a), checksum(head));
+        let _ = flip(&mut b, 3);
+        assert_ne!(checksum(&a), checksum(&b));
+    }
+
+    #[test]
+    fn test_kernels_parallel() -> anyhow::Result<()> {
+        let pool = ThreadPool::new(4)?;
+        let src = pattern(PARALLEL_CHUNK * 3 + 1234);
+        let mut dst = vec![0_u8; src.len()];
+        par_copy(&pool, &mut dst, &src, StoreHint::NonTemporal)?;
+        assert_eq!(dst, src);
+        assert_eq!(par_checksum(&pool, &dst)?, checksum(&src));
+        if let Some(byte) = dst.get_mut(PARALLEL_CHUNK * 2 + 5) {
+            *byte ^= 1;
+        }
+        assert_eq!(par_mismatch(&pool, &src, &dst)?, Some(PARALLEL_CHUNK * 2 + 5));
+        par_fill(&pool, &mut dst, 7, StoreHint::NonTemporal)?;
+        assert!(dst.iter().all(|&byte| byte == 7));
+        Ok(())
+    }
+}
@@ -0,0 +1,435 @@
+//! Importing regions on first use
+//!
+//! A tenant may list hundreds of remote regions and touch only a few of them.
+//! `LazyImports` reserves an inaccessible, aligned address range for every
+//! region it is given and only imports and maps the region into that range the
+//! first time `ensure_mapped` asks for it. The returned `Mapped` guard pins the
+//! region. Once the attached bytes would exceed the budget, unpinned regions
+//! are evicted least recently used first: unmapped, unimported, and their range
+//! made inaccessible again, so a stale pointer faults instead of reading
+//! whatever would be mapped there next. A region comes back at the same address.
+
+use std::marker::PhantomData;
+use std::ops::Deref;
+use std::ptr::NonNull;
+use std::sync::{Arc, Mutex, MutexGuard, PoisonError};
+
+use anyhow::Context;
+
+use crate::mapping::{self, MapOptions, RegionMap};
+use crate::teardown::{self, Outcome, TeardownRegion};
+use crate::{MemId, ObmmImportFlags, ObmmMemDesc, UbPrivData, mem_import_on};
+
+/// How `LazyImports` attaches regions
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct LazyConfig {
+    /// Most bytes attached at once
+    budget: usize,
+    /// Flags of every import
+    flags: ObmmImportFlags,
+    /// Alignment, populate and protection of every mapping
+    options: MapOptions,
+}
+
+impl Default for LazyConfig {
+    #[inline]
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl LazyConfig {
+    /// No budget, `ALLOWMMAP` imports, default read-only mappings
+    #[inline]
+    #[must_use]
+    pub const fn new() -> Self {
+        LazyConfig { budget: usize::MAX, flags: ObmmImportFlags::ALLOWMMAP, options: MapOptions::new() }
+    }
+
+    /// Evict idle regions to keep at most `bytes` attached
+    #[inline]
+    #[must_use]
+    pub const fn budget(mut self, bytes: usize) -> Self {
+        self.budget = bytes;
+        self
+    }
+
+    /// Import with `flags`
+    #[inline]
+    #[must_use]
+    pub const fn flags(mut self, flags: ObmmImportFlags) -> Self {
+        self.flags = flags;
+        self
+    }
+
+    /// Map with `options`; cacheability follows each descriptor's `CACHEABLE` bit
+    #[inline]
+    #[must_use]
+    pub const fn options(mut self, options: MapOptions) -> Self {
+        self.options = options;
+        self
+    }
+}
+
+/// Handle of a region added to `LazyImports`
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+#[non_exhaustive]
+pub struct LazyId(usize);
+
+/// Counters of a `LazyImports`
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct LazyStats {
+    /// Regions added
+    pub regions: usize,
+    /// Regions imported and mapped right now
+    pub attached: usize,
+    /// Bytes imported and mapped right now
+    pub attached_bytes: usize,
+    /// Imports taken so far
+    pub imports: u64,
+    /// Regions evicted so far
+    pub evictions: u64,
+    /// Evictions whose unimport failed, leaving the import behind
+    pub failed_unimports: u64,
+}
+
+/// Where a region stands
+#[derive(Debug)]
+enum SlotState {
+    /// Not imported; the reserved range, `None` if it was lost and has to be reserved again
+    Detached(Option<NonNull<u8>>),
+    /// Imported and mapped; the map is shared with the `Mapped` guards
+    Attached {
+        /// Memory ID of the import
+        mem_id: MemId,
+        /// NUMA node the region was imported on
+        numa: i32,
+        /// Mapping over the reserved range
+        map: Arc<RegionMap>,
+    },
+}
+
+/// One region added to `LazyImports`
+#[derive(Debug)]
+struct Slot {
+    /// Descriptor imported on first use
+    desc: ObmmMemDesc<UbPrivData>,
+    /// NUMA node to import onto, -1 to let the kernel choose
+    numa: i32,
+    /// Length of the reservation and the mapping
+    len: usize,
+    /// Import state
+    state: SlotState,
+    /// Clock value of the last `ensure_mapped`
+    last_use: u64,
+}
+
+// SAFETY: the reserved range is only touched under the owner's lock.
+unsafe impl Send for Slot {}
+
+impl Slot {
+    /// Whether the region is attached and no `Mapped` guard pins it
+    fn is_idle(&self) -> bool {
+        matches!(self.state, SlotState::Attached { ref map, .. } if Arc::strong_count(map) == 1)
+    }
+
+    /// Bytes attached for this region
+    fn attached_bytes(&self) -> usize {
+        match self.state {
+            SlotState::Attached { .. } => self.len,
+            SlotState::Detached(_) => 0,
+        }
+    }
+}
+
+/// Everything behind the lock of `LazyImports`
+#[derive(Debug, Default)]
+struct State {
+    /// Regions by `LazyId`
+    slots: Vec<Slot>,
+    /// Bumped by every `ensure_mapped`
+    clock: u64,
+    /// Imports taken so far
+    imports: u64,
+    /// Regions evicted so far
+    evictions: u64,
+    /// Evictions whose unimport failed
+    failed_unimports: u64,
+}
+
+impl State {
+    /// Bytes attached over all regions
+    fn attached_bytes(&self) -> usize {
+        self.slots.iter().map(Slot::attached_bytes).fold(0, usize::saturating_add)
+    }
+
+    /// Unmap and unimport the idle region at `index`
+    /// # Returns
+    /// Whether the region was detached
+    fn detach(&mut self, index: usize, align: usize) -> bool {
+        let Some(slot) = self.slots.get_mut(index) else {
+            return false;
+        };
+        if !slot.is_idle() {
+            return false;
+        }
+        let SlotState::Attached { mem_id, numa, map } =
+            std::mem::replace(&mut slot.state, SlotState::Detached(None))
+        else {
+            return false;
+        };
+        // idle means this is the only reference left
+        let window = Arc::try_unwrap(map)
+            .ok()
+            .and_then(|map| map.into_reservation().ok())
+            .or_else(|| mapping::reserve_aligned(slot.len, align).ok());
+        slot.state = SlotState::Detached(window);
+        self.evictions = self.evictions.saturating_add(1);
+        if let Outcome::Failed(_) =
+            teardown::release_inline(&TeardownRegion::imported(mem_id, usize::try_from(numa).ok()), false)
+        {
+            self.failed_unimports = self.failed_unimports.saturating_add(1);
+        }
+        true
+    }
+}
+
+/// Regions imported and mapped the first time they are used
+#[derive(Debug)]
+pub struct LazyImports {
+    /// How regions are attached
+    config: LazyConfig,
+    /// Regions and counters
+    state: Mutex<State>,
+}
+
+impl LazyImports {
+    /// No regions yet
+    #[inline]
+    #[must_use]
+    pub fn new(config: LazyConfig) -> Self {
+        LazyImports { config, state: Mutex::new(State::default()) }
+    }
+
+    /// Reserve address space for `desc` without importing it
+    /// # Arguments
+    /// * `desc` - Memory Descriptor from remote
+    /// * `numa` - NUMA node to import onto, -1 to let the kernel choose
+    /// # Returns
+    /// # Errors
+    /// `LazyId` on success, `anyhow::Error` if the length is not a non-zero
+    /// multiple of 4K or the range could not be reserved
+    #[inline]
+    pub fn add(&self, desc: &ObmmMemDesc<UbPrivData>, numa: i32) -> anyhow::Result<LazyId> {
+        let len = usize::try_from(desc.length)?;
+        if len == 0 || !len.is_multiple_of(mapping::PageSize::Base.bytes()) {
+            anyhow::bail!("Region at {:#x} has length {len}, not a non-zero multiple of 4K", desc.addr);
+        }
+        let window = mapping::reserve_aligned(len, self.align())?;
+        let mut state = self.lock();
+        state.slots.push(Slot { desc: desc.clone(), numa, len, state: SlotState::Detached(Some(window)), last_use: 0 });
+        Ok(LazyId(state.slots.len().saturating_sub(1)))
+    }
+
+    /// Import and map `id` if it is not attached yet, evicting idle regions over budget
+    /// # Returns
+    /// # Errors
+    /// Guard pinning the mapping on success, `anyhow::Error` if `id` is
+    /// unknown, pinned regions leave no room in the budget, or the import or
+    /// mapping fails
+    #[inline]
+    pub fn ensure_mapped(&self, id: LazyId) -> anyhow::Result<Mapped<'_>> {
+        let mut state = self.lock();
+        state.clock = state.clock.saturating_add(1);
+        let clock = state.clock;
+        let slot = state.slots.get_mut(id.0).with_context(|| format!("Unknown lazy region {}", id.0))?;
+        slot.last_use = clock;
+        if let SlotState::Attached { ref map, .. } = slot.state {
+            return Ok(Mapped { map: Arc::clone(map), owner: PhantomData });
+        }
+        let len = slot.len;
+        self.make_room(&mut state, len)?;
+        self.attach(&mut state, id.0)
+    }
+
+    /// Detach every region no guard pins
+    /// # Returns
+    /// Number of regions detached
+    #[inline]
+    #[must_use]
+    pub fn evict_idle(&self) -> usize {
+        let mut state = self.lock();
+        let align = self.align();
+        (0..state.slots.len()).filter(|&index| state.detach(index, align)).count()
+    }
+
+    /// Start of the range reserved for `id`, where it is mapped once attached
+    /// # Returns
+    /// The address, `None` if `id` is unknown or its range had to be given up
+    #[inline]
+    #[must_use]
+    pub fn address(&self, id: LazyId) -> Option<NonNull<u8>> {
+        let state = self.lock();
+        match state.slots.get(id.0)?.state {
+            SlotState::Detached(window) => window,
+            SlotState::Attached { ref map, .. } => NonNull::new(map.as_mut_ptr()),
+        }
+    }
+
+    /// Current counters
+    #[inline]
+    #[must_use]
+    pub fn stats(&self) -> LazyStats {
+        let state = self.lock();
+        LazyStats {
+            regions: state.slots.len(),
+            attached: state.slots.iter().filter(|slot| matches!(slot.state, SlotState::Attached { .. })).count(),
+            attached_bytes: state.attached_bytes(),
+            imports: state.imports,
+            evictions: state.evictions,
+            failed_unimports: state.failed_unimports,
+        }
+    }
+
+    /// Evict idle regions, least recently used first, until `len` more bytes fit the budget
+    fn make_room(&self, state: &mut State, len: usize) -> anyhow::Result<()> {
+        let align = self.align();
+        while state.attached_bytes().saturating_add(len) > self.config.budget {
+            let victim = state
+                .slots
+                .iter()
+                .enumerate()
+                .filter(|&(_, slot)| slot.is_idle())
+                .min_by_key(|&(_, slot)| slot.last_use)
+                .map(|(index, _)| index);
+            if !victim.is_some_and(|index| state.detach(index, align)) {
+                anyhow::bail!(
+                    "{} of {} budget bytes are pinned, no room for {len} more",
+                    state.attached_bytes(),
+                    self.config.budget
+                );
+            }
+        }
+        Ok(())
+    }
+
+    /// Import the detached region at `index` and map it over its reservation
+    fn attach(&self, state: &mut State, index: usize) -> anyhow::Result<Mapped<'_>> {
+        let align = self.align();
+        let slot = state.slots.get_mut(index).context("Lazy region vanished")?;
+        let window = match slot.state {
+            SlotState::Detached(Some(window)) => window,
+            SlotState::Detached(None) => mapping::reserve_aligned(slot.len, align)?,
+            SlotState::Attached { .. } => anyhow::bail!("Lazy region {index} is already attached"),
+        };
+        // keep the reservation recorded until the mapping replaces it
+        slot.state = SlotState::Detached(Some(window));
+        let (mem_id, numa) = mem_import_on(&slot.desc, self.config.flags, 0, slot.numa)
+            .map_err(|errno| anyhow::anyhow!("Failed to import region at {:#x}: errno {errno}", slot.desc.addr))?;
+        let options = self.config.options.cacheable(slot.desc.priv_data.contains(UbPrivData::CACHEABLE));
+        let map = match RegionMap::open_in(mem_id, window, slot.len, options) {
+            Ok(map) => Arc::new(map),
+            Err(err) => {
+                let _ = teardown::release_inline(&TeardownRegion::imported(mem_id, usize::try_from(numa).ok()), false);
+                return Err(err);
+            }
+        };
+        slot.state = SlotState::Attached { mem_id, numa, map: Arc::clone(&map) };
+        state.imports = state.imports.saturating_add(1);
+        Ok(Mapped { map, owner: PhantomData })
+    }
+
+    /// Alignment of every reservation
+    const fn align(&self) -> usize {
+        self.config.options.alignment()
+    }
+
+    /// Lock the state, a poisoned lock still holds consistent slots
+    fn lock(&self) -> MutexGuard<'_, State> {
+        self.state.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+}
+
+impl Drop for LazyImports {
+    #[inline]
+    fn drop(&mut self) {
+        let align = self.align();
+        let state = self.state.get_mut().unwrap_or_else(PoisonError::into_inner);
+        for index in 0..state.slots.len() {
+            let _ = state.detach(index, align);
+        }
+        for slot in &state.slots {
+            if let SlotState::Detached(Some(window)) = slot.state {
+                // SAFETY: every region is detached and no guard outlives `self`,
+                // so nothing points into the reservation any more.
+                unsafe { mapping::unreserve(window, slot.len) };
+            }
+        }
+    }
+}
+
+/// An attached region, pinned against eviction while the guard lives
+#[derive(Debug)]
+pub struct Mapped<'a> {
+    /// Mapping shared with the owning slot
+    map: Arc<RegionMap>,
+    /// Guards do not outlive the `LazyImports` that unimports on drop
+    owner: PhantomData<&'a LazyImports>,
+}
+
+impl Deref for Mapped<'_> {
+    type Target = RegionMap;
+
+    #[inline]
+    fn deref(&self) -> &RegionMap {
+        &self.map
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::mapping::PageSize;
+
+    fn desc_at(addr: u64) -> ObmmMemDesc<UbPrivData> {
+        ObmmMemDesc::<UbPrivData> { addr, length: 2 << 20_u32, ..Default::default() }
+    }
+
+    #[test]
+    fn test_lazy_attach_evict_reattach() -> anyhow::Result<()> {
+        let region = PageSize::Huge2M.bytes();
+        let lazy = LazyImports::new(
+            LazyConfig::new().budget(region.saturating_mul(2)).options(MapOptions::new().writable(true)),
+        );
+        let ids = [0_u64, 1, 2]
+            .into_iter()
+            .map(|n| lazy.add(&desc_at(n << 30_u32), -1))
+            .collect::<anyhow::Result<Vec<_>>>()?;
+        let &[first, second, third] = ids.as_slice() else { anyhow::bail!("expected three regions") };
+        let reserved = lazy.address(first).context("no reservation")?;
+        assert!(reserved.as_ptr().addr().is_multiple_of(region));
+        assert_eq!(lazy.stats().attached, 0);
+
+        {
+            let mapped = lazy.ensure_mapped(first)?;
+            assert_eq!(mapped.as_mut_ptr(), reserved.as_ptr());
+            // SAFETY: the mapping is writable and at least one word long.
+            unsafe { mapped.as_mut_ptr_of::<u64>()?.write_volatile(7) };
+        }
+        drop(lazy.ensure_mapped(second)?);
+        drop(lazy.ensure_mapped(third)?);
+        let stats = lazy.stats();
+        assert_eq!((stats.attached, stats.imports, stats.evictions), (2, 3, 1));
+        assert_eq!(lazy.address(first), Some(reserved));
+
+        let pinned = [lazy.ensure_mapped(second)?, lazy.ensure_mapped(third)?];
+        assert!(lazy.ensure_mapped(first).is_err());
+        drop(pinned);
+        assert_eq!(lazy.ensure_mapped(first)?.as_mut_ptr(), reserved.as_ptr());
+        assert_eq!(lazy.evict_idle(), 2);
+        assert_eq!(lazy.stats().attached_bytes, 0);
+        Ok(())
+    }
+}
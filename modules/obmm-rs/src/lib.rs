@@ -84,6 +84,26 @@ use std::ffi::c_void;
 use bitflags::bitflags;
 use serde::{Serialize, Deserialize};
 
+pub mod aio;
+pub mod arena;
+pub mod hugepage;
+pub mod kernels;
+pub mod lazy;
+pub mod lifecycle;
+pub mod mapping;
+pub mod migrate;
+pub mod ownership;
+pub mod placement;
+pub mod preimport;
+pub mod registry;
+pub mod resync;
+pub mod ring;
+pub mod stats;
+pub mod teardown;
+pub mod translate;
+pub mod watch;
+pub mod wire;
+
 /// Maximum number of NUMA nodes supported
 pub const MAX_NUMA_NODES: usize = 16;
 /// Invalid memory ID constant
@@ -95,7 +115,7 @@ pub type MemId = u64;
 
 bitflags! {
     /// Privilege data for UB memory regions
-    #[derive(Serialize, Deserialize, Default, Debug, PartialEq, Eq)]
+    #[derive(Serialize, Deserialize, Default, Debug, Clone, Copy, PartialEq, Eq)]
     #[serde(transparent)]
     pub struct UbPrivData: u16 {
         /// Owner Chip ID
@@ -107,7 +127,7 @@ bitflags! {
 
 bitflags! {
     /// Export flags for memory exporting
-    #[derive(Default, Debug)]
+    #[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
     pub struct ObmmExportFlags: u64 {
         /// Allow memory mapping
         const ALLOWMMAP = 1 << 0;
@@ -116,9 +136,22 @@ bitflags! {
     }
 }
 
+bitflags! {
+    /// Import flags for memory importing
+    #[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
+    pub struct ObmmImportFlags: u64 {
+        /// Allow memory mapping
+        const ALLOWMMAP = 1 << 0;
+        /// Import as a remote NUMA node
+        const NUMAREMOTE = 1 << 1;
+        /// Import into a range declared by `mem_preimport`
+        const PREIMPORT = 1 << 2;
+    }
+}
+
 bitflags! {
     /// Unexport flags for memory unexporting
-    #[derive(Default, Debug)]
+    #[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
     pub struct ObmmUnexportFlags: u64 {
         /// Force unexport
         const FORCE = 1 << 0;
@@ -127,7 +160,7 @@ bitflags! {
 
 /// Memory descriptor structure
 #[repr(C)]
-#[derive(Default, Debug, Serialize, Deserialize)]
+#[derive(Default, Debug, Clone, Serialize, Deserialize)]
 #[non_exhaustive]
 pub struct ObmmMemDesc<T> {
     /// Base address of the memory region
@@ -150,6 +183,32 @@ pub struct ObmmMemDesc<T> {
     pub priv_data: T,
 }
 
+/// Preimport range descriptor
+#[repr(C)]
+#[derive(Default, Debug, Clone)]
+#[non_exhaustive]
+pub struct ObmmPreimportInfo<T> {
+    /// Base physical address of the range
+    pub pa: u64,
+    /// Length of the range
+    pub length: u64,
+    /// Base distance of the remote NUMA node
+    pub base_dist: i32,
+    /// NUMA node of the range, -1 to let the kernel choose
+    pub numa_id: i32,
+    /// 128bit eid, ordered by little-endian
+    pub seid: [u8; 16],
+    /// 128bit deid, ordered by little-endian
+    pub deid: [u8; 16],
+    /// Source CNA
+    pub scna: u32,
+    /// Destination CNA
+    pub dcna: u32,
+    /// Length of privilege data
+    pub priv_len: u16,
+    /// Privilege data
+    pub priv_data: T,
+}
 
 impl<T> ObmmMemDesc<T>  
     where
@@ -185,6 +244,8 @@ impl<T> ObmmMemDesc<T>
     }
 
     /// Read the `ObmmMemDesc` from a json file
+    ///
+    /// One file per descriptor; use [`registry::DescRegistry`] for host-wide lookups.
     /// # Arguments
     /// * `mem_id` - Memory ID
     /// # Returns
@@ -199,6 +260,8 @@ impl<T> ObmmMemDesc<T>
     }
 
     /// Write the `ObmmMemDesc` to a json file
+    ///
+    /// One file per descriptor; use [`registry::DescRegistry`] for host-wide lookups.
     /// # Arguments
     /// * `mem_id` - Memory ID
     /// # Returns
@@ -213,6 +276,30 @@ impl<T> ObmmMemDesc<T>
     }
 }
 
+impl<T: Clone> ObmmPreimportInfo<T> {
+    /// Preimport range covering exactly the region `desc` describes
+    /// # Arguments
+    /// * `desc` - Memory Descriptor from remote
+    /// * `numa_id` - NUMA node of the range, -1 to let the kernel choose
+    /// * `base_dist` - Base distance of the remote NUMA node
+    #[inline]
+    #[must_use]
+    pub fn covering(desc: &ObmmMemDesc<T>, numa_id: i32, base_dist: i32) -> Self {
+        ObmmPreimportInfo {
+            pa: desc.addr,
+            length: desc.length,
+            base_dist,
+            numa_id,
+            seid: desc.seid,
+            deid: desc.deid,
+            scna: desc.scna,
+            dcna: desc.dcna,
+            priv_len: desc.priv_len,
+            priv_data: desc.priv_data.clone(),
+        }
+    }
+}
+
 /// Export memory region
 /// # Arguments
 /// * `length` - Array of lengths for each NUMA node
@@ -258,12 +345,72 @@ pub fn mem_export<T: Default>(length: &[usize], flags: ObmmExportFlags) -> anyho
     }
 }
 
+/// Export a VA range of a process
+///
+/// The range must be backed by 2M pages, see [`hugepage::HugeBuffer`].
+/// # Arguments
+/// * `pid` - Process owning the range, 0 for the calling process
+/// * `va` - Start of the range in the address space of `pid`
+/// * `length` - Length of the range
+/// * `flags` - Export flags
+/// # Returns
+/// # Errors
+/// Tuple of Memory ID and Memory Descriptor on success, `anyhow::Error` on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn mem_export_useraddr<T: Default>(
+    _: i32,
+    _: usize,
+    length: usize,
+    _: ObmmExportFlags,
+) -> anyhow::Result<(MemId, ObmmMemDesc<T>)> {
+    // hooked implementation
+    let desc = ObmmMemDesc::<T> { addr: 0xffff_fc00_0000, length: length.try_into()?, ..Default::default() };
+    Ok((1, desc))
+}
+
+/// Export a VA range of a process
+///
+/// The range must be backed by 2M pages, see [`hugepage::HugeBuffer`].
+/// # Arguments
+/// * `pid` - Process owning the range, 0 for the calling process
+/// * `va` - Start of the range in the address space of `pid`
+/// * `length` - Length of the range
+/// * `flags` - Export flags
+/// # Returns
+/// # Errors
+/// Tuple of Memory ID and Memory Descriptor on success, `anyhow::Error` on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn mem_export_useraddr<T: Default>(
+    pid: i32,
+    va: usize,
+    length: usize,
+    flags: ObmmExportFlags,
+) -> anyhow::Result<(MemId, ObmmMemDesc<T>)> {
+    let mut desc = ObmmMemDesc::<T>::default();
+    let memid = unsafe {
+        obmm_export_useraddr(
+            pid,
+            core::ptr::without_provenance_mut(va),
+            length,
+            flags.bits(),
+            core::ptr::from_mut(&mut desc).cast::<c_void>(),
+        )
+    };
+    if memid == OBMM_INVALID_MEMID {
+        Err(anyhow::Error::new(std::io::Error::last_os_error()).context("Failed to export user address range"))
+    } else {
+        Ok((memid, desc))
+    }
+}
+
 /// Unexport memory region
 /// # Arguments
 /// * `memid` - Memory ID to unexport
 /// * `flags` - Unexport flags
 /// # Returns
-/// Ok(()) on success, Err(i32) on failure
+/// Ok(()) on success, errno on failure
 /// # Errors
 #[cfg(feature = "hook")]
 #[inline]
@@ -277,14 +424,14 @@ pub fn mem_unexport(_: MemId, _: ObmmUnexportFlags) -> Result<(), i32> {
 /// * `memid` - Memory ID to unexport
 /// * `flags` - Unexport flags
 /// # Returns
-/// Ok(()) on success, Err(i32) on failure
+/// Ok(()) on success, errno on failure
 #[cfg(not(feature = "hook"))]
 pub fn mem_unexport(memid: MemId, flags: ObmmUnexportFlags) -> Result<(), i32> {
     let ret = unsafe { obmm_unexport(memid, flags.bits()) };
     if ret == 0 {
         Ok(())
     } else {
-        Err(ret)
+        Err(last_errno())
     }
 }
 
@@ -295,7 +442,7 @@ pub fn mem_unexport(memid: MemId, flags: ObmmUnexportFlags) -> Result<(), i32> {
 /// * `base_dist` - Base distribution hint
 /// # Returns
 /// # Errors
-/// Tuple of Memory ID and NUMA node on success, Err(i32) on failure
+/// Tuple of Memory ID and NUMA node on success, errno on failure
 #[cfg(feature = "hook")]
 #[inline]
 pub fn mem_import(
@@ -319,7 +466,7 @@ pub fn mem_import(
 /// * `flags` - Import flags
 /// * `base_dist` - Base distribution hint
 /// # Returns
-/// Tuple of Memory ID and NUMA node on success, Err(i32) on failure
+/// Tuple of Memory ID and NUMA node on success, errno on failure
 #[cfg(not(feature = "hook"))]
 pub fn mem_import(
     desc: &ObmmMemDesc<UbPrivData>,
@@ -336,7 +483,7 @@ pub fn mem_import(
         )
     };
     if memid == OBMM_INVALID_MEMID {
-        Err(-1)
+        Err(last_errno())
     } else {
         Ok((memid, numa))
     }
@@ -348,130 +495,1132 @@ pub fn mem_import(
 /// * `memid` - Memory ID to unimport
 /// * `flags` - Unimport flags
 /// # Returns
-/// Ok(()) on success, Err(i32) on failure
+/// Ok(()) on success, errno on failure
 #[cfg(not(feature = "hook"))]
 pub fn mem_unimport(memid: MemId, flags: ObmmExportFlags) -> Result<(), i32> {
     let ret = unsafe { obmm_unimport(memid, flags.bits()) };
     if ret == 0 {
         Ok(())
     } else {
-        Err(ret)
+        Err(last_errno())
     }
 }
 
-// FFI bindings to OBMM C library
-unsafe extern "C" {
-    /// Export memory regions for remote access
-    ///
-    /// # Arguments
-    /// * `length` - Array of lengths for each NUMA node
-    /// * `flags` - Export flags
-    /// * `desc` - Output memory descriptor
-    ///
-    /// # Returns
-    /// Memory ID on success, `OBMM_INVALID_MEMID` on failure
-    pub fn obmm_export(
-        length: *const usize,
-        flags: u64,
-        desc: *mut c_void,
-    ) -> MemId;
-
-    /// Unexport previously exported memory region
-    ///
-    /// # Arguments
-    /// * `id` - Memory ID to unexport
-    /// * `flags` - Unexport flags
-    ///
-    /// # Returns
-    /// 0 on success, -1 on failure
-    pub fn obmm_unexport(id: MemId, flags: u64) -> i32;
+/// Unimport memory region
+/// # Arguments
+/// * `memid` - Memory ID to unimport
+/// * `flags` - Unimport flags
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn mem_unimport(_: MemId, _: ObmmExportFlags) -> Result<(), i32> {
+    // hooked implementation
+    Ok(())
+}
 
-    /// Import remote memory region
-    ///
-    /// # Arguments
-    /// * `desc` - Memory descriptor from remote
-    /// * `flags` - Import flags
-    /// * `base_dist` - Base distribution hint
-    /// * `numa` - Output NUMA node ID
-    ///
-    /// # Returns
-    /// Memory ID on success, `OBMM_INVALID_MEMID` on failure
-    pub fn obmm_import(
-        desc: *const c_void,
-        flags: u64,
-        base_dist: i32,
-        numa: *mut i32,
-    ) -> MemId;
+/// Import memory region onto a given NUMA node
+/// # Arguments
+/// * `desc` - Memory Descriptor from remote
+/// * `flags` - Import flags
+/// * `base_dist` - Base distribution hint
+/// * `numa` - NUMA node to import onto, -1 to let the kernel choose
+/// # Returns
+/// # Errors
+/// Tuple of Memory ID and NUMA node on success, Err(i32) on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn mem_import_on(
+    _: &ObmmMemDesc<UbPrivData>,
+    _: ObmmImportFlags,
+    _: i32,
+    numa: i32,
+) -> Result<(MemId, i32), i32> {
+    // hooked implementation
+    Ok((1, numa.max(0)))
+}
 
-    /// Unimport previously imported memory region
-    ///
-    /// # Arguments
-    /// * `id` - Memory ID to unimport
-    /// * `flags` - Unimport flags
-    ///
-    /// # Returns
-    /// 0 on success, -1 on failure
-    pub fn obmm_unimport(id: MemId, flags: u64) -> i32;
+/// Import memory region onto a given NUMA node
+/// # Arguments
+/// * `desc` - Memory Descriptor from remote
+/// * `flags` - Import flags
+/// * `base_dist` - Base distribution hint
+/// * `numa` - NUMA node to import onto, -1 to let the kernel choose
+/// # Returns
+/// # Errors
+/// Tuple of Memory ID and NUMA node on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn mem_import_on(
+    desc: &ObmmMemDesc<UbPrivData>,
+    flags: ObmmImportFlags,
+    base_dist: i32,
+    numa: i32,
+) -> Result<(MemId, i32), i32> {
+    let mut node = numa;
+    let memid = unsafe {
+        obmm_import(
+            core::ptr::from_ref(desc).cast::<c_void>(),
+            flags.bits(),
+            base_dist,
+            &raw mut node,
+        )
+    };
+    if memid == OBMM_INVALID_MEMID {
+        Err(last_errno())
+    } else {
+        Ok((memid, node))
+    }
+}
 
-    /* debug interface */
-    
-    /// Query memory ID by physical address
-    ///
-    /// # Arguments
-    /// * `pa` - Physical address
-    /// * `id` - Output memory ID
-    /// * `offset` - Output offset within memory region
-    ///
-    /// # Returns
-    /// 0 on success, -1 on failure
-    pub fn obmm_query_memid_by_pa(
-        pa: u64,
-        id: *mut MemId,
-        offset: *mut u64,
-    ) -> i32;
+/// Declare a preimport range
+///
+/// On success `info.numa_id` holds the NUMA node the range was onlined on.
+/// # Arguments
+/// * `info` - Range to declare
+/// * `flags` - Preimport flags
+/// # Returns
+/// # Errors
+/// Ok(()) on success, Err(i32) on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn mem_preimport(info: &mut ObmmPreimportInfo<UbPrivData>, _: ObmmImportFlags) -> Result<(), i32> {
+    // hooked implementation
+    info.numa_id = info.numa_id.max(0);
+    Ok(())
+}
 
-    /// Query physical address by memory ID and offset
-    ///
-    /// # Arguments
-    /// * `id` - Memory ID
-    /// * `offset` - Offset within memory region
-    /// * `pa` - Output physical address
-    ///
-    /// # Returns
-    /// 0 on success, -1 on failure
-    pub fn obmm_query_pa_by_memid(
-        id: MemId,
-        offset: u64,
-        pa: *mut u64,
-    ) -> i32;
+/// Declare a preimport range
+///
+/// On success `info.numa_id` holds the NUMA node the range was onlined on.
+/// # Arguments
+/// * `info` - Range to declare
+/// * `flags` - Preimport flags
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn mem_preimport(info: &mut ObmmPreimportInfo<UbPrivData>, flags: ObmmImportFlags) -> Result<(), i32> {
+    let ret = unsafe { obmm_preimport(core::ptr::from_mut(info).cast::<c_void>(), flags.bits()) };
+    if ret == 0 {
+        Ok(())
+    } else {
+        Err(last_errno())
+    }
 }
 
-#[cfg(test)]
-mod tests {
-    use super::*;
+/// Undeclare a preimport range
+/// # Arguments
+/// * `info` - Range previously declared by `mem_preimport`
+/// * `flags` - Preimport flags
+/// # Returns
+/// # Errors
+/// Ok(()) on success, Err(i32) on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn mem_unpreimport(_: &ObmmPreimportInfo<UbPrivData>, _: ObmmImportFlags) -> Result<(), i32> {
+    // hooked implementation
+    Ok(())
+}
 
-    #[test]
-    fn test_export() -> anyhow::Result<()> {
-        let mut lengths = vec![0; MAX_NUMA_NODES];
-        if let Some(v) = lengths.get_mut(0) {
-            *v = 1024 * 1024 * 64; // 64MB on NUMA node 0
-        }
-        let flags = ObmmExportFlags::ALLOWMMAP;
-        match mem_export::<UbPrivData>(&lengths, flags) {
-            Ok((memid, desc)) => {
-                println!("Exported MemID: {memid}");
-                println!("Memory Descriptor: {desc:?}");
-                assert!(memid != OBMM_INVALID_MEMID);
-                assert!(desc.length == 1024 * 1024 * 128);
-                Ok(())
-            }
-            Err(code) => {
-                Err(anyhow::anyhow!("mem_export failed with code {code}"))
-            }
-        }
+/// Undeclare a preimport range
+/// # Arguments
+/// * `info` - Range previously declared by `mem_preimport`
+/// * `flags` - Preimport flags
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn mem_unpreimport(info: &ObmmPreimportInfo<UbPrivData>, flags: ObmmImportFlags) -> Result<(), i32> {
+    let ret = unsafe { obmm_unpreimport(core::ptr::from_ref(info).cast::<c_void>(), flags.bits()) };
+    if ret == 0 {
+        Ok(())
+    } else {
+        Err(last_errno())
     }
+}
 
-    #[test]
+/// Export a batch of memory regions in one call
+/// # Arguments
+/// * `lengths` - Per-NUMA-node lengths of every region
+/// * `flags` - Export flags, shared by all regions
+/// # Returns
+/// One entry per region: Memory ID and Memory Descriptor on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+#[must_use]
+pub fn mem_export_batch<T: Default>(
+    lengths: &[[usize; OBMM_MAX_LOCAL_NUMA_NODES]],
+    flags: ObmmExportFlags,
+) -> Vec<Result<(MemId, ObmmMemDesc<T>), i32>> {
+    // hooked implementation
+    lengths
+        .iter()
+        .map(|length| mem_export::<T>(length, flags).or(Err(-1)))
+        .collect()
+}
+
+/// Export a batch of memory regions in one call
+/// # Arguments
+/// * `lengths` - Per-NUMA-node lengths of every region
+/// * `flags` - Export flags, shared by all regions
+/// # Returns
+/// One entry per region: Memory ID and Memory Descriptor on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+#[must_use]
+pub fn mem_export_batch<T: Default>(
+    lengths: &[[usize; OBMM_MAX_LOCAL_NUMA_NODES]],
+    flags: ObmmExportFlags,
+) -> Vec<Result<(MemId, ObmmMemDesc<T>), i32>> {
+    let mut descs: Vec<ObmmMemDesc<T>> = lengths.iter().map(|_| ObmmMemDesc::<T>::default()).collect();
+    let desc_ptrs: Vec<*mut c_void> = descs
+        .iter_mut()
+        .map(|desc| core::ptr::from_mut(desc).cast::<c_void>())
+        .collect();
+    let mut ids = vec![OBMM_INVALID_MEMID; lengths.len()];
+    let mut errs = vec![0_i32; lengths.len()];
+    let ret = unsafe {
+        obmm_export_batch(
+            lengths.as_ptr(),
+            lengths.len(),
+            flags.bits(),
+            desc_ptrs.as_ptr(),
+            ids.as_mut_ptr(),
+            errs.as_mut_ptr(),
+        )
+    };
+    if ret < 0 {
+        let errno = last_errno();
+        return lengths.iter().map(|_| Err(errno)).collect();
+    }
+    descs
+        .into_iter()
+        .zip(ids.into_iter().zip(errs))
+        .map(|(desc, (memid, err))| if err == 0 { Ok((memid, desc)) } else { Err(err) })
+        .collect()
+}
+
+/// Import a batch of memory regions in one call
+/// # Arguments
+/// * `descs` - Memory Descriptors from remote
+/// * `flags` - Import flags, shared by all regions
+/// * `base_dist` - Base distribution hint, shared by all regions
+/// # Returns
+/// One entry per region: Memory ID and NUMA node on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+#[must_use]
+pub fn mem_import_batch(
+    descs: &[ObmmMemDesc<UbPrivData>],
+    flags: ObmmExportFlags,
+    base_dist: i32,
+) -> Vec<Result<(MemId, i32), i32>> {
+    // hooked implementation
+    descs
+        .iter()
+        .map(|desc| mem_import(desc, flags, base_dist))
+        .collect()
+}
+
+/// Import a batch of memory regions in one call
+/// # Arguments
+/// * `descs` - Memory Descriptors from remote
+/// * `flags` - Import flags, shared by all regions
+/// * `base_dist` - Base distribution hint, shared by all regions
+/// # Returns
+/// One entry per region: Memory ID and NUMA node on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+#[must_use]
+pub fn mem_import_batch(
+    descs: &[ObmmMemDesc<UbPrivData>],
+    flags: ObmmExportFlags,
+    base_dist: i32,
+) -> Vec<Result<(MemId, i32), i32>> {
+    let desc_ptrs: Vec<*const c_void> = descs
+        .iter()
+        .map(|desc| core::ptr::from_ref(desc).cast::<c_void>())
+        .collect();
+    let mut numa = vec![-1_i32; descs.len()];
+    let mut ids = vec![OBMM_INVALID_MEMID; descs.len()];
+    let mut errs = vec![0_i32; descs.len()];
+    let ret = unsafe {
+        obmm_import_batch(
+            desc_ptrs.as_ptr(),
+            descs.len(),
+            flags.bits(),
+            base_dist,
+            numa.as_mut_ptr(),
+            ids.as_mut_ptr(),
+            errs.as_mut_ptr(),
+        )
+    };
+    if ret < 0 {
+        let errno = last_errno();
+        return descs.iter().map(|_| Err(errno)).collect();
+    }
+    ids.into_iter()
+        .zip(numa.into_iter().zip(errs))
+        .map(|(memid, (node, err))| if err == 0 { Ok((memid, node)) } else { Err(err) })
+        .collect()
+}
+
+/// errno of the last failed libobmm call, -1 if it did not set one
+#[cfg(not(feature = "hook"))]
+fn last_errno() -> i32 {
+    std::io::Error::last_os_error().raw_os_error().unwrap_or(-1)
+}
+
+/// Physical address the hooked translations map offset 0 of every region to
+#[cfg(feature = "hook")]
+const HOOK_PA_BASE: u64 = 0x2000_0000_0000;
+
+/// Translate an offset inside a memory region to a physical address
+/// # Arguments
+/// * `memid` - Memory ID
+/// * `offset` - Offset within the region
+/// # Returns
+/// # Errors
+/// Physical address on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn query_pa_by_memid(memid: MemId, offset: u64) -> Result<u64, i32> {
+    // hooked implementation
+    if memid == OBMM_INVALID_MEMID {
+        return Err(libc::ENOENT);
+    }
+    HOOK_PA_BASE.checked_add(offset).ok_or(libc::EINVAL)
+}
+
+/// Translate an offset inside a memory region to a physical address
+/// # Arguments
+/// * `memid` - Memory ID
+/// * `offset` - Offset within the region
+/// # Returns
+/// # Errors
+/// Physical address on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn query_pa_by_memid(memid: MemId, offset: u64) -> Result<u64, i32> {
+    let mut pa = 0_u64;
+    if unsafe { obmm_query_pa_by_memid(memid, offset, &raw mut pa) } == 0 {
+        Ok(pa)
+    } else {
+        Err(last_errno())
+    }
+}
+
+/// Translate a physical address to the memory region containing it
+/// # Arguments
+/// * `pa` - Physical address
+/// # Returns
+/// # Errors
+/// Tuple of Memory ID and offset within the region on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn query_memid_by_pa(pa: u64) -> Result<(MemId, u64), i32> {
+    // hooked implementation
+    pa.checked_sub(HOOK_PA_BASE).map(|offset| (1, offset)).ok_or(libc::ENOENT)
+}
+
+/// Translate a physical address to the memory region containing it
+/// # Arguments
+/// * `pa` - Physical address
+/// # Returns
+/// # Errors
+/// Tuple of Memory ID and offset within the region on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn query_memid_by_pa(pa: u64) -> Result<(MemId, u64), i32> {
+    let mut memid = OBMM_INVALID_MEMID;
+    let mut offset = 0_u64;
+    if unsafe { obmm_query_memid_by_pa(pa, &raw mut memid, &raw mut offset) } == 0 {
+        Ok((memid, offset))
+    } else {
+        Err(last_errno())
+    }
+}
+
+/// Translate many offsets inside one memory region in a single call
+/// # Arguments
+/// * `memid` - Memory ID
+/// * `offsets` - Offsets within the region
+/// # Returns
+/// One entry per offset: physical address on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+#[must_use]
+pub fn query_pa_by_memid_bulk(memid: MemId, offsets: &[u64]) -> Vec<Result<u64, i32>> {
+    // hooked implementation
+    offsets.iter().map(|&offset| query_pa_by_memid(memid, offset)).collect()
+}
+
+/// Translate many offsets inside one memory region in a single call
+/// # Arguments
+/// * `memid` - Memory ID
+/// * `offsets` - Offsets within the region
+/// # Returns
+/// One entry per offset: physical address on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+#[must_use]
+pub fn query_pa_by_memid_bulk(memid: MemId, offsets: &[u64]) -> Vec<Result<u64, i32>> {
+    let mut pa = vec![0_u64; offsets.len()];
+    let mut errs = vec![0_i32; offsets.len()];
+    let ret = unsafe {
+        obmm_query_pa_by_memid_bulk(memid, offsets.as_ptr(), offsets.len(), pa.as_mut_ptr(), errs.as_mut_ptr())
+    };
+    if ret < 0 {
+        let errno = last_errno();
+        return offsets.iter().map(|_| Err(errno)).collect();
+    }
+    pa.into_iter()
+        .zip(errs)
+        .map(|(addr, err)| if err == 0 { Ok(addr) } else { Err(err) })
+        .collect()
+}
+
+/// Translate many physical addresses in a single call
+/// # Arguments
+/// * `pa` - Physical addresses
+/// # Returns
+/// One entry per address: Memory ID and offset within the region on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+#[must_use]
+pub fn query_memid_by_pa_bulk(pa: &[u64]) -> Vec<Result<(MemId, u64), i32>> {
+    // hooked implementation
+    pa.iter().map(|&addr| query_memid_by_pa(addr)).collect()
+}
+
+/// Translate many physical addresses in a single call
+/// # Arguments
+/// * `pa` - Physical addresses
+/// # Returns
+/// One entry per address: Memory ID and offset within the region on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+#[must_use]
+pub fn query_memid_by_pa_bulk(pa: &[u64]) -> Vec<Result<(MemId, u64), i32>> {
+    let mut ids = vec![OBMM_INVALID_MEMID; pa.len()];
+    let mut offsets = vec![0_u64; pa.len()];
+    let mut errs = vec![0_i32; pa.len()];
+    let ret = unsafe {
+        obmm_query_memid_by_pa_bulk(pa.as_ptr(), pa.len(), ids.as_mut_ptr(), offsets.as_mut_ptr(), errs.as_mut_ptr())
+    };
+    if ret < 0 {
+        let errno = last_errno();
+        return pa.iter().map(|_| Err(errno)).collect();
+    }
+    ids.into_iter()
+        .zip(offsets.into_iter().zip(errs))
+        .map(|(memid, (offset, err))| if err == 0 { Ok((memid, offset)) } else { Err(err) })
+        .collect()
+}
+
+/// Cache maintenance done by an ownership change
+#[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum CacheOp {
+    /// Leave the cache alone
+    None,
+    /// Invalidate without writeback, dirty lines are discarded
+    Invalidate,
+    /// Write back dirty lines, then invalidate
+    WritebackInvalidate,
+    /// Write back dirty lines and keep them cached
+    WritebackOnly,
+    /// Let the driver pick from the old and new ownership
+    #[default]
+    Infer,
+}
+
+impl CacheOp {
+    /// `OBMM_SHM_CACHE_*` value of the operation
+    ///
+    /// libobmm asserts at build time that the kernel header uses the same values.
+    #[inline]
+    #[must_use]
+    pub const fn bits(self) -> i32 {
+        match self {
+            CacheOp::None => 0,
+            CacheOp::Invalidate => 1,
+            CacheOp::WritebackInvalidate => 2,
+            CacheOp::WritebackOnly => 3,
+            CacheOp::Infer => 4,
+        }
+    }
+}
+
+/// One range of an ownership batch
+#[repr(C)]
+#[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct ObmmOwnershipRange {
+    /// Start virtual address of the range
+    pub start: usize,
+    /// End virtual address of the range, exclusive
+    pub end: usize,
+    /// Ownership as protection bits: `PROT_NONE`, `PROT_READ` or `PROT_WRITE`
+    pub prot: i32,
+    /// `OBMM_SHM_CACHE_*` operation, see `CacheOp::bits`
+    pub cache_ops: i32,
+}
+
+impl ObmmOwnershipRange {
+    /// Range `[start, end)` to be given ownership `prot`, cache maintenance inferred by the driver
+    #[inline]
+    #[must_use]
+    pub const fn new(start: usize, end: usize, prot: i32) -> Self {
+        ObmmOwnershipRange { start, end, prot, cache_ops: CacheOp::Infer.bits() }
+    }
+
+    /// The same range with cache maintenance `op`
+    #[inline]
+    #[must_use]
+    pub const fn with_cache_op(self, op: CacheOp) -> Self {
+        ObmmOwnershipRange { cache_ops: op.bits(), ..self }
+    }
+}
+
+/// Set the ownership of a range of an OBMM memory device mapping
+/// # Arguments
+/// * `fd` - File descriptor of the OBMM memory device
+/// * `start` - Start virtual address
+/// * `end` - End virtual address, exclusive
+/// * `prot` - Ownership as protection bits, `PROT_WRITE` implies `PROT_READ`
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn mem_set_ownership(_: i32, start: usize, end: usize, _: i32) -> Result<(), i32> {
+    // hooked implementation
+    if start < end { Ok(()) } else { Err(libc::EINVAL) }
+}
+
+/// Set the ownership of a range of an OBMM memory device mapping
+/// # Arguments
+/// * `fd` - File descriptor of the OBMM memory device
+/// * `start` - Start virtual address
+/// * `end` - End virtual address, exclusive
+/// * `prot` - Ownership as protection bits, `PROT_WRITE` implies `PROT_READ`
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn mem_set_ownership(fd: i32, start: usize, end: usize, prot: i32) -> Result<(), i32> {
+    let ret = unsafe {
+        obmm_set_ownership(
+            fd,
+            core::ptr::without_provenance_mut(start),
+            core::ptr::without_provenance_mut(end),
+            prot,
+        )
+    };
+    if ret == 0 { Ok(()) } else { Err(last_errno()) }
+}
+
+/// Set the ownership of a range with explicit cache maintenance
+/// # Arguments
+/// * `fd` - File descriptor of the OBMM memory device
+/// * `start` - Start virtual address
+/// * `end` - End virtual address, exclusive
+/// * `prot` - Ownership as protection bits, `PROT_WRITE` implies `PROT_READ`
+/// * `op` - Cache maintenance to do instead of the inferred one
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn mem_set_ownership_ex(fd: i32, start: usize, end: usize, prot: i32, _: CacheOp) -> Result<(), i32> {
+    // hooked implementation
+    mem_set_ownership(fd, start, end, prot)
+}
+
+/// Set the ownership of a range with explicit cache maintenance
+/// # Arguments
+/// * `fd` - File descriptor of the OBMM memory device
+/// * `start` - Start virtual address
+/// * `end` - End virtual address, exclusive
+/// * `prot` - Ownership as protection bits, `PROT_WRITE` implies `PROT_READ`
+/// * `op` - Cache maintenance to do instead of the inferred one
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn mem_set_ownership_ex(fd: i32, start: usize, end: usize, prot: i32, op: CacheOp) -> Result<(), i32> {
+    let ret = unsafe {
+        obmm_set_ownership_ex(
+            fd,
+            core::ptr::without_provenance_mut(start),
+            core::ptr::without_provenance_mut(end),
+            prot,
+            op.bits(),
+        )
+    };
+    if ret == 0 { Ok(()) } else { Err(last_errno()) }
+}
+
+/// Set the ownership of many ranges of an OBMM memory device mapping in one call
+/// # Arguments
+/// * `fd` - File descriptor of the OBMM memory device
+/// * `ranges` - Ranges to update, in order
+/// # Returns
+/// One entry per range: Ok(()) on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+#[must_use]
+pub fn mem_set_ownership_batch(fd: i32, ranges: &[ObmmOwnershipRange]) -> Vec<Result<(), i32>> {
+    // hooked implementation
+    ranges
+        .iter()
+        .map(|range| mem_set_ownership(fd, range.start, range.end, range.prot))
+        .collect()
+}
+
+/// Set the ownership of many ranges of an OBMM memory device mapping in one call
+/// # Arguments
+/// * `fd` - File descriptor of the OBMM memory device
+/// * `ranges` - Ranges to update, in order
+/// # Returns
+/// One entry per range: Ok(()) on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+#[must_use]
+pub fn mem_set_ownership_batch(fd: i32, ranges: &[ObmmOwnershipRange]) -> Vec<Result<(), i32>> {
+    let mut errs = vec![0_i32; ranges.len()];
+    let ret = unsafe { obmm_set_ownership_batch(fd, ranges.as_ptr(), ranges.len(), errs.as_mut_ptr()) };
+    if ret < 0 {
+        let errno = last_errno();
+        return ranges.iter().map(|_| Err(errno)).collect();
+    }
+    errs.into_iter().map(|err| if err == 0 { Ok(()) } else { Err(err) }).collect()
+}
+
+/// Open `/dev/obmm` now instead of lazily on the first call
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn init() -> Result<(), i32> {
+    // hooked implementation
+    Ok(())
+}
+
+/// Open `/dev/obmm` now instead of lazily on the first call
+/// # Returns
+/// # Errors
+/// Ok(()) on success, errno on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn init() -> Result<(), i32> {
+    if unsafe { obmm_init() } == 0 {
+        Ok(())
+    } else {
+        Err(last_errno())
+    }
+}
+
+/// Close `/dev/obmm` and drop cached topology
+///
+/// Must not race with any other call of this crate; later calls reopen the device.
+#[cfg(feature = "hook")]
+#[inline]
+pub fn fini() {
+    // hooked implementation
+}
+
+/// Close `/dev/obmm` and drop cached topology
+///
+/// Must not race with any other call of this crate; later calls reopen the device.
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn fini() {
+    unsafe { obmm_fini() };
+}
+
+/// Rescan the UB bus controller topology
+///
+/// libobmm caches the controller table on first use; call this after a
+/// controller has been added or reconfigured.
+/// # Returns
+/// # Errors
+/// Number of controllers found on success, Err(i32) on failure
+#[cfg(feature = "hook")]
+#[inline]
+pub fn refresh_topology() -> Result<usize, i32> {
+    // hooked implementation
+    Ok(1)
+}
+
+/// Rescan the UB bus controller topology
+///
+/// libobmm caches the controller table on first use; call this after a
+/// controller has been added or reconfigured.
+/// # Returns
+/// # Errors
+/// Number of controllers found on success, Err(i32) on failure
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn refresh_topology() -> Result<usize, i32> {
+    let ret = unsafe { obmm_refresh_topology() };
+    usize::try_from(ret).or(Err(ret))
+}
+
+/// Drop the cached UB bus controller topology, the next call rescans lazily
+#[cfg(feature = "hook")]
+#[inline]
+pub fn invalidate_topology() {
+    // hooked implementation
+}
+
+/// Drop the cached UB bus controller topology, the next call rescans lazily
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn invalidate_topology() {
+    unsafe { obmm_invalidate_topology() };
+}
+
+/// Cached attributes of one UB bus controller, -1 where unknown
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct ObmmControllerInfo {
+    /// 128bit eid, ordered by little-endian, zero if the controller is absent
+    pub eid: [u8; 16],
+    /// NUMA node of the controller
+    pub numa_id: i32,
+    /// Primary CNA, the `scna` of every descriptor exported through the controller
+    pub primary_cna: i32,
+    /// UMMU mapping mode
+    pub ummu_mapping: i32,
+}
+
+impl Default for ObmmControllerInfo {
+    #[inline]
+    fn default() -> Self {
+        ObmmControllerInfo { eid: [0; 16], numa_id: -1, primary_cna: -1, ummu_mapping: -1 }
+    }
+}
+
+impl ObmmControllerInfo {
+    /// Whether the entry describes a controller
+    #[inline]
+    #[must_use]
+    pub fn is_present(&self) -> bool {
+        self.eid != [0; 16]
+    }
+}
+
+/// What `refresh_controller` did to the cached entry of a controller
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum ControllerChange {
+    /// Nothing changed
+    Unchanged,
+    /// The controller appeared
+    Added,
+    /// Some attribute changed
+    Changed,
+    /// The controller disappeared
+    Removed,
+}
+
+/// Rescan one UB bus controller and update its cached entry
+/// # Arguments
+/// * `index` - N of `/sys/devices/ub_bus_controller<N>`
+/// # Returns
+/// # Errors
+/// The change with the entry before and after on success, Err(i32) if `index` is out of range
+#[cfg(feature = "hook")]
+#[inline]
+pub const fn refresh_controller(_: u32) -> Result<(ControllerChange, ObmmControllerInfo, ObmmControllerInfo), i32> {
+    // hooked implementation
+    let absent = ObmmControllerInfo { eid: [0; 16], numa_id: -1, primary_cna: -1, ummu_mapping: -1 };
+    Ok((ControllerChange::Unchanged, absent, absent))
+}
+
+/// Rescan one UB bus controller and update its cached entry
+/// # Arguments
+/// * `index` - N of `/sys/devices/ub_bus_controller<N>`
+/// # Returns
+/// # Errors
+/// The change with the entry before and after on success, Err(i32) if `index` is out of range
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn refresh_controller(index: u32) -> Result<(ControllerChange, ObmmControllerInfo, ObmmControllerInfo), i32> {
+    let mut old = ObmmControllerInfo::default();
+    let mut now = ObmmControllerInfo::default();
+    let ret = unsafe { obmm_refresh_controller(index, &raw mut old, &raw mut now) };
+    let change = match ret {
+        0 => ControllerChange::Unchanged,
+        1 => ControllerChange::Added,
+        2 => ControllerChange::Changed,
+        3 => ControllerChange::Removed,
+        _ => return Err(last_errno()),
+    };
+    Ok((change, old, now))
+}
+
+/// Counter bumped by every change of the cached controller table
+#[cfg(feature = "hook")]
+#[inline]
+#[must_use]
+pub const fn topology_generation() -> u64 {
+    // hooked implementation
+    0
+}
+
+/// Counter bumped by every change of the cached controller table
+#[cfg(not(feature = "hook"))]
+#[inline]
+#[must_use]
+pub fn topology_generation() -> u64 {
+    unsafe { obmm_topology_generation() }
+}
+
+/// NUMA node of the UB bus controller with `eid`
+/// # Returns
+/// # Errors
+/// NUMA node on success, Err(i32) if no controller has `eid`
+#[cfg(feature = "hook")]
+#[inline]
+pub fn controller_numa(_: &[u8; 16]) -> Result<usize, i32> {
+    // hooked implementation
+    Ok(0)
+}
+
+/// NUMA node of the UB bus controller with `eid`
+/// # Returns
+/// # Errors
+/// NUMA node on success, Err(i32) if no controller has `eid`
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn controller_numa(eid: &[u8; 16]) -> Result<usize, i32> {
+    let ret = unsafe { obmm_query_numa_by_eid(eid.as_ptr()) };
+    if ret < 0 {
+        return Err(last_errno());
+    }
+    usize::try_from(ret).or(Err(libc::ERANGE))
+}
+
+// FFI bindings to OBMM C library
+unsafe extern "C" {
+    /// Open `/dev/obmm` eagerly
+    ///
+    /// # Returns
+    /// 0 on success, -1 on failure
+    pub fn obmm_init() -> i32;
+
+    /// Close `/dev/obmm` and drop cached topology
+    pub fn obmm_fini();
+
+    /// Export memory regions for remote access
+    ///
+    /// # Arguments
+    /// * `length` - Array of lengths for each NUMA node
+    /// * `flags` - Export flags
+    /// * `desc` - Output memory descriptor
+    ///
+    /// # Returns
+    /// Memory ID on success, `OBMM_INVALID_MEMID` on failure
+    pub fn obmm_export(
+        length: *const usize,
+        flags: u64,
+        desc: *mut c_void,
+    ) -> MemId;
+
+    /// Unexport previously exported memory region
+    ///
+    /// # Arguments
+    /// * `id` - Memory ID to unexport
+    /// * `flags` - Unexport flags
+    ///
+    /// # Returns
+    /// 0 on success, -1 on failure
+    pub fn obmm_unexport(id: MemId, flags: u64) -> i32;
+
+    /// Export a VA range of a process
+    ///
+    /// # Arguments
+    /// * `pid` - Process owning the range, 0 for the calling process
+    /// * `va` - Start of the range
+    /// * `length` - Length of the range
+    /// * `flags` - Export flags
+    /// * `desc` - In/out memory descriptor
+    ///
+    /// # Returns
+    /// Memory ID on success, `OBMM_INVALID_MEMID` on failure
+    pub fn obmm_export_useraddr(
+        pid: i32,
+        va: *mut c_void,
+        length: usize,
+        flags: u64,
+        desc: *mut c_void,
+    ) -> MemId;
+
+    /// Import remote memory region
+    ///
+    /// # Arguments
+    /// * `desc` - Memory descriptor from remote
+    /// * `flags` - Import flags
+    /// * `base_dist` - Base distribution hint
+    /// * `numa` - Output NUMA node ID
+    ///
+    /// # Returns
+    /// Memory ID on success, `OBMM_INVALID_MEMID` on failure
+    pub fn obmm_import(
+        desc: *const c_void,
+        flags: u64,
+        base_dist: i32,
+        numa: *mut i32,
+    ) -> MemId;
+
+    /// Unimport previously imported memory region
+    ///
+    /// # Arguments
+    /// * `id` - Memory ID to unimport
+    /// * `flags` - Unimport flags
+    ///
+    /// # Returns
+    /// 0 on success, -1 on failure
+    pub fn obmm_unimport(id: MemId, flags: u64) -> i32;
+
+    /// Declare a preimport range
+    ///
+    /// # Arguments
+    /// * `info` - Range to declare, `numa_id` is updated on success
+    /// * `flags` - Preimport flags
+    ///
+    /// # Returns
+    /// 0 on success, -1 on failure
+    pub fn obmm_preimport(info: *mut c_void, flags: u64) -> i32;
+
+    /// Undeclare a preimport range
+    ///
+    /// # Arguments
+    /// * `info` - Range previously declared
+    /// * `flags` - Preimport flags
+    ///
+    /// # Returns
+    /// 0 on success, -1 on failure
+    pub fn obmm_unpreimport(info: *const c_void, flags: u64) -> i32;
+
+    /// Export a batch of memory regions
+    ///
+    /// # Arguments
+    /// * `length` - Per-NUMA-node lengths, one array per region
+    /// * `count` - Number of regions
+    /// * `flags` - Export flags
+    /// * `descs` - Output memory descriptors, one per region
+    /// * `ids` - Output memory IDs, `OBMM_INVALID_MEMID` for failed entries
+    /// * `errs` - Output errno per entry, 0 on success
+    ///
+    /// # Returns
+    /// Number of entries exported, -1 if the arguments are invalid
+    pub fn obmm_export_batch(
+        length: *const [usize; OBMM_MAX_LOCAL_NUMA_NODES],
+        count: usize,
+        flags: u64,
+        descs: *const *mut c_void,
+        ids: *mut MemId,
+        errs: *mut i32,
+    ) -> i32;
+
+    /// Import a batch of remote memory regions
+    ///
+    /// # Arguments
+    /// * `descs` - Memory descriptors from remote, one per region
+    /// * `count` - Number of regions
+    /// * `flags` - Import flags
+    /// * `base_dist` - Base distribution hint
+    /// * `numa` - In/out NUMA node IDs, may be null
+    /// * `ids` - Output memory IDs, `OBMM_INVALID_MEMID` for failed entries
+    /// * `errs` - Output errno per entry, 0 on success
+    ///
+    /// # Returns
+    /// Number of entries imported, -1 if the arguments are invalid
+    pub fn obmm_import_batch(
+        descs: *const *const c_void,
+        count: usize,
+        flags: u64,
+        base_dist: i32,
+        numa: *mut i32,
+        ids: *mut MemId,
+        errs: *mut i32,
+    ) -> i32;
+
+    /// Rescan the cached UB bus controller topology
+    ///
+    /// # Returns
+    /// Number of controllers found
+    pub fn obmm_refresh_topology() -> i32;
+
+    /// Drop the cached UB bus controller topology
+    pub fn obmm_invalidate_topology();
+
+    /// Rescan UB bus controller `ubc_index` and update its cached entry
+    ///
+    /// # Arguments
+    /// * `ubc_index` - N of `/sys/devices/ub_bus_controller<N>`
+    /// * `old` - Output entry before the rescan, may be null
+    /// * `now` - Output entry after the rescan, may be null
+    ///
+    /// # Returns
+    /// `OBMM_CTL_*` change, -1 with errno set on failure
+    pub fn obmm_refresh_controller(ubc_index: u32, old: *mut ObmmControllerInfo, now: *mut ObmmControllerInfo) -> i32;
+
+    /// Counter bumped by every change of the cached controller table
+    pub fn obmm_topology_generation() -> u64;
+
+    /// NUMA node of the UB bus controller with `eid`
+    ///
+    /// # Returns
+    /// NUMA node, -1 with errno set if unknown
+    pub fn obmm_query_numa_by_eid(eid: *const u8) -> i32;
+
+    /* debug interface */
+    
+    /// Query memory ID by physical address
+    ///
+    /// # Arguments
+    /// * `pa` - Physical address
+    /// * `id` - Output memory ID
+    /// * `offset` - Output offset within memory region
+    ///
+    /// # Returns
+    /// 0 on success, -1 on failure
+    pub fn obmm_query_memid_by_pa(
+        pa: u64,
+        id: *mut MemId,
+        offset: *mut u64,
+    ) -> i32;
+
+    /// Query physical address by memory ID and offset
+    ///
+    /// # Arguments
+    /// * `id` - Memory ID
+    /// * `offset` - Offset within memory region
+    /// * `pa` - Output physical address
+    ///
+    /// # Returns
+    /// 0 on success, -1 on failure
+    pub fn obmm_query_pa_by_memid(
+        id: MemId,
+        offset: u64,
+        pa: *mut u64,
+    ) -> i32;
+
+    /// Query memory IDs of many physical addresses
+    ///
+    /// # Arguments
+    /// * `pa` - Physical addresses
+    /// * `count` - Number of addresses
+    /// * `ids` - Output memory IDs, `OBMM_INVALID_MEMID` for failed entries
+    /// * `offsets` - Output offsets within the memory regions, may be null
+    /// * `errs` - Output errno per entry, 0 on success
+    ///
+    /// # Returns
+    /// Number of entries translated, -1 if the arguments are invalid
+    pub fn obmm_query_memid_by_pa_bulk(
+        pa: *const u64,
+        count: usize,
+        ids: *mut MemId,
+        offsets: *mut u64,
+        errs: *mut i32,
+    ) -> i32;
+
+    /// Query physical addresses of many offsets within one memory region
+    ///
+    /// # Arguments
+    /// * `id` - Memory ID
+    /// * `offsets` - Offsets within the memory region
+    /// * `count` - Number of offsets
+    /// * `pa` - Output physical addresses
+    /// * `errs` - Output errno per entry, 0 on success
+    ///
+    /// # Returns
+    /// Number of entries translated, -1 if the arguments are invalid
+    pub fn obmm_query_pa_by_memid_bulk(
+        id: MemId,
+        offsets: *const u64,
+        count: usize,
+        pa: *mut u64,
+        errs: *mut i32,
+    ) -> i32;
+
+    /// Set the ownership of a range of an OBMM memory device mapping
+    ///
+    /// # Arguments
+    /// * `fd` - File descriptor of the OBMM memory device
+    /// * `start` - Start virtual address
+    /// * `end` - End virtual address, exclusive
+    /// * `prot` - Ownership as protection bits
+    ///
+    /// # Returns
+    /// 0 on success, -1 with errno set on failure
+    pub fn obmm_set_ownership(fd: i32, start: *mut c_void, end: *mut c_void, prot: i32) -> i32;
+
+    /// Set the ownership of a range with explicit cache maintenance
+    ///
+    /// # Arguments
+    /// * `fd` - File descriptor of the OBMM memory device
+    /// * `start` - Start virtual address
+    /// * `end` - End virtual address, exclusive
+    /// * `prot` - Ownership as protection bits
+    /// * `cache_ops` - `OBMM_SHM_CACHE_*` operation
+    ///
+    /// # Returns
+    /// 0 on success, -1 with errno set on failure
+    pub fn obmm_set_ownership_ex(fd: i32, start: *mut c_void, end: *mut c_void, prot: i32, cache_ops: i32) -> i32;
+
+    /// Set the ownership of many ranges of an OBMM memory device mapping
+    ///
+    /// # Arguments
+    /// * `fd` - File descriptor of the OBMM memory device
+    /// * `ranges` - Ranges to update
+    /// * `count` - Number of ranges
+    /// * `errs` - Output errno per range, 0 on success
+    ///
+    /// # Returns
+    /// Number of ranges updated, -1 if the arguments are invalid
+    pub fn obmm_set_ownership_batch(fd: i32, ranges: *const ObmmOwnershipRange, count: usize, errs: *mut i32) -> i32;
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_export() -> anyhow::Result<()> {
+        let mut lengths = vec![0; MAX_NUMA_NODES];
+        if let Some(v) = lengths.get_mut(0) {
+            *v = 1024 * 1024 * 64; // 64MB on NUMA node 0
+        }
+        let flags = ObmmExportFlags::ALLOWMMAP;
+        match mem_export::<UbPrivData>(&lengths, flags) {
+            Ok((memid, desc)) => {
+                println!("Exported MemID: {memid}");
+                println!("Memory Descriptor: {desc:?}");
+                assert!(memid != OBMM_INVALID_MEMID);
+                assert!(desc.length == 1024 * 1024 * 128);
+                Ok(())
+            }
+            Err(code) => {
+                Err(anyhow::anyhow!("mem_export failed with code {code}"))
+            }
+        }
+    }
+
+    #[test]
     fn test_import() -> anyhow::Result<()> {
         let desc = ObmmMemDesc::<UbPrivData> {
             addr: 0xffff_fc00_0000,
@@ -574,4 +1723,52 @@ mod tests {
         assert_eq!(desc.priv_data, read_desc.priv_data);
         Ok(())
     }
+
+    #[test]
+    fn test_refresh_topology() {
+        invalidate_topology();
+        assert!(refresh_topology().is_ok());
+    }
+
+    #[cfg(not(feature = "hook"))]
+    #[test]
+    fn test_release_errors_are_errno() {
+        // libobmm rejects the invalid MemID with errno EINVAL before reaching the driver
+        assert_eq!(mem_unexport(OBMM_INVALID_MEMID, ObmmUnexportFlags::empty()), Err(libc::EINVAL));
+        assert_eq!(mem_unimport(OBMM_INVALID_MEMID, ObmmExportFlags::empty()), Err(libc::EINVAL));
+    }
+
+    #[test]
+    fn test_init_fini() {
+        assert!(init().is_ok());
+        fini();
+        // the device is reopened on demand after fini
+        assert!(init().is_ok());
+    }
+
+    #[test]
+    fn test_batch_export_import() {
+        let mut lengths = [[0_usize; OBMM_MAX_LOCAL_NUMA_NODES]; 4];
+        for (node, length) in lengths.iter_mut().enumerate() {
+            if let Some(v) = length.get_mut(node) {
+                *v = 1024 * 1024 * 2;
+            }
+        }
+        let exported = mem_export_batch::<UbPrivData>(&lengths, ObmmExportFlags::ALLOWMMAP);
+        assert_eq!(exported.len(), 4);
+        let descs: Vec<_> = exported
+            .into_iter()
+            .filter_map(Result::ok)
+            .map(|(memid, desc)| {
+                assert!(memid != OBMM_INVALID_MEMID);
+                assert_eq!(desc.length, 1024 * 1024 * 2);
+                desc
+            })
+            .collect();
+        assert_eq!(descs.len(), 4);
+
+        let imported = mem_import_batch(&descs, ObmmExportFlags::ALLOWMMAP, 0);
+        assert_eq!(imported.len(), 4);
+        assert!(imported.iter().all(Result::is_ok));
+    }
 }
\ No newline at end of file
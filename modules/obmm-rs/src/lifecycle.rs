@@ -0,0 +1,532 @@
+//! Owned regions with deferred, batched reclamation
+//!
+//! `mem_export` and `mem_import` hand out a bare `MemId`; if the caller forgets
+//! it or unwinds past it, the region stays pinned until a sweep finds it.
+//! `RegionRegistry` wraps both calls into `ExportedRegion` and `ImportedRegion`
+//! handles that release their region when dropped. Drop only queues the region:
+//! a background thread collects the queue into batches and releases each batch
+//! with a `Teardown`, so no drop path waits for an unexport ioctl. The registry
+//! also counts the live regions and can list them at any time.
+
+use std::sync::{Arc, Condvar, Mutex, MutexGuard, PoisonError};
+use std::thread::JoinHandle;
+use std::time::Duration;
+
+use threadpool::ThreadPool;
+
+use crate::teardown::{RegionKind, Teardown, TeardownRegion, TeardownReport, release_inline};
+use crate::{MemId, ObmmExportFlags, ObmmMemDesc, UbPrivData, mem_export, mem_import};
+
+/// Tuning of the reclamation thread
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct ReclaimConfig {
+    /// Pool workers releasing a batch
+    pub workers: usize,
+    /// Releases in flight per NUMA node, see `Teardown::new`
+    pub per_node: usize,
+    /// Most regions released in one batch
+    pub batch: usize,
+    /// How long a short queue waits for more regions before it is released
+    pub linger: Duration,
+    /// Retry busy unexports with `FORCE`, see `Teardown::force_fallback`
+    pub force_fallback: bool,
+}
+
+impl Default for ReclaimConfig {
+    #[inline]
+    fn default() -> Self {
+        ReclaimConfig { workers: 4, per_node: 4, batch: 64, linger: Duration::from_millis(5), force_fallback: true }
+    }
+}
+
+/// Live region as listed by `RegionRegistry::live`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct LiveRegion {
+    /// Memory ID
+    pub mem_id: MemId,
+    /// Direction
+    pub kind: RegionKind,
+    /// NUMA node backing the region, `None` if unknown
+    pub numa: Option<usize>,
+    /// Length in bytes
+    pub length: u64,
+}
+
+/// Reclamation counters
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct ReclaimStats {
+    /// Regions released normally
+    pub released: u64,
+    /// Exports that needed `FORCE`
+    pub forced: u64,
+    /// Regions that could not be released, see `RegionRegistry::take_failed`
+    pub failed: u64,
+    /// Batches released by the reclamation thread
+    pub batches: u64,
+    /// Regions queued and not yet released
+    pub pending: usize,
+}
+
+/// Slab of live regions, a handle keeps the index of its slot
+#[derive(Debug, Default)]
+struct Live {
+    /// Regions by slot, `None` for free slots
+    slots: Vec<Option<LiveRegion>>,
+    /// Free slot indexes
+    free: Vec<usize>,
+    /// Occupied slots
+    count: usize,
+}
+
+impl Live {
+    /// Store `region`, returning its slot
+    fn insert(&mut self, region: LiveRegion) -> usize {
+        self.count = self.count.saturating_add(1);
+        if let Some(slot) = self.free.pop()
+            && let Some(entry) = self.slots.get_mut(slot)
+        {
+            *entry = Some(region);
+            return slot;
+        }
+        self.slots.push(Some(region));
+        self.slots.len().saturating_sub(1)
+    }
+
+    /// Free `slot`
+    fn remove(&mut self, slot: usize) {
+        if self.slots.get_mut(slot).and_then(Option::take).is_some() {
+            self.count = self.count.saturating_sub(1);
+            self.free.push(slot);
+        }
+    }
+}
+
+/// Reclamation queue and its results
+#[derive(Debug, Default)]
+struct Queue {
+    /// Regions waiting for a batch
+    pending: Vec<TeardownRegion>,
+    /// Regions of the batch being released
+    in_flight: usize,
+    /// Callers of `flush` waiting, batches skip the linger while non-zero
+    flushing: usize,
+    /// Set when the registry is dropped, later drops release inline
+    shutdown: bool,
+    /// Counters
+    stats: ReclaimStats,
+    /// Regions that could not be released, with the errno of the last attempt
+    failed: Vec<(MemId, i32)>,
+}
+
+impl Queue {
+    /// Account for a released batch
+    fn record(&mut self, report: TeardownReport) {
+        let count = |regions: usize| u64::try_from(regions).unwrap_or(u64::MAX);
+        self.stats.released = self.stats.released.saturating_add(count(report.released.len()));
+        self.stats.forced = self.stats.forced.saturating_add(count(report.forced.len()));
+        self.stats.failed = self.stats.failed.saturating_add(count(report.failed.len()));
+        self.failed.extend(report.failed);
+    }
+}
+
+/// State shared by the registry, its handles and the reclamation thread
+#[derive(Debug)]
+struct Shared {
+    /// Live regions
+    live: Mutex<Live>,
+    /// Reclamation queue
+    queue: Mutex<Queue>,
+    /// Signalled when regions are queued, a flush starts or the registry is dropped
+    work: Condvar,
+    /// Signalled when a batch has been released
+    idle: Condvar,
+    /// Reclamation tuning
+    config: ReclaimConfig,
+}
+
+impl Shared {
+    /// Lock the live regions
+    fn live(&self) -> MutexGuard<'_, Live> {
+        self.live.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+
+    /// Lock the reclamation queue
+    fn queue(&self) -> MutexGuard<'_, Queue> {
+        self.queue.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+
+    /// Start tracking `region`
+    fn register(self: &Arc<Self>, region: LiveRegion) -> Lease {
+        let slot = self.live().insert(region);
+        let release = match region.kind {
+            RegionKind::Exported => TeardownRegion::exported(region.mem_id, region.numa),
+            RegionKind::Imported => TeardownRegion::imported(region.mem_id, region.numa),
+        };
+        Lease { shared: Arc::clone(self), slot, release, owned: true }
+    }
+
+    /// Stop tracking the region in `slot` and queue `release` for reclamation
+    fn retire(&self, slot: usize, release: TeardownRegion) {
+        self.live().remove(slot);
+        let mut queue = self.queue();
+        if queue.shutdown {
+            // no reclamation thread left, pay for the ioctl here
+            drop(queue);
+            let mut report = TeardownReport::default();
+            report.record(release.mem_id, release_inline(&release, self.config.force_fallback));
+            self.queue().record(report);
+            return;
+        }
+        queue.pending.push(release);
+        if queue.pending.len() == 1 || queue.pending.len() >= self.config.batch {
+            self.work.notify_one();
+        }
+    }
+
+    /// Take the next batch, `None` once the registry is dropped and the queue is empty
+    fn next_batch(&self) -> Option<Vec<TeardownRegion>> {
+        let mut queue = self.queue();
+        while queue.pending.is_empty() && !queue.shutdown {
+            queue = self.work.wait(queue).unwrap_or_else(PoisonError::into_inner);
+        }
+        if queue.pending.is_empty() {
+            return None;
+        }
+        if queue.pending.len() < self.config.batch && !queue.shutdown && queue.flushing == 0 {
+            // let the drops of a burst land in one batch
+            queue = self.work.wait_timeout(queue, self.config.linger).unwrap_or_else(PoisonError::into_inner).0;
+        }
+        let take = queue.pending.len().min(self.config.batch);
+        queue.in_flight = take;
+        Some(queue.pending.drain(..take).collect())
+    }
+
+    /// Release batches until the registry is dropped
+    fn reclaim(&self, pool: &ThreadPool) {
+        let teardown = Teardown::new(pool, self.config.per_node).force_fallback(self.config.force_fallback);
+        while let Some(batch) = self.next_batch() {
+            // the pool only fails once shut down, release the batch here then
+            let report = teardown.run(&batch).unwrap_or_else(|_| {
+                let mut report = TeardownReport::default();
+                for region in &batch {
+                    report.record(region.mem_id, release_inline(region, self.config.force_fallback));
+                }
+                report
+            });
+            let mut queue = self.queue();
+            queue.record(report);
+            queue.stats.batches = queue.stats.batches.saturating_add(1);
+            queue.in_flight = 0;
+            self.idle.notify_all();
+        }
+    }
+}
+
+/// Tracking of one registered region, queues it for reclamation when dropped
+#[derive(Debug)]
+struct Lease {
+    /// Registry state
+    shared: Arc<Shared>,
+    /// Slot in `Live`
+    slot: usize,
+    /// How the region is released
+    release: TeardownRegion,
+    /// Cleared by `detach`
+    owned: bool,
+}
+
+impl Lease {
+    /// Stop tracking the region without releasing it
+    fn detach(mut self) {
+        self.owned = false;
+        self.shared.live().remove(self.slot);
+    }
+}
+
+impl Drop for Lease {
+    #[inline]
+    fn drop(&mut self) {
+        if self.owned {
+            self.shared.retire(self.slot, self.release);
+        }
+    }
+}
+
+/// Exported region, unexported in the background once dropped
+#[derive(Debug)]
+pub struct ExportedRegion<T = UbPrivData> {
+    /// Registry tracking
+    lease: Lease,
+    /// Memory Descriptor to hand to importers
+    desc: ObmmMemDesc<T>,
+}
+
+impl<T> ExportedRegion<T> {
+    /// Memory ID
+    #[inline]
+    #[must_use]
+    pub const fn mem_id(&self) -> MemId {
+        self.lease.release.mem_id
+    }
+
+    /// NUMA node backing the region, `None` if unknown
+    #[inline]
+    #[must_use]
+    pub const fn numa(&self) -> Option<usize> {
+        self.lease.release.numa
+    }
+
+    /// Memory Descriptor
+    #[inline]
+    #[must_use]
+    pub const fn desc(&self) -> &ObmmMemDesc<T> {
+        &self.desc
+    }
+
+    /// Take the region out of the registry, the caller has to unexport it
+    /// # Returns
+    /// Memory ID and Memory Descriptor
+    #[inline]
+    #[must_use]
+    pub fn into_raw(self) -> (MemId, ObmmMemDesc<T>) {
+        let ExportedRegion { lease, desc } = self;
+        let mem_id = lease.release.mem_id;
+        lease.detach();
+        (mem_id, desc)
+    }
+}
+
+/// Imported region, unimported in the background once dropped
+#[derive(Debug)]
+pub struct ImportedRegion {
+    /// Registry tracking
+    lease: Lease,
+}
+
+impl ImportedRegion {
+    /// Memory ID
+    #[inline]
+    #[must_use]
+    pub const fn mem_id(&self) -> MemId {
+        self.lease.release.mem_id
+    }
+
+    /// NUMA node the region was placed on, `None` if unknown
+    #[inline]
+    #[must_use]
+    pub const fn numa(&self) -> Option<usize> {
+        self.lease.release.numa
+    }
+
+    /// Take the region out of the registry, the caller has to unimport it
+    /// # Returns
+    /// Memory ID
+    #[inline]
+    #[must_use]
+    pub fn into_raw(self) -> MemId {
+        let mem_id = self.lease.release.mem_id;
+        self.lease.detach();
+        mem_id
+    }
+}
+
+/// Registry of owned regions and their reclamation thread
+///
+/// Dropping the registry releases everything still queued and stops the
+/// thread; handles dropped after that release their region on the spot.
+#[derive(Debug)]
+pub struct RegionRegistry {
+    /// State shared with the handles
+    shared: Arc<Shared>,
+    /// Reclamation thread
+    reclaimer: Option<JoinHandle<()>>,
+}
+
+impl RegionRegistry {
+    /// Start a registry and its reclamation thread
+    /// # Returns
+    /// # Errors
+    /// `RegionRegistry` on success, `anyhow::Error` if the pool or thread cannot be started
+    #[inline]
+    pub fn new(config: ReclaimConfig) -> anyhow::Result<Self> {
+        let config = ReclaimConfig { batch: config.batch.max(1), ..config };
+        let pool = ThreadPool::new(config.workers.max(1))?;
+        let shared = Arc::new(Shared {
+            live: Mutex::new(Live::default()),
+            queue: Mutex::new(Queue::default()),
+            work: Condvar::new(),
+            idle: Condvar::new(),
+            config,
+        });
+        let worker = Arc::clone(&shared);
+        let reclaimer = std::thread::Builder::new()
+            .name("obmm-reclaim".to_owned())
+            .spawn(move || worker.reclaim(&pool))?;
+        Ok(RegionRegistry { shared, reclaimer: Some(reclaimer) })
+    }
+
+    /// Export memory, see `mem_export`
+    /// # Arguments
+    /// * `length` - Array of lengths for each NUMA node
+    /// * `flags` - Export flags
+    /// # Returns
+    /// # Errors
+    /// Handle of the region on success, `anyhow::Error` on failure
+    #[inline]
+    pub fn export<T: Default>(&self, length: &[usize], flags: ObmmExportFlags) -> anyhow::Result<ExportedRegion<T>> {
+        let (mem_id, desc) = mem_export::<T>(length, flags)?;
+        let numa = length.iter().position(|&len| len != 0);
+        Ok(self.adopt_export(mem_id, desc, numa))
+    }
+
+    /// Import memory, see `mem_import`
+    /// # Arguments
+    /// * `desc` - Memory Descriptor from remote
+    /// * `flags` - Import flags
+    /// * `base_dist` - Base distribution hint
+    /// # Returns
+    /// # Errors
+    /// Handle of the region on success, Err(i32) on failure
+    #[inline]
+    pub fn import(
+        &self,
+        desc: &ObmmMemDesc<UbPrivData>,
+        flags: ObmmExportFlags,
+        base_dist: i32,
+    ) -> Result<ImportedRegion, i32> {
+        let (mem_id, numa) = mem_import(desc, flags, base_dist)?;
+        Ok(self.adopt_import(mem_id, usize::try_from(numa).ok(), desc.length))
+    }
+
+    /// Take ownership of a region exported elsewhere, e.g. by `mem_export_batch`
+    #[inline]
+    #[must_use]
+    pub fn adopt_export<T>(&self, mem_id: MemId, desc: ObmmMemDesc<T>, numa: Option<usize>) -> ExportedRegion<T> {
+        let region = LiveRegion { mem_id, kind: RegionKind::Exported, numa, length: desc.length };
+        ExportedRegion { lease: self.shared.register(region), desc }
+    }
+
+    /// Take ownership of a region imported elsewhere, e.g. by `mem_import_batch`
+    #[inline]
+    #[must_use]
+    pub fn adopt_import(&self, mem_id: MemId, numa: Option<usize>, length: u64) -> ImportedRegion {
+        let region = LiveRegion { mem_id, kind: RegionKind::Imported, numa, length };
+        ImportedRegion { lease: self.shared.register(region) }
+    }
+
+    /// Number of live regions
+    #[inline]
+    #[must_use]
+    pub fn live_count(&self) -> usize {
+        self.shared.live().count
+    }
+
+    /// Copy of every live region
+    #[inline]
+    #[must_use]
+    pub fn live(&self) -> Vec<LiveRegion> {
+        self.shared.live().slots.iter().flatten().copied().collect()
+    }
+
+    /// Wait until every region dropped so far has been released
+    #[inline]
+    pub fn flush(&self) {
+        let mut queue = self.shared.queue();
+        queue.flushing = queue.flushing.saturating_add(1);
+        self.shared.work.notify_one();
+        while !queue.pending.is_empty() || queue.in_flight != 0 {
+            queue = self.shared.idle.wait(queue).unwrap_or_else(PoisonError::into_inner);
+        }
+        queue.flushing = queue.flushing.saturating_sub(1);
+    }
+
+    /// Reclamation counters
+    #[inline]
+    #[must_use]
+    pub fn stats(&self) -> ReclaimStats {
+        let queue = self.shared.queue();
+        ReclaimStats { pending: queue.pending.len().saturating_add(queue.in_flight), ..queue.stats }
+    }
+
+    /// Regions that could not be released since the last call, with their errno
+    ///
+    /// They are no longer tracked; the caller decides whether to retry them.
+    #[inline]
+    #[must_use]
+    pub fn take_failed(&self) -> Vec<(MemId, i32)> {
+        std::mem::take(&mut self.shared.queue().failed)
+    }
+}
+
+impl Drop for RegionRegistry {
+    #[inline]
+    fn drop(&mut self) {
+        self.shared.queue().shutdown = true;
+        self.shared.work.notify_all();
+        if let Some(reclaimer) = self.reclaimer.take() {
+            // a panic of the thread has already been reported by the runtime
+            reclaimer.join().unwrap_or(());
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn lengths(node: usize) -> Vec<usize> {
+        let mut length = vec![0; crate::MAX_NUMA_NODES];
+        if let Some(len) = length.get_mut(node) {
+            *len = 2 << 20_u32;
+        }
+        length
+    }
+
+    #[test]
+    fn test_lifecycle_drop_reclaims() -> anyhow::Result<()> {
+        let registry = RegionRegistry::new(ReclaimConfig::default())?;
+        let exported = (0..100)
+            .map(|node| registry.export::<UbPrivData>(&lengths(node % 4), ObmmExportFlags::ALLOWMMAP))
+            .collect::<anyhow::Result<Vec<_>>>()?;
+        let desc = exported.first().map(ExportedRegion::desc).ok_or_else(|| anyhow::anyhow!("Nothing exported"))?;
+        let imported =
+            registry.import(desc, ObmmExportFlags::empty(), 0).map_err(|e| anyhow::anyhow!("Failed to import: {e}"))?;
+        assert_eq!(registry.live_count(), 101);
+        assert_eq!(registry.live().iter().filter(|region| region.kind == RegionKind::Imported).count(), 1);
+        assert_eq!(exported.get(5).and_then(ExportedRegion::numa), Some(1));
+
+        drop(exported);
+        drop(imported);
+        assert_eq!(registry.live_count(), 0);
+        registry.flush();
+        let stats = registry.stats();
+        assert_eq!(stats.released, 101);
+        assert_eq!(stats.pending, 0);
+        assert!(stats.batches >= 2);
+        assert!(registry.take_failed().is_empty());
+        Ok(())
+    }
+
+    #[test]
+    fn test_lifecycle_detach_and_late_drop() -> anyhow::Result<()> {
+        let registry = RegionRegistry::new(ReclaimConfig::default())?;
+        let kept = registry.export::<UbPrivData>(&lengths(0), ObmmExportFlags::ALLOWMMAP)?;
+        let late = registry.adopt_import(7, None, 4096);
+        let (mem_id, desc) = kept.into_raw();
+        assert_eq!(mem_id, 1);
+        assert_eq!(desc.length, 2 << 20_u32);
+        assert_eq!(registry.live().iter().map(|region| region.mem_id).collect::<Vec<_>>(), vec![7]);
+        registry.flush();
+        assert_eq!(registry.stats().released, 0);
+
+        let shared = Arc::clone(&registry.shared);
+        drop(registry);
+        drop(late);
+        assert_eq!(shared.queue().stats.released, 1);
+        assert_eq!(shared.live().count, 0);
+        Ok(())
+    }
+}
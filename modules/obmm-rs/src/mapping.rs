@@ -0,0 +1,498 @@
+//! Mapping imported regions into the address space
+//!
+//! An imported region is reached through its shared memory device,
+//! `/dev/obmm_shmdev<MemId>`. The driver backs the mapping with huge entries
+//! only where the virtual address is aligned like the remote physical range, so
+//! `RegionMap` places the mapping on a 2M or 1G boundary instead of wherever
+//! `mmap` lands. The first access to every page still faults across the bus;
+//! `MapOptions::populate` takes those faults inside `mmap`, and
+//! `RegionMap::prefetch` takes them from every worker of a `ThreadPool`.
+
+#[cfg(not(feature = "hook"))]
+use std::fs::OpenOptions;
+use std::fs::File;
+use std::os::fd::AsRawFd;
+#[cfg(not(feature = "hook"))]
+use std::os::unix::fs::OpenOptionsExt;
+use std::ptr::NonNull;
+
+use anyhow::Context;
+use threadpool::ThreadPool;
+
+use crate::MemId;
+
+/// Shared memory device of an imported region, followed by the `MemId`
+pub const SHMDEV_PREFIX: &str = "/dev/obmm_shmdev";
+
+/// Granule every mapped length has to be a multiple of
+const BASE_PAGE_SIZE: usize = 4096;
+
+/// Alignment of a mapping and stride of `RegionMap::prefetch`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum PageSize {
+    /// 4K, wherever `mmap` places it
+    Base,
+    /// 2M, PMD mappings
+    Huge2M,
+    /// 1G, PUD mappings
+    Huge1G,
+}
+
+impl PageSize {
+    /// Size in bytes
+    #[inline]
+    #[must_use]
+    pub const fn bytes(self) -> usize {
+        match self {
+            PageSize::Base => BASE_PAGE_SIZE,
+            PageSize::Huge2M => 2 << 20_u32,
+            PageSize::Huge1G => 1 << 30_u32,
+        }
+    }
+}
+
+/// How `RegionMap::open` maps a region
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct MapOptions {
+    /// Alignment of the mapping
+    page_size: PageSize,
+    /// Fault the whole region in during `mmap`
+    populate: bool,
+    /// Map read-write instead of read-only
+    writable: bool,
+    /// Map cacheable instead of `O_SYNC`
+    cacheable: bool,
+}
+
+impl Default for MapOptions {
+    #[inline]
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl MapOptions {
+    /// Read-only, cacheable, 2M aligned, faulted in on first access
+    #[inline]
+    #[must_use]
+    pub const fn new() -> Self {
+        MapOptions { page_size: PageSize::Huge2M, populate: false, writable: false, cacheable: true }
+    }
+
+    /// Align the mapping to `page_size`
+    #[inline]
+    #[must_use]
+    pub const fn page_size(mut self, page_size: PageSize) -> Self {
+        self.page_size = page_size;
+        self
+    }
+
+    /// Fault every page in during `mmap` (`MAP_POPULATE`)
+    #[inline]
+    #[must_use]
+    pub const fn populate(mut self, enabled: bool) -> Self {
+        self.populate = enabled;
+        self
+    }
+
+    /// Map read-write
+    #[inline]
+    #[must_use]
+    pub const fn writable(mut self, enabled: bool) -> Self {
+        self.writable = enabled;
+        self
+    }
+
+    /// Map cacheable, otherwise the device is opened with `O_SYNC` and every access goes to the bus
+    #[inline]
+    #[must_use]
+    pub const fn cacheable(mut self, enabled: bool) -> Self {
+        self.cacheable = enabled;
+        self
+    }
+
+    /// Alignment the mapping will get, in bytes
+    #[inline]
+    #[must_use]
+    pub const fn alignment(self) -> usize {
+        self.page_size.bytes()
+    }
+}
+
+/// Types a mapped region can be viewed as: any bit pattern is a valid value
+///
+/// # Safety
+/// Implementors must be inhabited by every bit pattern of their size and have no padding.
+pub unsafe trait MapElement: Copy {}
+
+// SAFETY: primitive integers are valid for every bit pattern.
+unsafe impl MapElement for u8 {}
+// SAFETY: see above.
+unsafe impl MapElement for u16 {}
+// SAFETY: see above.
+unsafe impl MapElement for u32 {}
+// SAFETY: see above.
+unsafe impl MapElement for u64 {}
+// SAFETY: see above.
+unsafe impl MapElement for usize {}
+// SAFETY: see above.
+unsafe impl MapElement for i8 {}
+// SAFETY: see above.
+unsafe impl MapElement for i16 {}
+// SAFETY: see above.
+unsafe impl MapElement for i32 {}
+// SAFETY: see above.
+unsafe impl MapElement for i64 {}
+
+/// Shared mapping of one imported region, unmapped on drop
+#[derive(Debug)]
+pub struct RegionMap {
+    /// Start of the mapping, aligned to `page_size`
+    ptr: NonNull<u8>,
+    /// Length of the mapping
+    len: usize,
+    /// Alignment and prefetch stride
+    page_size: PageSize,
+    /// Whether the mapping is writable
+    writable: bool,
+    /// Whether the mapping is cacheable
+    cacheable: bool,
+    /// Shared memory device behind the mapping, kept open for ownership changes
+    device: Option<File>,
+}
+
+// SAFETY: the map owns its mapping; access goes through slices borrowed from it
+// or raw pointers handed out by the owner.
+unsafe impl Send for RegionMap {}
+// SAFETY: see above.
+unsafe impl Sync for RegionMap {}
+
+impl RegionMap {
+    /// Map `len` bytes of the imported region `mem_id`
+    /// # Arguments
+    /// * `mem_id` - Memory ID returned by `mem_import`
+    /// * `len` - Bytes to map from the start of the region, a multiple of 4K
+    /// * `options` - Alignment, populate and protection
+    /// # Returns
+    /// # Errors
+    /// `RegionMap` on success, `anyhow::Error` on failure
+    #[inline]
+    pub fn open(mem_id: MemId, len: usize, options: MapOptions) -> anyhow::Result<Self> {
+        if len == 0 || !len.is_multiple_of(BASE_PAGE_SIZE) {
+            anyhow::bail!("Mapping length {len} of MemID {mem_id} is not a non-zero multiple of {BASE_PAGE_SIZE}");
+        }
+        let window = reserve_aligned(len, options.page_size.bytes())?;
+        Self::open_in(mem_id, window, len, options).inspect_err(|_| {
+            // SAFETY: the reservation is still unused, unmapping it aliases nothing.
+            unsafe { unreserve(window, len) };
+        })
+    }
+
+    /// Map `mem_id` over `window`, a reservation of `len` bytes from `reserve_aligned`
+    ///
+    /// On failure the reservation is left in place for the caller.
+    pub(crate) fn open_in(mem_id: MemId, window: NonNull<u8>, len: usize, options: MapOptions) -> anyhow::Result<Self> {
+        let mut flags = libc::MAP_SHARED | libc::MAP_FIXED;
+        if options.populate {
+            flags |= libc::MAP_POPULATE;
+        }
+        let prot = if options.writable { libc::PROT_READ | libc::PROT_WRITE } else { libc::PROT_READ };
+        let (ptr, device) = map_region(mem_id, window, len, prot, flags, options)?;
+        Ok(RegionMap {
+            ptr,
+            len,
+            page_size: options.page_size,
+            writable: options.writable,
+            cacheable: options.cacheable,
+            device,
+        })
+    }
+
+    /// Unmap the region but keep its address range reserved and inaccessible
+    ///
+    /// Stale pointers into the range fault instead of reaching whatever
+    /// `mmap` would place there next.
+    /// # Errors
+    /// The reservation on success, `anyhow::Error` if the range could not be
+    /// replaced, in which case it is unmapped as on drop
+    pub(crate) fn into_reservation(self) -> anyhow::Result<NonNull<u8>> {
+        // SAFETY: MAP_FIXED over our own mapping only replaces that mapping.
+        let raw = unsafe {
+            libc::mmap(
+                self.ptr.as_ptr().cast(),
+                self.len,
+                libc::PROT_NONE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_NORESERVE | libc::MAP_FIXED,
+                -1,
+                0,
+            )
+        };
+        if raw == libc::MAP_FAILED {
+            return Err(anyhow::Error::new(std::io::Error::last_os_error())
+                .context(format!("Failed to reserve {} bytes at {:p} again", self.len, self.ptr)));
+        }
+        let mut map = std::mem::ManuallyDrop::new(self);
+        drop(map.device.take());
+        Ok(map.ptr)
+    }
+
+    /// Touch every page once, spread over all workers of `pool`
+    ///
+    /// Reads one byte per `PageSize` of the mapping, so the remote faults are
+    /// taken in parallel before the latency critical path sees them.
+    /// # Arguments
+    /// * `pool` - Workers taking the page faults
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` if a job could not run
+    #[inline]
+    pub fn prefetch(&self, pool: &ThreadPool) -> anyhow::Result<()> {
+        let stride = self.page_size.bytes();
+        let pages = self.len.div_ceil(stride);
+        let per_job = pages.div_ceil(pool.size().max(1)).max(1);
+        pool.scope(|scope| -> anyhow::Result<()> {
+            for first in (0..pages).step_by(per_job) {
+                let last = first.saturating_add(per_job).min(pages);
+                scope.spawn(move || {
+                    for page in first..last {
+                        // SAFETY: `page` is below `pages`, so the byte lies inside the
+                        // mapping, which outlives the scope.
+                        let _ = unsafe { self.ptr.as_ptr().add(page.saturating_mul(stride)).read_volatile() };
+                    }
+                })?;
+            }
+            Ok(())
+        })?
+        .context("Failed to queue prefetch job")
+    }
+
+    /// View the mapping as `T`, a trailing partial element is left out
+    ///
+    /// Other nodes may write the region at any time; readers that need a
+    /// consistent view coordinate through the ownership protocol first.
+    /// # Returns
+    /// # Errors
+    /// Slice on success, `anyhow::Error` if the mapping is not aligned for `T`
+    #[inline]
+    pub fn as_slice<T: MapElement>(&self) -> anyhow::Result<&[T]> {
+        let ptr = self.typed_ptr::<T>()?;
+        // SAFETY: the mapping is readable for `len` bytes while `self` lives and
+        // every bit pattern is a valid `T`.
+        Ok(unsafe { std::slice::from_raw_parts(ptr, self.len.checked_div(size_of::<T>()).unwrap_or(0)) })
+    }
+
+    /// Mutable view of the mapping as `T`, a trailing partial element is left out
+    /// # Returns
+    /// # Errors
+    /// Slice on success, `anyhow::Error` if the mapping is read-only or not aligned for `T`
+    #[inline]
+    pub fn as_mut_slice<T: MapElement>(&mut self) -> anyhow::Result<&mut [T]> {
+        if !self.writable {
+            anyhow::bail!("Mapping is read-only");
+        }
+        let ptr = self.typed_ptr::<T>()?;
+        // SAFETY: as in `as_slice`, and `&mut self` makes this the only view.
+        Ok(unsafe { std::slice::from_raw_parts_mut(ptr, self.len.checked_div(size_of::<T>()).unwrap_or(0)) })
+    }
+
+    /// Start of the mapping
+    #[inline]
+    #[must_use]
+    pub fn as_mut_ptr(&self) -> *mut u8 {
+        self.ptr.as_ptr()
+    }
+
+    /// Start of the mapping as `T`, for views that outlive a borrow such as shared atomics
+    /// # Returns
+    /// # Errors
+    /// Pointer on success, `anyhow::Error` if the mapping is not aligned for `T`
+    #[inline]
+    pub fn as_mut_ptr_of<T: MapElement>(&self) -> anyhow::Result<*mut T> {
+        self.typed_ptr::<T>()
+    }
+
+    /// Length of the mapping
+    #[inline]
+    #[must_use]
+    pub const fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Always false, empty regions cannot be mapped
+    #[inline]
+    #[must_use]
+    pub const fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Alignment of the mapping
+    #[inline]
+    #[must_use]
+    pub const fn page_size(&self) -> PageSize {
+        self.page_size
+    }
+
+    /// Whether the mapping is writable
+    #[inline]
+    #[must_use]
+    pub const fn is_writable(&self) -> bool {
+        self.writable
+    }
+
+    /// Whether the mapping goes through the cache, see `kernels::StoreHint::for_region`
+    #[inline]
+    #[must_use]
+    pub const fn is_cacheable(&self) -> bool {
+        self.cacheable
+    }
+
+    /// File descriptor of the shared memory device, for `mem_set_ownership` and `OwnershipMap`
+    /// # Returns
+    /// The descriptor, -1 if the mapping has no device behind it
+    #[inline]
+    #[must_use]
+    pub fn fd(&self) -> i32 {
+        self.device.as_ref().map_or(-1, AsRawFd::as_raw_fd)
+    }
+
+    /// Start of the mapping as `T`
+    fn typed_ptr<T>(&self) -> anyhow::Result<*mut T> {
+        let ptr = self.ptr.as_ptr().cast::<T>();
+        if !ptr.is_aligned() || size_of::<T>() == 0 {
+            anyhow::bail!("Mapping at {ptr:p} cannot be viewed as {}", std::any::type_name::<T>());
+        }
+        Ok(ptr)
+    }
+}
+
+impl Drop for RegionMap {
+    #[inline]
+    fn drop(&mut self) {
+        // SAFETY: unmapping exactly the range mapped in `open`.
+        let _ = unsafe { libc::munmap(self.ptr.as_ptr().cast(), self.len) };
+    }
+}
+
+/// Reserve `len` bytes of address space aligned to `align`, without backing it
+pub(crate) fn reserve_aligned(len: usize, align: usize) -> anyhow::Result<NonNull<u8>> {
+    let padded = len.checked_add(align).with_context(|| format!("Mapping of {len} bytes is too large"))?;
+    // SAFETY: a fresh inaccessible anonymous mapping aliases nothing; checked below.
+    let raw = unsafe {
+        libc::mmap(
+            std::ptr::null_mut(),
+            padded,
+            libc::PROT_NONE,
+            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_NORESERVE,
+            -1,
+            0,
+        )
+    };
+    if raw == libc::MAP_FAILED {
+        return Err(anyhow::Error::new(std::io::Error::last_os_error())
+            .context(format!("Failed to reserve {padded} bytes of address space")));
+    }
+    let raw = raw.cast::<u8>();
+    let head = raw.align_offset(align);
+    let tail = align.saturating_sub(head);
+    // SAFETY: `head` < `align`, so both the aligned start and the unused tail lie
+    // inside the padded reservation; trimming leaves exactly [aligned, aligned + len).
+    let aligned = unsafe {
+        let aligned = raw.add(head);
+        if head > 0 {
+            let _ = libc::munmap(raw.cast(), head);
+        }
+        if tail > 0 {
+            let _ = libc::munmap(aligned.add(len).cast(), tail);
+        }
+        aligned
+    };
+    NonNull::new(aligned).context("mmap returned null")
+}
+
+/// Give back a reservation from `reserve_aligned`
+///
+/// # Safety
+/// `window` must be a reservation or mapping of `len` bytes no live reference points into.
+pub(crate) unsafe fn unreserve(window: NonNull<u8>, len: usize) {
+    // SAFETY: the caller owns [window, window + len).
+    let _ = unsafe { libc::munmap(window.as_ptr().cast(), len) };
+}
+
+/// Map the region over the reserved `window`
+#[cfg(feature = "hook")]
+fn map_region(
+    _: MemId,
+    window: NonNull<u8>,
+    len: usize,
+    prot: i32,
+    flags: i32,
+    _: MapOptions,
+) -> anyhow::Result<(NonNull<u8>, Option<File>)> {
+    // hooked implementation
+    // SAFETY: MAP_FIXED over our own reservation only replaces that reservation.
+    let ptr = unsafe { libc::mmap(window.as_ptr().cast(), len, prot, flags | libc::MAP_ANONYMOUS, -1, 0) };
+    if ptr == libc::MAP_FAILED {
+        return Err(std::io::Error::last_os_error().into());
+    }
+    Ok((window, None))
+}
+
+/// Map the region over the reserved `window`
+#[cfg(not(feature = "hook"))]
+fn map_region(
+    mem_id: MemId,
+    window: NonNull<u8>,
+    len: usize,
+    prot: i32,
+    flags: i32,
+    options: MapOptions,
+) -> anyhow::Result<(NonNull<u8>, Option<File>)> {
+    let path = format!("{SHMDEV_PREFIX}{mem_id}");
+    let device = OpenOptions::new()
+        .read(true)
+        .write(options.writable)
+        .custom_flags(if options.cacheable { 0 } else { libc::O_SYNC })
+        .open(&path)
+        .with_context(|| format!("Failed to open {path}"))?;
+    // SAFETY: MAP_FIXED over our own reservation only replaces that reservation.
+    let ptr = unsafe { libc::mmap(window.as_ptr().cast(), len, prot, flags, device.as_raw_fd(), 0) };
+    if ptr == libc::MAP_FAILED {
+        return Err(anyhow::Error::new(std::io::Error::last_os_error())
+            .context(format!("Failed to map {len} bytes of {path}")));
+    }
+    Ok((window, Some(device)))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_map_aligned_and_prefetch() -> anyhow::Result<()> {
+        let pool = ThreadPool::new(4)?;
+        let len = PageSize::Huge2M.bytes() * 3 + BASE_PAGE_SIZE;
+        let mut map = RegionMap::open(1, len, MapOptions::new().writable(true))?;
+        assert_eq!(map.as_mut_ptr().align_offset(PageSize::Huge2M.bytes()), 0);
+        map.prefetch(&pool)?;
+        let words = map.as_mut_slice::<u64>()?;
+        assert_eq!(words.len(), len / 8);
+        if let Some(last) = words.last_mut() {
+            *last = 7;
+        }
+        assert_eq!(map.as_slice::<u64>()?.last(), Some(&7));
+        Ok(())
+    }
+
+    #[test]
+    fn test_map_options() -> anyhow::Result<()> {
+        let mut map =
+            RegionMap::open(1, BASE_PAGE_SIZE * 4, MapOptions::new().page_size(PageSize::Huge1G).populate(true))?;
+        assert_eq!(map.as_mut_ptr().align_offset(PageSize::Huge1G.bytes()), 0);
+        assert!(map.as_mut_slice::<u8>().is_err());
+        assert_eq!(map.as_slice::<u32>()?.len(), BASE_PAGE_SIZE);
+        assert!(RegionMap::open(1, 100, MapOptions::new()).is_err());
+        Ok(())
+    }
+}
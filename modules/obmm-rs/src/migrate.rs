@@ -0,0 +1,508 @@
+//! Moving a region to other NUMA nodes while it stays reachable
+//!
+//! Rebalancing a hot region used to mean unexporting it, exporting a new one
+//! and copying by hand. `Migration` does the whole move: it exports the
+//! destination on the requested nodes, imports source and destination locally,
+//! copies chunk by chunk on the workers of a `ThreadPool`, and hands the
+//! destination over with its dirty lines written back before retiring the
+//! source. Chunks already copied are released in batches while the rest are
+//! still in flight, so the writeback overlaps the copy instead of following it.
+//!
+//! Moving a region to another host runs the same engine on the destination
+//! host with a source descriptor received from the exporter, and
+//! `MigrateConfig::retire(false)`: the source is then retired by its owner.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Mutex, PoisonError};
+use std::time::{Duration, Instant};
+
+use anyhow::Context;
+use threadpool::ThreadPool;
+
+use crate::kernels::{self, StoreHint};
+use crate::mapping::{MapOptions, RegionMap};
+use crate::ownership::{Ownership, OwnershipMap};
+use crate::teardown::{self, Outcome, TeardownRegion};
+use crate::{MemId, ObmmExportFlags, ObmmMemDesc, UbPrivData, mem_export, mem_import};
+
+/// Bytes one worker copies before claiming the next chunk
+pub const DEFAULT_CHUNK: usize = 8 << 20_u32;
+
+/// Copied chunks handed over per ownership batch
+const DEFAULT_RELEASE_BATCH: usize = 8;
+
+/// How a `Migration` moves regions
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct MigrateConfig {
+    /// Bytes per copy job
+    chunk: usize,
+    /// Copied chunks released per ownership batch
+    release_batch: usize,
+    /// Compare source and destination before retiring the source
+    verify: bool,
+    /// Unexport the source once the destination holds the data
+    retire: bool,
+    /// Retry a busy source unexport with `ObmmUnexportFlags::FORCE`
+    force_fallback: bool,
+    /// Flags of the destination export
+    flags: ObmmExportFlags,
+}
+
+impl Default for MigrateConfig {
+    #[inline]
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl MigrateConfig {
+    /// 8M chunks released 8 at a time, no verification, source retired with `FORCE` fallback
+    #[inline]
+    #[must_use]
+    pub const fn new() -> Self {
+        MigrateConfig {
+            chunk: DEFAULT_CHUNK,
+            release_batch: DEFAULT_RELEASE_BATCH,
+            verify: false,
+            retire: true,
+            force_fallback: true,
+            flags: ObmmExportFlags::ALLOWMMAP,
+        }
+    }
+
+    /// Copy `chunk` bytes per job, rounded up to a multiple of 4K
+    #[inline]
+    #[must_use]
+    pub const fn chunk(mut self, chunk: usize) -> Self {
+        self.chunk = if chunk == 0 { 4096 } else { chunk.next_multiple_of(4096) };
+        self
+    }
+
+    /// Release copied chunks `batch` at a time, at least 1
+    #[inline]
+    #[must_use]
+    pub const fn release_batch(mut self, batch: usize) -> Self {
+        self.release_batch = if batch == 0 { 1 } else { batch };
+        self
+    }
+
+    /// Compare the copy against the source before the source is retired
+    #[inline]
+    #[must_use]
+    pub const fn verify(mut self, enabled: bool) -> Self {
+        self.verify = enabled;
+        self
+    }
+
+    /// Unexport the source after a successful copy
+    #[inline]
+    #[must_use]
+    pub const fn retire(mut self, enabled: bool) -> Self {
+        self.retire = enabled;
+        self
+    }
+
+    /// Retry a source unexport that fails with `EBUSY` with `ObmmUnexportFlags::FORCE`
+    #[inline]
+    #[must_use]
+    pub const fn force_fallback(mut self, enabled: bool) -> Self {
+        self.force_fallback = enabled;
+        self
+    }
+
+    /// Export the destination with `flags`
+    #[inline]
+    #[must_use]
+    pub const fn export_flags(mut self, flags: ObmmExportFlags) -> Self {
+        self.flags = flags;
+        self
+    }
+}
+
+/// Region to move
+#[derive(Debug, Clone)]
+#[non_exhaustive]
+pub struct MigrationSource {
+    /// Memory ID of the export, retired after the move
+    pub mem_id: MemId,
+    /// Descriptor of the export, imported locally to read it
+    pub desc: ObmmMemDesc<UbPrivData>,
+    /// NUMA node backing the export, `None` if unknown
+    pub numa: Option<usize>,
+}
+
+impl MigrationSource {
+    /// Export `mem_id` described by `desc`, backed by `numa`
+    #[inline]
+    #[must_use]
+    pub const fn new(mem_id: MemId, desc: ObmmMemDesc<UbPrivData>, numa: Option<usize>) -> Self {
+        MigrationSource { mem_id, desc, numa }
+    }
+}
+
+/// Progress of the copy, handed to the callback of `Migration::run` after every chunk
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct Progress {
+    /// Bytes copied so far
+    pub copied: u64,
+    /// Bytes to copy
+    pub total: u64,
+    /// Time since the copy started
+    pub elapsed: Duration,
+}
+
+impl Progress {
+    /// Average copy bandwidth so far
+    /// # Returns
+    /// Bytes per second, 0 before any time has passed
+    #[inline]
+    #[must_use]
+    pub fn bandwidth(&self) -> u64 {
+        bytes_per_sec(self.copied, self.elapsed)
+    }
+
+    /// Whether every byte has been copied
+    #[inline]
+    #[must_use]
+    pub const fn is_done(&self) -> bool {
+        self.copied >= self.total
+    }
+}
+
+/// What became of the source region
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum Retired {
+    /// Left exported, see `MigrateConfig::retire`
+    Kept,
+    /// Unexported
+    Released,
+    /// Unexported with `FORCE` after a plain unexport reported it busy
+    Forced,
+    /// Still exported, errno of the last unexport
+    Failed(i32),
+}
+
+/// Result of a finished move
+#[derive(Debug, Clone)]
+#[non_exhaustive]
+pub struct MigrationReport {
+    /// Memory ID of the destination export
+    pub mem_id: MemId,
+    /// Descriptor of the destination, to be handed to the consumers
+    pub desc: ObmmMemDesc<UbPrivData>,
+    /// Bytes moved
+    pub bytes: u64,
+    /// Chunks copied
+    pub chunks: usize,
+    /// Time spent exporting, importing and mapping
+    pub setup: Duration,
+    /// Time spent copying and handing the destination over
+    pub copy: Duration,
+    /// Time of the whole move, retirement included
+    pub total: Duration,
+    /// What became of the source
+    pub source: Retired,
+}
+
+impl MigrationReport {
+    /// Bandwidth of the copy phase
+    /// # Returns
+    /// Bytes per second, 0 if the copy took no measurable time
+    #[inline]
+    #[must_use]
+    pub fn bandwidth(&self) -> u64 {
+        bytes_per_sec(self.bytes, self.copy)
+    }
+}
+
+/// Moves regions with the workers of a pool
+#[derive(Debug, Clone, Copy)]
+pub struct Migration<'pool> {
+    /// Workers running the copy
+    pool: &'pool ThreadPool,
+    /// Chunking, verification and retirement
+    config: MigrateConfig,
+}
+
+impl<'pool> Migration<'pool> {
+    /// Move regions on `pool` as described by `config`
+    #[inline]
+    #[must_use]
+    pub const fn new(pool: &'pool ThreadPool, config: MigrateConfig) -> Self {
+        Migration { pool, config }
+    }
+
+    /// Move `source` to a new export of `lengths`, e.g. from `placement::NodeSet::lengths`
+    /// # Arguments
+    /// * `source` - Export to move
+    /// * `lengths` - Bytes of the destination on each NUMA node, summing to the source length
+    /// * `on_progress` - Called from the copying workers after every chunk
+    /// # Returns
+    /// # Errors
+    /// `MigrationReport` on success, `anyhow::Error` on failure; on failure the destination is
+    /// unexported again and the source left untouched
+    #[inline]
+    pub fn run<F>(&self, source: &MigrationSource, lengths: &[usize], on_progress: F) -> anyhow::Result<MigrationReport>
+    where
+        F: Fn(Progress) + Sync,
+    {
+        let started = Instant::now();
+        let len = usize::try_from(source.desc.length)?;
+        let planned = lengths.iter().try_fold(0_usize, |sum, &node| sum.checked_add(node));
+        if planned != Some(len) {
+            anyhow::bail!("Destination lengths do not add up to the {len} bytes of MemID {}", source.mem_id);
+        }
+
+        let (mem_id, desc) = mem_export::<UbPrivData>(lengths, self.config.flags)
+            .with_context(|| format!("Failed to export the destination of MemID {}", source.mem_id))?;
+        let copied = match self.transfer(source, &desc, len, started, &on_progress) {
+            Ok(copied) => copied,
+            Err(err) => {
+                let _ = teardown::release_inline(&TeardownRegion::exported(mem_id, None), true);
+                return Err(err.context(format!("Failed to migrate MemID {} to MemID {mem_id}", source.mem_id)));
+            }
+        };
+
+        let retired = if self.config.retire {
+            match teardown::release_inline(&TeardownRegion::exported(source.mem_id, source.numa), self.config.force_fallback) {
+                Outcome::Released => Retired::Released,
+                Outcome::Forced => Retired::Forced,
+                Outcome::Failed(errno) => Retired::Failed(errno),
+            }
+        } else {
+            Retired::Kept
+        };
+        Ok(MigrationReport {
+            mem_id,
+            desc,
+            bytes: u64::try_from(len)?,
+            chunks: len.div_ceil(self.config.chunk),
+            setup: copied.setup,
+            copy: copied.copy,
+            total: started.elapsed(),
+            source: retired,
+        })
+    }
+
+    /// Import source and destination, copy, and hand the destination over
+    fn transfer<F>(
+        &self,
+        source: &MigrationSource,
+        dest: &ObmmMemDesc<UbPrivData>,
+        len: usize,
+        started: Instant,
+        on_progress: &F,
+    ) -> anyhow::Result<Phases>
+    where
+        F: Fn(Progress) + Sync,
+    {
+        // declared before the maps, so every mapping is gone before its import
+        let src_import = LocalImport::new(&source.desc)?;
+        let dst_import = LocalImport::new(dest)?;
+        let src_cacheable = source.desc.priv_data.contains(UbPrivData::CACHEABLE);
+        let dst_cacheable = dest.priv_data.contains(UbPrivData::CACHEABLE);
+        let src_map = RegionMap::open(src_import.0, len, MapOptions::new().cacheable(src_cacheable))?;
+        let mut dst_map =
+            RegionMap::open(dst_import.0, len, MapOptions::new().writable(true).cacheable(dst_cacheable))?;
+
+        let src_base = src_map.as_mut_ptr().addr();
+        let dst_base = dst_map.as_mut_ptr().addr();
+        let mut src_owner = OwnershipMap::new(src_map.fd(), src_base, len, Ownership::None)?;
+        let _ = src_owner.set(src_base, src_base.saturating_add(len), Ownership::Reader)?;
+        let mut dst_owner = OwnershipMap::new(dst_map.fd(), dst_base, len, Ownership::None)?;
+        let _ = dst_owner.set(dst_base, dst_base.saturating_add(len), Ownership::Writer)?;
+        let setup = started.elapsed();
+
+        let copy_started = Instant::now();
+        let hint = StoreHint::for_region(dst_cacheable, len);
+        let releases = Mutex::new(Releases { owner: dst_owner, staged: 0 });
+        pipeline(
+            self.pool,
+            dst_map.as_mut_slice::<u8>()?,
+            src_map.as_slice::<u8>()?,
+            self.config.chunk,
+            hint,
+            |offset, chunk_len, progress| {
+                on_progress(progress);
+                let start = dst_base.saturating_add(offset);
+                let mut releases = releases.lock().unwrap_or_else(PoisonError::into_inner);
+                releases.owner.stage(start, start.saturating_add(chunk_len), Ownership::Reader)?;
+                releases.staged = releases.staged.saturating_add(1);
+                if releases.staged >= self.config.release_batch {
+                    releases.staged = 0;
+                    let _ = releases.owner.commit()?;
+                }
+                Ok(())
+            },
+        )?;
+        let mut releases = releases.into_inner().unwrap_or_else(PoisonError::into_inner);
+        let _ = releases.owner.commit()?;
+
+        if self.config.verify
+            && let Some(at) = kernels::par_mismatch(self.pool, dst_map.as_slice::<u8>()?, src_map.as_slice::<u8>()?)?
+        {
+            anyhow::bail!("Copy differs from the source at offset {at:#x}");
+        }
+        let _ = releases.owner.set(dst_base, dst_base.saturating_add(len), Ownership::None)?;
+        let _ = src_owner.set(src_base, src_base.saturating_add(len), Ownership::None)?;
+        Ok(Phases { setup, copy: copy_started.elapsed() })
+    }
+}
+
+/// Durations of the phases of `Migration::transfer`
+#[derive(Debug, Clone, Copy)]
+struct Phases {
+    /// Export, imports and mappings
+    setup: Duration,
+    /// Copy and hand-over
+    copy: Duration,
+}
+
+/// Destination ownership shared by the copying workers
+#[derive(Debug)]
+struct Releases {
+    /// Ownership of the destination mapping
+    owner: OwnershipMap,
+    /// Chunks staged since the last commit
+    staged: usize,
+}
+
+/// Import of a region on this node, unimported on drop
+#[derive(Debug)]
+struct LocalImport(MemId);
+
+impl LocalImport {
+    /// Import `desc` locally
+    fn new(desc: &ObmmMemDesc<UbPrivData>) -> anyhow::Result<Self> {
+        mem_import(desc, ObmmExportFlags::ALLOWMMAP, 0)
+            .map(|(mem_id, _)| LocalImport(mem_id))
+            .map_err(|errno| anyhow::anyhow!("Failed to import region at {:#x}: errno {errno}", desc.addr))
+    }
+}
+
+impl Drop for LocalImport {
+    fn drop(&mut self) {
+        let _ = teardown::release_inline(&TeardownRegion::imported(self.0, None), false);
+    }
+}
+
+/// Copy `src` into `dst` in `chunk` sized pieces claimed by the workers of `pool`
+///
+/// `after(offset, len, progress)` runs on the worker that copied `[offset, offset + len)`;
+/// the first error it returns is reported once every worker has stopped.
+fn pipeline<F>(
+    pool: &ThreadPool,
+    dst: &mut [u8],
+    src: &[u8],
+    chunk: usize,
+    hint: StoreHint,
+    after: F,
+) -> anyhow::Result<()>
+where
+    F: Fn(usize, usize, Progress) -> anyhow::Result<()> + Sync,
+{
+    if dst.len() != src.len() {
+        anyhow::bail!("Destination of {} bytes cannot hold a source of {} bytes", dst.len(), src.len());
+    }
+    let chunk = chunk.max(1);
+    let total = u64::try_from(src.len())?;
+    let workers = pool.size().max(1).min(src.len().div_ceil(chunk));
+    let pending = Mutex::new(dst.chunks_mut(chunk).zip(src.chunks(chunk)).enumerate());
+    let copied = AtomicU64::new(0);
+    let failure = Mutex::new(None);
+    let started = Instant::now();
+
+    pool.scope(|scope| -> anyhow::Result<()> {
+        for _ in 0..workers {
+            scope.spawn(|| {
+                loop {
+                    let next = pending.lock().unwrap_or_else(PoisonError::into_inner).next();
+                    let Some((index, (to, from))) = next else {
+                        break;
+                    };
+                    let result = kernels::copy(to, from, hint).and_then(|()| {
+                        let len = u64::try_from(from.len())?;
+                        let progress = Progress {
+                            copied: copied.fetch_add(len, Ordering::Relaxed).saturating_add(len),
+                            total,
+                            elapsed: started.elapsed(),
+                        };
+                        after(index.saturating_mul(chunk), from.len(), progress)
+                    });
+                    if let Err(err) = result {
+                        let _ = failure.lock().unwrap_or_else(PoisonError::into_inner).get_or_insert(err);
+                        break;
+                    }
+                }
+            })?;
+        }
+        Ok(())
+    })??;
+    failure.into_inner().unwrap_or_else(PoisonError::into_inner).map_or(Ok(()), Err)
+}
+
+/// `bytes` over `elapsed` in bytes per second, 0 if no time has passed
+fn bytes_per_sec(bytes: u64, elapsed: Duration) -> u64 {
+    u128::from(bytes)
+        .checked_mul(1_000_000_000)
+        .and_then(|scaled| scaled.checked_div(elapsed.as_nanos()))
+        .map_or(0, |rate| u64::try_from(rate).unwrap_or(u64::MAX))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_pipeline_copies_every_chunk() -> anyhow::Result<()> {
+        let pool = ThreadPool::new(4)?;
+        let src: Vec<u8> = (0..3 * DEFAULT_CHUNK + 12_345).map(|i| u8::try_from(i % 251).unwrap_or(0)).collect();
+        let mut dst = vec![0_u8; src.len()];
+        let seen = Mutex::new(Vec::new());
+        pipeline(&pool, &mut dst, &src, DEFAULT_CHUNK, StoreHint::NonTemporal, |offset, len, progress| {
+            seen.lock().unwrap_or_else(PoisonError::into_inner).push((offset, len, progress.copied));
+            Ok(())
+        })?;
+        assert_eq!(kernels::mismatch(&dst, &src), None);
+
+        let mut seen = seen.into_inner().unwrap_or_else(PoisonError::into_inner);
+        seen.sort_unstable();
+        let offsets: Vec<_> = seen.iter().map(|&(offset, len, _)| (offset, len)).collect();
+        assert_eq!(offsets, vec![(0, DEFAULT_CHUNK), (DEFAULT_CHUNK, DEFAULT_CHUNK), (2 * DEFAULT_CHUNK, DEFAULT_CHUNK), (3 * DEFAULT_CHUNK, 12_345)]);
+        assert_eq!(seen.iter().map(|&(_, _, copied)| copied).max(), Some(u64::try_from(src.len())?));
+
+        let failed = pipeline(&pool, &mut dst, &src, DEFAULT_CHUNK, StoreHint::Temporal, |offset, _, _| {
+            if offset == DEFAULT_CHUNK { Err(anyhow::anyhow!("chunk at {offset}")) } else { Ok(()) }
+        });
+        assert!(failed.is_err_and(|e| e.to_string().contains("chunk at")));
+        Ok(())
+    }
+
+    #[test]
+    fn test_migration_reports_progress_and_retires() -> anyhow::Result<()> {
+        let pool = ThreadPool::new(4)?;
+        let len = 5 * (2 << 20);
+        let bytes = u64::try_from(len)?;
+        let desc = ObmmMemDesc::<UbPrivData> { length: bytes, ..Default::default() };
+        let source = MigrationSource::new(7, desc, Some(0));
+        let calls = AtomicU64::new(0);
+        let config = MigrateConfig::new().chunk(2 << 20).release_batch(2).verify(true);
+
+        let report = Migration::new(&pool, config).run(&source, &[len / 2, len / 2], |progress| {
+            assert!(progress.copied <= progress.total);
+            let _ = calls.fetch_add(1, Ordering::Relaxed);
+        })?;
+        assert_eq!(calls.load(Ordering::Relaxed), 5);
+        assert_eq!((report.bytes, report.chunks, report.desc.length), (bytes, 5, bytes));
+        assert_eq!(report.source, Retired::Released);
+        assert!(report.total >= report.copy);
+
+        let kept = Migration::new(&pool, config.retire(false)).run(&source, &[len], |_| ())?;
+        assert_eq!(kept.source, Retired::Kept);
+        assert!(Migration::new(&pool, config).run(&source, &[len, 4096], |_| ()).is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,530 @@
+//! Ownership hand-off of OBMM memory device ranges
+//!
+//! Every `obmm_set_ownership` call is an ioctl that flushes or invalidates the
+//! cache lines of its range. Producers and consumers trading many scattered
+//! chunks would issue one per chunk, most of them redundant. `OwnershipMap`
+//! tracks the ownership of every byte of a mapping, stages requested
+//! transitions, and on `commit` drops the ones that change nothing, merges
+//! adjacent ranges heading for the same state and issues the rest as a single
+//! batched update.
+//!
+//! Each transition also carries an explicit cache operation. The map knows
+//! which writable ranges may hold dirty lines (`mark_clean` and `discard` tell
+//! it otherwise), so it only writes back what can actually be dirty and
+//! invalidates on acquire instead of on release of a clean range.
+
+use std::collections::BTreeMap;
+
+use crate::{mem_set_ownership_batch, CacheOp, ObmmOwnershipRange};
+
+/// Ownership of a range as seen by this node
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum Ownership {
+    /// No access, the peer owns the range
+    None,
+    /// Shared read access
+    Reader,
+    /// Exclusive read-write access
+    Writer,
+}
+
+impl Ownership {
+    /// Protection bits `obmm_set_ownership` expects for this state
+    /// # Returns
+    /// `PROT_NONE`, `PROT_READ` or `PROT_READ | PROT_WRITE`
+    #[inline]
+    #[must_use]
+    pub const fn prot(self) -> i32 {
+        match self {
+            Ownership::None => libc::PROT_NONE,
+            Ownership::Reader => libc::PROT_READ,
+            Ownership::Writer => libc::PROT_READ | libc::PROT_WRITE,
+        }
+    }
+}
+
+/// What the cache may hold for a writable range
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Lines {
+    /// Nothing newer than memory
+    Clean,
+    /// Possibly dirty lines that must reach memory
+    Dirty,
+    /// Possibly dirty lines whose contents may be dropped
+    Discard,
+}
+
+/// A maximal run of bytes in one state
+#[derive(Debug, Clone, Copy)]
+struct Extent {
+    /// End of the run, exclusive
+    end: usize,
+    /// State of the run
+    state: Ownership,
+    /// Cache contents of the run, only meaningful for `Ownership::Writer`
+    lines: Lines,
+    /// Cache operation requested for a staged transition, `None` to pick the cheapest safe one
+    cache: Option<CacheOp>,
+}
+
+impl Extent {
+    /// Whether `self` and `other` can be one extent
+    fn same_kind(&self, other: &Extent) -> bool {
+        self.state == other.state && self.lines == other.lines && self.cache == other.cache
+    }
+}
+
+/// Cheapest cache operation that keeps a transition of `lines` from `from` to `to` coherent
+///
+/// Stale lines are dropped when a range is acquired, since the peer may have
+/// written it meanwhile, so releasing a range only has to write back what may
+/// be dirty.
+const fn cheapest(from: Ownership, lines: Lines, to: Ownership) -> CacheOp {
+    match (from, to) {
+        (Ownership::None, Ownership::Reader | Ownership::Writer) => CacheOp::Invalidate,
+        (Ownership::Writer, Ownership::Reader) => match lines {
+            Lines::Clean => CacheOp::None,
+            Lines::Dirty => CacheOp::WritebackOnly,
+            Lines::Discard => CacheOp::Invalidate,
+        },
+        (Ownership::Writer, Ownership::None) => match lines {
+            Lines::Clean => CacheOp::None,
+            Lines::Dirty => CacheOp::WritebackInvalidate,
+            Lines::Discard => CacheOp::Invalidate,
+        },
+        (Ownership::None, Ownership::None)
+        | (Ownership::Reader, Ownership::None | Ownership::Reader | Ownership::Writer)
+        | (Ownership::Writer, Ownership::Writer) => CacheOp::None,
+    }
+}
+
+/// Extents keyed by start address, always covering the whole mapping and
+/// with no two neighbours in the same state
+type Extents = BTreeMap<usize, Extent>;
+
+/// Extent containing `addr`, `addr` must lie inside the mapping
+fn extent_at(extents: &Extents, addr: usize) -> Option<(usize, Extent)> {
+    extents.range(..=addr).next_back().map(|(&start, &extent)| (start, extent))
+}
+
+/// Split the extent containing `addr` so that an extent starts at `addr`
+fn split_at(extents: &mut Extents, addr: usize) {
+    if let Some((start, extent)) = extent_at(extents, addr).filter(|&(start, extent)| start < addr && addr < extent.end) {
+        let _ = extents.insert(start, Extent { end: addr, ..extent });
+        let _ = extents.insert(addr, extent);
+    }
+}
+
+/// Merge the extent starting at `addr` into its predecessor if they share a state
+fn merge_at(extents: &mut Extents, addr: usize) {
+    let Some(&next) = extents.get(&addr) else {
+        return;
+    };
+    if let Some(prev) = extents.range_mut(..addr).next_back().map(|(_, prev)| prev).filter(|prev| prev.same_kind(&next)) {
+        prev.end = next.end;
+        let _ = extents.remove(&addr);
+    }
+}
+
+/// Replace `[start, end)` by one extent like `extent`, both bounds inside the mapping
+fn assign(extents: &mut Extents, start: usize, end: usize, extent: Extent) {
+    split_at(extents, start);
+    split_at(extents, end);
+    let inner: Vec<usize> = extents.range(start..end).map(|(&addr, _)| addr).collect();
+    for addr in inner {
+        let _ = extents.remove(&addr);
+    }
+    let _ = extents.insert(start, Extent { end, ..extent });
+    merge_at(extents, end);
+    merge_at(extents, start);
+}
+
+/// Set the cache contents of the writable parts of `[start, end)` to `lines`
+fn set_lines(extents: &mut Extents, start: usize, end: usize, lines: Lines) {
+    split_at(extents, start);
+    split_at(extents, end);
+    let mut touched = Vec::new();
+    for (&addr, extent) in extents.range_mut(start..end) {
+        if extent.state == Ownership::Writer {
+            extent.lines = lines;
+        }
+        touched.push(addr);
+    }
+    merge_at(extents, end);
+    for addr in touched.into_iter().rev() {
+        merge_at(extents, addr);
+    }
+}
+
+/// Ownership state of one OBMM memory device mapping
+#[derive(Debug)]
+pub struct OwnershipMap {
+    /// File descriptor of the OBMM memory device
+    fd: i32,
+    /// Start of the mapping
+    base: usize,
+    /// End of the mapping, exclusive
+    end: usize,
+    /// State the device is known to be in
+    current: Extents,
+    /// State once the staged transitions are committed
+    target: Extents,
+    /// Ranges of the staged transitions
+    staged: Vec<(usize, usize)>,
+    /// Range updates issued so far
+    issued: u64,
+    /// Bytes of staged transitions dropped as no-ops so far
+    skipped: u64,
+    /// Bytes handed over with a writeback so far
+    written_back: u64,
+    /// Ranges made writable since the last `take_granted`
+    granted: Vec<(usize, usize)>,
+}
+
+impl OwnershipMap {
+    /// Track the mapping `[base, base + len)` of the device `fd`, currently all in `initial`
+    /// # Arguments
+    /// * `fd` - File descriptor of the OBMM memory device
+    /// * `base` - Start virtual address of the mapping
+    /// * `len` - Length of the mapping
+    /// * `initial` - Ownership the whole mapping starts in
+    /// # Returns
+    /// # Errors
+    /// `OwnershipMap` on success, `anyhow::Error` if the range is empty or overflows
+    #[inline]
+    pub fn new(fd: i32, base: usize, len: usize, initial: Ownership) -> anyhow::Result<Self> {
+        let end = base
+            .checked_add(len)
+            .filter(|&end| end > base)
+            .ok_or_else(|| anyhow::anyhow!("Invalid ownership range {base:#x}+{len:#x}"))?;
+        // a writable mapping may already hold dirty lines
+        let lines = if initial == Ownership::Writer { Lines::Dirty } else { Lines::Clean };
+        let current: Extents = BTreeMap::from([(base, Extent { end, state: initial, lines, cache: None })]);
+        Ok(OwnershipMap {
+            fd,
+            base,
+            end,
+            target: current.clone(),
+            current,
+            staged: Vec::new(),
+            issued: 0,
+            skipped: 0,
+            written_back: 0,
+            granted: Vec::new(),
+        })
+    }
+
+    /// Committed ownership of `addr`
+    /// # Returns
+    /// State of the byte at `addr`, `None` if it lies outside the mapping
+    #[inline]
+    #[must_use]
+    pub fn state(&self, addr: usize) -> Option<Ownership> {
+        (self.base..self.end)
+            .contains(&addr)
+            .then(|| extent_at(&self.current, addr).map(|(_, extent)| extent.state))
+            .flatten()
+    }
+
+    /// Committed state as `(start, end, state)` runs in address order
+    #[inline]
+    #[must_use]
+    pub fn extents(&self) -> Vec<(usize, usize, Ownership)> {
+        self.current.iter().map(|(&start, extent)| (start, extent.end, extent.state)).collect()
+    }
+
+    /// Stage a transition of `[start, end)` to `state`, later stages win where they overlap
+    /// # Arguments
+    /// * `start` - Start virtual address
+    /// * `end` - End virtual address, exclusive
+    /// * `state` - Ownership to hand the range to
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` if the range is empty or leaves the mapping
+    #[inline]
+    pub fn stage(&mut self, start: usize, end: usize, state: Ownership) -> anyhow::Result<()> {
+        self.stage_inner(start, end, state, None)
+    }
+
+    /// Stage a transition of `[start, end)` to `state` with cache maintenance `op`
+    ///
+    /// Overrides the operation the map would pick, e.g. `CacheOp::Invalidate`
+    /// for a range about to be overwritten by its next owner.
+    /// # Arguments
+    /// * `start` - Start virtual address
+    /// * `end` - End virtual address, exclusive
+    /// * `state` - Ownership to hand the range to
+    /// * `op` - Cache maintenance of the transition
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` if the range is empty or leaves the mapping
+    #[inline]
+    pub fn stage_with(&mut self, start: usize, end: usize, state: Ownership, op: CacheOp) -> anyhow::Result<()> {
+        self.stage_inner(start, end, state, Some(op))
+    }
+
+    /// Check that `[start, end)` is a non-empty part of the mapping
+    fn check(&self, start: usize, end: usize) -> anyhow::Result<()> {
+        if start >= end || start < self.base || end > self.end {
+            anyhow::bail!(
+                "Ownership range {start:#x}..{end:#x} is outside the mapping {:#x}..{:#x}",
+                self.base,
+                self.end
+            );
+        }
+        Ok(())
+    }
+
+    /// Stage a transition with an optional explicit cache operation
+    fn stage_inner(&mut self, start: usize, end: usize, state: Ownership, cache: Option<CacheOp>) -> anyhow::Result<()> {
+        self.check(start, end)?;
+        assign(&mut self.target, start, end, Extent { end, state, lines: Lines::Clean, cache });
+        self.staged.push((start, end));
+        Ok(())
+    }
+
+    /// Declare that the writable parts of `[start, end)` were only read since they were acquired
+    ///
+    /// Releasing them then skips the writeback.
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` if the range is empty or leaves the mapping
+    #[inline]
+    pub fn mark_clean(&mut self, start: usize, end: usize) -> anyhow::Result<()> {
+        self.check(start, end)?;
+        set_lines(&mut self.current, start, end, Lines::Clean);
+        Ok(())
+    }
+
+    /// Declare that the writable parts of `[start, end)` may have been written
+    ///
+    /// Freshly acquired writable ranges are dirty already; this undoes `mark_clean`.
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` if the range is empty or leaves the mapping
+    #[inline]
+    pub fn mark_dirty(&mut self, start: usize, end: usize) -> anyhow::Result<()> {
+        self.check(start, end)?;
+        set_lines(&mut self.current, start, end, Lines::Dirty);
+        Ok(())
+    }
+
+    /// Declare that the contents of the writable parts of `[start, end)` are garbage
+    ///
+    /// Releasing them then invalidates without writeback.
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` if the range is empty or leaves the mapping
+    #[inline]
+    pub fn discard(&mut self, start: usize, end: usize) -> anyhow::Result<()> {
+        self.check(start, end)?;
+        set_lines(&mut self.current, start, end, Lines::Discard);
+        Ok(())
+    }
+
+    /// Ranges whose staged state differs from the committed one, merged where adjacent
+    fn pending(&mut self) -> Vec<(ObmmOwnershipRange, Ownership)> {
+        let mut staged = core::mem::take(&mut self.staged);
+        staged.sort_unstable();
+        let mut ranges: Vec<(ObmmOwnershipRange, Ownership)> = Vec::new();
+        // staged ranges are walked in order; overlapping parts are only visited once
+        let mut addr = self.base;
+        for (start, end) in staged {
+            addr = addr.max(start);
+            while addr < end {
+                let (Some((_, target)), Some((_, current))) =
+                    (extent_at(&self.target, addr), extent_at(&self.current, addr))
+                else {
+                    break;
+                };
+                let next = target.end.min(current.end).min(end);
+                if target.state == current.state {
+                    let len = u64::try_from(next.saturating_sub(addr)).unwrap_or(u64::MAX);
+                    self.skipped = self.skipped.saturating_add(len);
+                } else {
+                    let op = target.cache.unwrap_or(cheapest(current.state, current.lines, target.state));
+                    let range = ObmmOwnershipRange::new(addr, next, target.state.prot()).with_cache_op(op);
+                    match ranges
+                        .last_mut()
+                        .filter(|&&mut (last, state)| last.end == addr && last.cache_ops == range.cache_ops && state == target.state)
+                    {
+                        Some(&mut (ref mut last, _)) => last.end = next,
+                        None => ranges.push((range, target.state)),
+                    }
+                }
+                addr = next;
+            }
+        }
+        ranges
+    }
+
+    /// Issue every staged transition that changes something, as one batch
+    /// # Returns
+    /// # Errors
+    /// Number of range updates issued on success, `anyhow::Error` if any of them failed;
+    /// the ranges that did succeed are committed either way and the rest are left unstaged
+    #[inline]
+    pub fn commit(&mut self) -> anyhow::Result<usize> {
+        let pending = self.pending();
+        if pending.is_empty() {
+            return Ok(0);
+        }
+        let ranges: Vec<ObmmOwnershipRange> = pending.iter().map(|&(range, _)| range).collect();
+        let results = mem_set_ownership_batch(self.fd, &ranges);
+        self.issued = self.issued.saturating_add(u64::try_from(ranges.len()).unwrap_or(u64::MAX));
+
+        let mut failed = Vec::new();
+        for (&(range, state), result) in pending.iter().zip(results) {
+            match result {
+                Ok(()) => {
+                    if [CacheOp::WritebackInvalidate.bits(), CacheOp::WritebackOnly.bits()].contains(&range.cache_ops) {
+                        let len = u64::try_from(range.end.saturating_sub(range.start)).unwrap_or(u64::MAX);
+                        self.written_back = self.written_back.saturating_add(len);
+                    }
+                    // a range just made writable is assumed written until `mark_clean`
+                    let lines = if state == Ownership::Writer { Lines::Dirty } else { Lines::Clean };
+                    if state == Ownership::Writer {
+                        self.granted.push((range.start, range.end));
+                    }
+                    assign(&mut self.current, range.start, range.end, Extent { end: range.end, state, lines, cache: None });
+                }
+                Err(errno) => failed.push(format!("{:#x}..{:#x}: errno {errno}", range.start, range.end)),
+            }
+        }
+        self.target.clone_from(&self.current);
+        if failed.is_empty() {
+            Ok(ranges.len())
+        } else {
+            Err(anyhow::anyhow!("Failed to set ownership of {}", failed.join(", ")))
+        }
+    }
+
+    /// Stage and commit a single transition
+    /// # Arguments
+    /// * `start` - Start virtual address
+    /// * `end` - End virtual address, exclusive
+    /// * `state` - Ownership to hand the range to
+    /// # Returns
+    /// # Errors
+    /// Number of range updates issued on success, `anyhow::Error` on failure
+    #[inline]
+    pub fn set(&mut self, start: usize, end: usize, state: Ownership) -> anyhow::Result<usize> {
+        self.stage(start, end, state)?;
+        self.commit()
+    }
+
+    /// Ranges granted `Ownership::Writer` by `commit` since the last call
+    ///
+    /// Everything written locally lies inside these ranges, which makes them
+    /// the dirty set of an incremental resync, see [`crate::resync::DirtyChunks::mark_grants`].
+    #[inline]
+    #[must_use]
+    pub fn take_granted(&mut self) -> Vec<(usize, usize)> {
+        std::mem::take(&mut self.granted)
+    }
+
+    /// Bytes handed over with a writeback so far
+    #[inline]
+    #[must_use]
+    pub const fn written_back(&self) -> u64 {
+        self.written_back
+    }
+
+    /// Range updates issued over the lifetime of the map
+    #[inline]
+    #[must_use]
+    pub const fn issued(&self) -> u64 {
+        self.issued
+    }
+
+    /// Bytes of staged transitions dropped because they changed nothing
+    #[inline]
+    #[must_use]
+    pub const fn skipped(&self) -> u64 {
+        self.skipped
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const BASE: usize = 0x10_0000;
+    const PAGE: usize = 0x1000;
+
+    #[test]
+    fn test_commit_merges_and_skips() -> anyhow::Result<()> {
+        let mut map = OwnershipMap::new(-1, BASE, 16 * PAGE, Ownership::None)?;
+        // four adjacent chunks heading to the same state become one update
+        for i in 0..4 {
+            map.stage(BASE + i * PAGE, BASE + (i + 1) * PAGE, Ownership::Writer)?;
+        }
+        // a scattered chunk in another state is a second one
+        map.stage(BASE + 8 * PAGE, BASE + 10 * PAGE, Ownership::Reader)?;
+        assert_eq!(map.commit()?, 2);
+        assert_eq!(map.state(BASE + 3 * PAGE), Some(Ownership::Writer));
+        assert_eq!(map.state(BASE + 5 * PAGE), Some(Ownership::None));
+        assert_eq!(map.extents().len(), 4);
+
+        // re-granting what is already held issues nothing
+        assert_eq!(map.set(BASE, BASE + 2 * PAGE, Ownership::Writer)?, 0);
+        assert_eq!(map.skipped(), u64::try_from(2 * PAGE)?);
+        // a transition undone before commit issues nothing either
+        map.stage(BASE + 12 * PAGE, BASE + 13 * PAGE, Ownership::Writer)?;
+        map.stage(BASE + 12 * PAGE, BASE + 13 * PAGE, Ownership::None)?;
+        assert_eq!(map.commit()?, 0);
+        assert_eq!(map.issued(), 2);
+
+        // only the part that changes is updated, and neighbours coalesce again
+        assert_eq!(map.set(BASE, BASE + 10 * PAGE, Ownership::None)?, 2);
+        assert_eq!(map.extents(), vec![(BASE, BASE + 16 * PAGE, Ownership::None)]);
+        Ok(())
+    }
+
+    #[test]
+    fn test_cache_ops_follow_dirty_tracking() -> anyhow::Result<()> {
+        let mut map = OwnershipMap::new(-1, BASE, 8 * PAGE, Ownership::None)?;
+        // acquiring drops stale lines
+        map.stage(BASE, BASE + 8 * PAGE, Ownership::Writer)?;
+        let ops: Vec<i32> = map.pending().iter().map(|&(range, _)| range.cache_ops).collect();
+        assert_eq!(ops, vec![CacheOp::Invalidate.bits()]);
+        map.target.clone_from(&map.current);
+        assert_eq!(map.set(BASE, BASE + 8 * PAGE, Ownership::Writer)?, 1);
+
+        // written, only read and scrapped chunks are released with different ops
+        map.mark_clean(BASE + 2 * PAGE, BASE + 4 * PAGE)?;
+        map.discard(BASE + 4 * PAGE, BASE + 6 * PAGE)?;
+        map.stage(BASE, BASE + 6 * PAGE, Ownership::None)?;
+        map.stage(BASE + 6 * PAGE, BASE + 8 * PAGE, Ownership::Reader)?;
+        let released: Vec<(usize, usize, i32)> =
+            map.pending().iter().map(|&(range, _)| (range.start, range.end, range.cache_ops)).collect();
+        assert_eq!(
+            released,
+            vec![
+                (BASE, BASE + 2 * PAGE, CacheOp::WritebackInvalidate.bits()),
+                (BASE + 2 * PAGE, BASE + 4 * PAGE, CacheOp::None.bits()),
+                (BASE + 4 * PAGE, BASE + 6 * PAGE, CacheOp::Invalidate.bits()),
+                (BASE + 6 * PAGE, BASE + 8 * PAGE, CacheOp::WritebackOnly.bits()),
+            ]
+        );
+
+        // an explicit op wins, and only real writebacks are accounted
+        map.stage_with(BASE, BASE + 6 * PAGE, Ownership::None, CacheOp::Invalidate)?;
+        map.stage(BASE + 6 * PAGE, BASE + 8 * PAGE, Ownership::Reader)?;
+        assert_eq!(map.commit()?, 2);
+        assert_eq!(map.written_back(), u64::try_from(2 * PAGE)?);
+        assert_eq!(map.state(BASE + 7 * PAGE), Some(Ownership::Reader));
+        Ok(())
+    }
+
+    #[test]
+    fn test_stage_rejects_out_of_range() -> anyhow::Result<()> {
+        let mut map = OwnershipMap::new(-1, BASE, PAGE, Ownership::Reader)?;
+        assert!(map.stage(BASE - 1, BASE + 1, Ownership::Writer).is_err());
+        assert!(map.stage(BASE, BASE + PAGE + 1, Ownership::Writer).is_err());
+        assert!(map.stage(BASE + 1, BASE + 1, Ownership::Writer).is_err());
+        assert_eq!(map.state(BASE + PAGE), None);
+        Ok(())
+    }
+}
@@ -0,0 +1,387 @@
+//! Placement of one exported region across NUMA nodes
+//!
+//! `obmm_export` takes one length per local NUMA node and backs the region with
+//! memory of every node that has a non-zero length. `NodeSet` reads the free
+//! memory, memory bandwidth and distances of the nodes from sysfs, and
+//! `NodeSet::lengths` turns a total size and a `Policy` into that length
+//! vector, so a large region can be striped over every socket instead of
+//! draining a single one.
+
+use std::collections::BTreeMap;
+use std::fs;
+use std::path::Path;
+
+use anyhow::Context;
+
+use crate::hugepage::HUGE_PAGE_SIZE;
+use crate::{OBMM_MAX_LOCAL_NUMA_NODES, controller_numa};
+
+/// Unit of placement, every per node length is a multiple of it
+pub const PLACEMENT_GRANULE: usize = HUGE_PAGE_SIZE;
+
+/// Where the kernel lists the NUMA nodes
+const NODE_SYSFS: &str = "/sys/devices/system/node";
+
+/// Distance the kernel reports for unrelated nodes
+const UNKNOWN_DISTANCE: u32 = u32::MAX;
+
+/// How one region is spread over the nodes
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum Policy {
+    /// Equal share on every node with free memory
+    Interleave,
+    /// Share proportional to the free memory of the node
+    Capacity,
+    /// Share proportional to the read bandwidth of the node, equal if unknown
+    Bandwidth,
+    /// Fill the given node first, then the nodes nearest to it
+    Closest(usize),
+}
+
+impl Policy {
+    /// `Policy::Closest` to the NUMA node of the UB bus controller with `eid`
+    /// # Returns
+    /// # Errors
+    /// Policy on success, Err(i32) if no controller has `eid`
+    #[inline]
+    pub fn closest_to(eid: &[u8; 16]) -> Result<Self, i32> {
+        controller_numa(eid).map(Policy::Closest)
+    }
+}
+
+/// Memory of one NUMA node
+#[derive(Debug, Clone, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct NodeMemInfo {
+    /// Node number
+    pub id: usize,
+    /// Free bytes
+    pub free: usize,
+    /// Read bandwidth from the nearest initiator in MB/s, `None` without HMAT
+    pub read_bandwidth: Option<u64>,
+    /// Distance to other nodes by node number, 10 to the node itself
+    pub distance: BTreeMap<usize, u32>,
+}
+
+impl NodeMemInfo {
+    /// Node `id` with `free` bytes and nothing else known
+    #[inline]
+    #[must_use]
+    pub const fn new(id: usize, free: usize) -> Self {
+        NodeMemInfo { id, free, read_bandwidth: None, distance: BTreeMap::new() }
+    }
+
+    /// Same node with a known read bandwidth
+    #[inline]
+    #[must_use]
+    pub const fn with_bandwidth(mut self, read_bandwidth: u64) -> Self {
+        self.read_bandwidth = Some(read_bandwidth);
+        self
+    }
+
+    /// Distance to node `to`, `u32::MAX` if unknown
+    #[inline]
+    #[must_use]
+    pub fn distance_to(&self, to: usize) -> u32 {
+        self.distance.get(&to).copied().unwrap_or(UNKNOWN_DISTANCE)
+    }
+
+    /// Granules the node can take
+    fn capacity(&self) -> usize {
+        self.free.checked_div(PLACEMENT_GRANULE).unwrap_or(0)
+    }
+}
+
+/// Share of one node while a placement is computed
+#[derive(Debug)]
+struct Share {
+    /// Node number
+    id: usize,
+    /// Weight of the node under the policy
+    weight: u64,
+    /// Granules the node can take
+    capacity: usize,
+    /// Granules placed so far
+    placed: usize,
+}
+
+impl Share {
+    /// Granules the node can still take
+    const fn room(&self) -> usize {
+        self.capacity.saturating_sub(self.placed)
+    }
+}
+
+/// NUMA nodes an export can be placed on
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct NodeSet {
+    /// Nodes ordered by number
+    nodes: Vec<NodeMemInfo>,
+}
+
+impl NodeSet {
+    /// Read the nodes from `/sys/devices/system/node`
+    ///
+    /// Without NUMA support the directory is missing and the host is one node 0
+    /// holding the free memory of `/proc/meminfo`.
+    /// # Returns
+    /// # Errors
+    /// `NodeSet` on success, `anyhow::Error` if sysfs cannot be parsed
+    #[inline]
+    pub fn detect() -> anyhow::Result<Self> {
+        if !Path::new(NODE_SYSFS).exists() {
+            let meminfo = fs::read_to_string("/proc/meminfo").context("Failed to read /proc/meminfo")?;
+            return Ok(Self::from_nodes(vec![NodeMemInfo::new(0, parse_mem_free(&meminfo)?)]));
+        }
+
+        let mut nodes = Vec::new();
+        for entry in fs::read_dir(NODE_SYSFS).with_context(|| format!("Failed to read {NODE_SYSFS}"))? {
+            let path = entry?.path();
+            let Some(id) = path
+                .file_name()
+                .and_then(|name| name.to_str())
+                .and_then(|name| name.strip_prefix("node"))
+                .and_then(|id| id.parse().ok())
+            else {
+                continue;
+            };
+            let meminfo = fs::read_to_string(path.join("meminfo"))
+                .with_context(|| format!("Failed to read meminfo of node {id}"))?;
+            let mut node = NodeMemInfo::new(id, parse_mem_free(&meminfo)?);
+            node.read_bandwidth = fs::read_to_string(path.join("access0/initiators/read_bandwidth"))
+                .ok()
+                .and_then(|bandwidth| bandwidth.trim().parse().ok())
+                .filter(|&bandwidth| bandwidth != 0);
+            nodes.push((node, fs::read_to_string(path.join("distance")).unwrap_or_default()));
+        }
+        if nodes.is_empty() {
+            anyhow::bail!("No NUMA nodes found under {NODE_SYSFS}");
+        }
+
+        // the distance file lists one value per online node, in node order
+        nodes.sort_by_key(|entry| entry.0.id);
+        let ids: Vec<usize> = nodes.iter().map(|entry| entry.0.id).collect();
+        Ok(Self::from_nodes(
+            nodes
+                .into_iter()
+                .map(|(mut node, distance)| {
+                    node.distance =
+                        ids.iter().copied().zip(distance.split_whitespace().filter_map(|d| d.parse().ok())).collect();
+                    node
+                })
+                .collect(),
+        ))
+    }
+
+    /// Node set of `nodes`
+    #[inline]
+    #[must_use]
+    pub fn from_nodes(mut nodes: Vec<NodeMemInfo>) -> Self {
+        nodes.sort_by_key(|node| node.id);
+        NodeSet { nodes }
+    }
+
+    /// Nodes ordered by number
+    #[inline]
+    #[must_use]
+    pub fn nodes(&self) -> &[NodeMemInfo] {
+        &self.nodes
+    }
+
+    /// Free bytes on the nodes `obmm_export` can allocate from
+    #[inline]
+    #[must_use]
+    pub fn free(&self) -> usize {
+        self.usable().fold(0, |free, node| free.saturating_add(node.free))
+    }
+
+    /// Per node lengths of a `total` byte region placed by `policy`
+    /// # Arguments
+    /// * `total` - Region size, a non-zero multiple of `PLACEMENT_GRANULE`
+    /// * `policy` - How the region is spread
+    /// # Returns
+    /// # Errors
+    /// Length vector for `mem_export` on success, `anyhow::Error` if `total` is
+    /// misaligned or does not fit in the free memory the policy may use
+    #[inline]
+    pub fn lengths(&self, total: usize, policy: Policy) -> anyhow::Result<[usize; OBMM_MAX_LOCAL_NUMA_NODES]> {
+        if total == 0 || !total.is_multiple_of(PLACEMENT_GRANULE) {
+            anyhow::bail!("Region size {total} is not a non-zero multiple of {PLACEMENT_GRANULE}");
+        }
+        let granules = total.checked_div(PLACEMENT_GRANULE).unwrap_or(0);
+        let shares = match policy {
+            Policy::Interleave => self.fill_weighted(granules, |_| 1),
+            Policy::Capacity => self.fill_weighted(granules, |node| u64::try_from(node.capacity()).unwrap_or(u64::MAX)),
+            Policy::Bandwidth if self.usable().all(|node| node.read_bandwidth.is_some()) => {
+                self.fill_weighted(granules, |node| node.read_bandwidth.unwrap_or(0))
+            }
+            Policy::Bandwidth => self.fill_weighted(granules, |_| 1),
+            Policy::Closest(numa) => self.fill_closest(granules, numa)?,
+        };
+
+        let placed = shares.iter().fold(0_usize, |placed, share| placed.saturating_add(share.placed));
+        if placed < granules {
+            anyhow::bail!(
+                "Region size {total} exceeds the {} free bytes {policy:?} can place",
+                placed.saturating_mul(PLACEMENT_GRANULE)
+            );
+        }
+        let mut lengths = [0_usize; OBMM_MAX_LOCAL_NUMA_NODES];
+        for share in shares {
+            if let Some(length) = lengths.get_mut(share.id) {
+                *length = share.placed.saturating_mul(PLACEMENT_GRANULE);
+            }
+        }
+        Ok(lengths)
+    }
+
+    /// Nodes with an `obmm_export` length slot
+    fn usable(&self) -> impl Iterator<Item = &NodeMemInfo> {
+        self.nodes.iter().filter(|node| node.id < OBMM_MAX_LOCAL_NUMA_NODES)
+    }
+
+    /// Place `granules` in proportion to `weight`, no node beyond its capacity
+    ///
+    /// Each round hands the remaining granules out by weight among the nodes with
+    /// room left; what a full node could not take goes to the others next round.
+    /// Once the shares round down to nothing, the heaviest nodes get one granule each.
+    fn fill_weighted(&self, granules: usize, weight: impl Fn(&NodeMemInfo) -> u64) -> Vec<Share> {
+        let mut shares: Vec<Share> = self
+            .usable()
+            .map(|node| Share { id: node.id, weight: weight(node), capacity: node.capacity(), placed: 0 })
+            .filter(|share| share.weight != 0 && share.capacity != 0)
+            .collect();
+        // heaviest first, so the leftover granules of a round go to them
+        shares.sort_by(|a, b| b.weight.cmp(&a.weight).then(a.id.cmp(&b.id)));
+
+        let mut left = granules;
+        while left != 0 {
+            let open: u128 =
+                shares.iter().filter(|share| share.room() != 0).map(|share| u128::from(share.weight)).sum();
+            if open == 0 {
+                break;
+            }
+            let round = u128::try_from(left).unwrap_or(u128::MAX);
+            let mut given = 0_usize;
+            for share in shares.iter_mut().filter(|share| share.room() != 0) {
+                let portion = round.saturating_mul(u128::from(share.weight)).checked_div(open).unwrap_or(0);
+                let take = usize::try_from(portion).unwrap_or(usize::MAX).min(share.room());
+                share.placed = share.placed.saturating_add(take);
+                given = given.saturating_add(take);
+            }
+            if given == 0 {
+                for share in shares.iter_mut().filter(|share| share.room() != 0).take(left) {
+                    share.placed = share.placed.saturating_add(1);
+                    given = given.saturating_add(1);
+                }
+            }
+            left = left.saturating_sub(given);
+        }
+        shares
+    }
+
+    /// Place `granules` on `numa` first, then on the nodes by distance from it
+    fn fill_closest(&self, granules: usize, numa: usize) -> anyhow::Result<Vec<Share>> {
+        let origin = self.nodes.iter().find(|node| node.id == numa).with_context(|| format!("No NUMA node {numa}"))?;
+        let mut shares: Vec<Share> = self
+            .usable()
+            .map(|node| Share { id: node.id, weight: 0, capacity: node.capacity(), placed: 0 })
+            .collect();
+        shares.sort_by_key(|share| (share.id != numa, origin.distance_to(share.id), share.id.abs_diff(numa)));
+
+        let mut left = granules;
+        for share in &mut shares {
+            share.placed = share.room().min(left);
+            left = left.saturating_sub(share.placed);
+        }
+        Ok(shares)
+    }
+}
+
+/// Free bytes of a `meminfo` file, node or system wide
+fn parse_mem_free(meminfo: &str) -> anyhow::Result<usize> {
+    let kb = meminfo
+        .lines()
+        .find_map(|line| line.split_once("MemFree:"))
+        .and_then(|(_, value)| value.trim().strip_suffix("kB"))
+        .and_then(|value| value.trim().parse::<usize>().ok())
+        .context("No MemFree in meminfo")?;
+    Ok(kb.saturating_mul(1024))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const GIB: usize = 1 << 30_u32;
+
+    fn two_sockets() -> NodeSet {
+        let mut near = NodeMemInfo::new(0, 8 * GIB).with_bandwidth(200_000);
+        let mut far = NodeMemInfo::new(1, 2 * GIB).with_bandwidth(100_000);
+        near.distance = BTreeMap::from([(0, 10), (1, 21), (2, 31)]);
+        far.distance = BTreeMap::from([(0, 21), (1, 10), (2, 16)]);
+        let mut pooled = NodeMemInfo::new(2, 4 * GIB).with_bandwidth(100_000);
+        pooled.distance = BTreeMap::from([(0, 31), (1, 16), (2, 10)]);
+        NodeSet::from_nodes(vec![pooled, far, near])
+    }
+
+    fn sum(lengths: &[usize]) -> usize {
+        lengths.iter().sum()
+    }
+
+    #[test]
+    fn test_placement_weighted() -> anyhow::Result<()> {
+        let nodes = two_sockets();
+        assert_eq!(nodes.free(), 14 * GIB);
+
+        let interleave = nodes.lengths(6 * GIB, Policy::Interleave)?;
+        assert_eq!(interleave[..3], [2 * GIB, 2 * GIB, 2 * GIB]);
+
+        // node 1 fills up, its share moves to the other two
+        let spill = nodes.lengths(9 * GIB, Policy::Interleave)?;
+        assert_eq!(spill[..3], [3584 * 1024 * 1024, 2 * GIB, 3584 * 1024 * 1024]);
+
+        let capacity = nodes.lengths(7 * GIB, Policy::Capacity)?;
+        assert_eq!(capacity[..3], [4 * GIB, GIB, 2 * GIB]);
+
+        let bandwidth = nodes.lengths(4 * GIB, Policy::Bandwidth)?;
+        assert_eq!(bandwidth[..3], [2 * GIB, GIB, GIB]);
+
+        // fewer granules than nodes
+        let small = nodes.lengths(2 * PLACEMENT_GRANULE, Policy::Interleave)?;
+        assert_eq!(sum(&small), 2 * PLACEMENT_GRANULE);
+        assert!(small.iter().all(|&length| length <= PLACEMENT_GRANULE));
+        Ok(())
+    }
+
+    #[test]
+    fn test_placement_closest_and_limits() -> anyhow::Result<()> {
+        let nodes = two_sockets();
+        let local = nodes.lengths(GIB, Policy::Closest(1))?;
+        assert_eq!(local[..3], [0, GIB, 0]);
+        let spill = nodes.lengths(5 * GIB, Policy::Closest(1))?;
+        assert_eq!(spill[..3], [0, 2 * GIB, 3 * GIB]);
+        let from_zero = nodes.lengths(10 * GIB, Policy::Closest(0))?;
+        assert_eq!(from_zero[..3], [8 * GIB, 2 * GIB, 0]);
+
+        assert!(nodes.lengths(15 * GIB, Policy::Capacity).is_err());
+        assert!(nodes.lengths(GIB + 4096, Policy::Interleave).is_err());
+        assert!(nodes.lengths(0, Policy::Interleave).is_err());
+        assert!(nodes.lengths(GIB, Policy::Closest(7)).is_err());
+
+        // unknown bandwidth on one node falls back to interleave
+        let mixed = NodeSet::from_nodes(vec![NodeMemInfo::new(0, GIB).with_bandwidth(1), NodeMemInfo::new(1, GIB)]);
+        assert_eq!(mixed.lengths(GIB, Policy::Bandwidth)?[..2], [GIB / 2, GIB / 2]);
+        Ok(())
+    }
+
+    #[test]
+    fn test_placement_detect() -> anyhow::Result<()> {
+        let nodes = NodeSet::detect()?;
+        assert!(!nodes.nodes().is_empty());
+        assert_eq!(parse_mem_free("Node 0 MemFree:         1024 kB\n")?, 1 << 20_u32);
+        Ok(())
+    }
+}
@@ -0,0 +1,482 @@
+//! Warm pool of preimported address ranges
+//!
+//! Declaring a preimport range (`OBMM_CMD_DECLARE_PREIMPORT`) onlines the remote
+//! NUMA node behind it and is far slower than the import that follows. The pool
+//! declares ranges ahead of time on a `ThreadPool`, serves every import that
+//! falls inside a declared range with `ObmmImportFlags::PREIMPORT`, and keeps
+//! `warm_per_node` idle ranges declared per node by refilling in the background,
+//! so the attach path only pays for the import itself.
+
+use std::collections::HashMap;
+use std::sync::{Arc, Condvar, Mutex, MutexGuard, PoisonError};
+
+use threadpool::ThreadPool;
+
+use crate::{
+    MemId, ObmmExportFlags, ObmmImportFlags, ObmmMemDesc, ObmmPreimportInfo, UbPrivData,
+    mem_import_on, mem_preimport, mem_unimport, mem_unpreimport,
+};
+
+/// Lifecycle of one preimport range
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Phase {
+    /// Not declared
+    Cold,
+    /// Declaration in flight
+    Declaring,
+    /// Declared and usable for imports
+    Warm,
+    /// Declaration failed with the given errno, not retried
+    Failed(i32),
+}
+
+/// One configured range
+#[derive(Debug)]
+struct Range {
+    /// Range as declared; `numa_id` is the actual node once warm
+    info: ObmmPreimportInfo<UbPrivData>,
+    /// NUMA node the range was configured for, used to count warm ranges
+    node: i32,
+    /// Current phase
+    phase: Phase,
+    /// Live imports inside the range
+    imports: usize,
+}
+
+impl Range {
+    /// Whether `desc` lies entirely inside this range
+    fn covers(&self, desc: &ObmmMemDesc<UbPrivData>) -> bool {
+        let end = self.info.pa.checked_add(self.info.length);
+        let desc_end = desc.addr.checked_add(desc.length);
+        desc.addr >= self.info.pa && desc_end.is_some() && desc_end <= end
+    }
+
+    /// Whether the range counts towards the warm target of its node
+    fn idle(&self) -> bool {
+        self.phase == Phase::Declaring || (self.phase == Phase::Warm && self.imports == 0)
+    }
+}
+
+/// State shared with the refill jobs
+#[derive(Debug)]
+struct State {
+    /// Configured ranges
+    ranges: Vec<Range>,
+    /// Range index of every import made through the pool
+    imports: HashMap<MemId, usize>,
+    /// Set when the pool is dropped, stops refilling
+    closed: bool,
+}
+
+/// Lock-protected pool state
+#[derive(Debug)]
+struct Inner {
+    /// Pool state
+    state: Mutex<State>,
+    /// Signalled whenever a declaration finishes
+    changed: Condvar,
+}
+
+impl Inner {
+    /// Lock the state, ignoring poisoning
+    fn lock(&self) -> MutexGuard<'_, State> {
+        self.state.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+
+    /// Declare range `idx`, which the caller has moved to `Phase::Declaring`
+    fn declare(&self, idx: usize) {
+        let Some(mut info) = self.lock().ranges.get(idx).map(|range| range.info.clone()) else {
+            return;
+        };
+        let result = mem_preimport(&mut info, ObmmImportFlags::empty());
+
+        // a range declared after the pool closed is undeclared by `PreimportPool::drop`
+        let mut state = self.lock();
+        if let Some(range) = state.ranges.get_mut(idx) {
+            range.phase = match result {
+                Ok(()) => {
+                    range.info = info;
+                    Phase::Warm
+                }
+                Err(errno) => Phase::Failed(errno),
+            };
+        }
+        drop(state);
+        self.changed.notify_all();
+    }
+}
+
+/// Pool of preimport ranges kept declared ahead of imports
+#[derive(Debug)]
+pub struct PreimportPool {
+    /// Shared state
+    inner: Arc<Inner>,
+    /// Runs the background declarations
+    workers: Arc<ThreadPool>,
+    /// Idle declared ranges to keep per NUMA node
+    warm_per_node: usize,
+}
+
+impl PreimportPool {
+    /// Create a pool over `ranges` and start declaring `warm_per_node` of them
+    /// per NUMA node on `workers`
+    /// # Arguments
+    /// * `workers` - Thread pool running the background declarations
+    /// * `ranges` - Physical address ranges available for preimport
+    /// * `warm_per_node` - Idle declared ranges to keep per NUMA node
+    #[inline]
+    #[must_use]
+    pub fn new(
+        workers: Arc<ThreadPool>,
+        ranges: Vec<ObmmPreimportInfo<UbPrivData>>,
+        warm_per_node: usize,
+    ) -> Self {
+        let ranges = ranges
+            .into_iter()
+            .map(|info| Range {
+                node: info.numa_id,
+                info,
+                phase: Phase::Cold,
+                imports: 0,
+            })
+            .collect();
+        let pool = PreimportPool {
+            inner: Arc::new(Inner {
+                state: Mutex::new(State {
+                    ranges,
+                    imports: HashMap::new(),
+                    closed: false,
+                }),
+                changed: Condvar::new(),
+            }),
+            workers,
+            warm_per_node,
+        };
+        pool.refill();
+        pool
+    }
+
+    /// Import `desc`, from a warm range when one covers it
+    ///
+    /// A cold covering range is declared inline; a descriptor outside every
+    /// range, or inside one whose declaration failed, is imported without
+    /// `PREIMPORT`.
+    /// # Arguments
+    /// * `desc` - Memory Descriptor from remote
+    /// * `flags` - Import flags, `PREIMPORT` is added for warm ranges
+    /// * `base_dist` - Base distribution hint
+    /// # Returns
+    /// # Errors
+    /// Tuple of Memory ID and NUMA node on success, errno on failure
+    #[inline]
+    pub fn import(
+        &self,
+        desc: &ObmmMemDesc<UbPrivData>,
+        flags: ObmmImportFlags,
+        base_dist: i32,
+    ) -> Result<(MemId, i32), i32> {
+        let cold_flags = flags.difference(ObmmImportFlags::PREIMPORT);
+        let mut state = self.inner.lock();
+        let Some(idx) = state.ranges.iter().position(|range| range.covers(desc)) else {
+            drop(state);
+            return mem_import_on(desc, cold_flags, base_dist, -1);
+        };
+        let numa = loop {
+            let Some(range) = state.ranges.get_mut(idx) else {
+                return Err(libc::EINVAL);
+            };
+            match range.phase {
+                Phase::Warm => {
+                    range.imports = range.imports.saturating_add(1);
+                    break range.info.numa_id;
+                }
+                Phase::Declaring => {
+                    state = self
+                        .inner
+                        .changed
+                        .wait(state)
+                        .unwrap_or_else(PoisonError::into_inner);
+                }
+                Phase::Cold => {
+                    range.phase = Phase::Declaring;
+                    drop(state);
+                    self.inner.declare(idx);
+                    state = self.inner.lock();
+                }
+                Phase::Failed(_) => {
+                    drop(state);
+                    return mem_import_on(desc, cold_flags, base_dist, -1);
+                }
+            }
+        };
+        drop(state);
+
+        let result = mem_import_on(
+            desc,
+            flags.union(ObmmImportFlags::PREIMPORT),
+            base_dist,
+            numa,
+        );
+        state = self.inner.lock();
+        match result {
+            Ok((memid, _)) => {
+                let _ = state.imports.insert(memid, idx);
+            }
+            Err(_) => {
+                if let Some(range) = state.ranges.get_mut(idx) {
+                    range.imports = range.imports.saturating_sub(1);
+                }
+            }
+        }
+        drop(state);
+        self.refill();
+        result
+    }
+
+    /// Unimport a region imported through `import`, its range stays declared
+    /// # Arguments
+    /// * `memid` - Memory ID returned by `import`
+    /// * `flags` - Unimport flags
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, Err(i32) on failure
+    #[inline]
+    pub fn unimport(&self, memid: MemId, flags: ObmmExportFlags) -> Result<(), i32> {
+        mem_unimport(memid, flags)?;
+        self.forget(memid);
+        Ok(())
+    }
+
+    /// Stop counting an import of the pool that was unimported elsewhere
+    ///
+    /// For imports released without `unimport`, e.g. by a `teardown::Teardown`.
+    /// # Arguments
+    /// * `memid` - Memory ID returned by `import`
+    #[inline]
+    pub fn forget(&self, memid: MemId) {
+        let mut guard = self.inner.lock();
+        let state = &mut *guard;
+        if let Some(range) = state
+            .imports
+            .remove(&memid)
+            .and_then(|idx| state.ranges.get_mut(idx))
+        {
+            range.imports = range.imports.saturating_sub(1);
+        }
+    }
+
+    /// Idle declared ranges on `node`, not counting declarations in flight
+    #[inline]
+    #[must_use]
+    pub fn warm(&self, node: i32) -> usize {
+        self.inner
+            .lock()
+            .ranges
+            .iter()
+            .filter(|range| range.node == node && range.phase == Phase::Warm && range.imports == 0)
+            .count()
+    }
+
+    /// NUMA nodes the ranges were configured for
+    #[inline]
+    #[must_use]
+    pub fn nodes(&self) -> Vec<i32> {
+        let mut nodes: Vec<i32> = self
+            .inner
+            .lock()
+            .ranges
+            .iter()
+            .map(|range| range.node)
+            .collect();
+        nodes.sort_unstable();
+        nodes.dedup();
+        nodes
+    }
+
+    /// Forget the declarations of `node` after its topology changed
+    ///
+    /// Idle warm ranges are undeclared and failed ones forgotten, then the pool
+    /// refills against the current topology. Ranges with live imports stay
+    /// declared until those are unimported.
+    /// # Returns
+    /// Number of ranges reset
+    #[inline]
+    #[must_use]
+    pub fn invalidate_node(&self, node: i32) -> usize {
+        self.wait_idle();
+        let mut state = self.inner.lock();
+        let mut reset = 0_usize;
+        for range in state.ranges.iter_mut().filter(|range| range.node == node) {
+            let idle = match range.phase {
+                Phase::Warm => {
+                    range.imports == 0
+                        && mem_unpreimport(&range.info, ObmmImportFlags::empty()).is_ok()
+                }
+                Phase::Failed(_) => true,
+                Phase::Cold | Phase::Declaring => false,
+            };
+            if idle {
+                range.phase = Phase::Cold;
+                reset = reset.saturating_add(1);
+            }
+        }
+        drop(state);
+        self.refill();
+        reset
+    }
+
+    /// Block until no declaration is in flight
+    #[inline]
+    pub fn wait_idle(&self) {
+        let mut state = self.inner.lock();
+        while state
+            .ranges
+            .iter()
+            .any(|range| range.phase == Phase::Declaring)
+        {
+            state = self
+                .inner
+                .changed
+                .wait(state)
+                .unwrap_or_else(PoisonError::into_inner);
+        }
+    }
+
+    /// Start background declarations until every node has `warm_per_node`
+    /// idle ranges or runs out of cold ones
+    fn refill(&self) {
+        let mut state = self.inner.lock();
+        if state.closed {
+            return;
+        }
+        let mut pending = Vec::new();
+        let mut nodes: Vec<i32> = state.ranges.iter().map(|range| range.node).collect();
+        nodes.sort_unstable();
+        nodes.dedup();
+        for node in nodes {
+            let mut idle = state
+                .ranges
+                .iter()
+                .filter(|range| range.node == node && range.idle())
+                .count();
+            for (idx, range) in state.ranges.iter_mut().enumerate() {
+                if idle >= self.warm_per_node {
+                    break;
+                }
+                if range.node == node && range.phase == Phase::Cold {
+                    range.phase = Phase::Declaring;
+                    idle = idle.saturating_add(1);
+                    pending.push(idx);
+                }
+            }
+        }
+        drop(state);
+
+        for idx in pending {
+            let inner = Arc::clone(&self.inner);
+            if self.workers.execute(move || inner.declare(idx)).is_err() {
+                if let Some(range) = self.inner.lock().ranges.get_mut(idx) {
+                    range.phase = Phase::Cold;
+                }
+                self.inner.changed.notify_all();
+            }
+        }
+    }
+}
+
+impl Drop for PreimportPool {
+    /// Undeclare every idle warm range; ranges with live imports stay declared
+    #[inline]
+    fn drop(&mut self) {
+        self.inner.lock().closed = true;
+        self.wait_idle();
+        let mut state = self.inner.lock();
+        for range in &mut state.ranges {
+            if range.phase == Phase::Warm
+                && range.imports == 0
+                && mem_unpreimport(&range.info, ObmmImportFlags::empty()).is_ok()
+            {
+                range.phase = Phase::Cold;
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn range(pa: u64, numa_id: i32) -> ObmmPreimportInfo<UbPrivData> {
+        ObmmPreimportInfo::<UbPrivData> {
+            pa,
+            length: 1 << 30_u32,
+            numa_id,
+            priv_len: 2,
+            ..Default::default()
+        }
+    }
+
+    fn desc_at(addr: u64) -> ObmmMemDesc<UbPrivData> {
+        let mut desc = ObmmMemDesc::<UbPrivData>::new();
+        desc.addr = addr;
+        desc.length = 1 << 21_u32;
+        desc
+    }
+
+    #[test]
+    fn test_preimport_pool_refills() -> anyhow::Result<()> {
+        let workers = Arc::new(ThreadPool::new(2)?);
+        let ranges = vec![
+            range(0x1_0000_0000, 2),
+            range(0x2_0000_0000, 2),
+            range(0x3_0000_0000, 3),
+        ];
+        let pool = PreimportPool::new(workers, ranges, 1);
+        pool.wait_idle();
+        assert_eq!(pool.warm(2), 1);
+        assert_eq!(pool.warm(3), 1);
+
+        // importing into the warm range of node 2 declares its second range
+        let (memid, numa) = pool
+            .import(&desc_at(0x1_0000_0000), ObmmImportFlags::NUMAREMOTE, 0)
+            .map_err(|e| anyhow::anyhow!("import failed: {e}"))?;
+        assert_eq!(numa, 2);
+        pool.wait_idle();
+        assert_eq!(pool.warm(2), 1);
+
+        pool.unimport(memid, ObmmExportFlags::empty())
+            .map_err(|e| anyhow::anyhow!("unimport failed: {e}"))?;
+        assert_eq!(pool.warm(2), 2);
+        Ok(())
+    }
+
+    #[test]
+    fn test_preimport_pool_cold_paths() -> anyhow::Result<()> {
+        let workers = Arc::new(ThreadPool::new(1)?);
+        let pool = PreimportPool::new(
+            workers,
+            vec![range(0x1_0000_0000, 4), range(0x2_0000_0000, 4)],
+            0,
+        );
+        pool.wait_idle();
+        assert_eq!(pool.warm(4), 0);
+
+        // a cold covering range is declared inline
+        let (_, numa) = pool
+            .import(&desc_at(0x2_0010_0000), ObmmImportFlags::empty(), 0)
+            .map_err(|e| anyhow::anyhow!("import failed: {e}"))?;
+        assert_eq!(numa, 4);
+        // outside every range falls back to a plain import
+        assert!(
+            pool.import(&desc_at(0x9_0000_0000), ObmmImportFlags::empty(), 0)
+                .is_ok()
+        );
+        // straddling the end of a range is not covered
+        assert!(
+            pool.import(&desc_at(0x1_3ff0_0000), ObmmImportFlags::empty(), 0)
+                .is_ok()
+        );
+        assert_eq!(pool.warm(4), 0);
+        Ok(())
+    }
+}
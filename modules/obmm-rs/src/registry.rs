@@ -0,0 +1,544 @@
+//! Host-wide, memory-mapped registry of memory descriptors keyed by `MemId`
+//!
+//! A single file holds a fixed-size open-addressing table. Every memlink process
+//! on the host maps it shared, so a lookup is a hash probe over mapped memory:
+//! no syscall, no file per descriptor, no JSON parsing.
+//!
+//! Every slot is a seqlock. Readers never block: they copy the slot out and
+//! retry if its sequence changed. Writers serialize on `flock` and bump the
+//! sequence to odd while they write. A writer that crashes mid-update leaves an
+//! odd sequence behind; readers skip that slot and the next writer (or the next
+//! `open`) clears it, so the table itself always stays consistent. Descriptors
+//! are stored in the [`wire`] encoding.
+
+use std::fs::{File, OpenOptions};
+use std::os::fd::AsRawFd;
+use std::os::unix::fs::OpenOptionsExt;
+use std::path::Path;
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering, fence};
+
+use crate::wire::{self, PrivPayload};
+use crate::{MemId, ObmmMemDesc, OBMM_INVALID_MEMID};
+
+/// Default registry location, next to the legacy per-descriptor JSON files
+pub const DEFAULT_REGISTRY_PATH: &str = "/tmp/memlink/registry";
+/// Default number of slots for a newly created registry
+pub const DEFAULT_REGISTRY_SLOTS: u32 = 4096;
+
+/// File magic
+const REGISTRY_MAGIC: [u8; 8] = *b"OBMMREG1";
+/// File layout version
+const REGISTRY_VERSION: u32 = 1;
+/// Bytes reserved for the file header
+const HEADER_LEN: usize = 64;
+/// Bytes per slot
+const SLOT_LEN: usize = 256;
+/// Payload words per slot
+const PAYLOAD_WORDS: usize = 29;
+/// Largest encoded descriptor a slot can hold
+pub const MAX_ENCODED_LEN: usize = PAYLOAD_WORDS * 8;
+/// Key of a slot that was used and then removed
+const TOMBSTONE: MemId = MemId::MAX;
+/// How often a reader retries a slot that is being written before giving up on it
+const READ_RETRIES: u32 = 1024;
+
+/// On-disk file header, padded to `HEADER_LEN`
+#[repr(C, align(64))]
+#[derive(Debug)]
+struct Header {
+    /// `REGISTRY_MAGIC`
+    magic: [u8; 8],
+    /// `REGISTRY_VERSION`
+    version: u32,
+    /// Number of slots, a power of two
+    slot_count: u32,
+    /// `SLOT_LEN`
+    slot_len: u32,
+    /// Zero
+    reserved: [u32; 11],
+}
+
+/// One table entry, shared between processes
+#[repr(C)]
+#[derive(Debug)]
+struct Slot {
+    /// Seqlock sequence, odd while a writer is updating the slot
+    seq: AtomicU64,
+    /// `MemId`, `OBMM_INVALID_MEMID` if never used, `TOMBSTONE` if removed
+    key: AtomicU64,
+    /// Length of the encoded descriptor in `payload`
+    len: AtomicU32,
+    /// Zero
+    reserved: AtomicU32,
+    /// Encoded descriptor, little-endian words
+    payload: [AtomicU64; PAYLOAD_WORDS],
+}
+
+/// Consistent copy of a slot taken by a reader
+#[derive(Debug)]
+struct SlotSnapshot {
+    /// Key at the time of the copy
+    key: MemId,
+    /// Valid length of `bytes`
+    len: usize,
+    /// Payload bytes
+    bytes: [u8; MAX_ENCODED_LEN],
+}
+
+/// Memory-mapped descriptor registry
+#[derive(Debug)]
+pub struct DescRegistry {
+    /// Backing file, kept open for writer locking
+    file: File,
+    /// Start of the shared mapping, slots follow the header
+    base: NonNull<Header>,
+    /// Length of the mapping
+    map_len: usize,
+    /// Number of slots
+    slot_count: usize,
+}
+
+// SAFETY: the mapping is only accessed through atomics in `Slot`, the header is
+// immutable after `open`.
+unsafe impl Send for DescRegistry {}
+// SAFETY: see above.
+unsafe impl Sync for DescRegistry {}
+
+/// Holds the registry-wide writer lock until dropped
+#[derive(Debug)]
+struct WriteLock<'a> {
+    /// Locked file
+    file: &'a File,
+}
+
+impl<'a> WriteLock<'a> {
+    /// Take the exclusive `flock` on `file`
+    fn acquire(file: &'a File) -> anyhow::Result<Self> {
+        // SAFETY: flock on a valid fd has no memory-safety requirements.
+        if unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_EX) } != 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+        Ok(WriteLock { file })
+    }
+}
+
+impl Drop for WriteLock<'_> {
+    #[inline]
+    fn drop(&mut self) {
+        // SAFETY: see `acquire`.
+        let _ = unsafe { libc::flock(self.file.as_raw_fd(), libc::LOCK_UN) };
+    }
+}
+
+impl DescRegistry {
+    /// Open the registry at [`DEFAULT_REGISTRY_PATH`], creating it if needed
+    /// # Returns
+    /// # Errors
+    /// `DescRegistry` on success, `anyhow::Error` on failure
+    #[inline]
+    pub fn open_default() -> anyhow::Result<Self> {
+        Self::open(DEFAULT_REGISTRY_PATH, DEFAULT_REGISTRY_SLOTS)
+    }
+
+    /// Open the registry at `path`, creating it with `slots` slots (rounded up
+    /// to a power of two) if it does not exist yet
+    /// # Returns
+    /// # Errors
+    /// `DescRegistry` on success, `anyhow::Error` on failure
+    #[inline]
+    pub fn open<P: AsRef<Path>>(path: P, slots: u32) -> anyhow::Result<Self> {
+        let path = path.as_ref();
+        if let Some(dir) = path.parent() {
+            std::fs::create_dir_all(dir)?;
+        }
+        let file = OpenOptions::new().read(true).write(true).create(true).truncate(false).mode(0o600).open(path)?;
+        let lock = WriteLock::acquire(&file)?;
+
+        let created = file.metadata()?.len() == 0;
+        let new_slots = if created {
+            let count = slots.max(1).checked_next_power_of_two().ok_or_else(|| anyhow::anyhow!("too many slots"))?;
+            file.set_len(u64::try_from(file_len(usize::try_from(count)?)?)?)?;
+            count
+        } else {
+            0
+        };
+        let map_len = usize::try_from(file.metadata()?.len())?;
+        if map_len < HEADER_LEN {
+            anyhow::bail!("registry {} is truncated", path.display());
+        }
+
+        // SAFETY: mapping a regular file we hold open; the result is checked below.
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                map_len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error().into());
+        }
+        let base = NonNull::new(ptr.cast::<Header>()).ok_or_else(|| anyhow::anyhow!("mmap returned null"))?;
+        let mut registry = DescRegistry { file: file.try_clone()?, base, map_len, slot_count: 0 };
+
+        let header = base.as_ptr();
+        let slot_len = u32::try_from(SLOT_LEN)?;
+        if created {
+            // SAFETY: the mapping is at least HEADER_LEN bytes and page aligned; other
+            // openers are blocked on the lock until the header is complete.
+            unsafe {
+                header.write(Header {
+                    magic: REGISTRY_MAGIC,
+                    version: REGISTRY_VERSION,
+                    slot_count: new_slots,
+                    slot_len,
+                    reserved: [0; 11],
+                });
+            }
+        }
+        // SAFETY: as above, the header is only written at creation under the lock.
+        let header = unsafe { header.read() };
+        if header.magic != REGISTRY_MAGIC || header.version != REGISTRY_VERSION || header.slot_len != slot_len {
+            anyhow::bail!("{} is not a version {REGISTRY_VERSION} descriptor registry", path.display());
+        }
+        let slot_count = usize::try_from(header.slot_count)?;
+        if !slot_count.is_power_of_two() || file_len(slot_count)? > map_len {
+            anyhow::bail!("registry {} has a corrupt header", path.display());
+        }
+        registry.slot_count = slot_count;
+
+        for idx in 0..slot_count {
+            Self::repair(registry.slot(idx));
+        }
+        drop(lock);
+        Ok(registry)
+    }
+
+    /// Number of slots in the table
+    #[inline]
+    #[must_use]
+    pub fn capacity(&self) -> usize {
+        self.slot_count
+    }
+
+    /// Look up the descriptor registered for `mem_id`
+    ///
+    /// Lock-free and syscall-free; a slot whose writer crashed mid-update is
+    /// treated as absent.
+    /// # Returns
+    /// # Errors
+    /// `Some(ObmmMemDesc)` if registered, `None` if not, `anyhow::Error` if the
+    /// stored descriptor cannot be decoded as `T`
+    #[inline]
+    pub fn lookup<T: PrivPayload + Default>(&self, mem_id: MemId) -> anyhow::Result<Option<ObmmMemDesc<T>>> {
+        if mem_id == OBMM_INVALID_MEMID || mem_id == TOMBSTONE {
+            return Ok(None);
+        }
+        for idx in self.probe(mem_id) {
+            let Some(snapshot) = Self::read_slot(self.slot(idx)) else {
+                continue;
+            };
+            if snapshot.key == OBMM_INVALID_MEMID {
+                return Ok(None);
+            }
+            if snapshot.key == mem_id {
+                let bytes = snapshot.bytes.get(..snapshot.len).unwrap_or_default();
+                return Ok(Some(wire::decode(bytes)?));
+            }
+        }
+        Ok(None)
+    }
+
+    /// Register `desc` under `mem_id`, replacing any previous entry
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` if the table is full or the
+    /// descriptor does not fit in a slot
+    #[inline]
+    pub fn insert<T: PrivPayload>(&self, mem_id: MemId, desc: &ObmmMemDesc<T>) -> anyhow::Result<()> {
+        if mem_id == OBMM_INVALID_MEMID || mem_id == TOMBSTONE {
+            anyhow::bail!("invalid memory id {mem_id}");
+        }
+        let mut bytes = [0_u8; MAX_ENCODED_LEN];
+        let len = wire::encode_into(desc, &mut bytes)?;
+
+        let _lock = WriteLock::acquire(&self.file)?;
+        let mut target = None;
+        for idx in self.probe(mem_id) {
+            let slot = self.slot(idx);
+            Self::repair(slot);
+            let key = slot.key.load(Ordering::Relaxed);
+            if key == mem_id {
+                target = Some(slot);
+                break;
+            }
+            if key == TOMBSTONE && target.is_none() {
+                target = Some(slot);
+            }
+            if key == OBMM_INVALID_MEMID {
+                target = target.or(Some(slot));
+                break;
+            }
+        }
+        let slot = target.ok_or_else(|| anyhow::anyhow!("descriptor registry is full"))?;
+        Self::write_slot(slot, mem_id, &bytes, len);
+        Ok(())
+    }
+
+    /// Remove the entry for `mem_id`
+    /// # Returns
+    /// # Errors
+    /// `true` if an entry was removed, `anyhow::Error` if the lock cannot be taken
+    #[inline]
+    pub fn remove(&self, mem_id: MemId) -> anyhow::Result<bool> {
+        if mem_id == OBMM_INVALID_MEMID || mem_id == TOMBSTONE {
+            return Ok(false);
+        }
+        let _lock = WriteLock::acquire(&self.file)?;
+        for idx in self.probe(mem_id) {
+            let slot = self.slot(idx);
+            Self::repair(slot);
+            let key = slot.key.load(Ordering::Relaxed);
+            if key == OBMM_INVALID_MEMID {
+                break;
+            }
+            if key == mem_id {
+                Self::write_slot(slot, TOMBSTONE, &[], 0);
+                return Ok(true);
+            }
+        }
+        Ok(false)
+    }
+
+    /// Remove every entry `stale` picks, e.g. descriptors invalidated by a topology change
+    ///
+    /// Scans the whole table under the writer lock; entries that cannot be
+    /// decoded as `T` are kept.
+    /// # Returns
+    /// # Errors
+    /// Number of entries removed, `anyhow::Error` if the lock cannot be taken
+    #[inline]
+    pub fn purge<T, F>(&self, stale: F) -> anyhow::Result<usize>
+    where
+        T: PrivPayload + Default,
+        F: Fn(MemId, &ObmmMemDesc<T>) -> bool,
+    {
+        let _lock = WriteLock::acquire(&self.file)?;
+        let mut purged = 0_usize;
+        for idx in 0..self.slot_count {
+            let slot = self.slot(idx);
+            Self::repair(slot);
+            let Some(snapshot) = Self::read_slot(slot) else {
+                continue;
+            };
+            if snapshot.key == OBMM_INVALID_MEMID || snapshot.key == TOMBSTONE {
+                continue;
+            }
+            let bytes = snapshot.bytes.get(..snapshot.len).unwrap_or_default();
+            if wire::decode::<T>(bytes).is_ok_and(|desc| stale(snapshot.key, &desc)) {
+                Self::write_slot(slot, TOMBSTONE, &[], 0);
+                purged = purged.saturating_add(1);
+            }
+        }
+        Ok(purged)
+    }
+
+    /// Flush the mapping to the backing file
+    /// # Returns
+    /// # Errors
+    /// Ok(()) on success, `anyhow::Error` on failure
+    #[inline]
+    pub fn sync(&self) -> anyhow::Result<()> {
+        // SAFETY: msync over exactly our own mapping.
+        if unsafe { libc::msync(self.base.as_ptr().cast(), self.map_len, libc::MS_SYNC) } != 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+        Ok(())
+    }
+
+    /// Slot indices to probe for `mem_id`, in order
+    fn probe(&self, mem_id: MemId) -> impl Iterator<Item = usize> {
+        let mask = self.slot_count.wrapping_sub(1);
+        let start = usize::try_from(mix(mem_id)).unwrap_or_default() & mask;
+        (0..self.slot_count).map(move |i| start.wrapping_add(i) & mask)
+    }
+
+    /// Slot `idx`, which must be below `slot_count`
+    fn slot(&self, idx: usize) -> &Slot {
+        debug_assert!(idx < self.slot_count);
+        // SAFETY: `open` checked that all `slot_count` slots lie inside the mapping
+        // right after the 64-byte aligned header, and slots consist of atomics only.
+        unsafe { &*self.base.as_ptr().add(1).cast::<Slot>().add(idx) }
+    }
+
+    /// Clear a slot whose writer died mid-update; writer lock must be held
+    fn repair(slot: &Slot) {
+        let seq = slot.seq.load(Ordering::Relaxed);
+        if seq & 1 == 1 {
+            slot.key.store(TOMBSTONE, Ordering::Relaxed);
+            slot.len.store(0, Ordering::Relaxed);
+            slot.seq.store(seq.wrapping_add(1), Ordering::Release);
+        }
+    }
+
+    /// Seqlock read of a slot, `None` if it stayed mid-update for too long
+    fn read_slot(slot: &Slot) -> Option<SlotSnapshot> {
+        let mut snapshot = SlotSnapshot { key: OBMM_INVALID_MEMID, len: 0, bytes: [0; MAX_ENCODED_LEN] };
+        for _ in 0..READ_RETRIES {
+            let before = slot.seq.load(Ordering::Acquire);
+            if before & 1 == 1 {
+                std::hint::spin_loop();
+                continue;
+            }
+            snapshot.key = slot.key.load(Ordering::Relaxed);
+            snapshot.len = usize::try_from(slot.len.load(Ordering::Relaxed)).unwrap_or_default().min(MAX_ENCODED_LEN);
+            for (word, chunk) in slot.payload.iter().zip(snapshot.bytes.chunks_exact_mut(8)) {
+                chunk.copy_from_slice(&word.load(Ordering::Relaxed).to_le_bytes());
+            }
+            fence(Ordering::Acquire);
+            if slot.seq.load(Ordering::Relaxed) == before {
+                return Some(snapshot);
+            }
+        }
+        None
+    }
+
+    /// Seqlock write of a slot; writer lock must be held
+    fn write_slot(slot: &Slot, key: MemId, bytes: &[u8], len: usize) {
+        let seq = slot.seq.load(Ordering::Relaxed);
+        slot.seq.store(seq.wrapping_add(1), Ordering::Relaxed);
+        fence(Ordering::Release);
+        for (word, chunk) in slot.payload.iter().zip(bytes.chunks(8)) {
+            let mut le = [0_u8; 8];
+            if let Some(dst) = le.get_mut(..chunk.len()) {
+                dst.copy_from_slice(chunk);
+            }
+            word.store(u64::from_le_bytes(le), Ordering::Relaxed);
+        }
+        slot.len.store(u32::try_from(len).unwrap_or_default(), Ordering::Relaxed);
+        slot.key.store(key, Ordering::Relaxed);
+        slot.seq.store(seq.wrapping_add(2), Ordering::Release);
+    }
+}
+
+impl Drop for DescRegistry {
+    #[inline]
+    fn drop(&mut self) {
+        // SAFETY: unmapping exactly the mapping created in `open`.
+        let _ = unsafe { libc::munmap(self.base.as_ptr().cast(), self.map_len) };
+    }
+}
+
+/// File length needed for `slot_count` slots
+fn file_len(slot_count: usize) -> anyhow::Result<usize> {
+    slot_count
+        .checked_mul(SLOT_LEN)
+        .and_then(|len| len.checked_add(HEADER_LEN))
+        .ok_or_else(|| anyhow::anyhow!("registry of {slot_count} slots is too large"))
+}
+
+/// splitmix64 finalizer, spreads sequential memory ids over the table
+const fn mix(mut x: u64) -> u64 {
+    x ^= x >> 30_u32;
+    x = x.wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    x ^= x >> 27_u32;
+    x = x.wrapping_mul(0x94d0_49bb_1331_11eb);
+    x ^ (x >> 31_u32)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::UbPrivData;
+
+    fn registry_path(name: &str) -> anyhow::Result<std::path::PathBuf> {
+        let path = std::env::temp_dir().join(format!("obmm-registry-{name}-{}", std::process::id()));
+        if path.exists() {
+            std::fs::remove_file(&path)?;
+        }
+        Ok(path)
+    }
+
+    fn sample(tokenid: u32) -> ObmmMemDesc<UbPrivData> {
+        ObmmMemDesc::<UbPrivData> {
+            addr: 0xffff_fc00_0000,
+            length: 1024 * 1024 * 128,
+            seid: [1; 16],
+            deid: [2; 16],
+            tokenid,
+            scna: 3,
+            dcna: 4,
+            priv_len: 2,
+            priv_data: UbPrivData::CACHEABLE,
+        }
+    }
+
+    #[test]
+    fn test_registry_insert_lookup_remove() -> anyhow::Result<()> {
+        let path = registry_path("basic")?;
+        let registry = DescRegistry::open(&path, 16)?;
+        assert_eq!(registry.capacity(), 16);
+
+        registry.insert(7, &sample(42))?;
+        let desc = registry.lookup::<UbPrivData>(7)?.ok_or_else(|| anyhow::anyhow!("missing"))?;
+        assert_eq!(desc.tokenid, 42);
+        assert_eq!(desc.priv_data, UbPrivData::CACHEABLE);
+        assert!(registry.lookup::<UbPrivData>(8)?.is_none());
+
+        registry.insert(7, &sample(43))?;
+        assert_eq!(registry.lookup::<UbPrivData>(7)?.map(|d| d.tokenid), Some(43));
+
+        assert!(registry.remove(7)?);
+        assert!(!registry.remove(7)?);
+        assert!(registry.lookup::<UbPrivData>(7)?.is_none());
+        std::fs::remove_file(&path)?;
+        Ok(())
+    }
+
+    #[test]
+    fn test_registry_shared_between_mappings() -> anyhow::Result<()> {
+        let path = registry_path("shared")?;
+        let writer = DescRegistry::open(&path, 8)?;
+        // an existing registry keeps its own size
+        let reader = DescRegistry::open(&path, 1024)?;
+        assert_eq!(reader.capacity(), 8);
+
+        for mem_id in 1..=8 {
+            writer.insert(mem_id, &sample(u32::try_from(mem_id)?))?;
+        }
+        assert!(writer.insert(9, &sample(9)).is_err());
+        for mem_id in 1..=8 {
+            assert_eq!(reader.lookup::<UbPrivData>(mem_id)?.map(|d| d.tokenid), Some(u32::try_from(mem_id)?));
+        }
+
+        // tombstones are reused
+        assert!(reader.remove(3)?);
+        writer.insert(9, &sample(9))?;
+        assert_eq!(reader.lookup::<UbPrivData>(9)?.map(|d| d.tokenid), Some(9));
+        std::fs::remove_file(&path)?;
+        Ok(())
+    }
+
+    #[test]
+    fn test_registry_recovers_torn_slot() -> anyhow::Result<()> {
+        let path = registry_path("torn")?;
+        let registry = DescRegistry::open(&path, 4)?;
+        registry.insert(5, &sample(5))?;
+        let torn = registry.probe(5).next().map(|idx| registry.slot(idx)).ok_or_else(|| anyhow::anyhow!("no slot"))?;
+        // simulate a writer that died between the two sequence bumps
+        torn.seq.store(torn.seq.load(Ordering::Relaxed).wrapping_add(1), Ordering::Release);
+        assert!(registry.lookup::<UbPrivData>(5)?.is_none());
+
+        drop(registry);
+        let reopened = DescRegistry::open(&path, 4)?;
+        assert!(reopened.lookup::<UbPrivData>(5)?.is_none());
+        reopened.insert(5, &sample(6))?;
+        assert_eq!(reopened.lookup::<UbPrivData>(5)?.map(|d| d.tokenid), Some(6));
+        std::fs::remove_file(&path)?;
+        Ok(())
+    }
+}
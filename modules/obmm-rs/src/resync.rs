@@ -0,0 +1,459 @@
+//! Incremental resync of a locally cached copy of a region
+//!
+//! Refreshing a cached copy of a multi-GB region by copying all of it moves
+//! mostly unchanged bytes across the bus. `Resync` splits the region into
+//! fixed chunks and copies only the dirty ones. A chunk is dirty either because
+//! the writer said so, `DirtyChunks::mark_grants` turns the write grants of an
+//! `OwnershipMap` into chunks, or because its checksum changed: the owner of
+//! the data computes a `ChunkDigest` where the data is local and hands it to
+//! the importer, which compares it against the digest of its last sync.
+//!
+//! The chunk defaults to the 2M page `mem_export_useraddr` requires, so a
+//! cached copy exported onwards is dirtied and resynced one page at a time.
+
+use serde::{Deserialize, Serialize};
+use threadpool::ThreadPool;
+
+use crate::hugepage::HUGE_PAGE_SIZE;
+use crate::kernels::{self, StoreHint};
+
+/// Granule every chunk length has to be a multiple of
+const MIN_CHUNK: usize = 4096;
+
+/// Dirty chunks copied by one job at most
+const RUN_CHUNKS: usize = 8;
+
+/// Bits per bitmap word
+const WORD_BITS: usize = 64;
+
+/// Check that `chunk` is a non-zero multiple of 4K
+fn check_chunk(chunk: usize) -> anyhow::Result<()> {
+    if chunk == 0 || !chunk.is_multiple_of(MIN_CHUNK) {
+        anyhow::bail!("Chunk size {chunk} is not a non-zero multiple of {MIN_CHUNK}");
+    }
+    Ok(())
+}
+
+/// Number of `chunk` sized chunks covering `len` bytes
+const fn chunk_count(len: usize, chunk: usize) -> usize {
+    len.div_ceil(chunk)
+}
+
+/// Bitmap of the chunks of a region that differ from the cached copy
+#[derive(Debug, Clone, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct DirtyChunks {
+    /// Bytes per chunk
+    chunk: usize,
+    /// Length of the region
+    len: usize,
+    /// One bit per chunk, set if dirty
+    bits: Vec<u64>,
+}
+
+impl DirtyChunks {
+    /// All clean bitmap of a `len` byte region split into `chunk` byte chunks
+    /// # Returns
+    /// # Errors
+    /// `DirtyChunks` on success, `anyhow::Error` if `chunk` is not a non-zero multiple of 4K
+    #[inline]
+    pub fn new(len: usize, chunk: usize) -> anyhow::Result<Self> {
+        check_chunk(chunk)?;
+        let words = chunk_count(len, chunk).div_ceil(WORD_BITS);
+        Ok(DirtyChunks { chunk, len, bits: vec![0; words] })
+    }
+
+    /// Bytes per chunk
+    #[inline]
+    #[must_use]
+    pub const fn chunk(&self) -> usize {
+        self.chunk
+    }
+
+    /// Number of chunks
+    #[inline]
+    #[must_use]
+    pub const fn chunks(&self) -> usize {
+        chunk_count(self.len, self.chunk)
+    }
+
+    /// Mark every chunk overlapping `[offset, offset + len)` dirty, clipped to the region
+    #[inline]
+    pub fn mark(&mut self, offset: usize, len: usize) {
+        let end = offset.saturating_add(len).min(self.len);
+        if offset >= end {
+            return;
+        }
+        let last = chunk_count(end, self.chunk);
+        for index in offset.checked_div(self.chunk).unwrap_or(0)..last {
+            self.set(index);
+        }
+    }
+
+    /// Mark the whole region dirty
+    #[inline]
+    pub fn mark_all(&mut self) {
+        self.mark(0, self.len);
+    }
+
+    /// Mark the ranges of `OwnershipMap::take_granted` dirty
+    /// # Arguments
+    /// * `base` - Virtual address the region is mapped at
+    /// * `granted` - `[start, end)` virtual address ranges made writable
+    #[inline]
+    pub fn mark_grants(&mut self, base: usize, granted: &[(usize, usize)]) {
+        for &(start, end) in granted {
+            let from = start.max(base).saturating_sub(base);
+            self.mark(from, end.saturating_sub(base).saturating_sub(from));
+        }
+    }
+
+    /// Whether chunk `index` is dirty
+    #[inline]
+    #[must_use]
+    pub fn is_dirty(&self, index: usize) -> bool {
+        let (word, bit) = locate(index);
+        self.bits.get(word).is_some_and(|&bits| bits & bit != 0)
+    }
+
+    /// Number of dirty chunks
+    #[inline]
+    #[must_use]
+    pub fn count(&self) -> usize {
+        self.bits.iter().map(|bits| bits.count_ones()).fold(0_usize, |sum, ones| {
+            sum.saturating_add(usize::try_from(ones).unwrap_or(usize::MAX))
+        })
+    }
+
+    /// Clear every chunk
+    #[inline]
+    pub fn clear(&mut self) {
+        self.bits.fill(0);
+    }
+
+    /// Byte ranges of the dirty chunks, each at most `max_chunks` chunks long
+    /// # Returns
+    /// `[start, end)` offsets in ascending order, the last one clipped to the region
+    #[inline]
+    #[must_use]
+    pub fn runs(&self, max_chunks: usize) -> Vec<(usize, usize)> {
+        let max_chunks = max_chunks.max(1);
+        let mut runs = Vec::new();
+        let mut open: Option<(usize, usize)> = None;
+        for index in (0..self.chunks()).filter(|&index| self.is_dirty(index)) {
+            open = match open {
+                Some((first, last)) if last.saturating_add(1) == index && index.saturating_sub(first) < max_chunks => {
+                    Some((first, index))
+                }
+                Some((first, last)) => {
+                    runs.push(self.byte_range(first, last));
+                    Some((index, index))
+                }
+                None => Some((index, index)),
+            };
+        }
+        if let Some((first, last)) = open {
+            runs.push(self.byte_range(first, last));
+        }
+        runs
+    }
+
+    /// Set the bit of chunk `index`
+    fn set(&mut self, index: usize) {
+        let (word, bit) = locate(index);
+        if let Some(bits) = self.bits.get_mut(word) {
+            *bits |= bit;
+        }
+    }
+
+    /// Byte range of chunks `first..=last`
+    fn byte_range(&self, first: usize, last: usize) -> (usize, usize) {
+        let start = first.saturating_mul(self.chunk);
+        let end = last.saturating_add(1).saturating_mul(self.chunk).min(self.len);
+        (start, end)
+    }
+}
+
+/// Word and bit of chunk `index` in a `DirtyChunks` bitmap
+fn locate(index: usize) -> (usize, u64) {
+    let word = index.checked_div(WORD_BITS).unwrap_or(0);
+    let bit = index.checked_rem(WORD_BITS).and_then(|bit| u32::try_from(bit).ok()).unwrap_or(0);
+    (word, 1_u64.checked_shl(bit).unwrap_or(0))
+}
+
+/// Per chunk checksums of a region, see `kernels::checksum`
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+#[non_exhaustive]
+pub struct ChunkDigest {
+    /// Bytes per chunk
+    pub chunk: usize,
+    /// Length of the region
+    pub len: usize,
+    /// Checksum of every chunk
+    pub sums: Vec<u64>,
+}
+
+impl ChunkDigest {
+    /// Checksum every `chunk` bytes of `data` on the workers of `pool`
+    ///
+    /// Run it where `data` is local: reading a remote region to digest it
+    /// costs as much bandwidth as copying it.
+    /// # Returns
+    /// # Errors
+    /// `ChunkDigest` on success, `anyhow::Error` if `chunk` is invalid or a job could not run
+    #[inline]
+    pub fn compute(pool: &ThreadPool, data: &[u8], chunk: usize) -> anyhow::Result<Self> {
+        check_chunk(chunk)?;
+        let mut sums = vec![0_u64; chunk_count(data.len(), chunk)];
+        let per_job = sums.len().div_ceil(pool.size().max(1)).max(1);
+        pool.scope(|scope| -> anyhow::Result<()> {
+            for (job_sums, job_data) in sums.chunks_mut(per_job).zip(data.chunks(per_job.saturating_mul(chunk))) {
+                scope.spawn(move || {
+                    for (sum, piece) in job_sums.iter_mut().zip(job_data.chunks(chunk)) {
+                        *sum = kernels::checksum(piece);
+                    }
+                })?;
+            }
+            Ok(())
+        })??;
+        Ok(ChunkDigest { chunk, len: data.len(), sums })
+    }
+
+    /// Chunks whose checksum differs between `self` and the newer digest `current`
+    /// # Returns
+    /// # Errors
+    /// The dirty chunks on success, `anyhow::Error` if the digests cover different layouts
+    #[inline]
+    pub fn changed(&self, current: &ChunkDigest) -> anyhow::Result<DirtyChunks> {
+        if (self.chunk, self.len) != (current.chunk, current.len) {
+            anyhow::bail!(
+                "Digest of {} bytes in {} byte chunks cannot be compared with one of {} bytes in {} byte chunks",
+                self.len,
+                self.chunk,
+                current.len,
+                current.chunk
+            );
+        }
+        let mut dirty = DirtyChunks::new(current.len, current.chunk)?;
+        for (index, (old, new)) in self.sums.iter().zip(&current.sums).enumerate() {
+            if old != new {
+                dirty.set(index);
+            }
+        }
+        Ok(dirty)
+    }
+}
+
+/// Outcome of one resync cycle
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct SyncReport {
+    /// Chunks of the region
+    pub chunks: usize,
+    /// Chunks copied
+    pub dirty: usize,
+    /// Bytes copied
+    pub bytes: u64,
+}
+
+/// Keeps a cached copy of a region current, one resync cycle at a time
+#[derive(Debug, Clone)]
+#[non_exhaustive]
+pub struct Resync {
+    /// Bytes per chunk
+    chunk: usize,
+    /// Digest the cache matched after the last digest driven cycle
+    synced: Option<ChunkDigest>,
+}
+
+impl Resync {
+    /// Resync in `chunk` byte chunks
+    /// # Returns
+    /// # Errors
+    /// `Resync` on success, `anyhow::Error` if `chunk` is not a non-zero multiple of 4K
+    #[inline]
+    pub fn new(chunk: usize) -> anyhow::Result<Self> {
+        check_chunk(chunk)?;
+        Ok(Resync { chunk, synced: None })
+    }
+
+    /// Resync in 2M chunks, the page `mem_export_useraddr` requires
+    #[inline]
+    #[must_use]
+    pub const fn huge_pages() -> Self {
+        Resync { chunk: HUGE_PAGE_SIZE, synced: None }
+    }
+
+    /// Bytes per chunk
+    #[inline]
+    #[must_use]
+    pub const fn chunk(&self) -> usize {
+        self.chunk
+    }
+
+    /// Copy the chunks whose checksum changed since the last cycle
+    ///
+    /// The first cycle has nothing to compare against and copies everything.
+    /// # Arguments
+    /// * `pool` - Workers doing the copy
+    /// * `cache` - Local copy to bring up to date
+    /// * `region` - Mapping of the region
+    /// * `current` - Digest of the region as it is now, computed by its owner
+    /// # Returns
+    /// # Errors
+    /// `SyncReport` on success, `anyhow::Error` if the layouts differ or a job could not run;
+    /// a failed cycle is repeated in full by the next one
+    #[inline]
+    pub fn sync_digest(
+        &mut self,
+        pool: &ThreadPool,
+        cache: &mut [u8],
+        region: &[u8],
+        current: ChunkDigest,
+    ) -> anyhow::Result<SyncReport> {
+        if current.chunk != self.chunk || current.len != region.len() {
+            anyhow::bail!("Digest does not cover the {} bytes of the region in {} byte chunks", region.len(), self.chunk);
+        }
+        let mut dirty = if let Some(synced) = self.synced.take() {
+            synced.changed(&current)?
+        } else {
+            let mut all = DirtyChunks::new(region.len(), self.chunk)?;
+            all.mark_all();
+            all
+        };
+        let report = self.sync_dirty(pool, cache, region, &mut dirty)?;
+        self.synced = Some(current);
+        Ok(report)
+    }
+
+    /// Copy the chunks marked in `dirty` and clear them
+    /// # Arguments
+    /// * `pool` - Workers doing the copy
+    /// * `cache` - Local copy to bring up to date
+    /// * `region` - Mapping of the region
+    /// * `dirty` - Chunks to copy, e.g. from `DirtyChunks::mark_grants`
+    /// # Returns
+    /// # Errors
+    /// `SyncReport` on success, `anyhow::Error` if the lengths or chunk sizes differ or a job
+    /// could not run; `dirty` is only cleared on success
+    #[inline]
+    pub fn sync_dirty(
+        &self,
+        pool: &ThreadPool,
+        cache: &mut [u8],
+        region: &[u8],
+        dirty: &mut DirtyChunks,
+    ) -> anyhow::Result<SyncReport> {
+        if cache.len() != region.len() || dirty.len != region.len() || dirty.chunk != self.chunk {
+            anyhow::bail!(
+                "Cache of {} bytes and dirty map of {} bytes do not match the {} bytes of the region",
+                cache.len(),
+                dirty.len,
+                region.len()
+            );
+        }
+        let runs = dirty.runs(RUN_CHUNKS);
+        let hint = StoreHint::for_region(true, runs.iter().map(|&(start, end)| end.saturating_sub(start)).sum());
+        let mut bytes = 0_usize;
+        pool.scope(|scope| -> anyhow::Result<()> {
+            let mut rest = cache;
+            let mut consumed = 0_usize;
+            for &(start, end) in &runs {
+                let (_, tail) = rest
+                    .split_at_mut_checked(start.saturating_sub(consumed))
+                    .ok_or_else(|| anyhow::anyhow!("Dirty run {start:#x} lies outside the cache"))?;
+                let (to, after) = tail
+                    .split_at_mut_checked(end.saturating_sub(start))
+                    .ok_or_else(|| anyhow::anyhow!("Dirty run {start:#x}..{end:#x} lies outside the cache"))?;
+                let from = region
+                    .get(start..end)
+                    .ok_or_else(|| anyhow::anyhow!("Dirty run {start:#x}..{end:#x} lies outside the region"))?;
+                rest = after;
+                consumed = end;
+                bytes = bytes.saturating_add(from.len());
+                // both runs are `end - start` bytes long
+                scope.spawn(move || kernels::copy(to, from, hint).unwrap_or_default())?;
+            }
+            Ok(())
+        })??;
+        let report = SyncReport { chunks: dirty.chunks(), dirty: dirty.count(), bytes: u64::try_from(bytes)? };
+        dirty.clear();
+        Ok(report)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const CHUNK: usize = 64 * 1024;
+
+    #[test]
+    fn test_dirty_runs_and_grants() -> anyhow::Result<()> {
+        let mut dirty = DirtyChunks::new(10 * CHUNK + 100, CHUNK)?;
+        assert_eq!(dirty.chunks(), 11);
+        dirty.mark(CHUNK - 1, 2);
+        dirty.mark(5 * CHUNK, 1);
+        dirty.mark(10 * CHUNK + 50, 1000);
+        assert_eq!(dirty.count(), 4);
+        assert_eq!(dirty.runs(8), vec![(0, 2 * CHUNK), (5 * CHUNK, 6 * CHUNK), (10 * CHUNK, 10 * CHUNK + 100)]);
+        assert_eq!(dirty.runs(1).len(), 4);
+
+        dirty.clear();
+        let base = 0x7000_0000;
+        dirty.mark_grants(base, &[(base - CHUNK, base + 1), (base + 3 * CHUNK, base + 4 * CHUNK)]);
+        assert_eq!(dirty.runs(8), vec![(0, CHUNK), (3 * CHUNK, 4 * CHUNK)]);
+        assert!(DirtyChunks::new(CHUNK, 1000).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_digest_cycles_copy_only_changes() -> anyhow::Result<()> {
+        let pool = ThreadPool::new(4)?;
+        let mut region: Vec<u8> = (0..40 * CHUNK).map(|i| u8::try_from(i % 253).unwrap_or(0)).collect();
+        let mut cache = vec![0_u8; region.len()];
+        let mut resync = Resync::new(CHUNK)?;
+
+        let first = resync.sync_digest(&pool, &mut cache, &region, ChunkDigest::compute(&pool, &region, CHUNK)?)?;
+        assert_eq!((first.chunks, first.dirty), (40, 40));
+        assert_eq!(cache, region);
+
+        for at in [3 * CHUNK + 7, 17 * CHUNK, 17 * CHUNK + 9, 39 * CHUNK + 1] {
+            if let Some(byte) = region.get_mut(at) {
+                *byte ^= 0x5a;
+            }
+        }
+        let second = resync.sync_digest(&pool, &mut cache, &region, ChunkDigest::compute(&pool, &region, CHUNK)?)?;
+        assert_eq!((second.dirty, second.bytes), (3, u64::try_from(3 * CHUNK)?));
+        assert_eq!(cache, region);
+
+        let idle = resync.sync_digest(&pool, &mut cache, &region, ChunkDigest::compute(&pool, &region, CHUNK)?)?;
+        assert_eq!(idle.dirty, 0);
+        assert!(resync.sync_digest(&pool, &mut cache, &region, ChunkDigest::compute(&pool, &region, 2 * CHUNK)?).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_sync_from_ownership_grants() -> anyhow::Result<()> {
+        use crate::ownership::{Ownership, OwnershipMap};
+
+        let pool = ThreadPool::new(2)?;
+        let region = vec![0xab_u8; 16 * CHUNK];
+        let mut cache = vec![0_u8; region.len()];
+        let base = region.as_ptr().addr();
+        let mut owner = OwnershipMap::new(-1, base, region.len(), Ownership::Reader)?;
+        let _ = owner.set(base + 2 * CHUNK, base + 4 * CHUNK, Ownership::Writer)?;
+        let _ = owner.set(base + 2 * CHUNK, base + 4 * CHUNK, Ownership::Reader)?;
+
+        let resync = Resync::new(CHUNK)?;
+        let mut dirty = DirtyChunks::new(region.len(), CHUNK)?;
+        dirty.mark_grants(base, &owner.take_granted());
+        let report = resync.sync_dirty(&pool, &mut cache, &region, &mut dirty)?;
+        assert_eq!(report.dirty, 2);
+        assert_eq!(dirty.count(), 0);
+        assert_eq!(cache.iter().position(|&byte| byte != 0), Some(2 * CHUNK));
+        assert_eq!(cache.iter().rposition(|&byte| byte != 0), Some(4 * CHUNK - 1));
+        assert!(owner.take_granted().is_empty());
+        Ok(())
+    }
+}
@@ -0,0 +1,624 @@
+//! Message ring living inside a mapped region
+//!
+//! Services trading messages across nodes used to poll JSON described
+//! regions. `Ring` lays a bounded multi-producer, single-consumer queue over a
+//! `RegionMap`, so a message is a copy into a slot and two stores, with no
+//! syscall on the data path.
+//!
+//! The region starts with a header, then the producer index and the consumer
+//! index on their own 128 byte lines, then the slots. Producers claim slots
+//! with one compare-exchange per batch and publish each slot with a sequence
+//! word; the consumer drains published slots in order and returns them with one
+//! store of its index per batch. Producers share one node: the claim is an
+//! atomic on that node's cache. The consumer may sit anywhere; it claims the
+//! ring with a compare-exchange on a header word of its own, so there is one
+//! consumer per ring however many times the ring is opened on that node.
+//!
+//! A cacheable mapping is not coherent with the other node's caches, so with
+//! `Coherence::Flush` every side writes back what it published and drops its
+//! stale copy before it reads what the other side published. Lines written by
+//! one side are never written by the other, which keeps the maintenance safe.
+
+use std::marker::PhantomData;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use crate::mapping::RegionMap;
+
+/// "OBMMRING", marks an initialized ring
+const MAGIC: u64 = u64::from_le_bytes(*b"OBMMRING");
+
+/// Bytes per index word
+const WORD: usize = 8;
+
+/// Word of the slot count in the header
+const SLOTS_WORD: usize = 1;
+
+/// Word of the slot size in the header
+const SLOT_SIZE_WORD: usize = 2;
+
+/// Word of the consumer claim, 64 bytes in so only the consumer writes its line
+const CONSUMER_WORD: usize = 8;
+
+/// Word of the producer index, 128 bytes in
+const HEAD_WORD: usize = 16;
+
+/// Word of the consumer index, 256 bytes in
+const TAIL_WORD: usize = 32;
+
+/// Bytes before the first slot
+const SLOTS_OFFSET: usize = 384;
+
+/// Sequence and length words at the start of every slot
+const SLOT_HEADER: usize = 16;
+
+/// Cache line, slots are a multiple of it so no two share one
+const CACHE_LINE: usize = 64;
+
+/// How the two sides see each other's writes
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum Coherence {
+    /// Writes are visible without cache maintenance: non-cacheable mappings, or both sides on one node
+    Coherent,
+    /// Published lines are written back and read lines invalidated explicitly
+    Flush,
+}
+
+impl Coherence {
+    /// What a ring over `map` needs: `Flush` if the mapping goes through the cache
+    #[inline]
+    #[must_use]
+    pub const fn of(map: &RegionMap) -> Self {
+        if map.is_cacheable() { Coherence::Flush } else { Coherence::Coherent }
+    }
+}
+
+/// Slot count and size of a ring
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct RingLayout {
+    /// Number of slots, a power of two
+    slots: usize,
+    /// Bytes per slot, header included, a multiple of the cache line
+    slot_size: usize,
+    /// Bytes of the whole ring
+    bytes: usize,
+}
+
+impl RingLayout {
+    /// `slots` slots each holding messages of up to `max_message` bytes
+    /// # Returns
+    /// # Errors
+    /// `RingLayout` on success, `anyhow::Error` if `slots` is not a power of two of at least 2
+    /// or the ring overflows
+    #[inline]
+    pub fn new(slots: usize, max_message: usize) -> anyhow::Result<Self> {
+        if slots < 2 || !slots.is_power_of_two() {
+            anyhow::bail!("Ring slot count {slots} is not a power of two of at least 2");
+        }
+        let slot_size = max_message
+            .checked_add(SLOT_HEADER)
+            .and_then(|size| size.checked_next_multiple_of(CACHE_LINE))
+            .ok_or_else(|| anyhow::anyhow!("Ring message size {max_message} is too large"))?;
+        let bytes = slot_size
+            .checked_mul(slots)
+            .and_then(|size| size.checked_add(SLOTS_OFFSET))
+            .ok_or_else(|| anyhow::anyhow!("Ring of {slots} slots of {slot_size} bytes is too large"))?;
+        Ok(RingLayout { slots, slot_size, bytes })
+    }
+
+    /// Number of slots
+    #[inline]
+    #[must_use]
+    pub const fn slots(&self) -> usize {
+        self.slots
+    }
+
+    /// Largest message a slot holds
+    #[inline]
+    #[must_use]
+    pub const fn max_message(&self) -> usize {
+        self.slot_size.saturating_sub(SLOT_HEADER)
+    }
+
+    /// Bytes of region the ring occupies
+    #[inline]
+    #[must_use]
+    pub const fn bytes(&self) -> usize {
+        self.bytes
+    }
+}
+
+/// Ring over a mapping, shared by its producers and its consumer
+#[derive(Debug)]
+pub struct Ring<'map> {
+    /// Start of the mapping
+    words: *mut u64,
+    /// Slot count and size
+    layout: RingLayout,
+    /// Cache maintenance on the data path
+    coherence: Coherence,
+    /// The mapping the ring lives in
+    map: PhantomData<&'map RegionMap>,
+}
+
+// SAFETY: the ring only touches the mapping through atomics and slots owned
+// by the side accessing them, as handed out by the claim protocol.
+unsafe impl Send for Ring<'_> {}
+// SAFETY: see above.
+unsafe impl Sync for Ring<'_> {}
+
+impl<'map> Ring<'map> {
+    /// Lay out a fresh, empty ring at the start of `map`
+    ///
+    /// Run by one side, before the other opens the ring.
+    /// # Returns
+    /// # Errors
+    /// `Ring` on success, `anyhow::Error` if the mapping is read-only or too small
+    #[inline]
+    pub fn create(map: &'map RegionMap, layout: RingLayout, coherence: Coherence) -> anyhow::Result<Self> {
+        let ring = Self::attach(map, layout, coherence)?;
+        ring.word(0).store(0, Ordering::Relaxed);
+        ring.word(SLOTS_WORD).store(u64::try_from(layout.slots)?, Ordering::Relaxed);
+        ring.word(SLOT_SIZE_WORD).store(u64::try_from(layout.slot_size)?, Ordering::Relaxed);
+        ring.word(CONSUMER_WORD).store(0, Ordering::Relaxed);
+        ring.word(HEAD_WORD).store(0, Ordering::Relaxed);
+        ring.word(TAIL_WORD).store(0, Ordering::Relaxed);
+        for pos in 0..u64::try_from(layout.slots)? {
+            ring.word(ring.slot_word(pos)).store(0, Ordering::Relaxed);
+        }
+        ring.publish(0, layout.bytes);
+        ring.word(0).store(MAGIC, Ordering::Release);
+        ring.publish(0, WORD);
+        Ok(ring)
+    }
+
+    /// Open the ring another side created at the start of `map`
+    /// # Returns
+    /// # Errors
+    /// `Ring` on success, `anyhow::Error` if there is no valid ring or the mapping is read-only
+    #[inline]
+    pub fn open(map: &'map RegionMap, coherence: Coherence) -> anyhow::Result<Self> {
+        let header = Self::attach(map, RingLayout::new(2, 0)?, coherence)?;
+        header.refresh(0, CACHE_LINE);
+        if header.word(0).load(Ordering::Acquire) != MAGIC {
+            anyhow::bail!("Mapping does not start with a ring");
+        }
+        let slots = usize::try_from(header.word(SLOTS_WORD).load(Ordering::Relaxed))?;
+        let slot_size = usize::try_from(header.word(SLOT_SIZE_WORD).load(Ordering::Relaxed))?;
+        let layout = RingLayout::new(slots, slot_size.saturating_sub(SLOT_HEADER))?;
+        if layout.slot_size != slot_size {
+            anyhow::bail!("Ring slot size {slot_size} is not a multiple of {CACHE_LINE}");
+        }
+        Self::attach(map, layout, coherence)
+    }
+
+    /// Slot count and size
+    #[inline]
+    #[must_use]
+    pub const fn layout(&self) -> RingLayout {
+        self.layout
+    }
+
+    /// A producer, any number of which may send at once
+    #[inline]
+    #[must_use]
+    pub fn producer(&self) -> Producer<'_> {
+        Producer { ring: self, tail: self.load_tail() }
+    }
+
+    /// The consumer, one at a time per ring
+    ///
+    /// The claim lives in the ring header, so it holds across every `Ring` opened
+    /// over the region on this node. Like the producer claim it is an atomic on
+    /// this node's cache: with `Coherence::Flush`, consumers racing from two nodes
+    /// are not told apart. A consumer that exits without being dropped keeps the
+    /// ring claimed until `Ring::create` lays it out again.
+    /// # Returns
+    /// # Errors
+    /// `Consumer` on success, `anyhow::Error` if another one is live
+    #[inline]
+    pub fn consumer(&self) -> anyhow::Result<Consumer<'_>> {
+        let claim = CONSUMER_WORD.saturating_mul(WORD);
+        self.refresh(claim, WORD);
+        if self.word(CONSUMER_WORD).compare_exchange(0, 1, Ordering::Acquire, Ordering::Relaxed).is_err() {
+            anyhow::bail!("Ring already has a consumer");
+        }
+        self.publish(claim, WORD);
+        Ok(Consumer { ring: self, tail: self.load_tail() })
+    }
+
+    /// Ring of `layout` at the start of `map`, without touching it
+    fn attach(map: &'map RegionMap, layout: RingLayout, coherence: Coherence) -> anyhow::Result<Self> {
+        if !map.is_writable() {
+            anyhow::bail!("Ring mapping is read-only");
+        }
+        if map.len() < layout.bytes {
+            anyhow::bail!("Ring of {} bytes does not fit a mapping of {} bytes", layout.bytes, map.len());
+        }
+        let words = map.as_mut_ptr_of::<u64>()?;
+        Ok(Ring { words, layout, coherence, map: PhantomData })
+    }
+
+    /// Word `index` of the mapping, inside the layout
+    fn word(&self, index: usize) -> &AtomicU64 {
+        // SAFETY: every index used lies inside the layout, which `attach` checked
+        // against the mapping; the word is aligned and lives as long as `self`.
+        unsafe { AtomicU64::from_ptr(self.words.add(index)) }
+    }
+
+    /// Byte offset of the slot of `pos`
+    fn slot_offset(&self, pos: u64) -> usize {
+        let mask = u64::try_from(self.layout.slots.saturating_sub(1)).unwrap_or(0);
+        let index = usize::try_from(pos & mask).unwrap_or(0);
+        SLOTS_OFFSET.saturating_add(index.saturating_mul(self.layout.slot_size))
+    }
+
+    /// Word of the sequence of the slot of `pos`
+    fn slot_word(&self, pos: u64) -> usize {
+        self.slot_offset(pos).checked_div(WORD).unwrap_or(0)
+    }
+
+    /// Pointer to byte `offset` of the mapping
+    fn byte(&self, offset: usize) -> *mut u8 {
+        // SAFETY: every offset used lies inside the layout.
+        unsafe { self.words.cast::<u8>().add(offset) }
+    }
+
+    /// Make `[offset, offset + len)` visible to the other side
+    fn publish(&self, offset: usize, len: usize) {
+        match self.coherence {
+            // SAFETY: the range lies inside the mapping.
+            Coherence::Flush => unsafe { cache::clean(self.byte(offset), len) },
+            Coherence::Coherent => {}
+        }
+    }
+
+    /// Drop any stale copy of `[offset, offset + len)` before reading it
+    fn refresh(&self, offset: usize, len: usize) {
+        match self.coherence {
+            // SAFETY: the range lies inside the mapping and is not written by this side.
+            Coherence::Flush => unsafe { cache::invalidate(self.byte(offset), len) },
+            Coherence::Coherent => {}
+        }
+    }
+
+    /// Consumer index as last published
+    fn load_tail(&self) -> u64 {
+        self.refresh(TAIL_WORD.saturating_mul(WORD), WORD);
+        self.word(TAIL_WORD).load(Ordering::Acquire)
+    }
+}
+
+/// Sending side of a ring, one per producing thread
+#[derive(Debug)]
+pub struct Producer<'ring> {
+    /// The ring
+    ring: &'ring Ring<'ring>,
+    /// Consumer index as last read, refreshed only when the ring looks full
+    tail: u64,
+}
+
+impl Producer<'_> {
+    /// Send one message
+    /// # Returns
+    /// # Errors
+    /// Whether it was sent, false if the ring is full; `anyhow::Error` if it does not fit a slot
+    #[inline]
+    pub fn send(&mut self, message: &[u8]) -> anyhow::Result<bool> {
+        Ok(self.send_batch(&[message])? == 1)
+    }
+
+    /// Send as many of `messages` as there are free slots, in order, publishing them together
+    /// # Returns
+    /// # Errors
+    /// Number of messages sent, `anyhow::Error` if one of them does not fit a slot
+    #[inline]
+    pub fn send_batch(&mut self, messages: &[&[u8]]) -> anyhow::Result<usize> {
+        let max = self.ring.layout.max_message();
+        if let Some(long) = messages.iter().find(|message| message.len() > max) {
+            anyhow::bail!("Message of {} bytes does not fit a ring slot of {max}", long.len());
+        }
+        let Some((head, count)) = self.claim(u64::try_from(messages.len())?) else {
+            return Ok(0);
+        };
+
+        let mut end = head;
+        for message in messages.iter().take(count) {
+            let slot = self.ring.slot_offset(end);
+            self.ring.word(self.ring.slot_word(end).saturating_add(1)).store(u64::try_from(message.len())?, Ordering::Relaxed);
+            // SAFETY: the claim made this slot ours until it is published, and the
+            // message fits behind the slot header.
+            unsafe { std::ptr::copy_nonoverlapping(message.as_ptr(), self.ring.byte(slot.saturating_add(SLOT_HEADER)), message.len()) };
+            self.ring.publish(slot, SLOT_HEADER.saturating_add(message.len()));
+            end = end.saturating_add(1);
+        }
+        for pos in head..end {
+            self.ring.word(self.ring.slot_word(pos)).store(pos.saturating_add(1), Ordering::Release);
+            self.ring.publish(self.ring.slot_offset(pos), WORD);
+        }
+        Ok(count)
+    }
+
+    /// Claim up to `wanted` consecutive slots
+    /// # Returns
+    /// Index of the first slot and number claimed, `None` if the ring is full
+    fn claim(&mut self, wanted: u64) -> Option<(u64, usize)> {
+        let head_word = self.ring.word(HEAD_WORD);
+        let slots = u64::try_from(self.ring.layout.slots).ok()?;
+        let mut head = head_word.load(Ordering::Relaxed);
+        loop {
+            let mut free = slots.saturating_sub(head.saturating_sub(self.tail));
+            if free < wanted {
+                self.tail = self.ring.load_tail();
+                free = slots.saturating_sub(head.saturating_sub(self.tail));
+            }
+            let count = free.min(wanted);
+            if count == 0 {
+                return None;
+            }
+            match head_word.compare_exchange_weak(head, head.saturating_add(count), Ordering::Acquire, Ordering::Relaxed) {
+                Ok(_) => return Some((head, usize::try_from(count).ok()?)),
+                Err(now) => head = now,
+            }
+        }
+    }
+}
+
+/// Receiving side of a ring
+#[derive(Debug)]
+pub struct Consumer<'ring> {
+    /// The ring
+    ring: &'ring Ring<'ring>,
+    /// Index of the next slot to read
+    tail: u64,
+}
+
+impl Consumer<'_> {
+    /// Receive one message into `buf`
+    /// # Returns
+    /// Whether a message was received
+    #[inline]
+    pub fn recv(&mut self, buf: &mut Vec<u8>) -> bool {
+        self.recv_batch(1, |message| {
+            buf.clear();
+            buf.extend_from_slice(message);
+        }) == 1
+    }
+
+    /// Hand up to `max` published messages to `each`, in order, returning their slots together
+    /// # Returns
+    /// Number of messages received
+    #[inline]
+    pub fn recv_batch<F: FnMut(&[u8])>(&mut self, max: usize, mut each: F) -> usize {
+        let mut taken = 0_usize;
+        let mut pos = self.tail;
+        while taken < max {
+            let slot = self.ring.slot_offset(pos);
+            self.ring.refresh(slot, CACHE_LINE);
+            if self.ring.word(self.ring.slot_word(pos)).load(Ordering::Acquire) != pos.saturating_add(1) {
+                break;
+            }
+            let len = usize::try_from(self.ring.word(self.ring.slot_word(pos).saturating_add(1)).load(Ordering::Relaxed))
+                .unwrap_or(usize::MAX)
+                .min(self.ring.layout.max_message());
+            self.ring.refresh(slot.saturating_add(CACHE_LINE), SLOT_HEADER.saturating_add(len).saturating_sub(CACHE_LINE));
+            // SAFETY: the sequence published the slot to us, and the producers leave it
+            // alone until the tail moves past it below.
+            let message = unsafe { std::slice::from_raw_parts(self.ring.byte(slot.saturating_add(SLOT_HEADER)), len) };
+            each(message);
+            taken = taken.saturating_add(1);
+            pos = pos.saturating_add(1);
+        }
+        if taken > 0 {
+            self.tail = pos;
+            self.ring.word(TAIL_WORD).store(pos, Ordering::Release);
+            self.ring.publish(TAIL_WORD.saturating_mul(WORD), WORD);
+        }
+        taken
+    }
+}
+
+impl Drop for Consumer<'_> {
+    #[inline]
+    fn drop(&mut self) {
+        self.ring.word(CONSUMER_WORD).store(0, Ordering::Release);
+        self.ring.publish(CONSUMER_WORD.saturating_mul(WORD), WORD);
+    }
+}
+
+/// Cache maintenance by virtual address
+mod cache {
+    #[cfg(target_arch = "aarch64")]
+    use std::arch::asm;
+    #[cfg(target_arch = "x86_64")]
+    use std::arch::x86_64::{_mm_clflush, _mm_mfence};
+
+    use super::CACHE_LINE;
+
+    /// Line addresses covering `[ptr, ptr + len)`
+    fn lines(ptr: *const u8, len: usize) -> impl Iterator<Item = *const u8> {
+        let first = ptr.addr() & !CACHE_LINE.saturating_sub(1);
+        let end = ptr.addr().saturating_add(len);
+        (first..end).step_by(CACHE_LINE).map(move |addr| ptr.with_addr(addr))
+    }
+
+    /// Write the lines of `[ptr, ptr + len)` back to memory
+    ///
+    /// # Safety
+    /// The range must be mapped.
+    #[cfg(target_arch = "x86_64")]
+    pub(super) unsafe fn clean(ptr: *const u8, len: usize) {
+        for line in lines(ptr, len) {
+            // SAFETY: the line is mapped, per the contract.
+            unsafe { _mm_clflush(line) };
+        }
+        // SAFETY: SSE2 is part of `x86_64`.
+        unsafe { _mm_mfence() };
+    }
+
+    /// Drop the cached copies of `[ptr, ptr + len)`; `clflush` writes back and invalidates
+    ///
+    /// # Safety
+    /// The range must be mapped.
+    #[cfg(target_arch = "x86_64")]
+    pub(super) unsafe fn invalidate(ptr: *const u8, len: usize) {
+        // SAFETY: forwarded contract.
+        unsafe { clean(ptr, len) };
+    }
+
+    /// Write the lines of `[ptr, ptr + len)` back to the point of coherence
+    ///
+    /// # Safety
+    /// The range must be mapped.
+    #[cfg(target_arch = "aarch64")]
+    pub(super) unsafe fn clean(ptr: *const u8, len: usize) {
+        for line in lines(ptr, len) {
+            // SAFETY: the line is mapped, per the contract; `dc cvac` only writes it back.
+            unsafe { asm!("dc cvac, {line}", line = in(reg) line, options(nostack, preserves_flags)) };
+        }
+        // SAFETY: a barrier has no memory operands.
+        unsafe { asm!("dsb sy", options(nostack, preserves_flags)) };
+    }
+
+    /// Drop the cached copies of `[ptr, ptr + len)`, writing back dirty lines first
+    ///
+    /// # Safety
+    /// The range must be mapped.
+    #[cfg(target_arch = "aarch64")]
+    pub(super) unsafe fn invalidate(ptr: *const u8, len: usize) {
+        for line in lines(ptr, len) {
+            // SAFETY: the line is mapped, per the contract; `dc civac` keeps dirty data.
+            unsafe { asm!("dc civac, {line}", line = in(reg) line, options(nostack, preserves_flags)) };
+        }
+        // SAFETY: a barrier has no memory operands.
+        unsafe { asm!("dsb sy", options(nostack, preserves_flags)) };
+    }
+
+    /// Order the accesses, targets without cache maintenance instructions are treated as coherent
+    ///
+    /// # Safety
+    /// Always safe, `unsafe` to match the other targets.
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    pub(super) unsafe fn clean(ptr: *const u8, len: usize) {
+        let _ = lines(ptr, len);
+        std::sync::atomic::fence(std::sync::atomic::Ordering::SeqCst);
+    }
+
+    /// See `clean`
+    ///
+    /// # Safety
+    /// Always safe, `unsafe` to match the other targets.
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    pub(super) unsafe fn invalidate(ptr: *const u8, len: usize) {
+        // SAFETY: forwarded contract.
+        unsafe { clean(ptr, len) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::mapping::MapOptions;
+
+    fn map(layout: RingLayout) -> anyhow::Result<RegionMap> {
+        RegionMap::open(1, layout.bytes().next_multiple_of(4096), MapOptions::new().writable(true))
+    }
+
+    #[test]
+    fn test_ring_batches_wraps_and_fills() -> anyhow::Result<()> {
+        let layout = RingLayout::new(8, 100)?;
+        assert_eq!(layout.max_message(), 112);
+        let map = map(layout)?;
+        let ring = Ring::create(&map, layout, Coherence::of(&map))?;
+        assert!(Ring::open(&map, Coherence::Flush)?.layout() == layout);
+
+        let mut producer = ring.producer();
+        let mut consumer = ring.consumer()?;
+        assert!(ring.consumer().is_err());
+        let mut seen = Vec::new();
+        for lap in 0..20_u8 {
+            let messages: Vec<Vec<u8>> = (0..5_usize).map(|i| vec![lap; i + 1]).collect();
+            let refs: Vec<&[u8]> = messages.iter().map(Vec::as_slice).collect();
+            assert_eq!(producer.send_batch(&refs)?, 5);
+            assert_eq!(consumer.recv_batch(3, |message| seen.push(message.to_vec())), 3);
+            assert_eq!(consumer.recv_batch(16, |message| seen.push(message.to_vec())), 2);
+        }
+        assert_eq!(seen.len(), 100);
+        assert_eq!(seen.last(), Some(&vec![19; 5]));
+
+        let big = [7_u8; 112];
+        assert_eq!(producer.send_batch(&[big.as_slice(); 10])?, 8);
+        assert!(!producer.send(&big)?);
+        assert!(producer.send(&[0; 113]).is_err());
+        let mut buf = Vec::new();
+        assert!(consumer.recv(&mut buf));
+        assert_eq!(buf, big);
+        assert!(producer.send(b"again")?);
+        drop(consumer);
+        assert_eq!(ring.consumer()?.recv_batch(16, |_| ()), 8);
+        Ok(())
+    }
+
+    #[test]
+    fn test_ring_one_consumer_across_opens() -> anyhow::Result<()> {
+        let layout = RingLayout::new(4, 16)?;
+        let map = map(layout)?;
+        let ring = Ring::create(&map, layout, Coherence::of(&map))?;
+        let other = Ring::open(&map, Coherence::of(&map))?;
+
+        let first = ring.consumer()?;
+        assert!(other.consumer().is_err());
+        assert!(Ring::open(&map, Coherence::of(&map))?.consumer().is_err());
+        drop(first);
+        // a consumer that never drops, as if its process died
+        let _leaked = std::mem::ManuallyDrop::new(other.consumer()?);
+        assert!(ring.consumer().is_err());
+        // laying the ring out again drops a claim left behind
+        let fresh = Ring::create(&map, layout, Coherence::of(&map))?;
+        assert!(fresh.consumer().is_ok());
+        Ok(())
+    }
+
+    #[test]
+    fn test_ring_many_producers() -> anyhow::Result<()> {
+        const PRODUCERS: u64 = 4;
+        const PER_PRODUCER: u64 = 5_000;
+        let layout = RingLayout::new(64, 16)?;
+        let map = map(layout)?;
+        let ring = Ring::create(&map, layout, Coherence::of(&map))?;
+
+        let next = std::thread::scope(|scope| -> anyhow::Result<Vec<u64>> {
+            for id in 0..PRODUCERS {
+                let ring = &ring;
+                let _ = scope.spawn(move || -> anyhow::Result<()> {
+                    let mut producer = ring.producer();
+                    for seq in 0..PER_PRODUCER {
+                        let message = [id.to_le_bytes(), seq.to_le_bytes()].concat();
+                        while !producer.send(&message)? {
+                            std::hint::spin_loop();
+                        }
+                    }
+                    Ok(())
+                });
+            }
+            let mut consumer = ring.consumer()?;
+            let mut next = vec![0_u64; 4];
+            let mut received = 0;
+            while received < PRODUCERS * PER_PRODUCER {
+                received += u64::try_from(consumer.recv_batch(32, |message| {
+                    let (id, seq) = message.split_at(8);
+                    let id = usize::try_from(u64::from_le_bytes(id.try_into().unwrap_or_default())).unwrap_or(0);
+                    let seq = u64::from_le_bytes(seq.try_into().unwrap_or_default());
+                    if let Some(expected) = next.get_mut(id) {
+                        assert_eq!(seq, *expected);
+                        *expected += 1;
+                    }
+                }))?;
+            }
+            Ok(next)
+        })?;
+        assert_eq!(next, vec![PER_PRODUCER; 4]);
+        Ok(())
+    }
+}
@@ -0,0 +1,320 @@
+//! Hot-path statistics of libobmm
+//!
+//! libobmm keeps per call type counters, latency sums per call and per phase
+//! (topology discovery, vendor adaptation, vendor info allocation, ioctl),
+//! bytes moved per NUMA node and failures by errno. Collection is off until
+//! `enable(true)`; while off every call pays one relaxed load. `snapshot` copies
+//! the counters out, each one read atomically.
+
+use crate::MAX_NUMA_NODES;
+
+/// Number of call types, `OBMM_STAT_NR_CALLS`
+pub const CALL_COUNT: usize = 8;
+/// Number of phases, `OBMM_STAT_NR_PHASES`
+pub const PHASE_COUNT: usize = 4;
+/// Size of the errno table, `OBMM_STAT_NR_ERRNO`; larger values land in slot 0
+pub const ERRNO_COUNT: usize = 134;
+
+/// Instrumented libobmm entry point
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+#[non_exhaustive]
+pub enum StatCall {
+    /// `obmm_export`, one per region of a batch
+    Export,
+    /// `obmm_export_useraddr`
+    ExportUseraddr,
+    /// `obmm_unexport`
+    Unexport,
+    /// `obmm_import`, one per region of a batch
+    Import,
+    /// `obmm_unimport`
+    Unimport,
+    /// `obmm_preimport`
+    Preimport,
+    /// `obmm_unpreimport`
+    Unpreimport,
+    /// `obmm_set_ownership`, one per range of a batch
+    SetOwnership,
+}
+
+impl StatCall {
+    /// Every call type, in libobmm order
+    pub const ALL: [StatCall; CALL_COUNT] = [
+        StatCall::Export,
+        StatCall::ExportUseraddr,
+        StatCall::Unexport,
+        StatCall::Import,
+        StatCall::Unimport,
+        StatCall::Preimport,
+        StatCall::Unpreimport,
+        StatCall::SetOwnership,
+    ];
+
+    /// Short lower case name
+    #[inline]
+    #[must_use]
+    pub const fn name(self) -> &'static str {
+        match self {
+            StatCall::Export => "export",
+            StatCall::ExportUseraddr => "export_useraddr",
+            StatCall::Unexport => "unexport",
+            StatCall::Import => "import",
+            StatCall::Unimport => "unimport",
+            StatCall::Preimport => "preimport",
+            StatCall::Unpreimport => "unpreimport",
+            StatCall::SetOwnership => "set_ownership",
+        }
+    }
+
+    /// Index into the per call arrays of `ObmmStats`
+    const fn index(self) -> usize {
+        match self {
+            StatCall::Export => 0,
+            StatCall::ExportUseraddr => 1,
+            StatCall::Unexport => 2,
+            StatCall::Import => 3,
+            StatCall::Unimport => 4,
+            StatCall::Preimport => 5,
+            StatCall::Unpreimport => 6,
+            StatCall::SetOwnership => 7,
+        }
+    }
+}
+
+/// Timed phase inside a call
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+#[non_exhaustive]
+pub enum StatPhase {
+    /// sysfs bus controller discovery
+    Topology,
+    /// vendor info or cna lookup for one command
+    VendorAdapt,
+    /// building the vendor info in caller-provided storage
+    VendorAlloc,
+    /// the driver call
+    Ioctl,
+}
+
+impl StatPhase {
+    /// Every phase, in libobmm order
+    pub const ALL: [StatPhase; PHASE_COUNT] =
+        [StatPhase::Topology, StatPhase::VendorAdapt, StatPhase::VendorAlloc, StatPhase::Ioctl];
+
+    /// Short lower case name
+    #[inline]
+    #[must_use]
+    pub const fn name(self) -> &'static str {
+        match self {
+            StatPhase::Topology => "topology",
+            StatPhase::VendorAdapt => "vendor_adapt",
+            StatPhase::VendorAlloc => "vendor_alloc",
+            StatPhase::Ioctl => "ioctl",
+        }
+    }
+
+    /// Index into the per phase arrays of `ObmmStats`
+    const fn index(self) -> usize {
+        match self {
+            StatPhase::Topology => 0,
+            StatPhase::VendorAdapt => 1,
+            StatPhase::VendorAlloc => 2,
+            StatPhase::Ioctl => 3,
+        }
+    }
+}
+
+/// Counter snapshot, mirrors `struct obmm_stats`
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct ObmmStats {
+    /// Completed calls by type
+    pub calls: [u64; CALL_COUNT],
+    /// Failed calls by type
+    pub errors: [u64; CALL_COUNT],
+    /// Total latency by call type, in nanoseconds
+    pub call_ns: [u64; CALL_COUNT],
+    /// Times each phase ran
+    pub phase_count: [u64; PHASE_COUNT],
+    /// Total time spent in each phase, in nanoseconds
+    pub phase_ns: [u64; PHASE_COUNT],
+    /// Bytes exported
+    pub bytes_exported: u64,
+    /// Bytes imported
+    pub bytes_imported: u64,
+    /// Exports by local NUMA node
+    pub node_exports: [u64; MAX_NUMA_NODES],
+    /// Imports by the NUMA node they were placed on
+    pub node_imports: [u64; MAX_NUMA_NODES],
+    /// Bytes exported by local NUMA node
+    pub node_bytes_exported: [u64; MAX_NUMA_NODES],
+    /// Bytes imported by NUMA node
+    pub node_bytes_imported: [u64; MAX_NUMA_NODES],
+    /// Failures by errno
+    pub errnos: [u64; ERRNO_COUNT],
+}
+
+impl Default for ObmmStats {
+    #[inline]
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl ObmmStats {
+    /// All zero counters
+    #[inline]
+    #[must_use]
+    pub const fn new() -> Self {
+        ObmmStats {
+            calls: [0; CALL_COUNT],
+            errors: [0; CALL_COUNT],
+            call_ns: [0; CALL_COUNT],
+            phase_count: [0; PHASE_COUNT],
+            phase_ns: [0; PHASE_COUNT],
+            bytes_exported: 0,
+            bytes_imported: 0,
+            node_exports: [0; MAX_NUMA_NODES],
+            node_imports: [0; MAX_NUMA_NODES],
+            node_bytes_exported: [0; MAX_NUMA_NODES],
+            node_bytes_imported: [0; MAX_NUMA_NODES],
+            errnos: [0; ERRNO_COUNT],
+        }
+    }
+
+    /// Completed calls of `call`
+    #[inline]
+    #[must_use]
+    pub fn calls(&self, call: StatCall) -> u64 {
+        self.calls.get(call.index()).copied().unwrap_or(0)
+    }
+
+    /// Failed calls of `call`
+    #[inline]
+    #[must_use]
+    pub fn errors(&self, call: StatCall) -> u64 {
+        self.errors.get(call.index()).copied().unwrap_or(0)
+    }
+
+    /// Total latency of `call`, in nanoseconds
+    #[inline]
+    #[must_use]
+    pub fn call_ns(&self, call: StatCall) -> u64 {
+        self.call_ns.get(call.index()).copied().unwrap_or(0)
+    }
+
+    /// Times `phase` ran
+    #[inline]
+    #[must_use]
+    pub fn phase_count(&self, phase: StatPhase) -> u64 {
+        self.phase_count.get(phase.index()).copied().unwrap_or(0)
+    }
+
+    /// Total time spent in `phase`, in nanoseconds
+    #[inline]
+    #[must_use]
+    pub fn phase_ns(&self, phase: StatPhase) -> u64 {
+        self.phase_ns.get(phase.index()).copied().unwrap_or(0)
+    }
+
+    /// Non-zero `(errno, failures)` pairs, errno 0 collecting the out of range values
+    #[inline]
+    pub fn errnos(&self) -> impl Iterator<Item = (usize, u64)> + '_ {
+        self.errnos.iter().copied().enumerate().filter(|&(_, count)| count != 0)
+    }
+}
+
+/// Start or stop collection, counters are kept across toggles
+#[cfg(feature = "hook")]
+#[inline]
+pub fn enable(_: bool) {
+    // hooked implementation
+}
+
+/// Start or stop collection, counters are kept across toggles
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn enable(on: bool) {
+    unsafe { obmm_stats_enable(on) }
+}
+
+/// Copy the current counters
+/// # Returns
+/// Counter snapshot
+#[cfg(feature = "hook")]
+#[inline]
+#[must_use]
+pub fn snapshot() -> ObmmStats {
+    // hooked implementation
+    ObmmStats::new()
+}
+
+/// Copy the current counters
+/// # Returns
+/// Counter snapshot
+#[cfg(not(feature = "hook"))]
+#[inline]
+#[must_use]
+pub fn snapshot() -> ObmmStats {
+    let mut stats = ObmmStats::new();
+    // only fails on a null pointer
+    let _ = unsafe { obmm_stats_snapshot(&raw mut stats) };
+    stats
+}
+
+/// Zero every counter
+#[cfg(feature = "hook")]
+#[inline]
+pub fn reset() {
+    // hooked implementation
+}
+
+/// Zero every counter
+#[cfg(not(feature = "hook"))]
+#[inline]
+pub fn reset() {
+    unsafe { obmm_stats_reset() }
+}
+
+#[cfg(not(feature = "hook"))]
+unsafe extern "C" {
+    /// Start or stop collection
+    fn obmm_stats_enable(enable: bool);
+
+    /// Copy the counters into `stats`
+    fn obmm_stats_snapshot(stats: *mut ObmmStats) -> i32;
+
+    /// Zero every counter
+    fn obmm_stats_reset();
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_stats_layout() {
+        let words = CALL_COUNT * 3 + PHASE_COUNT * 2 + 2 + MAX_NUMA_NODES * 4 + ERRNO_COUNT;
+        assert_eq!(size_of::<ObmmStats>(), words * size_of::<u64>());
+        for (index, call) in StatCall::ALL.iter().enumerate() {
+            assert_eq!(call.index(), index);
+        }
+        for (index, phase) in StatPhase::ALL.iter().enumerate() {
+            assert_eq!(phase.index(), index);
+        }
+    }
+
+    #[test]
+    fn test_stats_accessors() {
+        let mut stats = ObmmStats::new();
+        stats.calls[3] = 5;
+        stats.errors[3] = 2;
+        stats.phase_ns[3] = 100;
+        stats.errnos[19] = 2;
+        assert_eq!(stats.calls(StatCall::Import), 5);
+        assert_eq!(stats.errors(StatCall::Import), 2);
+        assert_eq!(stats.calls(StatCall::Export), 0);
+        assert_eq!(stats.phase_ns(StatPhase::Ioctl), 100);
+        assert_eq!(stats.errnos().collect::<Vec<_>>(), vec![(19, 2)]);
+    }
+}
@@ -0,0 +1,304 @@
+//! Parallel teardown of large region sets
+//!
+//! Unexporting or unimporting a region can take milliseconds while the kernel
+//! unpins its pages, so releasing a tenant one region at a time is bound by the
+//! ioctl latency. `Teardown` splits the regions by NUMA node and drains each
+//! node's share on at most `per_node` pool workers at once: nodes are released
+//! side by side, and no single node gets every worker.
+
+use std::collections::BTreeMap;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Mutex, PoisonError};
+
+use threadpool::ThreadPool;
+
+use crate::{MemId, ObmmExportFlags, ObmmUnexportFlags, mem_unexport, mem_unimport};
+
+/// Failures listed by `TeardownReport::into_result` before the rest is elided
+const MAX_LISTED_FAILURES: usize = 8;
+
+/// Direction of a region to release
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum RegionKind {
+    /// Released with `mem_unexport`
+    Exported,
+    /// Released with `mem_unimport`
+    Imported,
+}
+
+/// One region to release
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct TeardownRegion {
+    /// Memory ID
+    pub mem_id: MemId,
+    /// Direction
+    pub kind: RegionKind,
+    /// NUMA node backing the region, `None` if unknown
+    pub numa: Option<usize>,
+}
+
+impl TeardownRegion {
+    /// Exported region on `numa`
+    #[inline]
+    #[must_use]
+    pub const fn exported(mem_id: MemId, numa: Option<usize>) -> Self {
+        TeardownRegion { mem_id, kind: RegionKind::Exported, numa }
+    }
+
+    /// Imported region on `numa`
+    #[inline]
+    #[must_use]
+    pub const fn imported(mem_id: MemId, numa: Option<usize>) -> Self {
+        TeardownRegion { mem_id, kind: RegionKind::Imported, numa }
+    }
+}
+
+/// What happened to one region
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum Outcome {
+    /// Released normally
+    Released,
+    /// Unexported with `FORCE` after the plain unexport reported it busy
+    Forced,
+    /// Not released, errno of the last attempt
+    Failed(i32),
+}
+
+/// Aggregated result of a teardown
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct TeardownReport {
+    /// Regions released normally
+    pub released: Vec<MemId>,
+    /// Exports that needed `FORCE`
+    pub forced: Vec<MemId>,
+    /// Regions left in place, with the errno of the last attempt
+    pub failed: Vec<(MemId, i32)>,
+}
+
+impl TeardownReport {
+    /// Whether every region was released
+    #[inline]
+    #[must_use]
+    pub fn is_ok(&self) -> bool {
+        self.failed.is_empty()
+    }
+
+    /// The report itself, or an error listing the failed regions
+    /// # Returns
+    /// # Errors
+    /// The report if every region was released, `anyhow::Error` naming the failures otherwise
+    #[inline]
+    pub fn into_result(self) -> anyhow::Result<Self> {
+        if self.is_ok() {
+            return Ok(self);
+        }
+        let total = self.released.len().saturating_add(self.forced.len()).saturating_add(self.failed.len());
+        let listed: Vec<String> = self
+            .failed
+            .iter()
+            .take(MAX_LISTED_FAILURES)
+            .map(|&(mem_id, errno)| format!("MemID {mem_id} errno {errno}"))
+            .collect();
+        let more = if self.failed.len() > MAX_LISTED_FAILURES { ", ..." } else { "" };
+        Err(anyhow::anyhow!("Failed to release {} of {total} regions: {}{more}", self.failed.len(), listed.join(", ")))
+    }
+
+    /// Record the outcome of `mem_id`
+    pub(crate) fn record(&mut self, mem_id: MemId, outcome: Outcome) {
+        match outcome {
+            Outcome::Released => self.released.push(mem_id),
+            Outcome::Forced => self.forced.push(mem_id),
+            Outcome::Failed(errno) => self.failed.push((mem_id, errno)),
+        }
+    }
+}
+
+/// Regions of one NUMA node, claimed one at a time by the workers draining it
+#[derive(Debug)]
+struct Lane<'regions> {
+    /// Regions of the node
+    regions: Vec<&'regions TeardownRegion>,
+    /// Index of the next unclaimed region
+    next: AtomicUsize,
+}
+
+impl Lane<'_> {
+    /// Claim the next region
+    fn claim(&self) -> Option<&TeardownRegion> {
+        self.regions.get(self.next.fetch_add(1, Ordering::Relaxed)).copied()
+    }
+}
+
+/// Releases region sets on a thread pool, with bounded per node concurrency
+#[derive(Debug, Clone, Copy)]
+pub struct Teardown<'pool> {
+    /// Pool running the releases
+    pool: &'pool ThreadPool,
+    /// Releases in flight per NUMA node
+    per_node: usize,
+    /// Retry busy unexports with `FORCE`
+    force_fallback: bool,
+}
+
+impl<'pool> Teardown<'pool> {
+    /// Release on `pool` with at most `per_node` regions of a node in flight, at least 1
+    #[inline]
+    #[must_use]
+    pub fn new(pool: &'pool ThreadPool, per_node: usize) -> Self {
+        Teardown { pool, per_node: per_node.max(1), force_fallback: false }
+    }
+
+    /// Retry an unexport that fails with `EBUSY` with `ObmmUnexportFlags::FORCE`
+    #[inline]
+    #[must_use]
+    pub const fn force_fallback(mut self, enabled: bool) -> Self {
+        self.force_fallback = enabled;
+        self
+    }
+
+    /// Release every region of `regions`
+    /// # Returns
+    /// # Errors
+    /// The report of every region, `anyhow::Error` only if the pool could not run the releases;
+    /// failed regions are reported, see `TeardownReport::into_result`
+    #[inline]
+    pub fn run(&self, regions: &[TeardownRegion]) -> anyhow::Result<TeardownReport> {
+        self.run_with(regions, release)
+    }
+
+    /// `run` with `op(region, force)` standing in for the release ioctls
+    fn run_with<F>(&self, regions: &[TeardownRegion], op: F) -> anyhow::Result<TeardownReport>
+    where
+        F: Fn(&TeardownRegion, bool) -> Result<(), i32> + Sync,
+    {
+        let mut by_node: BTreeMap<Option<usize>, Vec<&TeardownRegion>> = BTreeMap::new();
+        for region in regions {
+            by_node.entry(region.numa).or_default().push(region);
+        }
+        let lanes: Vec<Lane<'_>> =
+            by_node.into_values().map(|node| Lane { regions: node, next: AtomicUsize::new(0) }).collect();
+        let report = Mutex::new(TeardownReport::default());
+
+        self.pool.scope(|scope| -> anyhow::Result<()> {
+            for lane in &lanes {
+                for _ in 0..self.per_node.min(lane.regions.len()) {
+                    scope.spawn(|| {
+                        let mut done = Vec::new();
+                        while let Some(region) = lane.claim() {
+                            done.push((region.mem_id, self.release_one(region, &op)));
+                        }
+                        let mut report = report.lock().unwrap_or_else(PoisonError::into_inner);
+                        for (mem_id, outcome) in done {
+                            report.record(mem_id, outcome);
+                        }
+                    })?;
+                }
+            }
+            Ok(())
+        })??;
+        Ok(report.into_inner().unwrap_or_else(PoisonError::into_inner))
+    }
+
+    /// Release one region, falling back to `FORCE` if allowed
+    fn release_one<F>(&self, region: &TeardownRegion, op: &F) -> Outcome
+    where
+        F: Fn(&TeardownRegion, bool) -> Result<(), i32>,
+    {
+        release_with(region, self.force_fallback, op)
+    }
+}
+
+/// Release `region` on the calling thread, as one job of a `Teardown` would
+pub(crate) fn release_inline(region: &TeardownRegion, force_fallback: bool) -> Outcome {
+    release_with(region, force_fallback, &release)
+}
+
+/// Release `region` with `op`, retrying a busy export with `FORCE` if `force_fallback`
+fn release_with<F>(region: &TeardownRegion, force_fallback: bool, op: &F) -> Outcome
+where
+    F: Fn(&TeardownRegion, bool) -> Result<(), i32>,
+{
+    match op(region, false) {
+        Ok(()) => Outcome::Released,
+        Err(errno) if force_fallback && errno == libc::EBUSY && region.kind == RegionKind::Exported => {
+            op(region, true).map_or_else(Outcome::Failed, |()| Outcome::Forced)
+        }
+        Err(errno) => Outcome::Failed(errno),
+    }
+}
+
+/// Release `region` through libobmm
+fn release(region: &TeardownRegion, force: bool) -> Result<(), i32> {
+    match region.kind {
+        RegionKind::Exported => {
+            let flags = if force { ObmmUnexportFlags::FORCE } else { ObmmUnexportFlags::empty() };
+            mem_unexport(region.mem_id, flags)
+        }
+        RegionKind::Imported => mem_unimport(region.mem_id, ObmmExportFlags::empty()),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::collections::HashMap;
+
+    #[test]
+    fn test_teardown_releases_all() -> anyhow::Result<()> {
+        let pool = ThreadPool::new(4)?;
+        let regions: Vec<_> = (1..=64_u64)
+            .map(|id| {
+                let node = usize::try_from(id % 4).ok();
+                if id % 2 == 0 { TeardownRegion::exported(id, node) } else { TeardownRegion::imported(id, node) }
+            })
+            .collect();
+        let mut report = Teardown::new(&pool, 2).run(&regions)?.into_result()?;
+        report.released.sort_unstable();
+        assert_eq!(report.released, (1..=64).collect::<Vec<_>>());
+        assert!(report.forced.is_empty());
+        Ok(())
+    }
+
+    #[test]
+    fn test_teardown_force_fallback_and_bound() -> anyhow::Result<()> {
+        let pool = ThreadPool::new(8)?;
+        let regions: Vec<_> = (1..=90_u64).map(|id| TeardownRegion::exported(id, usize::try_from(id % 3).ok())).collect();
+        let in_flight: HashMap<Option<usize>, AtomicUsize> =
+            (0..3).map(|node| (Some(node), AtomicUsize::new(0))).collect();
+        let peak = AtomicUsize::new(0);
+        let op = |region: &TeardownRegion, force: bool| {
+            let lane = in_flight.get(&region.numa).ok_or(libc::EINVAL)?;
+            let now = lane.fetch_add(1, Ordering::SeqCst).saturating_add(1);
+            let _ = peak.fetch_max(now, Ordering::SeqCst);
+            std::thread::sleep(std::time::Duration::from_millis(1));
+            let _ = lane.fetch_sub(1, Ordering::SeqCst);
+            match (region.mem_id, force) {
+                (13, _) => Err(libc::EIO),
+                (id, false) if id.is_multiple_of(10) => Err(libc::EBUSY),
+                _ => Ok(()),
+            }
+        };
+
+        let report = Teardown::new(&pool, 2).force_fallback(true).run_with(&regions, op)?;
+        assert!(peak.load(Ordering::SeqCst) <= 2);
+        assert_eq!(report.released.len(), 80);
+        assert_eq!(report.forced.len(), 9);
+        assert_eq!(report.failed, vec![(13, libc::EIO)]);
+        assert!(report.clone().into_result().is_err_and(|e| e.to_string().contains("MemID 13 errno 5")));
+
+        let strict = Teardown::new(&pool, 2).run_with(&regions, op)?;
+        assert_eq!(strict.failed.len(), 10);
+        Ok(())
+    }
+
+    #[cfg(not(feature = "hook"))]
+    #[test]
+    fn test_release_inline_reports_errno() {
+        // the real bindings must hand back errno for the EBUSY fallback to ever match
+        let region = TeardownRegion::exported(crate::OBMM_INVALID_MEMID, None);
+        assert!(matches!(release_inline(&region, true), Outcome::Failed(libc::EINVAL)));
+    }
+}
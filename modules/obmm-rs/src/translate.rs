@@ -0,0 +1,352 @@
+//! Userspace cache of memory region to physical address translations
+//!
+//! OBMM memory is backed by huge pages, so a single translation per granule
+//! answers every offset inside it. `TranslationCache` keeps the extents it has
+//! learned in two ordered maps, one per direction, asks the kernel only about
+//! granules it has not seen yet, and batches the misses of a bulk lookup into
+//! one bulk query.
+
+use std::collections::{BTreeMap, HashMap};
+
+use crate::{query_memid_by_pa, query_memid_by_pa_bulk, query_pa_by_memid, query_pa_by_memid_bulk, MemId};
+
+/// Default granule, the huge page size backing OBMM memory
+pub const DEFAULT_GRANULE: u64 = 2 << 20_u32;
+/// Smallest granule accepted by `TranslationCache::new`
+const MIN_GRANULE: u64 = 4096;
+
+/// Physical extent of a region range, keyed by `(memid, offset)`
+#[derive(Debug, Clone, Copy)]
+struct PaExtent {
+    /// Length of the extent
+    len: u64,
+    /// Physical address of the first byte
+    pa: u64,
+}
+
+/// Region range of a physical extent, keyed by physical address
+#[derive(Debug, Clone, Copy)]
+struct RegionExtent {
+    /// Length of the extent
+    len: u64,
+    /// Memory ID of the region
+    memid: MemId,
+    /// Offset of the first byte within the region
+    offset: u64,
+}
+
+/// Cache of (memid, offset range) to physical extent translations
+///
+/// Extents are learned one granule at a time, which assumes every granule of a
+/// region is physically contiguous. Call `invalidate` when a region goes away.
+#[derive(Debug)]
+pub struct TranslationCache {
+    /// Size of the extents learned from the kernel, a power of two
+    granule: u64,
+    /// Extents by start `(memid, offset)`
+    by_offset: BTreeMap<(MemId, u64), PaExtent>,
+    /// The same extents by start physical address
+    by_pa: BTreeMap<u64, RegionExtent>,
+    /// Lookups answered from the cache
+    hits: u64,
+    /// Lookups that needed the kernel
+    misses: u64,
+}
+
+impl Default for TranslationCache {
+    #[inline]
+    fn default() -> Self {
+        Self::new(DEFAULT_GRANULE)
+    }
+}
+
+impl TranslationCache {
+    /// Create an empty cache learning extents of `granule` bytes, rounded up to
+    /// a power of two of at least 4K
+    #[inline]
+    #[must_use]
+    pub fn new(granule: u64) -> Self {
+        TranslationCache {
+            granule: granule.max(MIN_GRANULE).checked_next_power_of_two().unwrap_or(DEFAULT_GRANULE),
+            by_offset: BTreeMap::new(),
+            by_pa: BTreeMap::new(),
+            hits: 0,
+            misses: 0,
+        }
+    }
+
+    /// Record that `[offset, offset + len)` of `memid` is backed by `[pa, pa + len)`,
+    /// replacing every overlapping extent
+    #[inline]
+    pub fn insert(&mut self, memid: MemId, offset: u64, len: u64, pa: u64) {
+        if len == 0 || offset.checked_add(len).is_none() || pa.checked_add(len).is_none() {
+            return;
+        }
+        self.remove_offset_overlaps(memid, offset, len);
+        self.remove_pa_overlaps(pa, len);
+        let _ = self.by_offset.insert((memid, offset), PaExtent { len, pa });
+        let _ = self.by_pa.insert(pa, RegionExtent { len, memid, offset });
+    }
+
+    /// Cached physical address of `offset` within `memid`
+    #[inline]
+    #[must_use]
+    pub fn lookup_pa(&self, memid: MemId, offset: u64) -> Option<u64> {
+        let (&(id, start), extent) = self.by_offset.range(..=(memid, offset)).next_back()?;
+        let delta = offset.wrapping_sub(start);
+        (id == memid && delta < extent.len).then(|| extent.pa.wrapping_add(delta))
+    }
+
+    /// Cached memory ID and offset of `pa`
+    #[inline]
+    #[must_use]
+    pub fn lookup_memid(&self, pa: u64) -> Option<(MemId, u64)> {
+        let (&start, extent) = self.by_pa.range(..=pa).next_back()?;
+        let delta = pa.wrapping_sub(start);
+        (delta < extent.len).then(|| (extent.memid, extent.offset.wrapping_add(delta)))
+    }
+
+    /// Physical address of `offset` within `memid`, asking the kernel on a miss
+    /// # Returns
+    /// # Errors
+    /// Physical address on success, errno on failure
+    #[inline]
+    pub fn pa_of(&mut self, memid: MemId, offset: u64) -> Result<u64, i32> {
+        if let Some(pa) = self.lookup_pa(memid, offset) {
+            self.hits = self.hits.saturating_add(1);
+            return Ok(pa);
+        }
+        self.misses = self.misses.saturating_add(1);
+        let base = self.granule_base(offset);
+        let pa = query_pa_by_memid(memid, base)?;
+        self.insert(memid, base, self.granule, pa);
+        Ok(pa.wrapping_add(offset.wrapping_sub(base)))
+    }
+
+    /// Memory ID and offset of `pa`, asking the kernel on a miss
+    /// # Returns
+    /// # Errors
+    /// Tuple of Memory ID and offset on success, errno on failure
+    #[inline]
+    pub fn memid_of(&mut self, pa: u64) -> Result<(MemId, u64), i32> {
+        if let Some(found) = self.lookup_memid(pa) {
+            self.hits = self.hits.saturating_add(1);
+            return Ok(found);
+        }
+        self.misses = self.misses.saturating_add(1);
+        let base = self.granule_base(pa);
+        let (memid, offset) = query_memid_by_pa(base)?;
+        self.insert(memid, offset, self.granule, base);
+        Ok((memid, offset.wrapping_add(pa.wrapping_sub(base))))
+    }
+
+    /// Physical addresses of many offsets within `memid`, uncached granules go
+    /// to the kernel in one bulk query
+    /// # Returns
+    /// One entry per offset: physical address on success, errno on failure
+    #[inline]
+    #[must_use]
+    pub fn pa_of_bulk(&mut self, memid: MemId, offsets: &[u64]) -> Vec<Result<u64, i32>> {
+        let mut missing: Vec<u64> = offsets
+            .iter()
+            .filter(|&&offset| self.lookup_pa(memid, offset).is_none())
+            .map(|&offset| self.granule_base(offset))
+            .collect();
+        missing.sort_unstable();
+        missing.dedup();
+
+        let mut failed = HashMap::new();
+        for (&base, result) in missing.iter().zip(query_pa_by_memid_bulk(memid, &missing)) {
+            match result {
+                Ok(pa) => self.insert(memid, base, self.granule, pa),
+                Err(errno) => {
+                    let _ = failed.insert(base, errno);
+                }
+            }
+        }
+        self.count(offsets.len(), missing.len());
+        offsets
+            .iter()
+            .map(|&offset| {
+                self.lookup_pa(memid, offset)
+                    .ok_or_else(|| failed.get(&self.granule_base(offset)).copied().unwrap_or(libc::ENOENT))
+            })
+            .collect()
+    }
+
+    /// Memory IDs and offsets of many physical addresses, uncached granules go
+    /// to the kernel in one bulk query
+    /// # Returns
+    /// One entry per address: Memory ID and offset on success, errno on failure
+    #[inline]
+    #[must_use]
+    pub fn memid_of_bulk(&mut self, pa: &[u64]) -> Vec<Result<(MemId, u64), i32>> {
+        let mut missing: Vec<u64> = pa
+            .iter()
+            .filter(|&&addr| self.lookup_memid(addr).is_none())
+            .map(|&addr| self.granule_base(addr))
+            .collect();
+        missing.sort_unstable();
+        missing.dedup();
+
+        let mut failed = HashMap::new();
+        for (&base, result) in missing.iter().zip(query_memid_by_pa_bulk(&missing)) {
+            match result {
+                Ok((memid, offset)) => self.insert(memid, offset, self.granule, base),
+                Err(errno) => {
+                    let _ = failed.insert(base, errno);
+                }
+            }
+        }
+        self.count(pa.len(), missing.len());
+        pa.iter()
+            .map(|&addr| {
+                self.lookup_memid(addr)
+                    .ok_or_else(|| failed.get(&self.granule_base(addr)).copied().unwrap_or(libc::ENOENT))
+            })
+            .collect()
+    }
+
+    /// Forget every extent of `memid`
+    #[inline]
+    pub fn invalidate(&mut self, memid: MemId) {
+        let starts: Vec<(MemId, u64)> = self.by_offset.range((memid, 0)..=(memid, u64::MAX)).map(|(&key, _)| key).collect();
+        for key in starts {
+            if let Some(extent) = self.by_offset.remove(&key) {
+                let _ = self.by_pa.remove(&extent.pa);
+            }
+        }
+    }
+
+    /// Forget every extent
+    #[inline]
+    pub fn clear(&mut self) {
+        self.by_offset.clear();
+        self.by_pa.clear();
+    }
+
+    /// Number of cached extents
+    #[inline]
+    #[must_use]
+    pub fn len(&self) -> usize {
+        self.by_offset.len()
+    }
+
+    /// Whether no extent is cached
+    #[inline]
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.by_offset.is_empty()
+    }
+
+    /// Lookups answered from the cache
+    #[inline]
+    #[must_use]
+    pub const fn hits(&self) -> u64 {
+        self.hits
+    }
+
+    /// Granules fetched from the kernel
+    #[inline]
+    #[must_use]
+    pub const fn misses(&self) -> u64 {
+        self.misses
+    }
+
+    /// Start of the granule containing `addr`
+    const fn granule_base(&self, addr: u64) -> u64 {
+        addr & !self.granule.wrapping_sub(1)
+    }
+
+    /// Account a bulk lookup of `total` entries that fetched `fetched` granules
+    fn count(&mut self, total: usize, fetched: usize) {
+        let total = u64::try_from(total).unwrap_or(u64::MAX);
+        let fetched = u64::try_from(fetched).unwrap_or(u64::MAX);
+        self.hits = self.hits.saturating_add(total.saturating_sub(fetched));
+        self.misses = self.misses.saturating_add(fetched);
+    }
+
+    /// Drop extents of `memid` overlapping `[offset, offset + len)`
+    fn remove_offset_overlaps(&mut self, memid: MemId, offset: u64, len: u64) {
+        let end = offset.saturating_add(len);
+        let mut starts: Vec<(MemId, u64)> = self
+            .by_offset
+            .range((memid, offset)..(memid, end))
+            .map(|(&key, _)| key)
+            .collect();
+        let before = self.by_offset.range(..(memid, offset)).next_back();
+        if let Some((&key, _)) = before.filter(|&(key, extent)| key.0 == memid && key.1.saturating_add(extent.len) > offset) {
+            starts.push(key);
+        }
+        for key in starts {
+            if let Some(extent) = self.by_offset.remove(&key) {
+                let _ = self.by_pa.remove(&extent.pa);
+            }
+        }
+    }
+
+    /// Drop extents overlapping `[pa, pa + len)`
+    fn remove_pa_overlaps(&mut self, pa: u64, len: u64) {
+        let end = pa.saturating_add(len);
+        let mut starts: Vec<u64> = self.by_pa.range(pa..end).map(|(&start, _)| start).collect();
+        let before = self.by_pa.range(..pa).next_back();
+        if let Some((&start, _)) = before.filter(|&(start, extent)| start.saturating_add(extent.len) > pa) {
+            starts.push(start);
+        }
+        for start in starts {
+            if let Some(extent) = self.by_pa.remove(&start) {
+                let _ = self.by_offset.remove(&(extent.memid, extent.offset));
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_translation_cache_serves_granule() -> Result<(), i32> {
+        let mut cache = TranslationCache::default();
+        let pa = cache.pa_of(1, 0x1234)?;
+        assert_eq!(cache.pa_of(1, 0x1234 + 4096)?, pa + 4096);
+        assert_eq!(cache.memid_of(pa + 8)?, (1, 0x1234 + 8));
+        assert_eq!((cache.hits(), cache.misses()), (2, 1));
+
+        // the next granule is a new miss
+        let _ = cache.pa_of(1, DEFAULT_GRANULE)?;
+        assert_eq!(cache.misses(), 2);
+        assert_eq!(cache.len(), 2);
+
+        cache.invalidate(1);
+        assert!(cache.is_empty());
+        assert!(cache.lookup_memid(pa).is_none());
+        Ok(())
+    }
+
+    #[test]
+    fn test_translation_cache_bulk() {
+        let mut cache = TranslationCache::new(1 << 16_u32);
+        let offsets: Vec<u64> = (0..64).map(|page| page * 4096).collect();
+        let pas = cache.pa_of_bulk(1, &offsets);
+        assert!(pas.iter().all(Result::is_ok));
+        // 64 pages of 4K span four 64K granules
+        assert_eq!((cache.hits(), cache.misses()), (60, 4));
+
+        let ids = cache.memid_of_bulk(&pas.iter().flatten().copied().collect::<Vec<_>>());
+        assert_eq!(ids.iter().flatten().map(|&(_, offset)| offset).collect::<Vec<_>>(), offsets);
+        assert_eq!(cache.misses(), 4);
+        assert!(cache.memid_of_bulk(&[0]).first().is_some_and(Result::is_err));
+    }
+
+    #[test]
+    fn test_translation_cache_insert_replaces_overlaps() {
+        let mut cache = TranslationCache::new(4096);
+        cache.insert(7, 0, 0x3000, 0x10_0000);
+        cache.insert(7, 0x1000, 0x1000, 0x20_0000);
+        assert_eq!(cache.lookup_pa(7, 0x1800), Some(0x20_0800));
+        assert_eq!(cache.lookup_pa(7, 0x0800), None);
+        assert_eq!(cache.lookup_memid(0x10_0800), None);
+        assert_eq!(cache.lookup_pa(8, 0x1800), None);
+    }
+}
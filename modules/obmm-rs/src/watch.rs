@@ -0,0 +1,423 @@
+//! Keeping cached topology in step with hotplug
+//!
+//! libobmm caches the UB bus controller table, and the layers above cache what
+//! was derived from it: preimport declarations per NUMA node, descriptors
+//! carrying a controller's primary CNA. `TopologyWatcher` listens to kernel
+//! uevents on a netlink socket. An event under `ub_bus_controller<N>` rescans
+//! only that controller with `refresh_controller`, an event of
+//! `/devices/system/node/node<N>` reports the node, and every subscribed
+//! `TopologyListener` hears of the change to drop what went stale. Nothing is
+//! rescanned periodically; if the socket overflows and events are lost, the
+//! whole table is rescanned once and listeners are told so.
+
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, PoisonError};
+use std::thread::JoinHandle;
+
+use anyhow::Context;
+
+use crate::preimport::PreimportPool;
+use crate::registry::DescRegistry;
+use crate::{ControllerChange, ObmmControllerInfo, UbPrivData, refresh_controller, refresh_topology};
+
+/// Kernel uevent multicast group
+const UEVENT_GROUP: u32 = 1;
+
+/// Largest uevent the kernel sends
+const UEVENT_BUFFER: usize = 8192;
+
+/// Socket receive buffer, room for a burst of hotplug events
+const RECEIVE_BUFFER: i32 = 1 << 20_u32;
+
+/// How often the watcher thread checks for shutdown, in milliseconds
+const POLL_MS: i32 = 100;
+
+/// Directory name prefix of a UB bus controller in sysfs
+const CONTROLLER_PREFIX: &str = "ub_bus_controller";
+
+/// Device path prefix of a NUMA node
+const NODE_PREFIX: &str = "/devices/system/node/node";
+
+/// Rescan of one controller, `refresh_controller` outside of tests
+type Refresh = fn(u32) -> Result<(ControllerChange, ObmmControllerInfo, ObmmControllerInfo), i32>;
+
+/// Controller entry replaced by a rescan
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub struct ControllerUpdate {
+    /// N of `ub_bus_controller<N>`
+    pub index: u32,
+    /// What changed
+    pub change: ControllerChange,
+    /// Entry before the rescan
+    pub old: ObmmControllerInfo,
+    /// Entry after the rescan
+    pub now: ObmmControllerInfo,
+}
+
+/// A change of the topology
+#[derive(Debug, Clone, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum TopologyEvent {
+    /// A controller was rescanned and its cached entry changed
+    Controller(Box<ControllerUpdate>),
+    /// A NUMA node came or went
+    Node {
+        /// Node number
+        node: usize,
+        /// Whether it is there now
+        online: bool,
+    },
+    /// Events were lost and the whole controller table was rescanned; anything may have changed
+    Rescanned,
+}
+
+impl TopologyEvent {
+    /// Whether a descriptor exported through controller `seid` with `scna` went stale
+    ///
+    /// `Rescanned` gives no detail and reports nothing stale, listeners that
+    /// cannot tell otherwise drop everything instead.
+    #[inline]
+    #[must_use]
+    pub fn invalidates(&self, seid: &[u8; 16], scna: u32) -> bool {
+        match *self {
+            TopologyEvent::Controller(ref update) => {
+                let ControllerUpdate { old, now, .. } = **update;
+                let owns = |info: &ObmmControllerInfo| info.is_present() && info.eid == *seid;
+                (owns(&old) || owns(&now)) && (!owns(&now) || u32::try_from(now.primary_cna) != Ok(scna))
+            }
+            TopologyEvent::Node { .. } | TopologyEvent::Rescanned => false,
+        }
+    }
+
+    /// NUMA nodes the change touches
+    /// # Returns
+    /// Node numbers, empty for `Rescanned`
+    #[inline]
+    #[must_use]
+    pub fn nodes(&self) -> Vec<usize> {
+        match *self {
+            TopologyEvent::Controller(ref update) => {
+                let ControllerUpdate { old, now, .. } = **update;
+                let mut nodes: Vec<usize> =
+                    [old.numa_id, now.numa_id].into_iter().filter_map(|node| usize::try_from(node).ok()).collect();
+                nodes.dedup();
+                nodes
+            }
+            TopologyEvent::Node { node, .. } => vec![node],
+            TopologyEvent::Rescanned => Vec::new(),
+        }
+    }
+}
+
+/// Something caching topology derived state
+pub trait TopologyListener: Send + Sync {
+    /// Drop whatever `event` made stale; runs on the watcher thread
+    fn topology_changed(&self, event: &TopologyEvent);
+}
+
+impl TopologyListener for PreimportPool {
+    /// Reset the declarations of every touched node, or of all nodes after a rescan
+    #[inline]
+    fn topology_changed(&self, event: &TopologyEvent) {
+        let nodes = match *event {
+            TopologyEvent::Rescanned => self.nodes(),
+            TopologyEvent::Controller(_) | TopologyEvent::Node { .. } => {
+                event.nodes().into_iter().filter_map(|node| i32::try_from(node).ok()).collect()
+            }
+        };
+        let _reset = nodes.into_iter().map(|node| self.invalidate_node(node)).fold(0, usize::saturating_add);
+    }
+}
+
+impl TopologyListener for DescRegistry {
+    /// Remove the descriptors whose controller changed its eid or primary CNA or went away
+    #[inline]
+    fn topology_changed(&self, event: &TopologyEvent) {
+        if matches!(event, TopologyEvent::Controller(_)) {
+            let _ = self.purge::<UbPrivData, _>(|_, desc| event.invalidates(&desc.seid, desc.scna)).unwrap_or(0);
+        }
+    }
+}
+
+/// What a uevent is about
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Subject {
+    /// `ub_bus_controller<N>` or a device below it
+    Controller(u32),
+    /// `node<N>`
+    Node(usize),
+}
+
+/// Action and subject of a kernel uevent, `None` for anything else
+fn parse_uevent(message: &[u8]) -> Option<(&str, Subject)> {
+    let mut fields = message.split(|&byte| byte == 0).filter_map(|field| std::str::from_utf8(field).ok());
+    // the summary line is `ACTION@DEVPATH`; libudev's own messages start with "libudev"
+    let (action, devpath) = fields.next()?.split_once('@')?;
+    if let Some(node) = devpath.strip_prefix(NODE_PREFIX) {
+        return node.parse().ok().map(|node| (action, Subject::Node(node)));
+    }
+    let controller = devpath.split('/').find_map(|part| part.strip_prefix(CONTROLLER_PREFIX))?;
+    controller.parse().ok().map(|index| (action, Subject::Controller(index)))
+}
+
+/// State shared with the watcher thread
+struct Shared {
+    /// Subscribers
+    listeners: Mutex<Vec<Arc<dyn TopologyListener>>>,
+    /// Set to stop the thread
+    stop: AtomicBool,
+    /// Events delivered so far
+    delivered: AtomicU64,
+    /// Rescan of one controller
+    refresh: Refresh,
+}
+
+impl std::fmt::Debug for Shared {
+    #[inline]
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("Shared")
+            .field("stop", &self.stop)
+            .field("delivered", &self.delivered)
+            .finish_non_exhaustive()
+    }
+}
+
+impl Shared {
+    /// Shared state rescanning controllers with `refresh`
+    fn new(refresh: Refresh) -> Self {
+        Shared { listeners: Mutex::new(Vec::new()), stop: AtomicBool::new(false), delivered: AtomicU64::new(0), refresh }
+    }
+
+    /// Turn one uevent into a topology event, if it is one
+    fn handle(&self, message: &[u8]) {
+        let event = match parse_uevent(message) {
+            Some((action, Subject::Node(node))) => match action {
+                "add" | "online" => TopologyEvent::Node { node, online: true },
+                "remove" | "offline" => TopologyEvent::Node { node, online: false },
+                _ => return,
+            },
+            Some((_, Subject::Controller(index))) => match (self.refresh)(index) {
+                Ok((ControllerChange::Unchanged, _, _)) | Err(_) => return,
+                Ok((change, old, now)) => TopologyEvent::Controller(Box::new(ControllerUpdate { index, change, old, now })),
+            },
+            None => return,
+        };
+        self.deliver(&event);
+    }
+
+    /// Rescan everything after events were lost
+    fn rescan(&self) {
+        let _ = refresh_topology().unwrap_or(0);
+        self.deliver(&TopologyEvent::Rescanned);
+    }
+
+    /// Hand `event` to every listener
+    fn deliver(&self, event: &TopologyEvent) {
+        let listeners = self.listeners.lock().unwrap_or_else(PoisonError::into_inner).clone();
+        for listener in listeners {
+            listener.topology_changed(event);
+        }
+        let _ = self.delivered.fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+/// Background thread applying hotplug events to the cached topology
+#[derive(Debug)]
+pub struct TopologyWatcher {
+    /// State shared with the thread
+    shared: Arc<Shared>,
+    /// The watcher thread, joined on drop
+    thread: Option<JoinHandle<()>>,
+}
+
+impl TopologyWatcher {
+    /// Subscribe to kernel uevents and start the watcher thread
+    /// # Returns
+    /// # Errors
+    /// `TopologyWatcher` on success, `anyhow::Error` if the netlink socket or the thread cannot be created
+    #[inline]
+    pub fn spawn() -> anyhow::Result<Self> {
+        let socket = uevent_socket()?;
+        let shared = Arc::new(Shared::new(refresh_controller));
+        let thread_shared = Arc::clone(&shared);
+        let thread = std::thread::Builder::new()
+            .name("obmm-topology".into())
+            .spawn(move || watch(&thread_shared, &socket))
+            .context("Failed to spawn the topology watcher")?;
+        Ok(TopologyWatcher { shared, thread: Some(thread) })
+    }
+
+    /// Tell `listener` about every later change
+    #[inline]
+    pub fn subscribe(&self, listener: Arc<dyn TopologyListener>) {
+        self.shared.listeners.lock().unwrap_or_else(PoisonError::into_inner).push(listener);
+    }
+
+    /// Topology events delivered so far
+    #[inline]
+    #[must_use]
+    pub fn delivered(&self) -> u64 {
+        self.shared.delivered.load(Ordering::Relaxed)
+    }
+}
+
+impl Drop for TopologyWatcher {
+    #[inline]
+    fn drop(&mut self) {
+        self.shared.stop.store(true, Ordering::Release);
+        if let Some(thread) = self.thread.take() {
+            thread.join().unwrap_or(());
+        }
+    }
+}
+
+/// Non-blocking netlink socket bound to the kernel uevent group
+fn uevent_socket() -> anyhow::Result<OwnedFd> {
+    // SAFETY: plain socket creation, the result is checked below.
+    let fd = unsafe {
+        libc::socket(
+            libc::AF_NETLINK,
+            libc::SOCK_DGRAM | libc::SOCK_CLOEXEC | libc::SOCK_NONBLOCK,
+            libc::NETLINK_KOBJECT_UEVENT,
+        )
+    };
+    if fd < 0 {
+        return Err(anyhow::Error::new(std::io::Error::last_os_error()).context("Failed to open a uevent socket"));
+    }
+    // SAFETY: `fd` is a fresh descriptor owned by nobody else.
+    let socket = unsafe { OwnedFd::from_raw_fd(fd) };
+
+    // SAFETY: an all-zero `sockaddr_nl` is valid, the fields that matter are set below.
+    let mut addr: libc::sockaddr_nl = unsafe { std::mem::zeroed() };
+    addr.nl_family = libc::sa_family_t::try_from(libc::AF_NETLINK)?;
+    addr.nl_groups = UEVENT_GROUP;
+    let addr_len = libc::socklen_t::try_from(size_of::<libc::sockaddr_nl>())?;
+    // SAFETY: binding a socket we own to an initialized address of the stated length.
+    if unsafe { libc::bind(socket.as_raw_fd(), (&raw const addr).cast(), addr_len) } != 0 {
+        return Err(anyhow::Error::new(std::io::Error::last_os_error()).context("Failed to bind the uevent socket"));
+    }
+    let size = RECEIVE_BUFFER;
+    let size_len = libc::socklen_t::try_from(size_of::<i32>())?;
+    // SAFETY: setting an int option from a live int; a smaller buffer only risks a rescan.
+    let _ = unsafe {
+        libc::setsockopt(socket.as_raw_fd(), libc::SOL_SOCKET, libc::SO_RCVBUF, (&raw const size).cast(), size_len)
+    };
+    Ok(socket)
+}
+
+/// Body of the watcher thread
+fn watch(shared: &Shared, socket: &OwnedFd) {
+    let mut buf = vec![0_u8; UEVENT_BUFFER];
+    while !shared.stop.load(Ordering::Acquire) {
+        let mut pollfd = libc::pollfd { fd: socket.as_raw_fd(), events: libc::POLLIN, revents: 0 };
+        // SAFETY: polling one live pollfd.
+        if unsafe { libc::poll(&raw mut pollfd, 1, POLL_MS) } <= 0 {
+            continue;
+        }
+        loop {
+            // SAFETY: receiving into a buffer we own, at most its length.
+            let received = unsafe { libc::recv(socket.as_raw_fd(), buf.as_mut_ptr().cast(), buf.len(), 0) };
+            if let Ok(len) = usize::try_from(received) {
+                shared.handle(buf.get(..len).unwrap_or_default());
+                continue;
+            }
+            match std::io::Error::last_os_error().raw_os_error() {
+                Some(libc::EINTR) => {}
+                Some(libc::ENOBUFS) => shared.rescan(),
+                _ => break,
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::ObmmMemDesc;
+
+    const EID: [u8; 16] = [9; 16];
+
+    fn info(eid: [u8; 16], numa_id: i32, primary_cna: i32) -> ObmmControllerInfo {
+        ObmmControllerInfo { eid, numa_id, primary_cna, ..ObmmControllerInfo::default() }
+    }
+
+    fn moved_cna(index: u32) -> Result<(ControllerChange, ObmmControllerInfo, ObmmControllerInfo), i32> {
+        match index {
+            2 => Ok((ControllerChange::Changed, info(EID, 1, 3), info(EID, 1, 5))),
+            3 => Ok((ControllerChange::Unchanged, info([3; 16], 0, 7), info([3; 16], 0, 7))),
+            _ => Err(libc::EINVAL),
+        }
+    }
+
+    #[derive(Default)]
+    struct Recorder(Mutex<Vec<TopologyEvent>>);
+
+    impl TopologyListener for Recorder {
+        fn topology_changed(&self, event: &TopologyEvent) {
+            self.0.lock().unwrap_or_else(PoisonError::into_inner).push(event.clone());
+        }
+    }
+
+    #[test]
+    fn test_uevents_become_topology_events() {
+        let shared = Shared::new(moved_cna);
+        let recorder = Arc::new(Recorder::default());
+        let listener: Arc<dyn TopologyListener> = Arc::<Recorder>::clone(&recorder);
+        shared.listeners.lock().unwrap_or_else(PoisonError::into_inner).push(listener);
+
+        shared.handle(b"change@/devices/ub_bus_controller2/ubc\0ACTION=change\0DEVPATH=/devices/ub_bus_controller2/ubc\0");
+        shared.handle(b"change@/devices/ub_bus_controller3/ubc\0ACTION=change\0");
+        shared.handle(b"add@/devices/system/node/node5\0ACTION=add\0");
+        shared.handle(b"online@/devices/system/memory/memory40\0ACTION=online\0");
+        shared.handle(b"libudev\0\xfe\xed\xca\xfe");
+
+        let events = recorder.0.lock().unwrap_or_else(PoisonError::into_inner).clone();
+        assert_eq!(events.len(), 2);
+        assert!(events.first().is_some_and(|event| matches!(event, TopologyEvent::Controller(update) if update.index == 2)));
+        assert_eq!(events.last(), Some(&TopologyEvent::Node { node: 5, online: true }));
+        assert_eq!(shared.delivered.load(Ordering::Relaxed), 2);
+    }
+
+    #[test]
+    fn test_stale_descriptors_and_pools_are_dropped() -> anyhow::Result<()> {
+        let event = TopologyEvent::Controller(Box::new(ControllerUpdate {
+            index: 2,
+            change: ControllerChange::Changed,
+            old: info(EID, 1, 3),
+            now: info(EID, 1, 5),
+        }));
+        assert!(event.invalidates(&EID, 3));
+        assert!(!event.invalidates(&EID, 5));
+        assert!(!event.invalidates(&[1; 16], 3));
+        assert_eq!(event.nodes(), vec![1]);
+
+        let path = std::env::temp_dir().join(format!("obmm-watch-{}", std::process::id()));
+        if path.exists() {
+            std::fs::remove_file(&path)?;
+        }
+        let registry = DescRegistry::open(&path, 16)?;
+        let stale = ObmmMemDesc::<UbPrivData> { seid: EID, scna: 3, ..Default::default() };
+        let fresh = ObmmMemDesc::<UbPrivData> { seid: EID, scna: 5, ..Default::default() };
+        registry.insert(1, &stale)?;
+        registry.insert(2, &fresh)?;
+        registry.topology_changed(&event);
+        assert!(registry.lookup::<UbPrivData>(1)?.is_none());
+        assert!(registry.lookup::<UbPrivData>(2)?.is_some());
+        std::fs::remove_file(&path)?;
+
+        let workers = Arc::new(threadpool::ThreadPool::new(2)?);
+        let ranges = [1, 1, 0]
+            .into_iter()
+            .map(|numa_id| crate::ObmmPreimportInfo::<UbPrivData> { length: 1 << 30_u32, numa_id, ..Default::default() })
+            .collect();
+        let pool = PreimportPool::new(workers, ranges, 1);
+        pool.wait_idle();
+        assert_eq!(pool.invalidate_node(1), 1);
+        pool.topology_changed(&TopologyEvent::Rescanned);
+        pool.wait_idle();
+        assert_eq!((pool.warm(1), pool.warm(0)), (1, 1));
+        Ok(())
+    }
+}
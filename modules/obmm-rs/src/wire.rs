@@ -0,0 +1,515 @@
+//! Fixed-layout binary encoding of [`ObmmMemDesc`]
+//!
+//! The JSON path is convenient for files and debugging, but descriptor exchange
+//! sits on the attach critical path. This encoding can be read in place from a
+//! received buffer without allocating.
+//!
+//! Layout, version 1, all integers little-endian:
+//!
+//! | offset | size       | field                                  |
+//! |--------|------------|----------------------------------------|
+//! | 0      | 4          | magic `OBMD`                           |
+//! | 4      | 2          | version                                |
+//! | 6      | 2          | reserved, zero                         |
+//! | 8      | 62         | `struct obmm_mem_desc` up to `priv_len` |
+//! | 70     | `priv_len` | `priv[]`                               |
+//!
+//! Bytes 8.. are byte-identical to `struct obmm_mem_desc` on little-endian hosts.
+
+use std::fmt;
+
+use crate::{ObmmMemDesc, UbPrivData};
+
+/// Magic bytes at the start of every encoded descriptor
+pub const WIRE_MAGIC: [u8; 4] = *b"OBMD";
+/// Current encoding version
+pub const WIRE_VERSION: u16 = 1;
+/// Length of the fixed part, `priv[]` follows it
+pub const WIRE_HEADER_LEN: usize = OFF_PRIV;
+
+/// Offset of the magic
+const OFF_MAGIC: usize = 0;
+/// Offset of the version
+const OFF_VERSION: usize = 4;
+/// Offset of the reserved field
+const OFF_RESERVED: usize = 6;
+/// Offset of `addr`
+const OFF_ADDR: usize = 8;
+/// Offset of `length`
+const OFF_LENGTH: usize = 16;
+/// Offset of `seid`
+const OFF_SEID: usize = 24;
+/// Offset of `deid`
+const OFF_DEID: usize = 40;
+/// Offset of `tokenid`
+const OFF_TOKENID: usize = 56;
+/// Offset of `scna`
+const OFF_SCNA: usize = 60;
+/// Offset of `dcna`
+const OFF_DCNA: usize = 64;
+/// Offset of `priv_len`
+const OFF_PRIV_LEN: usize = 68;
+/// Offset of `priv[]`
+const OFF_PRIV: usize = 70;
+
+/// Returned by accessors if the buffer is shorter than validated, which cannot happen
+static ZERO_EID: [u8; 16] = [0; 16];
+
+/// Vendor private payload carried in the trailing `priv[]` bytes
+pub trait PrivPayload: Sized {
+    /// Encoded length in bytes
+    const LEN: u16;
+
+    /// Write the payload into `out`, which is exactly `LEN` bytes long
+    fn encode(&self, out: &mut [u8]);
+
+    /// Read the payload from `bytes`, which is exactly `LEN` bytes long
+    fn decode(bytes: &[u8]) -> Option<Self>;
+}
+
+impl PrivPayload for UbPrivData {
+    const LEN: u16 = 2;
+
+    #[inline]
+    fn encode(&self, out: &mut [u8]) {
+        out.copy_from_slice(&self.bits().to_le_bytes());
+    }
+
+    #[inline]
+    fn decode(bytes: &[u8]) -> Option<Self> {
+        let bits = u16::from_le_bytes(bytes.try_into().ok()?);
+        Some(UbPrivData::from_bits_retain(bits))
+    }
+}
+
+impl PrivPayload for () {
+    const LEN: u16 = 0;
+
+    #[inline]
+    fn encode(&self, _: &mut [u8]) {}
+
+    #[inline]
+    fn decode(_: &[u8]) -> Option<Self> {
+        Some(())
+    }
+}
+
+/// Opaque vendor payload of exactly `N` bytes
+///
+/// For vendors whose `priv[]` layout obmm-rs does not interpret. The length is
+/// part of the type, so a descriptor carrying it has a size known at compile
+/// time and is copied without consulting `priv_len`. Implemented for lengths
+/// 4, 8, 16, 32 and 64.
+#[repr(transparent)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+#[non_exhaustive]
+pub struct RawPriv<const N: usize>([u8; N]);
+
+impl<const N: usize> RawPriv<N> {
+    /// Payload holding `bytes`
+    #[inline]
+    #[must_use]
+    pub const fn new(bytes: [u8; N]) -> Self {
+        RawPriv(bytes)
+    }
+
+    /// The payload bytes
+    #[inline]
+    #[must_use]
+    pub const fn bytes(&self) -> &[u8; N] {
+        &self.0
+    }
+}
+
+impl<const N: usize> Default for RawPriv<N> {
+    #[inline]
+    fn default() -> Self {
+        RawPriv([0; N])
+    }
+}
+
+/// `PrivPayload` for every supported `RawPriv` length
+macro_rules! raw_priv_payload {
+    ($($len:literal),*) => {$(
+        impl PrivPayload for RawPriv<$len> {
+            const LEN: u16 = $len;
+
+            #[inline]
+            fn encode(&self, out: &mut [u8]) {
+                out.copy_from_slice(&self.0);
+            }
+
+            #[inline]
+            fn decode(bytes: &[u8]) -> Option<Self> {
+                bytes.try_into().ok().map(RawPriv)
+            }
+        }
+    )*};
+}
+
+raw_priv_payload!(4, 8, 16, 32, 64);
+
+/// Attach `payload` to `desc`, with `priv_len` taken from its type
+#[inline]
+pub fn set_priv<T: PrivPayload>(desc: &mut ObmmMemDesc<T>, payload: T) {
+    desc.priv_data = payload;
+    desc.priv_len = T::LEN;
+}
+
+/// Errors of the binary descriptor encoding
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum WireError {
+    /// Buffer is shorter than the encoded descriptor
+    Truncated {
+        /// Bytes required
+        need: u32,
+    },
+    /// Buffer does not start with [`WIRE_MAGIC`]
+    BadMagic,
+    /// Encoded with a version this build does not understand
+    UnsupportedVersion(u16),
+    /// `priv_len` is neither 0 nor the payload length
+    PrivLength {
+        /// Expected payload length
+        expected: u16,
+        /// `priv_len` found in the descriptor
+        actual: u16,
+    },
+    /// Payload bytes could not be decoded
+    BadPayload,
+}
+
+impl fmt::Display for WireError {
+    #[inline]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match *self {
+            WireError::Truncated { need } => write!(f, "descriptor truncated: need {need} bytes"),
+            WireError::BadMagic => write!(f, "bad descriptor magic"),
+            WireError::UnsupportedVersion(version) => write!(f, "unsupported descriptor version {version}"),
+            WireError::PrivLength { expected, actual } => {
+                write!(f, "priv_len {actual} does not match payload length {expected}")
+            }
+            WireError::BadPayload => write!(f, "malformed priv payload"),
+        }
+    }
+}
+
+impl std::error::Error for WireError {}
+
+/// Encoded length of a descriptor with payload `T`
+#[inline]
+#[must_use]
+pub fn encoded_len<T: PrivPayload>(desc: &ObmmMemDesc<T>) -> usize {
+    WIRE_HEADER_LEN.saturating_add(usize::from(desc.priv_len))
+}
+
+/// Encode `desc` into the front of `buf`
+/// # Returns
+/// # Errors
+/// Number of bytes written on success, `WireError` if `buf` is too short or
+/// `priv_len` is inconsistent with `T`
+#[inline]
+pub fn encode_into<T: PrivPayload>(desc: &ObmmMemDesc<T>, buf: &mut [u8]) -> Result<usize, WireError> {
+    check_priv_len::<T>(desc.priv_len)?;
+    let need = encoded_len(desc);
+    let out = buf.get_mut(..need).ok_or(WireError::Truncated { need: wire_len(need) })?;
+
+    put(out, OFF_MAGIC, &WIRE_MAGIC);
+    put(out, OFF_VERSION, &WIRE_VERSION.to_le_bytes());
+    put(out, OFF_RESERVED, &[0; 2]);
+    put(out, OFF_ADDR, &desc.addr.to_le_bytes());
+    put(out, OFF_LENGTH, &desc.length.to_le_bytes());
+    put(out, OFF_SEID, &desc.seid);
+    put(out, OFF_DEID, &desc.deid);
+    put(out, OFF_TOKENID, &desc.tokenid.to_le_bytes());
+    put(out, OFF_SCNA, &desc.scna.to_le_bytes());
+    put(out, OFF_DCNA, &desc.dcna.to_le_bytes());
+    put(out, OFF_PRIV_LEN, &desc.priv_len.to_le_bytes());
+    if let Some(payload) = out.get_mut(OFF_PRIV..).filter(|payload| !payload.is_empty()) {
+        desc.priv_data.encode(payload);
+    }
+    Ok(need)
+}
+
+/// Encode `desc` into a new buffer
+/// # Returns
+/// # Errors
+/// Encoded bytes on success, `WireError` if `priv_len` is inconsistent with `T`
+#[inline]
+pub fn encode<T: PrivPayload>(desc: &ObmmMemDesc<T>) -> Result<Vec<u8>, WireError> {
+    let mut buf = vec![0; encoded_len(desc)];
+    let _ = encode_into(desc, &mut buf)?;
+    Ok(buf)
+}
+
+/// Decode a descriptor from the front of `buf`
+/// # Returns
+/// # Errors
+/// `ObmmMemDesc` on success, `WireError` if `buf` is not a valid encoding
+#[inline]
+pub fn decode<T: PrivPayload + Default>(buf: &[u8]) -> Result<ObmmMemDesc<T>, WireError> {
+    WireDesc::parse(buf)?.to_desc()
+}
+
+/// A validated, borrowed view of an encoded descriptor
+///
+/// Accessors read straight from the underlying buffer.
+#[derive(Debug, Clone, Copy)]
+pub struct WireDesc<'a> {
+    /// Exactly the encoded bytes, header plus `priv[]`
+    buf: &'a [u8],
+}
+
+impl<'a> WireDesc<'a> {
+    /// Validate the encoding at the front of `buf`, trailing bytes are ignored
+    /// # Returns
+    /// # Errors
+    /// View on success, `WireError` if `buf` is not a valid encoding
+    #[inline]
+    pub fn parse(buf: &'a [u8]) -> Result<Self, WireError> {
+        if buf.len() < WIRE_HEADER_LEN {
+            return Err(WireError::Truncated { need: wire_len(WIRE_HEADER_LEN) });
+        }
+        if field::<4>(buf, OFF_MAGIC) != WIRE_MAGIC {
+            return Err(WireError::BadMagic);
+        }
+        let version = u16::from_le_bytes(field(buf, OFF_VERSION));
+        if version != WIRE_VERSION {
+            return Err(WireError::UnsupportedVersion(version));
+        }
+        let priv_len = u16::from_le_bytes(field(buf, OFF_PRIV_LEN));
+        let need = WIRE_HEADER_LEN.saturating_add(usize::from(priv_len));
+        let buf = buf.get(..need).ok_or(WireError::Truncated { need: wire_len(need) })?;
+        Ok(WireDesc { buf })
+    }
+
+    /// Number of bytes the encoding occupies
+    #[inline]
+    #[must_use]
+    pub fn encoded_len(&self) -> usize {
+        self.buf.len()
+    }
+
+    /// Base address of the memory region
+    #[inline]
+    #[must_use]
+    pub fn addr(&self) -> u64 {
+        u64::from_le_bytes(field(self.buf, OFF_ADDR))
+    }
+
+    /// Length of the memory region
+    #[inline]
+    #[must_use]
+    pub fn length(&self) -> u64 {
+        u64::from_le_bytes(field(self.buf, OFF_LENGTH))
+    }
+
+    /// 128bit source eid, ordered by little-endian
+    #[inline]
+    #[must_use]
+    pub fn seid(&self) -> &'a [u8; 16] {
+        eid(self.buf, OFF_SEID)
+    }
+
+    /// 128bit destination eid, ordered by little-endian
+    #[inline]
+    #[must_use]
+    pub fn deid(&self) -> &'a [u8; 16] {
+        eid(self.buf, OFF_DEID)
+    }
+
+    /// Token ID
+    #[inline]
+    #[must_use]
+    pub fn tokenid(&self) -> u32 {
+        u32::from_le_bytes(field(self.buf, OFF_TOKENID))
+    }
+
+    /// Source CNA
+    #[inline]
+    #[must_use]
+    pub fn scna(&self) -> u32 {
+        u32::from_le_bytes(field(self.buf, OFF_SCNA))
+    }
+
+    /// Destination CNA
+    #[inline]
+    #[must_use]
+    pub fn dcna(&self) -> u32 {
+        u32::from_le_bytes(field(self.buf, OFF_DCNA))
+    }
+
+    /// Length of privilege data
+    #[inline]
+    #[must_use]
+    pub fn priv_len(&self) -> u16 {
+        u16::from_le_bytes(field(self.buf, OFF_PRIV_LEN))
+    }
+
+    /// Raw `priv[]` bytes
+    #[inline]
+    #[must_use]
+    pub fn priv_bytes(&self) -> &'a [u8] {
+        self.buf.get(OFF_PRIV..).unwrap_or_default()
+    }
+
+    /// Copy the view out into an `ObmmMemDesc`
+    /// # Returns
+    /// # Errors
+    /// `ObmmMemDesc` on success, `WireError` if the payload does not decode as `T`
+    #[inline]
+    pub fn to_desc<T: PrivPayload + Default>(&self) -> Result<ObmmMemDesc<T>, WireError> {
+        let priv_len = self.priv_len();
+        check_priv_len::<T>(priv_len)?;
+        let priv_data = if priv_len == 0 {
+            T::default()
+        } else {
+            T::decode(self.priv_bytes()).ok_or(WireError::BadPayload)?
+        };
+        Ok(ObmmMemDesc {
+            addr: self.addr(),
+            length: self.length(),
+            seid: *self.seid(),
+            deid: *self.deid(),
+            tokenid: self.tokenid(),
+            scna: self.scna(),
+            dcna: self.dcna(),
+            priv_len,
+            priv_data,
+        })
+    }
+}
+
+/// `priv_len` must be 0 (no payload) or exactly the payload length
+fn check_priv_len<T: PrivPayload>(priv_len: u16) -> Result<(), WireError> {
+    if priv_len == 0 || priv_len == T::LEN {
+        Ok(())
+    } else {
+        Err(WireError::PrivLength { expected: T::LEN, actual: priv_len })
+    }
+}
+
+/// Encoded lengths are at most header plus `u16::MAX` and always fit
+fn wire_len(len: usize) -> u32 {
+    u32::try_from(len).unwrap_or(u32::MAX)
+}
+
+/// Copy `N` bytes at `start` out of `buf`
+fn field<const N: usize>(buf: &[u8], start: usize) -> [u8; N] {
+    buf.get(start..)
+        .and_then(|rest| rest.get(..N))
+        .and_then(|bytes| bytes.try_into().ok())
+        .unwrap_or([0; N])
+}
+
+/// Borrow the 16-byte eid at `start` in `buf`
+fn eid(buf: &[u8], start: usize) -> &[u8; 16] {
+    buf.get(start..)
+        .and_then(|rest| rest.get(..16))
+        .and_then(|bytes| bytes.try_into().ok())
+        .unwrap_or(&ZERO_EID)
+}
+
+/// Copy `bytes` into `buf` at `start`
+fn put(buf: &mut [u8], start: usize, bytes: &[u8]) {
+    if let Some(dst) = buf.get_mut(start..).and_then(|rest| rest.get_mut(..bytes.len())) {
+        dst.copy_from_slice(bytes);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn sample() -> ObmmMemDesc<UbPrivData> {
+        ObmmMemDesc::<UbPrivData> {
+            addr: 0xffff_fc00_0000,
+            length: 1024 * 1024 * 128,
+            seid: [1; 16],
+            deid: [2; 16],
+            tokenid: 42,
+            scna: 3,
+            dcna: 4,
+            priv_len: 2,
+            priv_data: UbPrivData::OCHIP | UbPrivData::CACHEABLE,
+        }
+    }
+
+    #[test]
+    fn test_wire_roundtrip() -> anyhow::Result<()> {
+        let desc = sample();
+        let buf = encode(&desc)?;
+        assert_eq!(buf.len(), WIRE_HEADER_LEN + 2);
+
+        let view = WireDesc::parse(&buf)?;
+        assert_eq!(view.addr(), desc.addr);
+        assert_eq!(view.length(), desc.length);
+        assert_eq!(view.seid(), &desc.seid);
+        assert_eq!(view.deid(), &desc.deid);
+        assert_eq!(view.tokenid(), desc.tokenid);
+        assert_eq!(view.priv_bytes(), &[0x60, 0x00]);
+
+        let decoded = decode::<UbPrivData>(&buf)?;
+        assert_eq!(decoded.scna, desc.scna);
+        assert_eq!(decoded.dcna, desc.dcna);
+        assert_eq!(decoded.priv_len, desc.priv_len);
+        assert_eq!(decoded.priv_data, desc.priv_data);
+        Ok(())
+    }
+
+    #[test]
+    fn test_wire_trailing_bytes_and_no_payload() -> anyhow::Result<()> {
+        let mut desc = sample();
+        desc.priv_len = 0;
+        let mut buf = [0xaa_u8; 128];
+        let written = encode_into(&desc, &mut buf)?;
+        assert_eq!(written, WIRE_HEADER_LEN);
+
+        let view = WireDesc::parse(&buf)?;
+        assert_eq!(view.encoded_len(), WIRE_HEADER_LEN);
+        assert!(view.priv_bytes().is_empty());
+        assert_eq!(view.to_desc::<UbPrivData>()?.priv_data, UbPrivData::default());
+        Ok(())
+    }
+
+    #[test]
+    fn test_wire_raw_payload() -> anyhow::Result<()> {
+        let mut desc = ObmmMemDesc::<RawPriv<8>> { addr: 0x1000, length: 4096, ..Default::default() };
+        set_priv(&mut desc, RawPriv::new(*b"vendor01"));
+        assert_eq!(desc.priv_len, 8);
+        // priv[] sits where `struct obmm_mem_desc` puts it, right after priv_len
+        assert_eq!(std::mem::offset_of!(ObmmMemDesc<RawPriv<8>>, priv_data), OFF_PRIV - OFF_ADDR);
+
+        let buf = encode(&desc)?;
+        assert_eq!(buf.len(), WIRE_HEADER_LEN + 8);
+        assert_eq!(WireDesc::parse(&buf)?.priv_bytes(), b"vendor01");
+        assert_eq!(decode::<RawPriv<8>>(&buf)?.priv_data, desc.priv_data);
+        assert_eq!(decode::<RawPriv<4>>(&buf).err(), Some(WireError::PrivLength { expected: 4, actual: 8 }));
+        Ok(())
+    }
+
+    #[test]
+    fn test_wire_rejects_bad_input() -> anyhow::Result<()> {
+        let buf = encode(&sample())?;
+        let no_header = buf.get(..40).unwrap_or_default();
+        assert_eq!(WireDesc::parse(no_header).err(), Some(WireError::Truncated { need: 70 }));
+        let no_payload = buf.get(..=WIRE_HEADER_LEN).unwrap_or_default();
+        assert_eq!(WireDesc::parse(no_payload).err(), Some(WireError::Truncated { need: 72 }));
+
+        let mut bad_magic = buf.clone();
+        if let Some(b) = bad_magic.first_mut() {
+            *b = b'X';
+        }
+        assert_eq!(WireDesc::parse(&bad_magic).err(), Some(WireError::BadMagic));
+
+        let mut bad_version = buf.clone();
+        if let Some(b) = bad_version.get_mut(4) {
+            *b = 9;
+        }
+        assert_eq!(WireDesc::parse(&bad_version).err(), Some(WireError::UnsupportedVersion(9)));
+
+        assert_eq!(decode::<()>(&buf).err(), Some(WireError::PrivLength { expected: 0, actual: 2 }));
+        Ok(())
+    }
+}
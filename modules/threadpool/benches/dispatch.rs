@@ -0,0 +1,82 @@
+//! 线程池任务分发开销
+//!
+//! 对比逐个 `execute`、`execute_batch`、`submit`、`scope` 与每个任务新建线程的耗时，任务本身为空，
+//! 测得的即为入队、唤醒与完成通知的开销。
+
+use std::hint::black_box;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use threadpool::ThreadPool;
+
+/// 每轮分发的任务数
+const JOBS: [usize; 3] = [1, 64, 1024];
+/// 线程池大小
+const WORKERS: [usize; 3] = [1, 4, 16];
+
+fn bench_execute(c: &mut Criterion) {
+    let mut group = c.benchmark_group("dispatch");
+    for workers in WORKERS {
+        let pool = ThreadPool::new(workers).expect("pool");
+        for jobs in JOBS {
+            group.throughput(Throughput::Elements(jobs as u64));
+            let id = format!("{workers}w/{jobs}");
+            group.bench_with_input(BenchmarkId::new("execute", &id), &jobs, |b, &jobs| {
+                b.iter(|| {
+                    let (tx, rx) = mpsc::channel();
+                    for i in 0..jobs {
+                        let tx = tx.clone();
+                        pool.execute(move || tx.send(black_box(i)).unwrap_or_default()).expect("execute");
+                    }
+                    drop(tx);
+                    rx.iter().count()
+                });
+            });
+            group.bench_with_input(BenchmarkId::new("execute_batch", &id), &jobs, |b, &jobs| {
+                b.iter(|| {
+                    let (tx, rx) = mpsc::channel::<usize>();
+                    let tasks: Vec<_> = (0..jobs)
+                        .map(|i| {
+                            let tx = tx.clone();
+                            move || tx.send(black_box(i)).unwrap_or_default()
+                        })
+                        .collect();
+                    drop(tx);
+                    let queued = pool.execute_batch(tasks).into_iter().filter(Result::is_ok).count();
+                    assert_eq!(rx.iter().count(), queued);
+                });
+            });
+            group.bench_with_input(BenchmarkId::new("submit", &id), &jobs, |b, &jobs| {
+                b.iter(|| {
+                    let handles: Vec<_> = (0..jobs).map(|i| pool.submit(move || black_box(i)).expect("submit")).collect();
+                    handles.into_iter().map(|h| h.join().expect("join")).sum::<usize>()
+                });
+            });
+            group.bench_with_input(BenchmarkId::new("scope", &id), &jobs, |b, &jobs| {
+                let slots: Vec<AtomicUsize> = (0..jobs).map(|_| AtomicUsize::new(0)).collect();
+                b.iter(|| {
+                    pool.scope(|scope| {
+                        for (i, slot) in slots.iter().enumerate() {
+                            scope.spawn(move || slot.store(black_box(i), Ordering::Relaxed)).expect("spawn");
+                        }
+                    })
+                    .expect("scope");
+                });
+            });
+        }
+    }
+    for jobs in JOBS {
+        group.throughput(Throughput::Elements(jobs as u64));
+        group.bench_with_input(BenchmarkId::new("thread_spawn", jobs), &jobs, |b, &jobs| {
+            b.iter(|| {
+                let handles: Vec<_> = (0..jobs).map(|i| std::thread::spawn(move || black_box(i))).collect();
+                handles.into_iter().map(|h| h.join().expect("join")).sum::<usize>()
+            });
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_execute);
+criterion_main!(benches);
@@ -0,0 +1,328 @@
+use std::{
+    any::Any,
+    future::Future,
+    marker::PhantomData,
+    mem::{self, MaybeUninit},
+    panic::{self, AssertUnwindSafe},
+    pin::Pin,
+    sync::{Arc, Condvar, Mutex, atomic::{AtomicBool, Ordering}},
+    task::{Context, Poll, Waker},
+    thread,
+};
+
+use anyhow::{Result, anyhow, bail};
+
+use crate::{Shared, ThreadPool, ThreadPoolError};
+
+/// 内联存储区：能直接放下捕获了三个指针以内的闭包
+type Inline = [usize; 3];
+
+/// 类型擦除后的任务
+///
+/// 不超过 `Inline` 大小的闭包直接存放在任务内部，提交时不需要堆分配；
+/// 更大的闭包才装箱，把 Box 指针存进内联存储区。
+pub(crate) struct Job {
+    storage: MaybeUninit<Inline>,
+    /// 取出存储区中的闭包，`run` 为 true 时执行它，否则只析构；调用后存储区为空
+    invoke: Option<unsafe fn(*mut u8, bool)>,
+}
+
+// 构造时要求闭包是 Send 的
+unsafe impl Send for Job {}
+
+const fn fits_inline<F>() -> bool {
+    mem::size_of::<F>() <= mem::size_of::<Inline>() && mem::align_of::<F>() <= mem::align_of::<Inline>()
+}
+
+unsafe fn invoke<F: FnOnce()>(data: *mut u8, run: bool) {
+    let f = unsafe { data.cast::<F>().read() };
+    if run {
+        f();
+    }
+}
+
+impl Job {
+    pub(crate) fn new<F>(f: F) -> Job
+    where
+        F: FnOnce() + Send + 'static,
+    {
+        // SAFETY: 'static 的闭包不借用任何数据
+        unsafe { Job::new_unchecked(f) }
+    }
+
+    /// 不要求 'static 的任务
+    ///
+    /// # Safety
+    /// 调用者保证闭包借用的数据在任务执行完或被析构之前一直有效
+    pub(crate) unsafe fn new_unchecked<F>(f: F) -> Job
+    where
+        F: FnOnce() + Send,
+    {
+        if fits_inline::<F>() {
+            Job::inline(f)
+        } else {
+            Job::inline(Box::new(f))
+        }
+    }
+
+    fn inline<F: FnOnce() + Send>(f: F) -> Job {
+        assert!(fits_inline::<F>());
+        let mut storage = MaybeUninit::<Inline>::uninit();
+        unsafe { storage.as_mut_ptr().cast::<F>().write(f) };
+        Job { storage, invoke: Some(invoke::<F>) }
+    }
+
+    pub(crate) fn run(mut self) {
+        if let Some(invoke) = self.invoke.take() {
+            unsafe { invoke(self.storage.as_mut_ptr().cast(), true) }
+        }
+    }
+}
+
+impl Drop for Job {
+    fn drop(&mut self) {
+        if let Some(invoke) = self.invoke.take() {
+            unsafe { invoke(self.storage.as_mut_ptr().cast(), false) }
+        }
+    }
+}
+
+/// 执行任务并捕获 panic，返回 panic 信息
+pub(crate) fn run_job(job: Job) -> Option<String> {
+    panic::catch_unwind(AssertUnwindSafe(|| job.run())).err().map(|e| panic_message(&*e))
+}
+
+pub(crate) fn panic_message(payload: &(dyn Any + Send)) -> String {
+    if let Some(s) = payload.downcast_ref::<String>() {
+        s.clone()
+    } else if let Some(s) = payload.downcast_ref::<&str>() {
+        s.to_string()
+    } else {
+        "Unknown panic payload".to_string()
+    }
+}
+
+/// 任务结果，任务和句柄之间共享
+struct Packet<T> {
+    slot: Mutex<Slot<T>>,
+    done: Condvar,
+}
+
+struct Slot<T> {
+    result: Option<thread::Result<T>>,
+    waker: Option<Waker>,
+}
+
+impl<T> Packet<T> {
+    fn lock(&self) -> std::sync::MutexGuard<'_, Slot<T>> {
+        self.slot.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    fn set(&self, result: thread::Result<T>) {
+        let mut slot = self.lock();
+        slot.result = Some(result);
+        let waker = slot.waker.take();
+        self.done.notify_all();
+        drop(slot);
+        if let Some(waker) = waker {
+            waker.wake();
+        }
+    }
+}
+
+/// 任务一侧的结果写入端；任务没有执行就被丢弃时，句柄会得到一个错误而不是永远等待
+pub(crate) struct Completer<T> {
+    packet: Option<Arc<Packet<T>>>,
+}
+
+impl<T> Completer<T> {
+    /// 执行 `f` 并把返回值或 panic 交给句柄
+    pub(crate) fn run<F: FnOnce() -> T>(mut self, f: F) {
+        let result = panic::catch_unwind(AssertUnwindSafe(f));
+        if let Some(packet) = self.packet.take() {
+            packet.set(result);
+        }
+    }
+}
+
+impl<T> Drop for Completer<T> {
+    fn drop(&mut self) {
+        if let Some(packet) = self.packet.take() {
+            packet.set(Err(Box::new("task was dropped before it ran")));
+        }
+    }
+}
+
+/// `ThreadPool::submit` 返回的任务句柄
+///
+/// `join` 阻塞等待任务的返回值；句柄同时实现了 `Future`，可以在任意执行器中 await。
+/// 任务 panic 时两者都返回 `ThreadPoolError::WorkerPanicked`。
+pub struct TaskHandle<T> {
+    packet: Arc<Packet<T>>,
+}
+
+impl<T> std::fmt::Debug for TaskHandle<T> {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("TaskHandle").field("finished", &self.is_finished()).finish()
+    }
+}
+
+pub(crate) fn task<T>() -> (Completer<T>, TaskHandle<T>) {
+    let packet = Arc::new(Packet {
+        slot: Mutex::new(Slot { result: None, waker: None }),
+        done: Condvar::new(),
+    });
+    (Completer { packet: Some(Arc::clone(&packet)) }, TaskHandle { packet })
+}
+
+fn task_result<T>(result: thread::Result<T>) -> Result<T> {
+    result.map_err(|e| anyhow!(ThreadPoolError::WorkerPanicked(panic_message(&*e))))
+}
+
+impl<T> TaskHandle<T> {
+    /// 任务是否已经结束
+    pub fn is_finished(&self) -> bool {
+        self.packet.lock().result.is_some()
+    }
+
+    /// 等待任务结束并取得返回值
+    pub fn join(self) -> Result<T> {
+        let mut slot = self.packet.lock();
+        loop {
+            if let Some(result) = slot.result.take() {
+                return task_result(result);
+            }
+            slot = self.packet.done.wait(slot).unwrap_or_else(|e| e.into_inner());
+        }
+    }
+}
+
+impl<T> Future for TaskHandle<T> {
+    type Output = Result<T>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Result<T>> {
+        let mut slot = self.packet.lock();
+        match slot.result.take() {
+            Some(result) => Poll::Ready(task_result(result)),
+            None => {
+                slot.waker = Some(cx.waker().clone());
+                Poll::Pending
+            }
+        }
+    }
+}
+
+/// 作用域内尚未完成的任务
+#[derive(Debug, Default)]
+struct ScopeState {
+    pending: Mutex<usize>,
+    done: Condvar,
+    panicked: AtomicBool,
+}
+
+impl ScopeState {
+    fn lock(&self) -> std::sync::MutexGuard<'_, usize> {
+        self.pending.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    fn finish(&self) {
+        let mut pending = self.lock();
+        *pending -= 1;
+        if *pending == 0 {
+            self.done.notify_all();
+        }
+    }
+
+    /// 等待所有任务完成
+    ///
+    /// 调用者本身可能就是 worker：等待期间先帮忙执行队列中的任务，
+    /// 避免所有 worker 都在作用域里等待时，剩下的任务没有人执行。
+    fn wait(&self, shared: &Shared) {
+        loop {
+            if *self.lock() == 0 {
+                return;
+            }
+            if let Some(job) = shared.steal_help() {
+                if let Some(msg) = run_job(job) {
+                    eprintln!("Job panicked while waiting for a scope: {}", msg);
+                }
+                continue;
+            }
+            // 队列已空，剩下的任务都正在其他 worker 上执行
+            let mut pending = self.lock();
+            while *pending != 0 {
+                pending = self.done.wait(pending).unwrap_or_else(|e| e.into_inner());
+            }
+            return;
+        }
+    }
+}
+
+/// `ThreadPool::scope` 的作用域，其中提交的任务可以借用作用域外的数据
+///
+/// 作用域结束前会等待其中的所有任务完成。
+pub struct Scope<'scope, 'env: 'scope> {
+    pool: &'scope ThreadPool,
+    state: Arc<ScopeState>,
+    scope: PhantomData<&'scope mut &'scope ()>,
+    env: PhantomData<&'env mut &'env ()>,
+}
+
+impl std::fmt::Debug for Scope<'_, '_> {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("Scope").field("pending", &*self.state.lock()).finish()
+    }
+}
+
+impl<'scope> Scope<'scope, '_> {
+    /// 在线程池中执行借用了作用域外数据的任务
+    pub fn spawn<F>(&'scope self, f: F) -> Result<()>
+    where
+        F: FnOnce() + Send + 'scope,
+    {
+        if self.pool.is_shutdown() {
+            bail!(ThreadPoolError::PoolShutdown);
+        }
+        *self.state.lock() += 1;
+        let state = Arc::clone(&self.state);
+        // SAFETY: scope 返回前等待 pending 归零，而 f 在 finish 之前已经执行完并析构；
+        // 作用域借用着线程池，线程池不会在此期间关闭，任务一定会被执行
+        let job = unsafe {
+            Job::new_unchecked(move || {
+                if panic::catch_unwind(AssertUnwindSafe(f)).is_err() {
+                    state.panicked.store(true, Ordering::Relaxed);
+                }
+                state.finish();
+            })
+        };
+        self.pool.shared.push(job);
+        Ok(())
+    }
+}
+
+impl ThreadPool {
+    /// 创建作用域，`f` 中通过 `Scope::spawn` 提交的任务可以借用非 'static 数据
+    ///
+    /// 返回前等待所有任务完成；有任务 panic 时返回 `ThreadPoolError::WorkerPanicked`，
+    /// `f` 本身 panic 时在任务完成后继续 panic。
+    pub fn scope<'env, F, T>(&self, f: F) -> Result<T>
+    where
+        F: for<'scope> FnOnce(&'scope Scope<'scope, 'env>) -> T,
+    {
+        let scope = Scope {
+            pool: self,
+            state: Arc::new(ScopeState::default()),
+            scope: PhantomData,
+            env: PhantomData,
+        };
+        let result = panic::catch_unwind(AssertUnwindSafe(|| f(&scope)));
+        scope.state.wait(&self.shared);
+        match result {
+            Err(payload) => panic::resume_unwind(payload),
+            Ok(_) if scope.state.panicked.load(Ordering::Relaxed) => {
+                bail!(ThreadPoolError::WorkerPanicked("a scoped job panicked".to_string()))
+            }
+            Ok(value) => Ok(value),
+        }
+    }
+}
@@ -1,13 +1,23 @@
 use std::{
-    sync::{Arc, Mutex, mpsc},
+    cell::Cell,
+    sync::{
+        Arc, Condvar, Mutex,
+        atomic::{AtomicBool, AtomicUsize, Ordering, fence},
+    },
     thread,
-    time::Duration,
 };
 
 
-use anyhow::{Context, Result, anyhow, bail};
+use anyhow::{Result, anyhow, bail};
+use crossbeam_deque::{Injector, Steal, Stealer, Worker as LocalQueue};
 use thiserror::Error;
 
+mod job;
+mod numa;
+use job::Job;
+pub use job::{Scope, TaskHandle};
+pub use numa::{NumaNode, NumaTopology};
+
 #[derive(Error, Debug, Clone)]
 pub enum ThreadPoolError {
     #[error("Thread pool size must be greater than 0")]
@@ -26,17 +36,211 @@ pub enum ThreadPoolError {
     MutexPoisoned(String),
     #[error("Job execution failed: {0}")]
     JobExecutionFailed(String),
+    #[error("No workers on NUMA node {0}")]
+    NoWorkersOnNode(usize),
 }
 
-type Job = Box<dyn FnOnce() + Send + 'static>;
-
 #[derive(Debug)]
 pub struct ThreadPool {
     workers: Vec<Worker>,
-    sender: Option<mpsc::Sender<Job>>,
+    shared: Arc<Shared>,
     is_shutdown: bool,
 }
 
+/// 所有worker共享的调度状态
+///
+/// `execute` 把任务放入全局 injector，worker 先取自己的本地队列，
+/// 再取所在节点的 injector 和全局 injector，最后从同组 worker 的本地队列窃取。
+/// 没有任务时 worker 在所在组的 condvar 上休眠，直到有新任务或线程池关闭。
+#[derive(Debug)]
+struct Shared {
+    injector: Injector<Job>,
+    groups: Vec<Group>,
+    next_group: AtomicUsize,
+    shutdown: AtomicBool,
+}
+
+/// 一组worker：NUMA 线程池中对应一个节点，普通线程池只有一组
+///
+/// 组内 worker 只相互窃取，保证 `execute_on_node` 的任务留在本节点执行。
+#[derive(Debug)]
+struct Group {
+    node: Option<usize>,
+    injector: Injector<Job>,
+    stealers: Vec<Stealer<Job>>,
+    sleepers: AtomicUsize,
+    sleep_lock: Mutex<()>,
+    wakeup: Condvar,
+}
+
+impl Group {
+    fn new(node: Option<usize>, stealers: Vec<Stealer<Job>>) -> Group {
+        Group {
+            node,
+            injector: Injector::new(),
+            stealers,
+            sleepers: AtomicUsize::new(0),
+            sleep_lock: Mutex::new(()),
+            wakeup: Condvar::new(),
+        }
+    }
+
+    /// 有睡眠的worker时唤醒其中一个，返回是否唤醒
+    fn notify_one(&self) -> bool {
+        if self.sleepers.load(Ordering::SeqCst) == 0 {
+            return false;
+        }
+        let _guard = self.sleep_lock.lock().unwrap_or_else(|e| e.into_inner());
+        self.wakeup.notify_one();
+        true
+    }
+
+    /// 唤醒至多 `n` 个睡眠的worker，返回唤醒的数量
+    fn notify(&self, n: usize) -> usize {
+        let sleepers = self.sleepers.load(Ordering::SeqCst);
+        if sleepers == 0 || n == 0 {
+            return 0;
+        }
+        let _guard = self.sleep_lock.lock().unwrap_or_else(|e| e.into_inner());
+        let woken = n.min(sleepers);
+        if woken == sleepers {
+            self.wakeup.notify_all();
+        } else {
+            for _ in 0..woken {
+                self.wakeup.notify_one();
+            }
+        }
+        woken
+    }
+
+    fn notify_all(&self) {
+        let _guard = self.sleep_lock.lock().unwrap_or_else(|e| e.into_inner());
+        self.wakeup.notify_all();
+    }
+}
+
+impl Shared {
+    fn push(&self, job: Job) {
+        self.injector.push(job);
+        // 与 wait_for_work 中的 fence 配对：要么worker看到新任务，要么这里看到 sleepers > 0
+        fence(Ordering::SeqCst);
+        let count = self.groups.len();
+        let start = self.next_group.fetch_add(1, Ordering::Relaxed);
+        for i in 0..count {
+            if self.groups[(start + i) % count].notify_one() {
+                break;
+            }
+        }
+    }
+
+    /// 一次放入一批任务：全部入队后只做一次 fence，再按需唤醒至多与任务数相同的worker
+    fn push_batch(&self, jobs: impl Iterator<Item = Job>) {
+        let mut count = 0;
+        for job in jobs {
+            self.injector.push(job);
+            count += 1;
+        }
+        if count == 0 {
+            return;
+        }
+        fence(Ordering::SeqCst);
+        let groups = self.groups.len();
+        let start = self.next_group.fetch_add(1, Ordering::Relaxed);
+        for i in 0..groups {
+            count -= self.groups[(start + i) % groups].notify(count);
+            if count == 0 {
+                break;
+            }
+        }
+    }
+
+    fn push_to_group(&self, group: usize, job: Job) {
+        let group = &self.groups[group];
+        group.injector.push(job);
+        fence(Ordering::SeqCst);
+        group.notify_one();
+    }
+
+    fn find_job(&self, group: usize, slot: usize, local: &LocalQueue<Job>) -> Option<Job> {
+        let group = &self.groups[group];
+        local.pop().or_else(|| {
+            std::iter::repeat_with(|| {
+                group.injector.steal_batch_and_pop(local)
+                    .or_else(|| self.injector.steal_batch_and_pop(local))
+                    .or_else(|| {
+                        group.stealers
+                            .iter()
+                            .enumerate()
+                            .filter(|(peer, _)| *peer != slot)
+                            .map(|(_, stealer)| stealer.steal())
+                            .collect()
+                    })
+            })
+            .find(|steal| !steal.is_retry())
+            .and_then(Steal::success)
+        })
+    }
+
+    /// 取一个任务，供等待作用域的调用者帮忙执行
+    ///
+    /// 只取全局 injector；调用者是本线程池的 worker 时再取所在组的 injector 和组内队列，
+    /// 不碰其他节点的队列，保证 `execute_on_node` 的任务不离开本节点。
+    fn steal_help(&self) -> Option<Job> {
+        let group = CURRENT_WORKER
+            .with(Cell::get)
+            .filter(|&(shared, _)| std::ptr::eq(shared, self))
+            .and_then(|(_, group)| self.groups.get(group));
+        std::iter::repeat_with(|| {
+            self.injector.steal().or_else(|| match group {
+                Some(group) => group.injector.steal().or_else(|| group.stealers.iter().map(Stealer::steal).collect()),
+                None => Steal::Empty,
+            })
+        })
+        .find(|steal| !steal.is_retry())
+        .and_then(Steal::success)
+    }
+
+    fn has_work(&self, group: usize) -> bool {
+        let group = &self.groups[group];
+        !self.injector.is_empty()
+            || !group.injector.is_empty()
+            || group.stealers.iter().any(|stealer| !stealer.is_empty())
+    }
+
+    /// 休眠直到有任务可做；线程池关闭且任务已全部完成时返回 false
+    fn wait_for_work(&self, group: usize) -> bool {
+        let sleep = &self.groups[group];
+        let mut guard = sleep.sleep_lock.lock().unwrap_or_else(|e| e.into_inner());
+        sleep.sleepers.fetch_add(1, Ordering::SeqCst);
+        fence(Ordering::SeqCst);
+        while !self.has_work(group) && !self.shutdown.load(Ordering::SeqCst) {
+            guard = sleep.wakeup.wait(guard).unwrap_or_else(|e| e.into_inner());
+        }
+        sleep.sleepers.fetch_sub(1, Ordering::SeqCst);
+        drop(guard);
+        self.has_work(group) || !self.shutdown.load(Ordering::SeqCst)
+    }
+
+    fn notify_all(&self) {
+        for group in &self.groups {
+            group.notify_all();
+        }
+    }
+}
+
+thread_local! {
+    /// 当前线程所属线程池的共享状态和组号，不是 worker 时为 `None`
+    static CURRENT_WORKER: Cell<Option<(*const Shared, usize)>> = const { Cell::new(None) };
+}
+
+/// worker 在线程池中的位置
+#[derive(Debug, Clone, Copy)]
+struct Placement {
+    group: usize,
+    slot: usize,
+    cpu: Option<usize>,
+}
+
 #[derive(Debug)]
 struct Worker {
     id: usize,
@@ -44,59 +248,41 @@ struct Worker {
 }
 
 impl Worker {
-    fn new(id: usize, receiver: Arc<Mutex<mpsc::Receiver<Job>>>) -> Result<Worker, ThreadPoolError> {
+    fn new(id: usize, placement: Placement, local: LocalQueue<Job>, shared: Arc<Shared>) -> Result<Worker, ThreadPoolError> {
 
         let thread_builder = thread::Builder::new();
         let thread = thread_builder
             .name(format!("worker:{}", id))
             .spawn(move || {
-                Self::run_worker(id, receiver)
+                let pinned = placement.cpu.map(|cpu| (cpu, numa::pin_current_thread(cpu)));
+                if let Some((cpu, Err(e))) = pinned {
+                    eprintln!("Warning: Failed to pin worker {} to cpu {}: {}", id, cpu, e);
+                }
+                Self::run_worker(id, placement, local, shared)
             }).map_err(|e| ThreadPoolError::ThreadCreationFailed(e.to_string()))?;
 
         Ok(Worker { id, thread })
     }
 
-    fn run_worker(id: usize, receiver: Arc<Mutex<mpsc::Receiver<Job>>>) {
+    fn run_worker(id: usize, placement: Placement, local: LocalQueue<Job>, shared: Arc<Shared>) {
+        CURRENT_WORKER.with(|current| current.set(Some((Arc::as_ptr(&shared), placement.group))));
         loop {
-            let job_result = || -> Result<(), anyhow::Error> {
-                let lock_result = receiver.lock()
-                    .map_err(|e| anyhow!("Failed to lock mutex: {}", e))?;
-                let job = lock_result.recv_timeout(Duration::from_millis(100))
-                    .context("Failed to receive job")?;
-                let result = std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| {
-                    job();
-                }));
-                if let Err(e) = result {
-                    eprintln!("Worker {} panicked while executing a job", id);
-                    if let Some(s) = e.downcast_ref::<String>() {
-                        eprintln!("Panic message: {}", s);
-                    } else if let Some(s) = e.downcast_ref::<&str>() {
-                        eprintln!("Panic message: {}", s);
-                    }
-                }
-                Ok(())
-            }();
-
-            match job_result {
-                Ok(_) => continue,
-                Err(e) => {
-                    // 检查错误类型
-                    if e.to_string().contains("disconnected") || 
-                       e.to_string().contains("Failed to receive job") {
-                        println!("Worker {} disconnected; shutting down.", id);
-                        break;
-                    } else if e.to_string().contains("poisoned") {
-                        eprintln!("Worker {} detected a poisoned mutex, attempting to recover", id);
-                        // 继续尝试
-                        continue;
-                    } else {
-                        eprintln!("Worker {} encountered error: {}", id, e);
-                        // 其他错误也继续尝试
-                        continue;
-                    }
-                }
+            if let Some(job) = shared.find_job(placement.group, placement.slot, &local) {
+                Self::run_job(id, job);
+                continue;
+            }
+            if !shared.wait_for_work(placement.group) {
+                break;
             }
         }
+        println!("Worker {} disconnected; shutting down.", id);
+    }
+
+    fn run_job(id: usize, job: Job) {
+        if let Some(msg) = job::run_job(job) {
+            eprintln!("Worker {} panicked while executing a job", id);
+            eprintln!("Panic message: {}", msg);
+        }
     }
 }
 
@@ -106,12 +292,54 @@ impl ThreadPool {
         if size == 0 {
             bail!(ThreadPoolError::InvalidSize);
         }
-        let (sender, receiver) = mpsc::channel();
-        let receiver = Arc::new(Mutex::new(receiver));
-        let mut workers = Vec::with_capacity(size);
-        for id in 0..size {
-            match Worker::new(id, Arc::clone(&receiver)) {
-                Ok(worker) => workers.push(worker),
+        Self::with_layout(vec![(None, vec![None; size])])
+    }
+
+    /// 按 NUMA 拓扑创建线程池，每个 worker 绑定到所在节点的一个 CPU 上
+    ///
+    /// `workers_per_node` 为 0 时每个 CPU 一个 worker；没有 CPU 的节点（纯内存节点）不创建 worker。
+    pub fn with_numa_topology(topology: &NumaTopology, workers_per_node: usize) -> Result<ThreadPool> {
+        let layout: Vec<_> = topology
+            .nodes()
+            .iter()
+            .filter(|node| !node.cpus.is_empty())
+            .map(|node| {
+                let count = if workers_per_node == 0 { node.cpus.len() } else { workers_per_node };
+                let cpus = node.cpus.iter().cycle().take(count).map(|&cpu| Some(cpu)).collect();
+                (Some(node.id), cpus)
+            })
+            .collect();
+        if layout.is_empty() {
+            bail!(ThreadPoolError::InvalidSize);
+        }
+        Self::with_layout(layout)
+    }
+
+    /// 每组为 (NUMA 节点, 每个 worker 绑定的 CPU)
+    fn with_layout(layout: Vec<(Option<usize>, Vec<Option<usize>>)>) -> Result<ThreadPool> {
+        let mut groups = Vec::with_capacity(layout.len());
+        let mut pending = Vec::new();
+        for (group, (node, cpus)) in layout.into_iter().enumerate() {
+            let locals: Vec<LocalQueue<Job>> = cpus.iter().map(|_| LocalQueue::new_fifo()).collect();
+            groups.push(Group::new(node, locals.iter().map(LocalQueue::stealer).collect()));
+            for (slot, (local, cpu)) in locals.into_iter().zip(cpus).enumerate() {
+                pending.push((Placement { group, slot, cpu }, local));
+            }
+        }
+        let shared = Arc::new(Shared {
+            injector: Injector::new(),
+            groups,
+            next_group: AtomicUsize::new(0),
+            shutdown: AtomicBool::new(false),
+        });
+        let mut workers = Vec::with_capacity(pending.len());
+        let mut alive = vec![0usize; shared.groups.len()];
+        for (id, (placement, local)) in pending.into_iter().enumerate() {
+            match Worker::new(id, placement, local, Arc::clone(&shared)) {
+                Ok(worker) => {
+                    alive[placement.group] += 1;
+                    workers.push(worker);
+                }
                 Err(e) => {
                     // 如果第一个worker就失败，直接返回错误
                     if workers.is_empty() {
@@ -122,15 +350,38 @@ impl ThreadPool {
                 }
             }
         }
-        // 确保至少创建了一个worker
-        if workers.is_empty() {
-            bail!("Failed to create any workers");
-        }
-        Ok(ThreadPool { 
-            workers, 
-            sender: Some(sender),
+        let mut pool = ThreadPool {
+            workers,
+            shared,
             is_shutdown: false,
-        })
+        };
+        // 确保每组至少创建了一个worker，否则发往该组的任务永远不会执行
+        if let Some(group) = alive.iter().position(|&count| count == 0) {
+            let _ = pool.shutdown();
+            bail!("Failed to create any workers for group {}", group);
+        }
+        Ok(pool)
+    }
+
+    /// 线程池中有 worker 的 NUMA 节点
+    pub fn nodes(&self) -> Vec<usize> {
+        self.shared.groups.iter().filter_map(|group| group.node).collect()
+    }
+
+    /// 在指定 NUMA 节点的 worker 上执行任务
+    pub fn execute_on_node<F>(&self, node: usize, f: F) -> Result<()>
+    where
+        F: FnOnce() + Send + 'static,
+    {
+        if self.is_shutdown {
+            bail!(ThreadPoolError::PoolShutdown);
+        }
+        let group = self.shared.groups
+            .iter()
+            .position(|group| group.node == Some(node))
+            .ok_or(ThreadPoolError::NoWorkersOnNode(node))?;
+        self.shared.push_to_group(group, Job::new(f));
+        Ok(())
     }
     /// 获取线程池大小
     pub fn size(&self) -> usize {
@@ -149,17 +400,24 @@ impl ThreadPool {
             bail!(ThreadPoolError::PoolShutdown);
         }
         
-        let job = Box::new(f);
-
-        self.sender
-            .as_ref()
-            .ok_or_else(|| anyhow!(ThreadPoolError::PoolShutdown))?
-            .send(job)
-            .map_err(|e| anyhow!(ThreadPoolError::TaskSubmissionFailed(e.to_string())))?;
-            
+        self.shared.push(Job::new(f));
         Ok(())
     }
 
+    /// 执行任务并返回句柄，通过句柄等待任务的返回值
+    pub fn submit<F, T>(&self, f: F) -> Result<TaskHandle<T>>
+    where
+        F: FnOnce() -> T + Send + 'static,
+        T: Send + 'static,
+    {
+        if self.is_shutdown {
+            bail!(ThreadPoolError::PoolShutdown);
+        }
+        let (completer, handle) = job::task();
+        self.shared.push(Job::new(move || completer.run(f)));
+        Ok(handle)
+    }
+
     pub fn shutdown(&mut self) -> Result<()> {
         if self.is_shutdown {
             return Ok(());
@@ -167,8 +425,9 @@ impl ThreadPool {
         
         self.is_shutdown = true;
         
-        // 丢弃发送者，这样workers会在处理完所有任务后退出
-        drop(self.sender.take());
+        // 唤醒所有worker，它们会在处理完所有任务后退出
+        self.shared.shutdown.store(true, Ordering::SeqCst);
+        self.shared.notify_all();
         
         // 收集所有join错误
         let mut errors = Vec::new();
@@ -177,15 +436,7 @@ impl ThreadPool {
             match worker.thread.join() {
                 Ok(()) => (),
                 Err(e) => {
-                    let error_msg = if let Some(s) = e.downcast_ref::<String>() {
-                        s.clone()
-                    } else if let Some(s) = e.downcast_ref::<&str>() {
-                        s.to_string()
-                    } else {
-                        "Unknown panic payload".to_string()
-                    };
-                    
-                    errors.push(anyhow!(ThreadPoolError::WorkerPanicked(error_msg)));
+                    errors.push(anyhow!(ThreadPoolError::WorkerPanicked(job::panic_message(&*e))));
                 }
             }
         }
@@ -218,13 +469,17 @@ impl ThreadPool {
         }
     }
 
+    /// 批量执行任务，整批一次入队
     pub fn execute_batch<F>(&self, tasks: Vec<F>) -> Vec<Result<()>>
     where
-        F: FnOnce() + Send + 'static + Clone,
+        F: FnOnce() + Send + 'static,
     {
-        tasks.into_iter()
-            .map(|task| self.execute(task))
-            .collect()
+        if self.is_shutdown {
+            return tasks.iter().map(|_| Err(anyhow!(ThreadPoolError::PoolShutdown))).collect();
+        }
+        let count = tasks.len();
+        self.shared.push_batch(tasks.into_iter().map(Job::new));
+        (0..count).map(|_| Ok(())).collect()
     }
 }
 
@@ -242,7 +497,8 @@ impl Drop for ThreadPool {
 #[cfg(test)]
 mod tests {
     use super::*;
-    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::mpsc;
+    use std::time::{Duration, Instant};
 
     #[test]
     fn test_thread_pool_creation() -> Result<()> {
@@ -444,4 +700,231 @@ mod tests {
         thread::sleep(Duration::from_millis(50));
         Ok(())
     }
+
+    #[test]
+    fn test_blocked_worker_does_not_stall_queue() -> Result<()> {
+        let pool = ThreadPool::new(2)?;
+        let (block_tx, block_rx) = mpsc::channel::<()>();
+        let (done_tx, done_rx) = mpsc::channel();
+
+        // 一个worker被长期占用，其余任务应由另一个worker完成
+        pool.execute(move || {
+            let _ = block_rx.recv();
+        })?;
+        for i in 0..32 {
+            let done_tx = done_tx.clone();
+            pool.execute(move || {
+                done_tx.send(i).unwrap();
+            })?;
+        }
+
+        let mut results: Vec<i32> = (0..32)
+            .map(|_| done_rx.recv_timeout(Duration::from_secs(5)))
+            .collect::<Result<_, _>>()?;
+        results.sort();
+        assert_eq!(results, (0..32).collect::<Vec<_>>());
+        block_tx.send(())?;
+        Ok(())
+    }
+
+    #[test]
+    fn test_idle_worker_wakes_without_polling() -> Result<()> {
+        let pool = ThreadPool::new(2)?;
+        // 等待worker进入休眠
+        thread::sleep(Duration::from_millis(50));
+
+        let (tx, rx) = mpsc::channel();
+        let start = Instant::now();
+        pool.execute(move || {
+            tx.send(Instant::now()).unwrap();
+        })?;
+        let ran_at = rx.recv_timeout(Duration::from_secs(5))?;
+        assert!(ran_at.duration_since(start) < Duration::from_millis(50));
+        Ok(())
+    }
+
+    #[test]
+    fn test_shutdown_drains_queue() -> Result<()> {
+        let mut pool = ThreadPool::new(3)?;
+        let counter = Arc::new(AtomicUsize::new(0));
+        for _ in 0..1000 {
+            let counter = Arc::clone(&counter);
+            pool.execute(move || {
+                counter.fetch_add(1, Ordering::SeqCst);
+            })?;
+        }
+        pool.shutdown()?;
+        assert_eq!(counter.load(Ordering::SeqCst), 1000);
+        Ok(())
+    }
+
+    #[test]
+    fn test_numa_pool_runs_on_node() -> Result<()> {
+        let topology = NumaTopology::detect()?;
+        let pool = ThreadPool::with_numa_topology(&topology, 1)?;
+        let nodes = pool.nodes();
+        assert!(!nodes.is_empty());
+        assert_eq!(pool.size(), nodes.len());
+
+        let node = nodes[0];
+        let cpus = topology.node(node).map(|n| n.cpus.clone()).unwrap_or_default();
+        let (tx, rx) = mpsc::channel();
+        for _ in 0..8 {
+            let tx = tx.clone();
+            pool.execute_on_node(node, move || {
+                tx.send(unsafe { libc::sched_getcpu() }).unwrap();
+            })?;
+        }
+        for _ in 0..8 {
+            let cpu = rx.recv_timeout(Duration::from_secs(5))?;
+            assert!(cpus.contains(&usize::try_from(cpu)?));
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_execute_on_unknown_node() -> Result<()> {
+        let pool = ThreadPool::new(2)?;
+        let result = pool.execute_on_node(0, || {});
+        assert!(result.is_err());
+        assert!(result.unwrap_err().to_string().contains("No workers on NUMA node 0"));
+
+        let topology = NumaTopology::from_nodes(vec![NumaNode { id: 3, cpus: vec![0] }]);
+        let pool = ThreadPool::with_numa_topology(&topology, 2)?;
+        assert_eq!(pool.nodes(), vec![3]);
+        assert!(pool.execute_on_node(1, || {}).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_submit_returns_value() -> Result<()> {
+        let pool = ThreadPool::new(2)?;
+        let handles = (0..16)
+            .map(|i| pool.submit(move || i * 2))
+            .collect::<Result<Vec<_>>>()?;
+        let results = handles.into_iter().map(TaskHandle::join).collect::<Result<Vec<_>>>()?;
+        assert_eq!(results, (0..16).map(|i| i * 2).collect::<Vec<_>>());
+
+        // 大闭包走装箱路径
+        let big = [7u64; 64];
+        assert_eq!(pool.submit(move || big.iter().sum::<u64>())?.join()?, 448);
+        Ok(())
+    }
+
+    #[test]
+    fn test_submit_panic() -> Result<()> {
+        let pool = ThreadPool::new(1)?;
+        let handle = pool.submit(|| -> usize { panic!("submitted panic") })?;
+        let err = handle.join().unwrap_err();
+        assert!(err.to_string().contains("submitted panic"));
+        // worker 仍然可用
+        assert_eq!(pool.submit(|| 1)?.join()?, 1);
+        Ok(())
+    }
+
+    #[test]
+    fn test_dropped_job_cancels_handle() -> Result<()> {
+        let (completer, handle) = job::task::<usize>();
+        drop(Job::new(move || completer.run(|| 1)));
+        assert!(handle.join().unwrap_err().to_string().contains("dropped"));
+        Ok(())
+    }
+
+    #[test]
+    fn test_scope_borrows_local_data() -> Result<()> {
+        let pool = ThreadPool::new(3)?;
+        let data: Vec<usize> = (0..1000).collect();
+        let total = AtomicUsize::new(0);
+        let count = pool.scope(|scope| -> Result<usize> {
+            for chunk in data.chunks(100) {
+                let total = &total;
+                scope.spawn(move || {
+                    total.fetch_add(chunk.iter().sum::<usize>(), Ordering::SeqCst);
+                })?;
+            }
+            Ok(data.len() / 100)
+        })??;
+        assert_eq!(count, 10);
+        assert_eq!(total.load(Ordering::SeqCst), 499500);
+
+        let result = pool.scope(|scope| scope.spawn(|| panic!("scoped panic")));
+        assert!(result.is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_nested_scope_on_single_worker() -> Result<()> {
+        // 唯一的worker在作用域中等待时，需要自己执行剩下的任务
+        let pool = Arc::new(ThreadPool::new(1)?);
+        let inner = Arc::clone(&pool);
+        let handle = pool.submit(move || {
+            let hits = AtomicUsize::new(0);
+            inner.scope(|scope| {
+                for _ in 0..8 {
+                    scope.spawn(|| {
+                        hits.fetch_add(1, Ordering::SeqCst);
+                    }).unwrap();
+                }
+            }).unwrap();
+            hits.load(Ordering::SeqCst)
+        })?;
+        assert_eq!(handle.join()?, 8);
+        Ok(())
+    }
+
+    #[test]
+    fn test_scope_wait_leaves_node_jobs() -> Result<()> {
+        let topology = NumaTopology::from_nodes(vec![
+            NumaNode { id: 0, cpus: vec![0] },
+            NumaNode { id: 1, cpus: vec![0] },
+        ]);
+        let pool = ThreadPool::with_numa_topology(&topology, 1)?;
+        // 让两个节点的worker都忙着，后面的任务只能留在队列里
+        let (started_tx, started_rx) = mpsc::channel();
+        let (release_tx, release_rx) = mpsc::channel::<()>();
+        let release_rx = Arc::new(Mutex::new(release_rx));
+        for node in [0, 1] {
+            let started_tx = started_tx.clone();
+            let release_rx = Arc::clone(&release_rx);
+            pool.execute_on_node(node, move || {
+                started_tx.send(()).unwrap();
+                let _ = release_rx.lock().unwrap().recv();
+            })?;
+        }
+        for _ in 0..2 {
+            started_rx.recv_timeout(Duration::from_secs(5))?;
+        }
+
+        let (tx, rx) = mpsc::channel();
+        pool.execute_on_node(1, move || tx.send(thread::current().name().map(str::to_owned)).unwrap())?;
+        // 不是worker的调用者只帮忙执行全局队列中的任务
+        assert!(pool.shared.steal_help().is_none());
+        pool.execute(|| {})?;
+        assert!(pool.shared.steal_help().is_some());
+
+        drop(release_tx);
+        assert_eq!(rx.recv_timeout(Duration::from_secs(5))?.as_deref(), Some("worker:1"));
+        Ok(())
+    }
+
+    #[test]
+    fn test_execute_batch_wakes_workers() -> Result<()> {
+        let pool = ThreadPool::new(4)?;
+        // 等待worker进入休眠
+        thread::sleep(Duration::from_millis(50));
+        let (tx, rx) = mpsc::channel();
+        let tasks: Vec<_> = (0..64)
+            .map(|i| {
+                let tx = tx.clone();
+                move || tx.send(i).unwrap()
+            })
+            .collect();
+        assert!(pool.execute_batch(tasks).iter().all(|r| r.is_ok()));
+        let mut results: Vec<i32> = (0..64)
+            .map(|_| rx.recv_timeout(Duration::from_secs(5)))
+            .collect::<Result<_, _>>()?;
+        results.sort();
+        assert_eq!(results, (0..64).collect::<Vec<_>>());
+        Ok(())
+    }
 }
\ No newline at end of file
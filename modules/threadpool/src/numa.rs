@@ -0,0 +1,118 @@
+use std::{fs, path::Path};
+
+use anyhow::{Context, Result, anyhow, bail};
+
+const NODE_SYSFS: &str = "/sys/devices/system/node";
+
+/// 一个 NUMA 节点及其 CPU 列表
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct NumaNode {
+    pub id: usize,
+    pub cpus: Vec<usize>,
+}
+
+/// 主机的 NUMA 拓扑，按节点号排序
+#[derive(Debug, Clone, PartialEq, Eq, Default)]
+pub struct NumaTopology {
+    nodes: Vec<NumaNode>,
+}
+
+impl NumaTopology {
+    /// 从 `/sys/devices/system/node/node*/cpulist` 读取拓扑
+    ///
+    /// 内核未开启 NUMA 时没有该目录，此时视为只有节点 0，包含所有可用 CPU。
+    pub fn detect() -> Result<NumaTopology> {
+        if !Path::new(NODE_SYSFS).exists() {
+            let cpus = std::thread::available_parallelism()
+                .context("Failed to query available parallelism")?
+                .get();
+            return Ok(Self::from_nodes(vec![NumaNode { id: 0, cpus: (0..cpus).collect() }]));
+        }
+
+        let mut nodes = Vec::new();
+        for entry in fs::read_dir(NODE_SYSFS).with_context(|| format!("Failed to read {}", NODE_SYSFS))? {
+            let entry = entry?;
+            let name = entry.file_name();
+            let Some(id) = name.to_str().and_then(|n| n.strip_prefix("node")).and_then(|n| n.parse().ok()) else {
+                continue;
+            };
+            let cpulist = fs::read_to_string(entry.path().join("cpulist"))
+                .with_context(|| format!("Failed to read cpulist of node {}", id))?;
+            nodes.push(NumaNode { id, cpus: parse_cpulist(&cpulist)? });
+        }
+        if nodes.is_empty() {
+            bail!("No NUMA nodes found under {}", NODE_SYSFS);
+        }
+        Ok(Self::from_nodes(nodes))
+    }
+
+    pub fn from_nodes(mut nodes: Vec<NumaNode>) -> NumaTopology {
+        nodes.sort_by_key(|node| node.id);
+        NumaTopology { nodes }
+    }
+
+    pub fn nodes(&self) -> &[NumaNode] {
+        &self.nodes
+    }
+
+    pub fn node(&self, id: usize) -> Option<&NumaNode> {
+        self.nodes.iter().find(|node| node.id == id)
+    }
+}
+
+/// 解析内核 cpulist 格式，如 "0-3,8,10-11"
+fn parse_cpulist(list: &str) -> Result<Vec<usize>> {
+    let mut cpus = Vec::new();
+    for part in list.trim().split(',').filter(|part| !part.is_empty()) {
+        let parse = |s: &str| s.trim().parse::<usize>().map_err(|e| anyhow!("Invalid cpulist '{}': {}", list.trim(), e));
+        match part.split_once('-') {
+            Some((start, end)) => cpus.extend(parse(start)?..=parse(end)?),
+            None => cpus.push(parse(part)?),
+        }
+    }
+    Ok(cpus)
+}
+
+/// 将当前线程绑定到指定 CPU
+#[cfg(target_os = "linux")]
+pub(crate) fn pin_current_thread(cpu: usize) -> Result<()> {
+    if cpu >= libc::CPU_SETSIZE as usize {
+        bail!("cpu {} exceeds CPU_SETSIZE", cpu);
+    }
+    // SAFETY: cpu_set_t 是普通位图，全零即空集合；sched_setaffinity 只读取它
+    let ret = unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_SET(cpu, &mut set);
+        libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set)
+    };
+    if ret != 0 {
+        return Err(std::io::Error::last_os_error().into());
+    }
+    Ok(())
+}
+
+#[cfg(not(target_os = "linux"))]
+pub(crate) fn pin_current_thread(_cpu: usize) -> Result<()> {
+    bail!("CPU pinning is only supported on Linux")
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_cpulist() -> Result<()> {
+        assert_eq!(parse_cpulist("0-3,8,10-11\n")?, vec![0, 1, 2, 3, 8, 10, 11]);
+        assert_eq!(parse_cpulist("\n")?, Vec::<usize>::new());
+        assert!(parse_cpulist("0-x").is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_detect() -> Result<()> {
+        let topology = NumaTopology::detect()?;
+        assert!(!topology.nodes().is_empty());
+        assert!(topology.nodes().iter().any(|node| !node.cpus.is_empty()));
+        Ok(())
+    }
+}